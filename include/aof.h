@@ -0,0 +1,172 @@
+/**
+ * @file aof.h
+ * @author pengchang
+ * @brief AOF持久化：追加写命令，按配置的策略fsync，启动时重放
+
+ */
+#ifndef AOF_H
+#define AOF_H
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief 追加写文件
+ * @details 每条命令为一条记录，参数带长度前缀，值中可以含有空白和换行符：
+ * *<参数个数>\r\n 之后每个参数为 $<字节数>\r\n<参数>\r\n。
+ * 重放时兼容旧版本每行一条的文本命令。
+ * 事务中的写命令前后有multi和exec记录，重放时整体执行，
+ * 没有exec结尾的事务(写入时崩溃)整体丢弃。
+ * 写命令先追加到内存缓冲区，由DbServer在每轮事件循环结束时调用Flush，
+ * 用一次write写出这一轮的所有命令(组提交)。fsync策略：
+ * kAofFsyncAlways Flush中write之后立即fdatasync；
+ * kAofFsyncEverysec 由后台线程每秒fdatasync一次；
+ * kAofFsyncNo 由操作系统决定何时落盘。
+ *
+ * 后台重写：子进程把当前数据写成最少的命令到临时文件，期间父进程追加的命令
+ * 同时记入重写缓冲区；子进程完成后把重写缓冲区追加到临时文件，再原子地替换旧文件。
+ */
+class Aof
+{
+public:
+  Aof(const std::string &path, int fsync_policy);
+  ~Aof();
+  Aof(const Aof &) = delete;
+  Aof &operator=(const Aof &) = delete;
+
+  /**
+   * @brief 打开(不存在则创建)AOF文件用于追加
+   */
+  bool Open();
+
+  /**
+   * @brief 追加一条在库db上执行的写命令，库与上一条命令不同时先追加select
+   * @param[in] argv 命令名及参数
+   */
+  void Feed(int db, const std::vector<std::string> &argv);
+
+  /**
+   * @brief 之后Feed的命令属于同一个事务，直到EndMulti
+   * @details 事务中有写命令时才在第一条之前追加multi，没有写命令时不写入任何记录
+   */
+  void BeginMulti();
+
+  /**
+   * @brief 事务结束，写过multi时追加exec
+   */
+  void EndMulti();
+
+  /**
+   * @brief 把一条命令编码为一条记录追加到buf
+   */
+  static void AppendRecord(std::string *buf,
+                           const std::vector<std::string> &argv);
+
+  bool HasPending() const { return !buf_.empty(); }
+
+  /**
+   * @brief 一次write写出缓冲区中的所有命令，always策略下随后fdatasync
+   * @details 部分写入时截掉已写入的字节，截断也失败时记下写到的位置，
+   * 重试时不会重复写入；always策略下fdatasync失败时，重试再次fdatasync
+   * @return false 写文件或fdatasync失败，未写出的命令保留等待下次重试
+   */
+  bool Flush();
+
+  /**
+   * @brief 重放AOF文件，每条命令调用一次handler
+   * @details 文件末尾不完整的命令或事务(写入时崩溃)被截断丢弃，
+   * 事务中的命令在读到exec后才依次调用handler
+   * @return false 文件读取失败或中间有格式错误的记录
+   */
+  bool Replay(
+      const std::function<void(const std::vector<std::string> &)> &handler);
+
+  /**
+   * @brief 开始后台重写，之后追加的命令同时记入重写缓冲区
+   */
+  void StartRewrite();
+
+  /**
+   * @brief 重写子进程已成功写完tmp_path，追加重写缓冲区后替换旧文件
+   * @return false 失败，继续使用旧文件
+   */
+  bool FinishRewrite(const std::string &tmp_path);
+
+  /**
+   * @brief 重写子进程失败，丢弃重写缓冲区
+   */
+  void AbortRewrite();
+
+  bool Rewriting() const { return rewriting_; }
+
+  /**
+   * @brief 重写子进程写入的临时文件，与AOF文件在同一目录下以便原子替换
+   */
+  std::string RewriteTmpPath(pid_t pid) const
+  {
+    return path_ + ".temp-" + std::to_string(pid);
+  }
+
+  /**
+   * @brief 文件相对上次重写后的大小增长了percentage%以上且不小于min_size
+   */
+  bool NeedRewrite(int percentage, uint64_t min_size) const;
+
+  // 文件当前大小(含未写出的缓冲区)
+  uint64_t Size() const { return size_ + buf_.size(); }
+  // 上次重写(或启动)时的文件大小
+  uint64_t BaseSize() const { return base_size_; }
+  const std::string &Path() const { return path_; }
+
+  /**
+   * @brief 向fd写入全部数据，被信号中断时重试
+   * @param[out] written 不为空时为实际写入的字节数，失败时可能部分写入
+   */
+  static bool WriteFully(int fd, const char *data, size_t len,
+                         size_t *written = nullptr);
+
+private:
+  /**
+   * @brief everysec策略的后台fsync线程
+   */
+  void FsyncThread();
+
+private:
+  std::string path_;
+  int fsync_policy_;
+  int fd_;
+  // 待写出的命令
+  std::string buf_;
+  // 文件中已写入的字节数
+  uint64_t size_;
+  // always策略下上次fdatasync失败
+  bool sync_failed_;
+  // 上一条写入命令所在的库，-1表示还没有
+  int db_;
+  // 在BeginMulti和EndMulti之间
+  bool multi_;
+  // 本事务已追加multi
+  bool multi_fed_;
+  uint64_t base_size_;
+
+  // 后台重写期间追加的命令
+  bool rewriting_;
+  std::string rewrite_buf_;
+  int rewrite_db_;
+
+  std::thread fsync_thread_;
+  // 保护fsync线程使用的fd_，重写替换文件时加锁
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool quit_;
+  // 上次fsync之后有新的write
+  std::atomic<bool> dirty_;
+};
+#endif
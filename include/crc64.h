@@ -0,0 +1,18 @@
+/**
+ * @file crc64.h
+ * @author pengchang
+ * @brief CRC-64/Jones校验(与redis相同的多项式)，用于rdb文件各段的校验
+
+ */
+#ifndef CRC64_H
+#define CRC64_H
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief 计算crc64
+ * @details 使用slice-by-8查表，每次处理8个字节
+ * @param[in] crc 之前数据的crc，首次为0，可分段连续计算
+ */
+uint64_t Crc64(uint64_t crc, const void *data, size_t len);
+#endif
@@ -7,83 +7,293 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
-#include <muduo/base/Timestamp.h>
 #include <signal.h>
 #include <sys/time.h>
 
 #include <ext/pool_allocator.h>
+#include <functional>
 #include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include "db_obj.h"
+#include "dict.h"
 #include "skiplist.h"
+#include "storage_engine.h"
+#include "timestamp.h"
+#include "value_log.h"
+
+struct RdbSection;
 using SkipListSp = Skiplist::ptr;
-using Timestamp = muduo::Timestamp;
 
-// 使用STL中unordered_map作为字典
+// 字典的桶数总是2的幂(见dict.h)，scan系列命令的反向二进制游标在扩容前后都有效
 template <typename T1, typename T2>
 using Dict =
-    std::unordered_map<T1, T2, std::hash<T1>, std::equal_to<T1>,
-                       __gnu_cxx::__pool_alloc<std::pair<const T1, T2>>>;
+    HashMap<T1, T2, __gnu_cxx::__pool_alloc<std::pair<const T1, T2>>>;
+
+template <typename T>
+using DictSet = HashSet<T, __gnu_cxx::__pool_alloc<T>>;
 
 // 数据库键类型为std::string
 // 数据库五种值类型定义
 // __pool_alloc内部使用链表进行管理内存、预分配内存、不归还内存给操作系统等机制来减少malloc的调用次数。
-using String = Dict<std::string, std::string>;
+// 字符串值不可变，以引用计数共享：读者(GET的响应、快照)持有指针即可，
+// 覆盖或删除key只替换字典中的指针，不影响已取出的值
+using StringSp = std::shared_ptr<const std::string>;
+using String = Dict<std::string, StringSp>;
 using List = Dict<std::string,
                   std::list<std::string, __gnu_cxx::__pool_alloc<std::string>>>;
-using Hash =
-    Dict<std::string, std::map<std::string, std::string, std::less<>,
-                               __gnu_cxx::__pool_alloc<
-                                   std::pair<const std::string, std::string>>>>;
-using Set =
-    Dict<std::string, std::unordered_set<std::string, std::hash<std::string>,
-                                         std::equal_to<>,
-                                         __gnu_cxx::__pool_alloc<std::string>>>;
+// 哈希、集合、有序集合的值同样以引用计数共享：工作线程中的读取和快照持有指针，
+// 主线程修改其他线程可能在读的值(见Database::Exclusive)前先复制一份换入字典，
+// 不必等待读者
+using HashValue =
+    std::map<std::string, std::string, std::less<>,
+             __gnu_cxx::__pool_alloc<std::pair<const std::string, std::string>>>;
+using SetValue = DictSet<std::string>;
+using HashSp = std::shared_ptr<HashValue>;
+using SetSp = std::shared_ptr<SetValue>;
+using Hash = Dict<std::string, HashSp>;
+using Set = Dict<std::string, SetSp>;
 using ZSet = Dict<std::string, SkipListSp>;
 using Expire = Dict<std::string, Timestamp>;
 
-class Database
+/**
+ * @brief rdb中一个段解析后的暂存结果
+ * @details keys_[i]为第i个键及其过期时间(微秒，0表示不过期)，值存放在与段类型
+ * 对应的容器的第i项，其余容器为空。
+ */
+struct RdbStage
+{
+  RdbStage() : db_(0), type_(0) {}
+
+  int db_;
+  int type_;
+  std::vector<std::pair<std::string, int64_t>> keys_;
+  std::vector<String::mapped_type> strings_;
+  std::vector<List::mapped_type> lists_;
+  std::vector<Hash::mapped_type> hashes_;
+  std::vector<Set::mapped_type> sets_;
+  std::vector<ZSet::mapped_type> zsets_;
+};
+
+/**
+ * @brief 不fork的后台快照中一种类型的进度
+ */
+struct SnapshotState
+{
+  SnapshotState() : cursor_(0) {}
+
+  // 编号小于cursor_的桶已被快照线程访问
+  size_t cursor_;
+  // 所在的桶尚未访问时被修改的key在快照开始时刻的值，等待快照线程写出
+  RdbStage pending_;
+  // 已保存过快照时刻的值(或快照开始时不存在)的key，快照线程访问桶时跳过
+  std::unordered_set<std::string> done_;
+};
+
+/**
+ * @brief 读快照中一个key在快照时刻的值
+ */
+template <typename V>
+struct VersionedValue
+{
+  VersionedValue() : exists_(false), expire_at_(0) {}
+
+  // 快照时刻key是否存在，为false时其余成员无意义
+  bool exists_;
+  // 过期时间(微秒)，0表示不过期
+  int64_t expire_at_;
+  V value_;
+};
+
+/**
+ * @brief 读快照中一种类型被修改过的key
+ * @details 同一个版本可被多个读快照共享
+ */
+template <typename V>
+struct VersionTable
+{
+  Dict<std::string, std::shared_ptr<const VersionedValue<V>>> versions_;
+  // 桶编号 -> 该桶中有版本的key，遍历时据此找到已从字典中删除的key
+  std::multimap<size_t, std::string> by_bucket_;
+};
+
+/**
+ * @brief Database的读快照(写时复制)
+ * @details 读快照打开期间，key第一次被修改前把其当前值(不存在也记录)作为版本保存，
+ * 读取时有版本的key读版本，其余key直接读字典。字典不再扩容，桶的编号保持不变。
+ */
+struct DictReadSnapshot : public ReadSnapshot
+{
+  // 各类型保存的版本数之和
+  size_t Versions() const
+  {
+    return strings_.versions_.size() + lists_.versions_.size() +
+           hashes_.versions_.size() + sets_.versions_.size() +
+           zsets_.versions_.size();
+  }
+
+  VersionTable<String::mapped_type> strings_;
+  VersionTable<List::mapped_type> lists_;
+  VersionTable<Hash::mapped_type> hashes_;
+  VersionTable<Set::mapped_type> sets_;
+  VersionTable<ZSet::mapped_type> zsets_;
+};
+
+/**
+ * @brief 默认的存储引擎(--engine dict)：五种类型各用一个STL字典
+ */
+class Database : public StorageEngine
 {
 public:
-  Database();
+  // 定期删除的间隔(秒)
+  static const int kExpireCycleSeconds = 3;
+
+  /**
+   * @param[in] run_at 定时删除使用的定时器，为空时不做定时删除
+   */
+  explicit Database(const RunAtFunc &run_at = RunAtFunc());
   ~Database() = default;
   /**
-   * @brief 从rdb文件中恢复数据库
+   * @brief 从rdb文件中单独恢复一个数据库
+   * @details 通过文件末尾的段索引直接定位该库的段，不扫描文件的其余部分。
+   * 启动时所有库由DbServer::InitDB一次性载入，无需再调用。
    * @param[in] index 数据库分库编号
    */
   void RdbLoad(int index);
+
+  const char *Name() const override { return "dict"; }
+
+  /**
+   * @brief 每kExpireCycleSeconds秒做一次定期删除，开启键值分离时做一步垃圾回收
+   */
+  void Cron(const Timestamp &now) override;
+
+  /**
+   * @brief 将当前数据库按类型分段写入rdb，已过期的key不写入
+   * @param[in] index 数据库分库编号
+   */
+  void RdbSave(RdbWriter *writer, int index) override;
+
+  void AofRewrite(
+      const std::function<void(const std::vector<std::string> &)> &emit) override;
+
+  // 开启键值分离后快照线程读不到值日志中的值
+  bool SupportsThreadSnapshot() const override { return !vlog_; }
+
+  /**
+   * @brief 开始不fork的后台快照，在主线程调用
+   * @details 快照结束前字典不再扩容，桶的编号保持不变。主线程修改一个key前，
+   * 若其所在的桶尚未被快照线程访问，先保存该key在快照开始时刻的值。
+   * @param[in] now 快照时刻，所有库使用同一时刻
+   */
+  void SnapshotBegin(const Timestamp &now) override;
+
+  /**
+   * @brief 在快照线程中写出SnapshotBegin时刻的数据，与主线程的读写并发执行
+   * @details 逐批持锁复制若干个桶中的key，释放锁后再序列化和写文件
+   */
+  void SnapshotSave(RdbWriter *writer, int index) override;
+
+  /**
+   * @brief 快照线程退出后在主线程调用，恢复字典扩容并释放快照状态
+   */
+  void SnapshotEnd() override;
+
+  /**
+   * @brief 打开读快照，纪元加一
+   * @details 快照打开期间修改一个key的代价是复制一次其整个值(每个key只复制一次，
+   * 多个快照共享)，读取不加锁、不复制
+   */
+  std::shared_ptr<ReadSnapshot> OpenReadSnapshot() override;
+  /**
+   * @brief 关闭读快照并释放其版本，最后一个读快照关闭后恢复字典扩容
+   */
+  void CloseReadSnapshot(const std::shared_ptr<ReadSnapshot> &snap) override;
+  std::string GetKeyAt(const ReadSnapshot &snap, const int type,
+                       const std::string &key) override;
+  /**
+   * @brief 按桶编号遍历，一个桶中的key(含已删除但有版本的key)一次输出
+   */
+  bool ScanAt(const ReadSnapshot &snap, const int type, size_t *cursor,
+              size_t count,
+              std::vector<std::pair<std::string, int64_t>> *keys) override;
+
+  /**
+   * @brief 解析一个已校验的段，只写暂存结果而不访问任何数据库，可多线程并行调用
+   * @return false 段数据损坏
+   */
+  static bool RdbParseSection(const RdbSection &section, RdbStage *stage);
+
+  /**
+   * @brief 将暂存结果并入当前数据库
+   * @details 每种类型只修改自己的数据字典和过期字典，
+   * 不同类型的暂存结果可在不同线程中同时并入。每个key与写操作一样经过
+   * PrepareWrite，没有快照和读快照时才预先扩容字典。
+   */
+  void RdbMergeStage(RdbStage &&stage) override;
   bool AddKey(const int type, const std::string &key, const std::string &objKey,
-              const std::string &objValue);
-  bool DelKey(const int type, const std::string &key);
-  std::string GetKey(const int type, const std::string &key);
+              const std::string &objValue) override;
+  bool DelKey(const int type, const std::string &key) override;
+  std::string GetKey(const int type, const std::string &key) override;
+  /**
+   * @brief 哈希、集合、有序集合较大时返回在其他线程中格式化整个值的函数
+   * @details 值记入lent_直到done_被调用：期间修改该key时先复制一份换入字典，
+   * 删除、覆盖只替换字典中的指针，写操作不等待读取完成
+   */
+  PreparedRead PrepareRead(const int type, const std::string &key,
+                           size_t min_size) override;
+  bool GetString(const std::string &key, std::string *value) override;
+  bool GetSharedString(const std::string &key, StringSp *value) override;
+  bool HGet(const std::string &key, const std::string &field,
+            std::string *value) override;
+  long ZCard(const std::string &key) override;
+  size_t GetValueSize(const int type, const std::string &key) override;
   bool SetPExpireTime(const int type, const std::string &key,
-                      double expiredTime);
+                      double expiredTime) override;
   bool SetPExpireTime(const int type, const std::string &key,
-                      const Timestamp &expiredTime);
+                      const Timestamp &expiredTime) override;
 
   /**
    * @brief 求过期时间
    */
-  Timestamp GetKeyExpiredTime(const int type, const std::string &key);
+  Timestamp GetKeyExpiredTime(const int type, const std::string &key) override;
 
   /**
    * @brief 判断是否过期
    */
-  bool JudgeKeyExpiredTime(const int type, const std::string &key);
-  const std::string RPopList(const std::string &key);
+  bool JudgeKeyExpiredTime(const int type, const std::string &key) override;
+  const std::string RPopList(const std::string &key) override;
+  bool RPop(const std::string &key, std::string *value) override;
+
+  /**
+   * @brief 有序集合分值范围内的个数、分值和、最值，O(log n)
+   * @return false key不存在或已过期
+   */
+  bool ZRangeAggregate(const std::string &key, RangeSpec &range,
+                       RangeAggregate *agg) override;
+  uint64_t Scan(const int type, uint64_t cursor, size_t count,
+                std::vector<std::string> *keys) override;
+  bool ScanValue(const int type, const std::string &key, ValueCursor *cursor,
+                 size_t count, std::vector<ValueItem> *items) override;
+
+  /**
+   * @brief 有序集合的并、交、差运算，结果整体替换dest
+   * @details 交集和差集遍历最小(差集为第一个)的输入集合，其余集合通过成员索引探测，
+   * 结果排序后一次构建跳表。不存在或已过期的key视为空集合，结果为空时删除dest。
+   */
+  long ZSetStore(const int op, const std::string &dest,
+                 const std::vector<std::string> &keys,
+                 const std::vector<double> &weights,
+                 const int aggregate) override;
 
-  String &GetKeyStringObj() { return string_; }
-  List &GetKeyListObj() { return list_; }
-  Hash &GetKeyHashObj() { return hash_; }
-  Set &GetKeySetObj() { return set_; }
-  ZSet &GetKeyZSetObj() { return zset_; }
   // 得到当前数据库键的数目
-  int GetKeySize() const
+  int GetKeySize() const override
   {
     return GetKeyStringSize() + GetKeyListSize() + GetKeyHashSize() +
            GetKeySetSize() + GetKeyZSetSize();
@@ -94,8 +304,21 @@ public:
   int GetKeySetSize() const { return set_.size(); }
   int GetKeyZSetSize() const { return zset_.size(); }
 
+  uint64_t GetDirty() const override { return dirty_; }
+
+  /**
+   * @brief 各类型的键数，开启键值分离时还有值日志的统计
+   */
+  void AddStats(std::map<std::string, uint64_t> *stats) const override;
+
+  /**
+   * @brief 开启键值分离：不短于min_size的字符串值写入值日志，字典中只保留其位置
+   * @details 需在载入数据前调用。值日志的垃圾回收在Cron中分步执行。
+   * 不fork的后台快照不支持键值分离。
+   */
+  void SetValueLog(std::unique_ptr<ValueLog> vlog, size_t min_size);
+
 private:
-  std::string InterceptString(const std::string &ss, int p1, int p2);
   // void DingshiHandler(const std::string &key);
 
   /**
@@ -103,10 +326,114 @@ private:
    */
   void DingqiHandler();
 
+  /**
+   * @brief 值日志垃圾回收的一步
+   */
+  void ValueLogGc();
+
+  /**
+   * @brief 写入字符串值，开启键值分离时较大的值写入值日志
+   */
+  void PutString(const std::string &key, StringSp value);
+
+  /**
+   * @brief 删除字符串key前调用，其值在值日志中的记录计为无效
+   */
+  void DropString(const std::string &key);
+
+  /**
+   * @brief 字符串key的值
+   * @param[in] stored 字典中的值，值存放在值日志中时为空
+   * @param[out] buf 值存放在值日志中时读入buf
+   * @return *stored或buf
+   */
+  const std::string &StringValue(const std::string &key,
+                                 const StringSp &stored, std::string *buf);
+
+  /**
+   * @brief 与StringValue相同，但返回共享的值，值在值日志中时读入新分配的值
+   * @return 读值日志失败时返回空
+   */
+  StringSp SharedStringValue(const std::string &key, const StringSp &stored);
+
+  /**
+   * @brief 修改type类型的key前调用
+   * @return 快照进行中时返回已加锁的snapshot_mutex_，修改完成前不得释放
+   */
+  std::unique_lock<std::mutex> PrepareWrite(const int type,
+                                            const std::string &key);
+
+  /**
+   * @brief key所在的桶尚未被快照线程访问时，保存其快照时刻的值
+   */
+  template <typename D>
+  void SnapshotPreserve(D &dict, Expire &expire,
+                        std::vector<typename D::mapped_type> RdbStage::*values,
+                        SnapshotState &state, const std::string &key);
+
+  /**
+   * @brief 持锁取走已保存的值，并复制下一批桶中的key
+   * @return true 所有桶均已访问
+   */
+  template <typename D>
+  bool SnapshotCollect(D &dict, Expire &expire,
+                       std::vector<typename D::mapped_type> RdbStage::*values,
+                       SnapshotState &state, RdbStage *out);
+
+  /**
+   * @brief 有快照进行中时字典不扩容，否则按正常负载因子扩容
+   */
+  void UpdateLoadFactor();
+
+  /**
+   * @brief 为尚未保存key的版本的读快照保存其当前值，所有这些快照共享同一个版本
+   */
+  template <typename D>
+  void ReadSnapshotPreserve(
+      D &dict, Expire &expire,
+      VersionTable<typename D::mapped_type> DictReadSnapshot::*table,
+      const std::string &key);
+
+  /**
+   * @brief 版本中保存的值：字符串为值本身(值日志中的值读出)，其余类型为深复制
+   */
+  StringSp VersionValue(const std::string &key, const StringSp &stored);
+  template <typename T>
+  T VersionValue(const std::string &key, const T &stored);
+
+  /**
+   * @brief 原地修改哈希、集合、有序集合的值前调用
+   * @details 值不是Exclusive时复制一份换入字典，其他线程继续读原来的值；
+   * 否则直接返回原值
+   */
+  template <typename T>
+  T &Unshare(std::shared_ptr<T> &value);
+
+  /**
+   * @brief 值是否只有主线程能访问
+   * @details 借给工作线程读取的值不是；快照进行中时，快照开始前就存在的值
+   * 可能已交给快照线程，也不是
+   */
+  bool Exclusive(const void *value) const;
+
+  /**
+   * @brief 记录主线程新建的值，快照进行中时其修改不必复制
+   */
+  void MarkFresh(const void *value);
+
+  template <typename D>
+  void SnapshotSaveType(RdbWriter *writer, int index, const int type, D &dict,
+                        Expire &expire,
+                        std::vector<typename D::mapped_type> RdbStage::*values);
+
 private:
   // 过期删除策略
   // 惰性删除只需要在查该key时判断一下过期没有即可，过期则删除
   short del_mode_ = dbobject::kDuoxingDel | dbobject::kDingqiDel;
+  // 定时删除使用的定时器
+  RunAtFunc run_at_;
+  // 上次定期删除的时间
+  Timestamp last_expire_cycle_;
 
   // 五个数据字典
   String string_;
@@ -121,5 +448,30 @@ private:
   Expire hash_expire_;
   Expire set_expire_;
   Expire zset_expire_;
+
+  // 累计修改次数
+  uint64_t dirty_ = 0;
+
+  // 键值分离：值在值日志中的字符串在string_中的值为空串，位置记在string_vlog_中
+  std::unique_ptr<ValueLog> vlog_;
+  size_t vlog_min_size_ = 0;
+  Dict<std::string, ValuePointer> string_vlog_;
+
+  // 不fork的后台快照，snapshotting_只由主线程读写
+  bool snapshotting_ = false;
+  Timestamp snapshot_time_;
+  // 快照进行中时，快照线程访问字典和主线程修改字典都需持有
+  std::mutex snapshot_mutex_;
+  SnapshotState snapshot_[dbobject::kDbZSet + 1];
+
+  // 以下两项只在主线程访问，两个线程之间的值交接都在主线程中登记
+  // 借给工作线程读取的值 -> 进行中的读取数
+  std::unordered_map<const void *, int> lent_;
+  // 本次快照开始后主线程新建的值，快照线程不会读到
+  std::unordered_set<const void *> fresh_;
+
+  // 读快照，按纪元编号排列，只在主线程访问
+  uint64_t epoch_ = 0;
+  std::map<uint64_t, std::shared_ptr<DictReadSnapshot>> read_snapshots_;
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,79 @@
+/**
+ * @file db_config.h
+ * @author pengchang
+ * @brief 服务器配置项，目前从命令行参数中读取
+
+ */
+#ifndef DB_CONFIG_H
+#define DB_CONFIG_H
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "db_obj.h"
+
+struct DbConfig
+{
+  /**
+   * @brief 解析命令行参数，形如 --port 10000 --appendonly yes
+   * @return false 参数错误，err中为错误信息
+   */
+  bool ParseArgs(int argc, char *argv[], std::string *err);
+
+  // 监听端口
+  int port_ = 10000;
+
+  // 自动保存规则<秒数, 修改次数>：距上次保存超过秒数且修改次数达到时执行bgsave
+  std::vector<std::pair<int, uint64_t>> save_rules_ = {
+      {3600, 1}, {300, 100}, {60, 10000}};
+
+  // RDB快照方式
+  int snapshot_mode_ = dbobject::kSnapshotFork;
+  // RDB段数据和较长的字符串是否压缩
+  bool rdb_compression_ = true;
+  // RDB写出限速(字节/秒)，0表示不限制
+  uint64_t rdb_rate_limit_ = 0;
+  // RDB每写出该字节数回写一次脏页并丢弃已落盘的页缓存，0表示不处理
+  uint64_t rdb_sync_bytes_ = 4 * 1024 * 1024;
+
+  // 存储引擎，见StorageEngine::Create
+  std::string engine_ = "dict";
+
+  // 键值分离(dict引擎)：不短于该长度的字符串值存放在值日志中，0表示不分离
+  uint64_t vlog_min_size_ = 0;
+  // 值日志文件所在目录
+  std::string vlog_dir_ = "vlog";
+  // 所有库的值日志块缓存的总容量(字节)
+  uint64_t vlog_cache_size_ = 64 * 1024 * 1024;
+
+  // 启动时在后台线程中载入rdb，载入期间照常处理请求
+  bool async_load_ = false;
+
+  // 执行较大读命令(hgetall/smembers/zgetall/zrange)的工作线程数，0表示都在事件循环中执行
+  int worker_threads_ = 2;
+  // 值的元素个数不少于该值时读命令交给工作线程
+  uint64_t offload_min_size_ = 4096;
+  // 值的元素个数不少于该值且未交给工作线程时读命令分片执行，0表示不分片
+  uint64_t slice_min_size_ = 1024;
+  // 分片执行时每片的时长(微秒)
+  int64_t slice_us_ = 1000;
+
+  // 热升级：在该unix域套接字上等待新进程的接管请求，空表示不开启
+  std::string handover_socket_;
+  // 热升级：启动时向该unix域套接字上的旧进程请求接管
+  std::string upgrade_from_;
+  // 接管时旧进程写出rdb镜像的目录，应在内存文件系统中
+  std::string handover_image_dir_ = "/dev/shm";
+  // 启动时从该rdb镜像载入并随后删除，由热升级设置，不是命令行参数
+  std::string restart_image_;
+
+  // AOF持久化
+  bool appendonly_ = false;
+  std::string aof_path_ = "appendonly.aof";
+  int aof_fsync_ = dbobject::kAofFsyncEverysec;
+  // AOF比上次重写后增长该百分比且不小于最小大小时自动后台重写，0表示不自动重写
+  int aof_rewrite_percentage_ = 100;
+  uint64_t aof_rewrite_min_size_ = 64 * 1024 * 1024;
+};
+#endif
@@ -0,0 +1,64 @@
+/**
+ * @file db_log.h
+ * @author pengchang
+ * @brief 存储引擎和嵌入接口使用的日志
+ * @details 只依赖标准库。默认输出到stderr，服务器启动时用SetLogOutput转给muduo的Logger，
+ * 格式和级别与服务器自身的日志一致。
+ */
+#ifndef DB_LOG_H
+#define DB_LOG_H
+#include <functional>
+#include <sstream>
+#include <string>
+
+namespace dblog
+{
+    enum LogLevel
+    {
+        kDebug = 0,
+        kInfo,
+        kWarn,
+        kError
+    };
+
+    // 一条日志的输出函数，msg不含换行
+    using LogOutput = std::function<void(LogLevel level, const char *file,
+                                         int line, const std::string &msg)>;
+
+    /**
+     * @brief 设置输出函数和最低输出级别，应在使用引擎前调用
+     * @param[in] output 为空时恢复为输出到stderr
+     */
+    void SetLogOutput(const LogOutput &output, LogLevel min_level = kInfo);
+
+    bool LevelEnabled(LogLevel level);
+
+    // 一条日志，析构时输出
+    class LogLine
+    {
+    public:
+        LogLine(LogLevel level, const char *file, int line)
+            : level_(level), file_(file), line_(line) {}
+        ~LogLine();
+        LogLine(const LogLine &) = delete;
+        LogLine &operator=(const LogLine &) = delete;
+
+        std::ostream &stream() { return stream_; }
+
+    private:
+        LogLevel level_;
+        const char *file_;
+        int line_;
+        std::ostringstream stream_;
+    };
+} // namespace dblog
+
+#define DB_LOG_DEBUG                          \
+  if (dblog::LevelEnabled(dblog::kDebug))     \
+  dblog::LogLine(dblog::kDebug, __FILE__, __LINE__).stream()
+#define DB_LOG_INFO                           \
+  if (dblog::LevelEnabled(dblog::kInfo))      \
+  dblog::LogLine(dblog::kInfo, __FILE__, __LINE__).stream()
+#define DB_LOG_WARN dblog::LogLine(dblog::kWarn, __FILE__, __LINE__).stream()
+#define DB_LOG_ERROR dblog::LogLine(dblog::kError, __FILE__, __LINE__).stream()
+#endif
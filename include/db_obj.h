@@ -5,7 +5,7 @@
  */
 #ifndef DB_OBJ_H
 #define DB_OBJ_H
-#include <muduo/base/Timestamp.h>
+#include <string>
 
 /**
  * @brief 存放与数据库有关常量
@@ -21,9 +21,6 @@ namespace dbobject
 
     const std::string kDefaultObjValue = "NULL";
 
-    // RDB默认保存时间(ms)
-    const muduo::Timestamp kRdbDefaultTime(1000 * 1000 * 1000);
-
     // 过期删除策略
     const short kDingshiDel = 0x0;
     const short kDuoxingDel = 0x1;
@@ -31,5 +28,24 @@ namespace dbobject
 
     // 定期删除每次抽查的key数量
     const int kCheckNum = 20;
+
+    // AOF的fsync策略
+    const short kAofFsyncAlways = 0;
+    const short kAofFsyncEverysec = 1;
+    const short kAofFsyncNo = 2;
+
+    // RDB快照方式：fork子进程，或后台线程配合主线程保存修改前的值
+    const short kSnapshotFork = 0;
+    const short kSnapshotThread = 1;
+
+    // 有序集合的集合运算
+    const short kZSetUnion = 0;
+    const short kZSetInter = 1;
+    const short kZSetDiff = 2;
+
+    // 有序集合运算时相同成员分值的聚合方式
+    const short kAggregateSum = 0;
+    const short kAggregateMin = 1;
+    const short kAggregateMax = 2;
 } // namespace dbobject
 #endif
\ No newline at end of file
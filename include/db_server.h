@@ -7,18 +7,31 @@
 
 #ifndef DB_SERVER_H
 #define DB_SERVER_H
+#include <muduo/base/ThreadPool.h>
+#include <muduo/net/Channel.h>
 #include <muduo/net/EventLoop.h>
 #include <muduo/net/InetAddress.h>
 #include <muduo/net/TcpServer.h>
 
-#include "database.h"
+#include <atomic>
+#include <deque>
+#include <thread>
+
+#include "aof.h"
+#include "db_config.h"
+#include "rdb.h"
+#include "storage_engine.h"
+
+class AsyncRdbLoader;
+
 class DbServer
 {
 public:
   typedef std::vector<std::string> VecS;
   DbServer(muduo::net::EventLoop *loop,
-           const muduo::net::InetAddress &localAddr);
-  ~DbServer() {}
+           const muduo::net::InetAddress &localAddr,
+           const DbConfig &config = DbConfig());
+  ~DbServer();
 
   /**
    * @brief 新连接建立回调
@@ -41,70 +54,391 @@ public:
 
   /**
    * @brief rdb存储
+   * @details 按配置fork子进程写快照，或在后台线程中写快照而不fork
+   * @return false 已有保存在进行或fork失败
    */
-  void RdbSave();
+  bool RdbSave();
+
+  /**
+   * @brief 后台重写AOF
+   * @details 子进程把所有库写成最少的命令到临时文件，父进程继续处理请求并把
+   * 期间的写命令记入重写缓冲区，子进程退出后由ServerCron追加缓冲区并替换AOF
+   * @return false 未开启AOF、已有重写在进行或fork失败
+   */
+  bool RewriteAof();
 
 private:
   // 数据分库的数目
   static const long kDefaultDbNum = 16;
+  // 自动保存失败后重试的间隔(秒)
+  static const int kSaveRetryDelay = 5;
   /**
    * @brief 数据库初始化
    * @details
-   * 生成所有数据分库，并对当前数据分库从rdb文件进行数据恢复。
+   * 生成所有数据分库。热升级时从旧进程留下的rdb镜像恢复；
+   * 否则开启AOF且AOF文件非空时重放AOF，再否则从rdb文件一次性并行恢复所有分库。
    */
   void InitDB();
 
+  /**
+   * @brief 热升级时处理新进程的接管请求
+   * @details 没有后台保存或重写在进行时，把所有库写成rdb镜像，
+   * 连同监听套接字交给新进程，然后退出事件循环。
+   * 数据不是原地交接的：写镜像期间两个进程都不处理请求，停顿随数据量线性增长
+   * (约为内存带宽下序列化全部数据的时间)；新进程开启--async-load时写完镜像即可服务
+   */
+  void HandleHandover();
+
+  /**
+   * @brief 把所有库不压缩、不限速地写入handover_image_dir_中的rdb镜像
+   * @param[out] path 镜像路径
+   */
+  bool WriteRestartImage(std::string *path);
+
+  /**
+   * @brief 把所有库写入临时文件，落盘后原子地替换dump.rdb
+   * @param[in] snapshot true 在快照线程中调用，写出快照开始时刻的数据
+   */
+  bool WriteRdbFile(bool snapshot);
+
+  /**
+   * @brief 开始写rdb前重置写出进度
+   */
+  void ResetRdbProgress();
+
+  /**
+   * @brief 不fork的后台快照
+   * @details 所有库在同一时刻开始快照，之后由后台线程写文件，主线程照常处理请求
+   */
+  void RdbSaveInThread();
+
+  /**
+   * @brief 处理连接上的一条命令并发送响应
+   */
+  void HandleMessage(const muduo::net::TcpConnectionPtr &conn,
+                     const std::string &msg);
+
+  /**
+   * @brief 发送响应，有AOF待写出时暂存到写出之后
+   */
+  void Reply(const muduo::net::TcpConnectionPtr &conn, const std::string &res);
+
+  /**
+   * @brief get命中时以共享的值直接调用Reply，不经过GetKey和命令回调
+   * @details 省去的是中间字符串的复制。发送本身仍会复制：套接字没写完的部分
+   * 由TcpConnection复制到输出缓冲区，等待AOF写出时复制到pending_reply_
+   * @return false 不是get或key不存在、已过期、值为空，应正常执行
+   */
+  bool SendString(const muduo::net::TcpConnectionPtr &conn,
+                  const std::string &msg);
+
+  /**
+   * @brief 较大的hgetall/smembers/zgetall/zrange交给工作线程执行
+   * @details 值的元素个数达到offload_min_size_时，由引擎的PrepareRead准备读取函数，
+   * 在工作线程中格式化响应后交回事件循环，归还值并发送。期间该连接的后续命令排队等待，
+   * 保证响应的顺序
+   * @return false 不需要或不能交给工作线程，应在事件循环中执行
+   */
+  bool Offload(const muduo::net::TcpConnectionPtr &conn,
+               const std::string &msg);
+
+  /**
+   * @brief 工作线程执行完后在事件循环中调用
+   */
+  void DoneOffload(const muduo::net::TcpConnectionPtr &conn,
+                   const std::string &cmd, std::string &&res);
+
+  /**
+   * @brief 较大的hgetall/smembers/zgetall/zrange在事件循环中分片执行
+   * @details 值的元素个数达到slice_min_size_且未交给工作线程时，
+   * 每片执行不超过slice_us_微秒后让出事件循环，下一轮与其他连接的命令和
+   * 其他分片命令轮流执行。连接只保存读到的位置(ValueCursor)，下一片从上一片
+   * 返回的最后一个元素之后重新定位：命令执行期间一直存在的元素恰好返回一次，
+   * 其间写入的元素可能返回也可能不返回。期间该连接的后续命令排队等待
+   * @return false 不需要分片，应直接执行
+   */
+  bool StartSliced(const muduo::net::TcpConnectionPtr &conn,
+                   const std::string &msg);
+
+  /**
+   * @brief 每个分片命令各执行一片，执行完的发送响应，其余的下一轮继续
+   */
+  void RunSlices();
+
+  struct SlicedRead;
+  /**
+   * @brief 执行一片
+   * @return true 命令已执行完
+   */
+  bool RunSlice(SlicedRead &job);
+
+  struct ClientSession;
+  // 命令回调，第一个参数为发出命令的连接的会话
+  typedef std::function<std::string(ClientSession &, VecS &&)> CommandFunc;
+  /**
+   * @brief 连接的会话，在连接建立时创建
+   */
+  static ClientSession &Session(const muduo::net::TcpConnectionPtr &conn);
+
+  /**
+   * @brief 连接上在工作线程中或分片执行的命令完成后调用，
+   * 发送响应并继续处理排队的命令
+   */
+  void Resume(const muduo::net::TcpConnectionPtr &conn, std::string &&res);
+
+  /**
+   * @brief 在会话选择的库上执行一条命令，是写命令时追加到AOF缓冲区并安排
+   * 本轮事件循环结束时写出
+   * @return 响应信息
+   */
+  std::string Execute(ClientSession &session, const std::string &msg);
+
+  /**
+   * @brief 处理事务：multi开始排队，exec依次执行排队的命令，discard放弃
+   * @details 事务中的命令在一次调用中连续执行，期间不会插入其他连接的命令；
+   * 写命令在本轮事件循环结束时与其他写命令一起写入AOF，响应合并为一个
+   * @param[out] res 响应信息
+   * @return false 不是事务命令且连接不在事务中，应正常执行
+   */
+  bool HandleTransaction(const muduo::net::TcpConnectionPtr &conn,
+                         const std::string &msg, std::string *res);
+
+  /**
+   * @brief 将执行过的写命令追加到AOF缓冲区
+   * @details expire/pexpire改写为绝对时间的pexpireat，重放时不受重启时间影响
+   * @param[in] db 命令执行所在的库
+   * @param[in] argv ParseMsg传给命令回调的参数
+   * @return true 是写命令，已追加
+   */
+  bool FeedAof(const int db, const VecS &argv);
+
+  /**
+   * @brief 执行AOF中的一条命令
+   * @details 参数已由AOF记录分好，直接调用命令回调，参数中可以含有空白
+   * @param[in] session 重放用的会话，由AOF中的select切换库
+   */
+  void ReplayAofCommand(ClientSession &session, const VecS &argv);
+
+  /**
+   * @brief 本轮事件循环结束时写出AOF缓冲区，再发送期间暂存的响应
+   * @details 写出失败时暂存的响应都换成错误，之后拒绝写命令直到ServerCron重试成功
+   */
+  void FlushAof();
+
+  /**
+   * @brief 周期任务：执行各库的Cron，回收后台子进程和快照线程，完成AOF重写，
+   * 检查是否需要自动重写
+   */
+  void ServerCron();
+
+  /**
+   * @brief AOF重写子进程退出后调用
+   * @param[in] status waitpid得到的退出状态
+   */
+  void DoneRewriteAof(int status);
+
+  /**
+   * @brief 后台载入rdb期间，执行命令前先载入命令在库db中访问的类型的段
+   * @details bgsave/bgrewriteaof需要完整的数据，先载入全部段
+   */
+  void EnsureLoaded(const int db, const std::string &cmd);
+
+  /**
+   * @brief 后台载入rdb结束后调用，释放载入器
+   */
+  void DoneAsyncLoad(bool ok);
+
   /**
    * @brief 从字符串中解析一行命令，并调用相应的命令回调函数处理
    * @details 比如""set key1 value1",解析完毕后，会将其存入一个VecS对象，
    * 值为{"set", "key1","value1"}，然后将该对象传给命令回调函数。
+   * @param[in] session 发出命令的连接的会话，命令在其选择的库上执行
    * @param[in] msg OnMessage收到的数据，即一行命令，比如"set key1 value1"
+   * @param[out] executed 不为空时追加每次传给命令回调的参数。命令只取固定个数的参数，
+   * 多余的被忽略；rpush每个元素调用一次回调
    * @return std::string 响应信息，比如"OK"
    */
-  std::string ParseMsg(const std::string &msg);
-
-  // 数据库操作命令的回调处理函数。目前只支持十八个命令。
-  std::string SetCommand(VecS &&);
-  std::string GetCommand(VecS &&);
-  std::string PExpiredCommand(VecS &&);
-  std::string ExpiredCommand(VecS &&);
-  std::string BgsaveCommand(VecS &&);
-  std::string SelectCommand(VecS &&);
-  std::string RpushCommand(VecS &&);
-  std::string RpopCommand(VecS &&);
-  std::string HSetCommand(VecS &&);
-  std::string HGetCommand(VecS &&);
-  std::string HGetAllCommand(VecS &&);
-  std::string SAddCommand(VecS &&);
-  std::string SMembersCommand(VecS &&);
-  std::string ZAddCommand(VecS &&);
-  std::string ZCardCommand(VecS &&);
-  std::string ZRangeCommand(VecS &&);
-  std::string ZCountCommand(VecS &&);
-  std::string ZGetAllCommand(VecS &&);
-
-  std::string SaveHead();
-  std::string SaveSelectDB(const int index);
-  std::string SaveExpiredTime(const muduo::Timestamp &expiredTime);
-  std::string SaveType(const int type);
-  std::string SaveKV(const std::string &key, const std::string &value);
-  /**
-   * @brief 判断是否应执行RDB持久化
+  std::string ParseMsg(ClientSession &session, const std::string &msg,
+                       std::vector<VecS> *executed);
+
+  /**
+   * @brief 调用命令回调
+   * @param[out] executed 不为空时先追加argv
+   */
+  std::string Dispatch(const CommandFunc &func, ClientSession &session,
+                       VecS &&argv, std::vector<VecS> *executed);
+
+  // 数据库操作命令的回调处理函数，第一个参数为发出命令的连接的会话
+  std::string SetCommand(ClientSession &, VecS &&);
+  std::string GetCommand(ClientSession &, VecS &&);
+  std::string PExpiredCommand(ClientSession &, VecS &&);
+  std::string ExpiredCommand(ClientSession &, VecS &&);
+  std::string PExpireAtCommand(ClientSession &, VecS &&);
+  std::string BgsaveCommand(ClientSession &, VecS &&);
+  std::string BgRewriteAofCommand(ClientSession &, VecS &&);
+  std::string InfoCommand(ClientSession &, VecS &&);
+  std::string LastSaveCommand(ClientSession &, VecS &&);
+  std::string SelectCommand(ClientSession &, VecS &&);
+  std::string PingCommand(ClientSession &, VecS &&);
+  std::string RpushCommand(ClientSession &, VecS &&);
+  std::string RpopCommand(ClientSession &, VecS &&);
+  std::string HSetCommand(ClientSession &, VecS &&);
+  std::string HGetCommand(ClientSession &, VecS &&);
+  std::string HGetAllCommand(ClientSession &, VecS &&);
+  std::string SAddCommand(ClientSession &, VecS &&);
+  std::string SMembersCommand(ClientSession &, VecS &&);
+  std::string ZAddCommand(ClientSession &, VecS &&);
+  std::string ZCardCommand(ClientSession &, VecS &&);
+  std::string ZRangeCommand(ClientSession &, VecS &&);
+  std::string ZCountCommand(ClientSession &, VecS &&);
+  std::string ZSumRangeCommand(ClientSession &, VecS &&);
+  std::string ZAvgRangeCommand(ClientSession &, VecS &&);
+  std::string ZGetAllCommand(ClientSession &, VecS &&);
+  std::string ZUnionStoreCommand(ClientSession &, VecS &&);
+  std::string ZInterStoreCommand(ClientSession &, VecS &&);
+  std::string ZDiffStoreCommand(ClientSession &, VecS &&);
+
+  /**
+   * @brief zunionstore/zinterstore/zdiffstore的参数解析
+   * @details 格式为 dest numkeys key [key ...] [weights w [w ...]]
+   * [aggregate sum|min|max]，zdiffstore不支持weights和aggregate
+   * @param[in] op dbobject::kZSetUnion/kZSetInter/kZSetDiff
+   */
+  std::string ZSetStoreCommand(ClientSession &, const int op, VecS &&);
+
+  /**
+   * @brief scan cursor [match pattern] [count count] [type type]
+   * @details 游标不对应服务器中的任何状态，可以随时放弃遍历
+   */
+  std::string ScanCommand(ClientSession &, VecS &&);
+  std::string HScanCommand(ClientSession &, VecS &&);
+  std::string SScanCommand(ClientSession &, VecS &&);
+  std::string ZScanCommand(ClientSession &, VecS &&);
+  /**
+   * @brief client list|setname name|getname
+   * @details list每行一个连接：连接名、setname设置的名称、所在的库、
+   * 连接时长(秒)及ClientStats中的统计
+   */
+  std::string ClientCommand(ClientSession &, VecS &&);
+
+  /**
+   * @brief hscan/sscan/zscan，格式为 key cursor [match pattern] [count count]
+   * @param[in] type dbobject::kDbHash/kDbSet/kDbZSet
+   */
+  std::string ScanValueCommand(ClientSession &, const int type, VecS &&);
+
+  /**
+   * @brief 判断是否应执行RDB持久化，由ServerCron周期调用
+   * @details 任一保存规则满足(距上次成功保存的秒数和期间的修改次数均达到)时返回true，
+   * 上次保存失败后至少间隔kSaveRetryDelay秒再重试
    * @return true 满足执行RDB持久化的条件
    * @return false 不满足执行RDB持久化的条件
    */
   bool CheckSaveCondition();
 
+  /**
+   * @brief rdb子进程或快照线程结束后调用，更新上次保存的时间、耗时和状态
+   */
+  void DoneRdbSave(bool ok);
+
+  // 所有库的累计修改次数
+  uint64_t TotalDirty() const;
+
 private:
   // db相关
-  std::vector<std::unique_ptr<Database>> database_; // 所有数据库分库
-  int db_idx_;                                      // 当前数据库分库编号
-  std::unordered_map<std::string, std::function<std::string(VecS &&)>>
-      cmd_dict_; // <命令名称, 命令回调函数对象>
-  muduo::Timestamp last_save_;
+  std::vector<std::unique_ptr<StorageEngine>> database_; // 所有数据库分库
+  // <命令名称, 命令回调函数对象>
+  std::unordered_map<std::string, CommandFunc> cmd_dict_;
+  // rdb相关
+  Timestamp last_save_;       // 上次成功保存的时间
+  Timestamp last_save_try_;   // 上次开始保存的时间
+  bool last_save_ok_;                // 上次保存是否成功
+  int64_t last_save_duration_us_;    // 上次保存的耗时，-1表示还没有
+  int64_t last_fork_us_;             // 上次fork的耗时，-1表示还没有
+  uint64_t dirty_at_last_save_;      // 上次成功保存的数据对应的修改次数
+  uint64_t dirty_at_save_start_;     // 当前保存开始时的修改次数
+  DbConfig config_;
+  std::thread snapshot_thread_;       // 不fork的后台快照线程
+  std::atomic<bool> snapshot_done_;   // 快照线程已写完
+  std::atomic<bool> snapshot_ok_;     // 快照线程写出成功
+  pid_t rdb_child_;                   // rdb子进程，-1表示没有
+  RdbProgress *rdb_progress_;         // rdb写出进度，与子进程共享
+  std::unique_ptr<AsyncRdbLoader> loader_; // 后台载入rdb，载入完成后为空
+
+  // aof相关
+  std::unique_ptr<Aof> aof_;
+  bool aof_flush_pending_; // 已安排本轮事件循环结束时写出AOF
+  // 上次写出AOF失败，ServerCron重试成功前拒绝写命令
+  bool aof_write_error_;
+  pid_t aof_rewrite_child_; // AOF重写子进程，-1表示没有
+  // AOF写出前有暂存响应的连接，保证客户端收到响应时命令已写入AOF
+  std::vector<muduo::net::TcpConnectionPtr> pending_replies_;
+
+  // 工作线程相关
+  std::unique_ptr<muduo::ThreadPool> workers_; // 执行较大读命令，未开启时为空
+  uint64_t offloaded_reads_; // 交给工作线程执行的命令数
+  size_t offloaded_in_flight_; // 正在工作线程中执行的命令数
+
+  // 分片执行相关
+  struct SlicedRead
+  {
+    muduo::net::TcpConnectionPtr conn_;
+    std::string cmd_;
+    int db_;
+    int type_;
+    std::string key_;
+    double low_, high_; // zrange的范围，不含两端，与GetKey相同
+    ValueCursor cursor_; // 已读到的位置
+    std::string res_; // 已生成的响应
+  };
+  std::deque<SlicedRead> sliced_; // 轮流执行的分片命令
+  bool slices_pending_;           // 已安排下一轮执行RunSlices
+  uint64_t sliced_reads_;         // 分片执行的命令数
+  uint64_t slices_;               // 执行的片数
+  int64_t slice_max_us_;          // 最长的一片的耗时
+
+  // 每个连接的统计，用于观察是否有连接占用过多的执行时间
+  struct ClientStats
+  {
+    Timestamp since_;  // 连接建立的时间
+    uint64_t cmds_ = 0;       // 执行的命令数
+    int64_t usec_ = 0;        // 在事件循环中执行命令的总耗时
+    uint64_t sliced_ = 0;     // 分片执行的命令数
+    uint64_t slices_ = 0;     // 执行的片数
+    uint64_t queued_ = 0;     // 因前一条命令未完成而排队的命令数
+    int64_t max_wait_us_ = 0; // 排队最久的命令等待的时间
+  };
+
+  // 事务相关
+  struct MultiState
+  {
+    std::vector<std::string> cmds_; // multi之后排队的命令
+    bool aborted_ = false;          // 排队时有命令出错，exec时放弃整个事务
+  };
+
+  // 连接的会话状态，以shared_ptr存入TcpConnection的context，随连接释放
+  struct ClientSession
+  {
+    std::string name_; // client setname设置的名称
+    int db_ = 0;       // select选择的库
+    ClientStats stats_;
+    // 有命令在工作线程中或分片执行，后续命令及其到达时间在queued_中排队
+    bool busy_ = false;
+    std::deque<std::pair<Timestamp, std::string>> queued_;
+    std::unique_ptr<MultiState> multi_; // 不在事务中时为空
+    // AOF写出前暂存的响应，写出后一次发送，清空时保留容量供下次使用
+    std::string pending_reply_;
+    // pending_reply_中的响应数，AOF写出失败时换成同样数目的错误
+    size_t pending_count_ = 0;
+  };
+  // <连接名, 会话>，用于client list和统计
+  std::unordered_map<std::string, std::shared_ptr<ClientSession>> sessions_;
 
   // net相关
   muduo::net::EventLoop *loop_;
   muduo::net::TcpServer server_;
+  // 等待热升级接管请求的unix域套接字，-1表示未开启
+  int handover_fd_;
+  std::unique_ptr<muduo::net::Channel> handover_channel_;
 };
 #endif
\ No newline at end of file
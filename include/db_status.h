@@ -13,32 +13,20 @@ class DbStatus
 public:
   ~DbStatus() = default;
 
-  std::string ToString()
+  std::string ToString() const
   {
-    if (msg_ == "")
+    if (msg_.empty())
     {
       return "OK\n";
     }
-    else
-    {
-      std::string type;
-      switch (db_state_)
-      {
-      case kOK:
-        type = "OK: ";
-        break;
-      case kNotFound:
-        type = "NotFound: ";
-        break;
-      case kIOError:
-        type = "IO Error: ";
-        break;
-      default:
-        break;
-      }
-      std::string res = type + msg_ + "\n";
-      return res;
-    }
+    // 按ResCode索引，一次分配拼出整个响应
+    static const char *const kTypes[] = {"OK: ", "NotFound: ", "IO Error: "};
+    std::string res;
+    res.reserve(sizeof("IO Error: \n") + msg_.size());
+    res += kTypes[db_state_];
+    res += msg_;
+    res += '\n';
+    return res;
   }
   /**
    * @brief 构造DbStatus对象
@@ -72,4 +60,20 @@ private:
   int db_state_;
   std::string msg_;
 };
+
+/**
+ * @brief 最常用的几种响应，与对应的DbStatus::ToString()相同，
+ * 预先生成，命令直接返回它们而不必每次构造DbStatus再拼接
+ * @details 命令回调按值返回std::string，返回时仍复制一次：
+ * 不超过15字节的(OK、QUEUED)在短字符串缓冲区内，不分配内存
+ */
+namespace dbreply
+{
+    const std::string kOk = "OK\n";
+    const std::string kParameterError = "IO Error: Parameter error\n";
+    const std::string kCommandNotFound = "NotFound: command\n";
+    const std::string kKeyNotFound = "NotFound: key\n";
+    // 事务中排队的命令
+    const std::string kQueued = "QUEUED\n";
+} // namespace dbreply
 #endif
\ No newline at end of file
@@ -0,0 +1,540 @@
+/**
+ * @file dict.h
+ * @brief 数据库字典使用的哈希表
+ */
+#ifndef DICT_H
+#define DICT_H
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace dictdetail
+{
+// 从元素中取出key
+struct Select1st
+{
+  template <typename P>
+  const typename P::first_type &operator()(const P &p) const
+  {
+    return p.first;
+  }
+};
+
+struct Identity
+{
+  template <typename T>
+  const T &operator()(const T &t) const
+  {
+    return t;
+  }
+};
+} // namespace dictdetail
+
+/**
+ * @brief 链式哈希表，桶数总是2的幂
+ * @details 桶编号为哈希值的低位，扩容时桶数成倍增加，一个桶中的元素只会分到
+ * 低位相同的几个桶，scan系列命令的反向二进制游标因此在扩容前后都有效。
+ * 每个元素在单独的节点中，插入和扩容不会使元素的引用失效。
+ * 只修改负载因子不会立即rehash，也从不缩容，快照期间借此保持桶的编号不变。
+ * 接口是unordered_map/unordered_set的子集，遍历顺序为桶的编号顺序
+ * @tparam kConstElements 为true时(集合)迭代器只给出const引用
+ */
+template <typename Key, typename Value, typename ExtractKey,
+          bool kConstElements, typename Alloc = std::allocator<Value>,
+          typename Hash = std::hash<Key>, typename Equal = std::equal_to<Key>>
+class HashTable
+{
+  struct Node
+  {
+    template <typename... Args>
+    explicit Node(size_t hash, Args &&...args)
+        : next_(nullptr), hash_(hash), value_(std::forward<Args>(args)...)
+    {
+    }
+
+    Node *next_;
+    size_t hash_; // 缓存的哈希值，扩容和查找时不必重新计算
+    Value value_;
+  };
+  using NodeAlloc =
+      typename std::allocator_traits<Alloc>::template rebind_alloc<Node>;
+  using NodeTraits = std::allocator_traits<NodeAlloc>;
+
+public:
+  using key_type = Key;
+  using value_type = Value;
+  using size_type = size_t;
+  using hasher = Hash;
+  using key_equal = Equal;
+
+  template <bool kConst>
+  class Iterator
+  {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Value;
+    using difference_type = std::ptrdiff_t;
+    using reference =
+        std::conditional_t<kConst || kConstElements, const Value &, Value &>;
+    using pointer =
+        std::conditional_t<kConst || kConstElements, const Value *, Value *>;
+
+    Iterator() : table_(nullptr), bucket_(0), node_(nullptr) {}
+    // iterator可以转换为const_iterator
+    template <bool kOther, typename = std::enable_if_t<kConst && !kOther>>
+    Iterator(const Iterator<kOther> &other)
+        : table_(other.table_), bucket_(other.bucket_), node_(other.node_)
+    {
+    }
+
+    reference operator*() const { return node_->value_; }
+    pointer operator->() const { return &node_->value_; }
+
+    Iterator &operator++()
+    {
+      node_ = node_->next_;
+      if (node_ == nullptr)
+      {
+        table_->FirstFrom(bucket_ + 1, &bucket_, &node_);
+      }
+      return *this;
+    }
+
+    Iterator operator++(int)
+    {
+      Iterator old = *this;
+      ++*this;
+      return old;
+    }
+
+    template <bool kOther>
+    bool operator==(const Iterator<kOther> &other) const
+    {
+      return node_ == other.node_;
+    }
+
+    template <bool kOther>
+    bool operator!=(const Iterator<kOther> &other) const
+    {
+      return node_ != other.node_;
+    }
+
+  private:
+    friend class HashTable;
+    template <bool>
+    friend class Iterator;
+
+    Iterator(const HashTable *table, size_t bucket, Node *node)
+        : table_(table), bucket_(bucket), node_(node)
+    {
+    }
+
+    const HashTable *table_;
+    size_t bucket_;
+    Node *node_; // 为空时为end()
+  };
+
+  // 只遍历一个桶
+  template <bool kConst>
+  class LocalIterator
+  {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Value;
+    using difference_type = std::ptrdiff_t;
+    using reference =
+        std::conditional_t<kConst || kConstElements, const Value &, Value &>;
+    using pointer =
+        std::conditional_t<kConst || kConstElements, const Value *, Value *>;
+
+    LocalIterator() : node_(nullptr) {}
+
+    reference operator*() const { return node_->value_; }
+    pointer operator->() const { return &node_->value_; }
+
+    LocalIterator &operator++()
+    {
+      node_ = node_->next_;
+      return *this;
+    }
+
+    LocalIterator operator++(int)
+    {
+      LocalIterator old = *this;
+      node_ = node_->next_;
+      return old;
+    }
+
+    bool operator==(const LocalIterator &other) const
+    {
+      return node_ == other.node_;
+    }
+
+    bool operator!=(const LocalIterator &other) const
+    {
+      return node_ != other.node_;
+    }
+
+  private:
+    friend class HashTable;
+    explicit LocalIterator(Node *node) : node_(node) {}
+
+    Node *node_;
+  };
+
+  using iterator = Iterator<false>;
+  using const_iterator = Iterator<true>;
+  using local_iterator = LocalIterator<false>;
+  using const_local_iterator = LocalIterator<true>;
+
+  HashTable()
+      : buckets_(&single_bucket_), bucket_count_(1), single_bucket_(nullptr),
+        size_(0), max_load_factor_(1.0f)
+  {
+  }
+
+  HashTable(const HashTable &other) : HashTable()
+  {
+    max_load_factor_ = other.max_load_factor_;
+    Rehash(other.bucket_count_);
+    // 保持桶内的顺序，副本的遍历顺序与原表相同
+    for (size_t i = 0; i < other.bucket_count_; ++i)
+    {
+      Node **tail = &buckets_[i];
+      for (Node *node = other.buckets_[i]; node; node = node->next_)
+      {
+        *tail = NewNode(node->hash_, node->value_);
+        tail = &(*tail)->next_;
+      }
+    }
+    size_ = other.size_;
+  }
+
+  HashTable(HashTable &&other) noexcept : HashTable() { swap(other); }
+
+  HashTable &operator=(HashTable other) noexcept
+  {
+    swap(other);
+    return *this;
+  }
+
+  ~HashTable()
+  {
+    clear();
+    if (buckets_ != &single_bucket_)
+    {
+      delete[] buckets_;
+    }
+  }
+
+  void swap(HashTable &other) noexcept
+  {
+    // 只有一个桶时桶数组是对象自己的成员，不能直接交换指针
+    bool single = buckets_ == &single_bucket_;
+    bool other_single = other.buckets_ == &other.single_bucket_;
+    std::swap(buckets_, other.buckets_);
+    std::swap(single_bucket_, other.single_bucket_);
+    if (other_single)
+    {
+      buckets_ = &single_bucket_;
+    }
+    if (single)
+    {
+      other.buckets_ = &other.single_bucket_;
+    }
+    std::swap(bucket_count_, other.bucket_count_);
+    std::swap(size_, other.size_);
+    std::swap(max_load_factor_, other.max_load_factor_);
+  }
+
+  iterator begin()
+  {
+    iterator it(this, 0, nullptr);
+    FirstFrom(0, &it.bucket_, &it.node_);
+    return it;
+  }
+  const_iterator begin() const
+  {
+    const_iterator it(this, 0, nullptr);
+    FirstFrom(0, &it.bucket_, &it.node_);
+    return it;
+  }
+  iterator end() { return iterator(this, bucket_count_, nullptr); }
+  const_iterator end() const
+  {
+    return const_iterator(this, bucket_count_, nullptr);
+  }
+
+  local_iterator begin(size_t bucket)
+  {
+    return local_iterator(buckets_[bucket]);
+  }
+  const_local_iterator begin(size_t bucket) const
+  {
+    return const_local_iterator(buckets_[bucket]);
+  }
+  local_iterator end(size_t) { return local_iterator(nullptr); }
+  const_local_iterator end(size_t) const
+  {
+    return const_local_iterator(nullptr);
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_t bucket_count() const { return bucket_count_; }
+  size_t bucket(const Key &key) const
+  {
+    return Hash()(key) & (bucket_count_ - 1);
+  }
+
+  float max_load_factor() const { return max_load_factor_; }
+  // 不立即rehash，下次插入时按新的负载因子判断是否扩容
+  void max_load_factor(float factor) { max_load_factor_ = factor; }
+
+  /**
+   * @brief 扩容到能容纳n个元素而不超过负载因子
+   */
+  void reserve(size_t n)
+  {
+    Rehash(BucketsFor(n));
+  }
+
+  iterator find(const Key &key)
+  {
+    size_t hash = Hash()(key);
+    size_t bucket = hash & (bucket_count_ - 1);
+    return iterator(this, bucket, FindNode(bucket, hash, key));
+  }
+
+  const_iterator find(const Key &key) const
+  {
+    size_t hash = Hash()(key);
+    size_t bucket = hash & (bucket_count_ - 1);
+    return const_iterator(this, bucket, FindNode(bucket, hash, key));
+  }
+
+  size_t count(const Key &key) const { return find(key) == end() ? 0 : 1; }
+
+  /**
+   * @brief key不存在时插入由args构造的元素
+   * @return 元素的迭代器，是否插入
+   */
+  template <typename... Args>
+  std::pair<iterator, bool> emplace(Args &&...args)
+  {
+    Node *node = NewNode(0, std::forward<Args>(args)...);
+    const Key &key = ExtractKey()(node->value_);
+    node->hash_ = Hash()(key);
+    size_t bucket = node->hash_ & (bucket_count_ - 1);
+    Node *found = FindNode(bucket, node->hash_, key);
+    if (found != nullptr)
+    {
+      DeleteNode(node);
+      return std::make_pair(iterator(this, bucket, found), false);
+    }
+    if (size_ + 1 > bucket_count_ * static_cast<double>(max_load_factor_))
+    {
+      Rehash(std::max(bucket_count_ * 2, BucketsFor(size_ + 1)));
+      bucket = node->hash_ & (bucket_count_ - 1);
+    }
+    node->next_ = buckets_[bucket];
+    buckets_[bucket] = node;
+    ++size_;
+    return std::make_pair(iterator(this, bucket, node), true);
+  }
+
+  template <typename V>
+  std::pair<iterator, bool> insert(V &&value)
+  {
+    return emplace(std::forward<V>(value));
+  }
+
+  /**
+   * @brief 只对map：key不存在时插入值初始化的元素
+   */
+  template <typename V = Value>
+  typename V::second_type &operator[](const Key &key)
+  {
+    iterator it = find(key);
+    if (it == end())
+    {
+      it = emplace(std::piecewise_construct, std::forward_as_tuple(key),
+                   std::forward_as_tuple())
+               .first;
+    }
+    return it->second;
+  }
+
+  /**
+   * @brief 删除pos处的元素
+   * @return 下一个元素的迭代器
+   */
+  iterator erase(const_iterator pos)
+  {
+    iterator next(this, pos.bucket_, pos.node_);
+    ++next;
+    Unlink(pos.bucket_, pos.node_);
+    return next;
+  }
+
+  size_t erase(const Key &key)
+  {
+    size_t hash = Hash()(key);
+    size_t bucket = hash & (bucket_count_ - 1);
+    Node *node = FindNode(bucket, hash, key);
+    if (node == nullptr)
+    {
+      return 0;
+    }
+    Unlink(bucket, node);
+    return 1;
+  }
+
+  void clear()
+  {
+    for (size_t i = 0; i < bucket_count_; ++i)
+    {
+      Node *node = buckets_[i];
+      while (node)
+      {
+        Node *next = node->next_;
+        DeleteNode(node);
+        node = next;
+      }
+      buckets_[i] = nullptr;
+    }
+    size_ = 0;
+  }
+
+private:
+  template <typename... Args>
+  Node *NewNode(size_t hash, Args &&...args)
+  {
+    NodeAlloc alloc;
+    Node *node = NodeTraits::allocate(alloc, 1);
+    try
+    {
+      ::new (static_cast<void *>(node)) Node(hash, std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+      NodeTraits::deallocate(alloc, node, 1);
+      throw;
+    }
+    return node;
+  }
+
+  void DeleteNode(Node *node)
+  {
+    NodeAlloc alloc;
+    node->~Node();
+    NodeTraits::deallocate(alloc, node, 1);
+  }
+
+  Node *FindNode(size_t bucket, size_t hash, const Key &key) const
+  {
+    for (Node *node = buckets_[bucket]; node; node = node->next_)
+    {
+      if (node->hash_ == hash && Equal()(ExtractKey()(node->value_), key))
+      {
+        return node;
+      }
+    }
+    return nullptr;
+  }
+
+  void Unlink(size_t bucket, Node *node)
+  {
+    Node **prev = &buckets_[bucket];
+    while (*prev != node)
+    {
+      prev = &(*prev)->next_;
+    }
+    *prev = node->next_;
+    DeleteNode(node);
+    --size_;
+  }
+
+  // 编号不小于bucket的第一个非空桶中的第一个节点，没有时为(bucket_count_, nullptr)
+  void FirstFrom(size_t bucket, size_t *found, Node **node) const
+  {
+    for (; bucket < bucket_count_; ++bucket)
+    {
+      if (buckets_[bucket] != nullptr)
+      {
+        *found = bucket;
+        *node = buckets_[bucket];
+        return;
+      }
+    }
+    *found = bucket_count_;
+    *node = nullptr;
+  }
+
+  // 容纳n个元素而不超过负载因子的最少桶数(2的幂)
+  size_t BucketsFor(size_t n) const
+  {
+    size_t buckets = 1;
+    while (buckets * static_cast<double>(max_load_factor_) < n)
+    {
+      buckets <<= 1;
+    }
+    return buckets;
+  }
+
+  // 桶数增加到buckets(2的幂)，节点按哈希值的低位分到新的桶
+  void Rehash(size_t buckets)
+  {
+    if (buckets <= bucket_count_)
+    {
+      return;
+    }
+    Node **table = new Node *[buckets]();
+    for (size_t i = 0; i < bucket_count_; ++i)
+    {
+      Node *node = buckets_[i];
+      while (node)
+      {
+        Node *next = node->next_;
+        size_t bucket = node->hash_ & (buckets - 1);
+        node->next_ = table[bucket];
+        table[bucket] = node;
+        node = next;
+      }
+    }
+    if (buckets_ != &single_bucket_)
+    {
+      delete[] buckets_;
+    }
+    single_bucket_ = nullptr;
+    buckets_ = table;
+    bucket_count_ = buckets;
+  }
+
+  Node **buckets_;
+  size_t bucket_count_;
+  // 只有一个桶时的桶数组，空表不必分配内存
+  Node *single_bucket_;
+  size_t size_;
+  float max_load_factor_;
+};
+
+template <typename Key, typename T,
+          typename Alloc = std::allocator<std::pair<const Key, T>>>
+class HashMap : public HashTable<Key, std::pair<const Key, T>,
+                                 dictdetail::Select1st, false, Alloc>
+{
+public:
+  using mapped_type = T;
+};
+
+template <typename Key, typename Alloc = std::allocator<Key>>
+using HashSet = HashTable<Key, Key, dictdetail::Identity, true, Alloc>;
+
+#endif
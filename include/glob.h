@@ -0,0 +1,46 @@
+/**
+ * @file glob.h
+ * @author pengchang
+ * @brief scan系列命令MATCH选项使用的glob匹配
+
+ */
+#ifndef GLOB_H
+#define GLOB_H
+#include <cstddef>
+#include <string>
+
+/**
+ * @brief glob匹配，语法与redis相同
+ * @details *匹配任意个字符，?匹配一个字符，[abc]、[a-z]、[^a]匹配一个字符集，
+ * \转义下一个字符。*只记录最后一个回溯点，最坏O(plen * slen)，不会因多个*指数回溯
+ */
+bool GlobMatch(const char *pattern, size_t plen, const char *str, size_t slen);
+
+/**
+ * @brief 预先分析一次模式，匹配大量字符串时使用
+ * @details 只含末尾*、开头*或不含通配符的常见模式按前缀、后缀、相等比较，
+ * 其余模式调用GlobMatch
+ */
+class GlobMatcher
+{
+public:
+  explicit GlobMatcher(const std::string &pattern);
+
+  bool Match(const std::string &str) const;
+
+private:
+  enum Kind
+  {
+    kAll,    // *
+    kExact,  // 不含通配符
+    kPrefix, // abc*
+    kSuffix, // *abc
+    kGeneral
+  };
+
+  Kind kind_;
+  std::string pattern_;
+  // kExact/kPrefix/kSuffix比较的字面部分
+  std::string literal_;
+};
+#endif
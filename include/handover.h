@@ -0,0 +1,61 @@
+/**
+ * @file handover.h
+ * @author pengchang
+ * @brief 热升级：新进程从旧进程接管监听套接字和数据
+ * @details 旧进程以--handover-socket在一个unix域套接字上等待接管请求，
+ * 新进程以--upgrade-from连接该套接字并发送"handover\n"。旧进程停止处理请求，
+ * 把所有库不压缩地写成内存文件系统中的rdb镜像，回复"ok <镜像路径>"并以
+ * SCM_RIGHTS附带监听套接字，随后退出；失败时回复"err <原因>"且不附带套接字。
+ * 新进程从镜像载入数据后接着在同一个监听套接字上accept，
+ * 期间到达的连接在监听队列中等待，不会被拒绝。
+ * 数据经序列化的快照交接，两个进程不共享内存中的数据结构：
+ * 接管只是不丢连接，不是零停顿，停顿随数据量线性增长。
+ */
+#ifndef HANDOVER_H
+#define HANDOVER_H
+#include <string>
+
+namespace handover
+{
+  /**
+   * @brief 创建并监听unix域套接字，已存在的同名文件先删除
+   * @return 套接字，失败时返回-1
+   */
+  int Listen(const std::string &path);
+
+  /**
+   * @brief 新进程：向path上的旧进程请求接管
+   * @param[out] listen_fd 旧进程的监听套接字
+   * @param[out] image 旧进程写出的rdb镜像路径
+   * @return false 连接失败或旧进程拒绝，err中为原因
+   */
+  bool Request(const std::string &path, int *listen_fd, std::string *image,
+               std::string *err);
+
+  /**
+   * @brief 旧进程：读取接管请求
+   * @return false 不是接管请求
+   */
+  bool ReadRequest(int conn);
+
+  /**
+   * @brief 发送msg，fd不小于0时以SCM_RIGHTS附带fd
+   */
+  bool Reply(int conn, const std::string &msg, int fd);
+
+  /**
+   * @brief 在本进程中查找绑定在port上的TCP套接字，port为-1时不限端口
+   * @param[in] listening true 找已listen的，false 找已绑定但未listen、未连接的
+   * @return 文件描述符，没有时返回-1
+   */
+  int FindTcpSocket(int port, bool listening);
+
+  /**
+   * @brief 新进程：用接管的监听套接字替换TcpServer已创建但未listen的套接字
+   * @details TcpServer不能使用外部的套接字，因此以端口0构造，
+   * 再把接管的套接字dup2到它创建的套接字的描述符上
+   * @return false 没有找到TcpServer的套接字
+   */
+  bool Adopt(int listen_fd);
+} // namespace handover
+#endif
@@ -0,0 +1,188 @@
+/**
+ * @file kvdb.h
+ * @author pengchang
+ * @brief 进程内嵌入使用的数据库接口
+ * @details 不经过网络和命令解析，直接调用存储引擎，也不需要事件循环：
+ * 过期key在访问时惰性删除，定期删除和值日志回收由调用者定期调用Tick驱动。
+ * 头文件和kvdb库都不依赖muduo，只需链接kvdb库和pthread；日志默认写到stderr，
+ * 可用dblog::SetLogOutput(db_log.h)转到宿主自己的日志。
+ * 与StorageEngine相同，一个Kvdb对象同一时刻只能在一个线程中使用。
+ */
+#ifndef KVDB_H
+#define KVDB_H
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class StorageEngine;
+
+struct KvdbOptions
+{
+  // 库的个数，与服务器相同默认16个
+  int db_num_ = 16;
+  // 存储引擎，见StorageEngine::Create
+  std::string engine_ = "dict";
+  // 键值分离，含义与DbConfig中的同名项相同
+  uint64_t vlog_min_size_ = 0;
+  std::string vlog_dir_ = "vlog";
+  uint64_t vlog_cache_size_ = 64 * 1024 * 1024;
+  // Save时是否压缩
+  bool rdb_compression_ = true;
+};
+
+/**
+ * @brief 一组写操作，由Kvdb::Write在当前库中连续执行，相当于服务器的multi/exec
+ * @details 与multi/exec相同，某个操作失败不回滚已执行的操作，也不影响其后的操作
+ */
+class WriteBatch
+{
+public:
+  void Set(const std::string &key, const std::string &value);
+  void Del(const std::string &key);
+  void PExpire(const std::string &key, int64_t ms);
+  void RPush(const std::string &key, const std::string &value);
+  void HSet(const std::string &key, const std::string &field,
+            const std::string &value);
+  void SAdd(const std::string &key, const std::string &member);
+  void ZAdd(const std::string &key, double score, const std::string &member);
+
+  void Clear() { ops_.clear(); }
+  size_t Count() const { return ops_.size(); }
+
+private:
+  friend class Kvdb;
+
+  enum OpType
+  {
+    kSet,
+    kDel,
+    kPExpire,
+    kRPush,
+    kHSet,
+    kSAdd,
+    kZAdd
+  };
+  struct Op
+  {
+    OpType type_;
+    std::string key_;
+    // HSet的field，SAdd/ZAdd的成员
+    std::string field_;
+    std::string value_;
+    // PExpire的毫秒数，ZAdd的分值
+    double number_;
+  };
+
+  void Add(OpType type, const std::string &key, const std::string &field,
+           const std::string &value, double number);
+
+  std::vector<Op> ops_;
+};
+
+class Kvdb
+{
+public:
+  /**
+   * @brief 按options创建所有库
+   * @return 引擎创建失败时返回nullptr
+   */
+  static std::unique_ptr<Kvdb> Open(
+      const KvdbOptions &options = KvdbOptions());
+  ~Kvdb();
+  Kvdb(const Kvdb &) = delete;
+  Kvdb &operator=(const Kvdb &) = delete;
+
+  /**
+   * @brief 切换当前库，之后的读写都作用于该库
+   * @param[in] index 从0开始
+   * @return false 超出范围
+   */
+  bool Select(int index);
+  int Index() const { return index_; }
+
+  // 字符串
+  bool Set(const std::string &key, const std::string &value);
+  /**
+   * @return false key不存在或已过期
+   */
+  bool Get(const std::string &key, std::string *value);
+
+  /**
+   * @brief 删除key，同名的key在各类型中都删除
+   * @return false 任何类型中都没有该key
+   */
+  bool Del(const std::string &key);
+
+  /**
+   * @brief 设置ms毫秒后过期，作用于第一个含有该key的类型，顺序与pexpire命令相同
+   * @return false key不存在
+   */
+  bool PExpire(const std::string &key, int64_t ms);
+
+  // 列表
+  bool RPush(const std::string &key, const std::string &value);
+  /**
+   * @return false key不存在、已过期或列表为空
+   */
+  bool RPop(const std::string &key, std::string *value);
+
+  // 哈希
+  bool HSet(const std::string &key, const std::string &field,
+            const std::string &value);
+  bool HGet(const std::string &key, const std::string &field,
+            std::string *value);
+
+  // 集合
+  bool SAdd(const std::string &key, const std::string &member);
+
+  // 有序集合
+  bool ZAdd(const std::string &key, double score, const std::string &member);
+  /**
+   * @return key不存在时返回-1
+   */
+  long ZCard(const std::string &key);
+  /**
+   * @brief 分值在[min, max]内的成员个数
+   * @return key不存在时返回-1
+   */
+  long ZCount(const std::string &key, double min, double max);
+
+  /**
+   * @brief 在当前库中按顺序执行batch中的所有操作
+   * @return false 有操作失败(如PExpire的key不存在)，其余操作仍已执行
+   */
+  bool Write(const WriteBatch &batch);
+
+  /**
+   * @brief 把所有库写入path处的rdb文件，先写临时文件，落盘后原子地替换
+   */
+  bool Save(const std::string &path);
+
+  /**
+   * @brief 从rdb文件多线程载入所有库，应在写入数据前调用
+   * @return false 文件格式不支持或已损坏，文件不存在时返回true
+   */
+  bool Load(const std::string &path);
+
+  /**
+   * @brief 周期维护：定期删除过期key、分步回收值日志
+   * @details 由调用者定期调用，建议间隔0.1秒左右，每次耗时有上限。
+   * 不调用时过期key只在被访问时删除，值日志不回收
+   */
+  void Tick();
+
+  // 所有库的key的总数
+  uint64_t KeyCount() const;
+
+private:
+  Kvdb();
+
+  StorageEngine *Current() { return dbs_[index_].get(); }
+
+private:
+  KvdbOptions options_;
+  std::vector<std::unique_ptr<StorageEngine>> dbs_;
+  int index_;
+};
+#endif
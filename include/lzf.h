@@ -0,0 +1,26 @@
+/**
+ * @file lzf.h
+ * @author pengchang
+ * @brief LZF格式的压缩与解压，用于rdb中的段数据和较长的字符串
+
+ */
+#ifndef LZF_H
+#define LZF_H
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief 压缩
+ * @details 数据由若干块组成：控制字节小于32时其后为(控制字节+1)个原样字节；
+ * 否则高3位为匹配长度-2(为7时再加下一字节)，低5位与下一字节组成回溯距离-1，
+ * 匹配长度最大264字节，回溯距离最大8192字节。
+ * @return 压缩后的长度，0表示输出空间不足，即压缩后不小于out_len
+ */
+size_t LzfCompress(const void *in, size_t in_len, void *out, size_t out_len);
+
+/**
+ * @brief 解压
+ * @return 解压后的长度，0表示数据损坏或输出空间不足
+ */
+size_t LzfDecompress(const void *in, size_t in_len, void *out, size_t out_len);
+#endif
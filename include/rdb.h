@@ -0,0 +1,274 @@
+/**
+ * @file rdb.h
+ * @author pengchang
+ * @brief rdb v2二进制格式的编码与解码
+ * @details 文件格式:
+ * "KVDB" 版本号(1字节)
+ * 若干段: kOpSection 库编号(varint) 类型(1字节) 编码(1字节) 键数目(varint)
+ *         段数据长度(varint) [原始长度(varint)] 段数据 段数据的crc64(8字节小端)
+ *         编码为kEncLzf时段数据为LZF压缩后的数据，段头中多一个解压后的长度
+ * kOpEof
+ * 段索引: kOpIndex 段数目(varint) 每段的(库编号 类型 键数目 段在文件中的偏移)(varint)
+ *         索引的crc64(8字节小端)
+ * 索引在文件中的偏移(8字节小端) "KIDX"
+ *
+ * 顺序读取在kOpEof处结束；需要定位某个库或并行载入时从文件末尾读取段索引。
+ *
+ * 段数据由若干条目组成，每个条目为 过期时间(varint，微秒，0表示不过期) 键 值，
+ * 值按类型编码：String为字符串；List、Set为元素个数(varint)加元素；
+ * Hash为元素个数加field、value；ZSet为元素个数加按(分值, 成员)升序的成员、分值。
+ * 字符串为 (长度 << 1)(varint) 加原始字节，或 (压缩后长度 << 1 | 1)(varint)
+ * 加原始长度(varint)加LZF压缩后的字节；分值为8字节小端IEEE754 double。
+
+ */
+#ifndef RDB_H
+#define RDB_H
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace rdb
+{
+  const char kMagic[] = "KVDB";
+  const size_t kMagicLen = 4;
+  const uint8_t kVersion = 2;
+  const char kIndexMagic[] = "KIDX";
+
+  // 操作码
+  const uint8_t kOpIndex = 0xFC;
+  const uint8_t kOpSection = 0xFD;
+  const uint8_t kOpEof = 0xFF;
+
+  // 段数据编码
+  const uint8_t kEncRaw = 0;
+  const uint8_t kEncLzf = 1;
+
+  // 不短于该长度的字符串单独压缩
+  const size_t kCompressMinLen = 64;
+
+  // 写入时段数据缓冲区的大小，超过后结束当前段并写出，下一个条目开始同类型的新段
+  const size_t kSectionBufferSize = 1 << 20;
+
+  // 限速时每次write的最大字节数，使写出比较平滑
+  const size_t kThrottleChunk = 64 * 1024;
+} // namespace rdb
+
+/**
+ * @brief rdb写出进度
+ * @details fork子进程写出时位于父子进程共享的匿名内存中，只使用无锁的原子变量
+ */
+struct RdbProgress
+{
+  std::atomic<bool> in_progress_;
+  std::atomic<int64_t> start_us_;
+  std::atomic<uint64_t> keys_total_;
+  std::atomic<uint64_t> keys_saved_;
+  std::atomic<uint64_t> bytes_written_;
+};
+
+/**
+ * @brief 一个段的段头及其在内存中的段数据
+ */
+struct RdbSection
+{
+  RdbSection()
+      : db_(0), type_(0), encoding_(rdb::kEncRaw), count_(0),
+        payload_(nullptr), len_(0), raw_len_(0), crc_(0) {}
+
+  /**
+   * @brief 校验段数据的crc64
+   */
+  bool Verify() const;
+
+  /**
+   * @brief 解压kEncLzf编码的段数据
+   * @return false 数据损坏
+   */
+  bool Decompress(std::string *raw) const;
+
+  int db_;
+  int type_;
+  int encoding_;
+  uint64_t count_;
+  const char *payload_;
+  size_t len_;
+  // 解压后的长度，仅kEncLzf编码有效
+  uint64_t raw_len_;
+  uint64_t crc_;
+};
+
+/**
+ * @brief 段索引中的一项
+ */
+struct RdbIndexEntry
+{
+  int db_;
+  int type_;
+  uint64_t count_;
+  // 段(kOpSection)在文件中的偏移
+  uint64_t offset_;
+};
+
+/**
+ * @brief rdb编码器
+ * @details 条目先写入当前段的缓冲区，段结束时再连同段头、校验和一起写出。
+ * 缓冲区达到buffer_size后自动切分为多个同类型的段，因此内存占用以缓冲区大小为界，
+ * 与数据量无关。
+ */
+class RdbWriter
+{
+public:
+  /**
+   * @brief 输出到文件描述符fd
+   */
+  explicit RdbWriter(int fd, size_t buffer_size = rdb::kSectionBufferSize);
+  /**
+   * @brief 输出追加到内存中的字符串
+   */
+  explicit RdbWriter(std::string *out,
+                     size_t buffer_size = rdb::kSectionBufferSize);
+
+  /**
+   * @brief 开启后段数据和不短于rdb::kCompressMinLen的字符串压缩后写入，
+   * 压缩后没有变小的仍原样写入
+   */
+  void SetCompression(bool on) { compress_ = on; }
+
+  /**
+   * @brief 用令牌桶把写出速度限制为bytes_per_sec字节/秒，0表示不限制
+   * @details 桶的容量为0.1秒的配额，令牌不足时睡眠
+   */
+  void SetRateLimit(uint64_t bytes_per_sec);
+
+  /**
+   * @brief 每写出bytes字节启动这部分脏页的回写，并等待上一部分落盘后
+   * 将其从页缓存中丢弃，0表示不处理
+   * @details 脏页和快照占用的页缓存都以约2*bytes为界，不会挤占其他进程
+   */
+  void SetSyncInterval(uint64_t bytes) { sync_bytes_ = bytes; }
+
+  /**
+   * @brief 写出的字节数和已结束的段中的键数累加到progress
+   */
+  void SetProgress(RdbProgress *progress) { progress_ = progress; }
+
+  void WriteHeader();
+  /**
+   * @brief 写入kOpEof，并在其后写入所有段的索引
+   */
+  void WriteEof();
+
+  /**
+   * @brief 开始库index中类型为type的一个段
+   */
+  void BeginSection(int index, int type);
+  void EndSection();
+
+  /**
+   * @brief 写入一个条目的过期时间和键，之后紧跟着写入值
+   * @param[in] expire 过期时间(微秒)，0表示不过期
+   */
+  void PutEntry(int64_t expire, const std::string &key);
+
+  void PutVarint(uint64_t value);
+  void PutDouble(double value);
+  void PutString(const std::string &value);
+
+  /**
+   * @return false 写文件出错，之后的写入都被忽略
+   */
+  bool Ok() const { return ok_; }
+  // 已写出的字节数
+  uint64_t Offset() const { return offset_; }
+
+private:
+  static void AppendVarint(std::string *dst, uint64_t value);
+  static void AppendFixed64(std::string *dst, uint64_t value);
+  void Write(const char *data, size_t len);
+  void WriteFd(const char *data, size_t len);
+  // 等待令牌桶中有len字节的配额
+  void Throttle(size_t len);
+  // 回写脏页并丢弃已落盘的页缓存
+  void SyncRange();
+
+private:
+  int fd_;
+  std::string *out_;
+  size_t buffer_size_;
+  bool compress_;
+  // 压缩输出的缓冲区
+  std::string compressed_;
+  // 限速
+  uint64_t rate_limit_;
+  double tokens_;
+  int64_t last_refill_us_;
+  // 页缓存控制：[dropped_, synced_)已启动回写，之前的部分已丢弃
+  uint64_t sync_bytes_;
+  uint64_t synced_;
+  uint64_t dropped_;
+  RdbProgress *progress_;
+  bool ok_;
+  uint64_t offset_;
+  // 当前段
+  std::string section_;
+  int db_;
+  int type_;
+  uint64_t count_;
+  std::vector<RdbIndexEntry> index_;
+};
+
+/**
+ * @brief rdb解码器，在一段连续内存上单向向前解析，不做任何查找
+ * @details 读取失败(数据截断或格式错误)后所有读取都返回false
+ */
+class RdbReader
+{
+public:
+  RdbReader(const char *data, size_t len)
+      : cur_(data), end_(data + len), ok_(true) {}
+
+  /**
+   * @brief 检查文件头
+   * @return false 不是rdb v2文件
+   */
+  bool ReadHeader();
+
+  /**
+   * @brief 读取下一个段头，段数据不拷贝也不校验，读取后跳到下一段
+   * @return 1 读到一个段；0 到达kOpEof；-1 文件损坏
+   */
+  int ReadSection(RdbSection *section);
+
+  /**
+   * @brief 读取文件末尾的段索引
+   * @param[in] data 整个rdb文件
+   * @return false 没有索引或索引损坏，此时只能顺序读取
+   */
+  static bool ReadIndex(const char *data, size_t len,
+                        std::vector<RdbIndexEntry> *index);
+
+  bool GetByte(uint8_t *value);
+  bool GetVarint(uint64_t *value);
+  bool GetFixed64(uint64_t *value);
+  bool GetDouble(double *value);
+  bool GetString(std::string *value);
+
+  bool Ok() const { return ok_; }
+  bool Eof() const { return cur_ == end_; }
+  const char *Pos() const { return cur_; }
+
+private:
+  bool Fail()
+  {
+    ok_ = false;
+    return false;
+  }
+
+private:
+  const char *cur_;
+  const char *end_;
+  bool ok_;
+};
+#endif
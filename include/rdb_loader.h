@@ -0,0 +1,155 @@
+/**
+ * @file rdb_loader.h
+ * @author pengchang
+ * @brief 多线程并行载入rdb文件
+
+ */
+#ifndef RDB_LOADER_H
+#define RDB_LOADER_H
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rdb.h"
+#include "timestamp.h"
+
+class StorageEngine;
+struct RdbStage;
+
+/**
+ * @brief 按段并行载入rdb文件
+ * @details 先由文件末尾的段索引(没有索引时顺序扫描段头)得到所有段的位置，
+ * 之后分两个阶段：
+ * 1. 各工作线程从共享计数器领取段，校验并解析到各自的暂存结果，互不加锁；
+ * 2. 按(库, 类型)分组，每组由一个线程按文件顺序并入对应的数据字典，
+ *    不同组修改的是不同的字典，也无需加锁。
+ * 文件以mmap映射，直接在映射上解析，每个值只复制一次到暂存结果，之后移动进字典。
+ * 每个段解析完立即丢弃其映射的页和页缓存。
+ */
+class RdbLoader
+{
+public:
+  /**
+   * @param[in] dbs 下标为库编号，为nullptr或超出范围的库不载入
+   * @param[in] threads 工作线程数，0表示使用硬件线程数
+   */
+  explicit RdbLoader(const std::vector<StorageEngine *> &dbs, int threads = 0);
+
+  /**
+   * @brief 载入rdb文件，文件不存在或为空时什么也不做
+   * @return false 文件格式不支持或已损坏，损坏段之前的段仍会载入
+   */
+  bool Load(const std::string &path);
+
+  // 上一次载入的统计信息
+  uint64_t KeysLoaded() const { return keys_loaded_; }
+  size_t SectionsLoaded() const { return sections_loaded_; }
+  int Threads() const { return threads_; }
+
+private:
+  std::vector<StorageEngine *> dbs_;
+  int threads_;
+  uint64_t keys_loaded_;
+  size_t sections_loaded_;
+};
+
+/**
+ * @brief 在后台线程中逐段载入rdb文件，载入期间服务器照常处理请求
+ * @details 后台线程按文件顺序逐段校验、解析到暂存结果，每解析完一批通知主线程，
+ * 由主线程在事件循环中并入字典，字典只在主线程修改，无需加锁。
+ * 命令访问的(库, 类型)还有段未并入时调用EnsureLoaded：
+ * 后台线程还没解析到的段在当前线程立即解析，正在解析的段只等待这一个段，
+ * 因此请求的等待时间只取决于它用到的段，而不是整个文件。
+ * 与RdbLoader不同，损坏的段被跳过，后面的段仍会载入。
+ *
+ * 除Start中启动的后台线程外，所有成员函数只在主线程调用。
+ */
+class AsyncRdbLoader
+{
+public:
+  explicit AsyncRdbLoader(const std::vector<StorageEngine *> &dbs);
+  ~AsyncRdbLoader();
+  AsyncRdbLoader(const AsyncRdbLoader &) = delete;
+  AsyncRdbLoader &operator=(const AsyncRdbLoader &) = delete;
+
+  /**
+   * @brief 映射文件、收集段并启动后台线程
+   * @param[in] ready 后台线程解析完段后调用(在后台线程中)，
+   * 调用者应把MergeReady投递到主线程
+   * @param[in] done 所有段都并入后在主线程调用，参数为false表示有段损坏。
+   * done可以销毁载入器，但不能在done中同步销毁，应投递到事件循环
+   * @return false 文件不存在、为空或没有可载入的段，无需后台载入
+   */
+  bool Start(const std::string &path, const std::function<void()> &ready,
+             const std::function<void(bool)> &done);
+
+  // 并入后台线程已解析完的段
+  void MergeReady();
+
+  // 立即载入库db中类型为type的所有段
+  void EnsureLoaded(int db, int type);
+  void EnsureAllLoaded();
+
+  bool Done() const { return merged_ == sections_.size(); }
+  size_t SectionsTotal() const { return sections_.size(); }
+  size_t SectionsMerged() const { return merged_; }
+  uint64_t KeysLoaded() const { return keys_loaded_; }
+  uint64_t BytesTotal() const { return bytes_total_; }
+  uint64_t BytesParsed() const { return bytes_loaded_; }
+  Timestamp StartTime() const { return start_; }
+
+private:
+  enum SectionState
+  {
+    kPending,
+    kParsing,
+    kParsed,
+    kMerged
+  };
+
+  // 后台线程主函数
+  void Run();
+  // 校验并解析第i个段，损坏时暂存结果为空
+  bool Parse(size_t i);
+  void Merge(size_t i);
+  void CheckDone();
+
+private:
+  std::vector<StorageEngine *> dbs_;
+  std::string path_;
+  char *addr_;
+  size_t len_;
+  int fd_;
+  std::vector<RdbSection> sections_;
+  std::vector<std::unique_ptr<RdbStage>> stages_;
+  // (库, 类型) -> 还有段未并入的组中的段，按文件顺序
+  std::map<std::pair<int, int>, std::vector<size_t>> groups_;
+  std::function<void()> ready_;
+  std::function<void(bool)> done_;
+  std::thread thread_;
+  // 析构时通知后台线程不再解析剩余的段
+  std::atomic<bool> stop_;
+
+  // 保护state_、ok_、merge_queued_、parsed_
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<SectionState> state_;
+  bool ok_;
+  // 已通知主线程且主线程还未处理
+  bool merge_queued_;
+  size_t parsed_;
+
+  size_t merged_;
+  uint64_t keys_loaded_;
+  std::atomic<uint64_t> bytes_loaded_;
+  uint64_t bytes_total_;
+  Timestamp start_;
+};
+#endif
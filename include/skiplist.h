@@ -7,6 +7,7 @@
 
 #ifndef SKIPLIST_H
 #define SKIPLIST_H
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -17,6 +18,41 @@
 
 class SkiplistLevel;
 
+/**
+ * @brief 分值和
+ * @details 有限分值用两个double(hi_ + lo_)做补偿求和，精度约为double的两倍，
+ * 反复插入删除不会累积出可见的误差，两个很大的前缀和相减也不会丢失精度。
+ * +inf和-inf不进入和中，只计数，否则前缀和相减会得到inf - inf = NaN。
+ */
+struct ScoreSum
+{
+  ScoreSum() : hi_(0), lo_(0), pos_inf_(0), neg_inf_(0) {}
+
+  void Add(double score);
+  void Sub(double score);
+  ScoreSum &operator+=(const ScoreSum &rhs);
+  ScoreSum &operator-=(const ScoreSum &rhs);
+
+  /**
+   * @brief 和的值，同时含有+inf和-inf时为NaN
+   */
+  double Value() const;
+
+  double hi_, lo_;
+  // 计数只做加减，按模运算，相减的结果总是正确的
+  uint32_t pos_inf_, neg_inf_;
+};
+
+inline ScoreSum operator+(ScoreSum lhs, const ScoreSum &rhs)
+{
+  return lhs += rhs;
+}
+
+inline ScoreSum operator-(ScoreSum lhs, const ScoreSum &rhs)
+{
+  return lhs -= rhs;
+}
+
 // class for Node
 class SkiplistNode
 {
@@ -33,10 +69,21 @@ public:
 class SkiplistLevel
 {
 public:
-  SkiplistLevel() : forward_(nullptr) {}
+  SkiplistLevel() : forward_(nullptr), span_(0) {}
   SkiplistNode *forward_;
+  // 到forward_跨过的节点数(含forward_)，forward_为空时为到表尾的节点数
+  unsigned long span_;
+  // 跨过的节点的分值和
+  ScoreSum sum_;
 };
 
+/**
+ * @brief 把命令参数解析为分值
+ * @details 整个参数须为strtod可解析的浮点数(可以是inf)，NaN无法排序，不接受
+ * @return false 参数为空、含有多余字符或为NaN
+ */
+bool ParseScore(const std::string &str, double *score);
+
 // class for range
 struct RangeSpec
 {
@@ -47,6 +94,16 @@ struct RangeSpec
   bool minex_, maxex_;
 };
 
+// 分值范围内的聚合结果
+struct RangeAggregate
+{
+  RangeAggregate() : count_(0), sum_(0), min_(0), max_(0) {}
+
+  unsigned long count_;
+  double sum_;
+  double min_, max_;
+};
+
 // class for skip list
 class Skiplist
 {
@@ -61,14 +118,51 @@ public:
   int GetRandomLevel();
   void InsertNode(const std::string &, double);
   void DeleteNode(const std::string &, double);
+
+  /**
+   * @brief 通过成员索引查找成员的分值，O(1)
+   * @return false 成员不存在
+   */
+  bool GetScore(const std::string &obj, double *score) const;
+
+  /**
+   * @brief 第0层的第一个节点，沿levels_[0]->forward_可按分值升序遍历
+   */
+  SkiplistNode *First() const { return header_->levels_[0]->forward_; }
+
+  /**
+   * @brief 由已按(分值, 成员)升序排好且成员不重复的元素一次顺序构建跳表
+   * @details 每层只维护一个尾指针，逐个追加节点，无需InsertNode的逐层查找
+   */
+  static ptr BuildFromSorted(std::vector<std::pair<std::string, double>> &&elems);
+
   unsigned long GetCountInRange(RangeSpec &range);
+
+  /**
+   * @brief 求分值范围内节点的个数、分值和、最小和最大分值
+   * @details 利用每层的跨度和分值和求两个前缀相减，O(log n)，与范围宽度无关
+   */
+  RangeAggregate GetAggregateInRange(RangeSpec &range);
   std::vector<SkiplistNode *> GetNodeInRange(RangeSpec &range);
+  /**
+   * @brief 按(分值, 成员)升序排在(score, obj)之后的第一个节点，O(log n)
+   * @details (score, obj)不必在跳表中，从上次访问的节点之后继续遍历时使用
+   * @return 没有时返回nullptr
+   */
+  SkiplistNode *GetNodeAfter(double score, const std::string &obj) const;
   unsigned long GetLength() { return length_; }
 
 private:
   int ValueGteMin(double value, RangeSpec &spec);
   int ValueLteMax(double value, RangeSpec &spec);
 
+  /**
+   * @brief 求分值小于value(inclusive为true时小于等于)的节点个数和分值和
+   * @return 满足条件的最后一个节点，没有时为头节点
+   */
+  SkiplistNode *GetPrefix(double value, bool inclusive, unsigned long *count,
+                          ScoreSum *sum);
+
 private:
   // 头节点
   SkiplistNode *header_;
@@ -78,5 +172,7 @@ private:
 
   int level_;
   unsigned long length_;
+  // 所有节点的分值和
+  ScoreSum sum_;
 };
 #endif
\ No newline at end of file
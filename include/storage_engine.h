@@ -0,0 +1,302 @@
+/**
+ * @file storage_engine.h
+ * @author pengchang
+ * @brief 存储引擎接口，DbServer只通过该接口访问数据
+
+ */
+#ifndef STORAGE_ENGINE_H
+#define STORAGE_ENGINE_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "skiplist.h"
+#include "timestamp.h"
+
+class RdbWriter;
+struct RdbStage;
+struct DbConfig;
+
+/**
+ * @brief 宿主提供的定时器：在when时刻于调用线程中执行cb
+ * @details 服务器以事件循环的runAt实现。嵌入使用时可以为空，
+ * 此时引擎不设定时任务，过期key由惰性删除和Cron中的定期删除清理
+ */
+using RunAtFunc =
+    std::function<void(const Timestamp &when, const std::function<void()> &cb)>;
+
+/**
+ * @brief 读快照，由StorageEngine::OpenReadSnapshot创建，内容由引擎定义
+ */
+struct ReadSnapshot
+{
+  ReadSnapshot() : epoch_(0) {}
+  virtual ~ReadSnapshot() = default;
+
+  // 纪元编号，同一个引擎中每打开一个读快照加一
+  uint64_t epoch_;
+  // 快照时刻，key是否过期以该时刻为准
+  Timestamp time_;
+};
+
+/**
+ * @brief StorageEngine::PrepareRead准备的读取
+ * @details read_可在任意线程中调用一次，读取结束后必须回到调用PrepareRead的线程
+ * 调用done_。调用done_之前引擎修改该值时先复制一份，之后才可原地修改
+ */
+struct PreparedRead
+{
+  explicit operator bool() const { return static_cast<bool>(read_); }
+
+  std::function<std::string()> read_;
+  std::function<void()> done_;
+};
+
+/**
+ * @brief 遍历哈希、集合、有序集合的值时的位置
+ * @details 由调用者在两次调用之间保存，引擎不保存任何遍历状态
+ */
+struct ValueCursor
+{
+  ValueCursor() : started_(false), bucket_(0), score_(0) {}
+
+  // 为false时从第一个元素开始
+  bool started_;
+  // 集合：反向二进制游标
+  uint64_t bucket_;
+  // 哈希：上次返回的field；有序集合：上次返回的成员
+  std::string member_;
+  // 有序集合：上次返回的成员的分值
+  double score_;
+};
+
+/**
+ * @brief 遍历哈希、集合、有序集合的值时访问到的一个元素
+ */
+struct ValueItem
+{
+  // 哈希的field，集合、有序集合的成员
+  std::string member_;
+  // 哈希的值
+  std::string value_;
+  // 有序集合的分值
+  double score_;
+};
+
+/**
+ * @brief 一个库的存储引擎
+ * @details 所有方法都在同一个线程(服务器中为事件循环线程)中调用，除非另有说明。
+ * 引擎不依赖事件循环，周期任务由宿主调用Cron驱动。
+ * 值类型为dbobject::kDbString等五种，同名的key在不同类型中互不相干。
+ * 新的引擎实现该接口并在StorageEngine::Create中注册名字即可通过--engine选用，
+ * 协议层无需改动。
+ */
+class StorageEngine
+{
+public:
+  virtual ~StorageEngine() = default;
+
+  /**
+   * @brief 按配置创建共db_num个库中第index个库的引擎
+   * @return 引擎名未知或初始化失败时返回nullptr
+   */
+  static std::unique_ptr<StorageEngine> Create(const DbConfig &config,
+                                               int index, int db_num,
+                                               const RunAtFunc &run_at =
+                                                   RunAtFunc());
+
+  // 引擎名，与--engine的取值相同
+  virtual const char *Name() const = 0;
+
+  /**
+   * @brief 周期任务：定期删除过期key、分步回收空间等，每步耗时有上限
+   * @details 由宿主定期调用(服务器每0.1秒一次)，引擎自行决定每次做哪些工作
+   */
+  virtual void Cron(const Timestamp &now) = 0;
+
+  // 读写
+  /**
+   * @brief 写入：String为设置值，List为尾部追加，Hash为设置field，
+   * Set为添加成员，ZSet为添加成员(objValue为分值)
+   */
+  virtual bool AddKey(const int type, const std::string &key,
+                      const std::string &objKey,
+                      const std::string &objValue) = 0;
+  virtual bool DelKey(const int type, const std::string &key) = 0;
+  /**
+   * @brief 以文本形式返回整个值，key不存在时返回错误信息
+   */
+  virtual std::string GetKey(const int type, const std::string &key) = 0;
+  /**
+   * @brief 准备在其他线程中读取key的整个值，用于把较大的读取移出事件循环线程
+   * @param[in] key 格式与GetKey相同
+   * @param[in] min_size 值的元素个数不少于min_size时才准备
+   * @return read_返回与GetKey相同的文本；key不存在、已过期、值较小或引擎不支持时
+   * 返回空，此时应直接调用GetKey。read_读取PrepareRead时刻的值，
+   * 之后对该key的修改不影响它，也不等待它
+   */
+  virtual PreparedRead PrepareRead(const int type, const std::string &key,
+                                   size_t min_size) = 0;
+
+  /**
+   * @brief 读取字符串值
+   * @return false key不存在或已过期
+   */
+  virtual bool GetString(const std::string &key, std::string *value) = 0;
+
+  /**
+   * @brief 读取字符串值，不复制：值不可变，key之后被覆盖或删除时*value仍然有效
+   * @details 已过期的key不做惰性删除，由调用者按GetKey处理
+   * @return false key不存在或已过期
+   */
+  virtual bool GetSharedString(const std::string &key,
+                               std::shared_ptr<const std::string> *value) = 0;
+
+  // 集合类型的操作
+  /**
+   * @return false key或field不存在
+   */
+  virtual bool HGet(const std::string &key, const std::string &field,
+                    std::string *value) = 0;
+  /**
+   * @return 有序集合的元素个数，key不存在时返回-1
+   */
+  virtual long ZCard(const std::string &key) = 0;
+  /**
+   * @brief 列表、哈希、集合、有序集合的元素个数，用于估计读取整个值的代价
+   * @return key不存在、已过期或类型为字符串时返回0
+   */
+  virtual size_t GetValueSize(const int type, const std::string &key) = 0;
+  virtual const std::string RPopList(const std::string &key) = 0;
+  /**
+   * @brief 弹出列表的最后一个元素
+   * @return false key不存在、已过期或列表为空
+   */
+  virtual bool RPop(const std::string &key, std::string *value) = 0;
+  /**
+   * @brief 有序集合分值范围内的个数、分值和、最值
+   * @return false key不存在或已过期
+   */
+  virtual bool ZRangeAggregate(const std::string &key, RangeSpec &range,
+                               RangeAggregate *agg) = 0;
+  /**
+   * @brief 有序集合的并、交、差运算，结果整体替换dest
+   * @param[in] op dbobject::kZSetUnion/kZSetInter/kZSetDiff
+   * @param[in] weights 每个输入集合的权重，为空表示全为1，差集忽略
+   * @param[in] aggregate dbobject::kAggregateSum/kAggregateMin/kAggregateMax
+   * @return 结果集合的元素个数
+   */
+  virtual long ZSetStore(const int op, const std::string &dest,
+                         const std::vector<std::string> &keys,
+                         const std::vector<double> &weights,
+                         const int aggregate) = 0;
+
+  // 过期时间
+  virtual bool SetPExpireTime(const int type, const std::string &key,
+                              double expiredTime) = 0;
+  virtual bool SetPExpireTime(const int type, const std::string &key,
+                              const Timestamp &expiredTime) = 0;
+  /**
+   * @return 没有过期时间时返回Timestamp::invalid()
+   */
+  virtual Timestamp GetKeyExpiredTime(const int type,
+                                      const std::string &key) = 0;
+  virtual bool JudgeKeyExpiredTime(const int type, const std::string &key) = 0;
+
+  // 遍历
+  /**
+   * @brief 生成能重建当前库的最少写命令，每条命令调用一次emit
+   * @details 每条命令以命令名及参数的形式给出，参数中可以含有空白。
+   * 不含select，已过期的key不生成。可在fork出的子进程中调用。
+   */
+  virtual void AofRewrite(
+      const std::function<void(const std::vector<std::string> &)> &emit) = 0;
+
+  // 持久化与快照
+  /**
+   * @brief 将当前库写入rdb，已过期的key不写入。可在fork出的子进程中调用。
+   */
+  virtual void RdbSave(RdbWriter *writer, int index) = 0;
+  /**
+   * @brief 将rdb一个段的解析结果并入当前库
+   * @details 载入时不同类型的段可在不同线程中同时并入
+   */
+  virtual void RdbMergeStage(RdbStage &&stage) = 0;
+  /**
+   * @brief 是否支持不fork的后台快照，不支持时不能调用下面三个方法
+   * @details SnapshotBegin和SnapshotEnd在事件循环线程调用，SnapshotSave在快照线程中
+   * 与事件循环的读写并发执行，写出SnapshotBegin时刻的数据
+   */
+  virtual bool SupportsThreadSnapshot() const = 0;
+  virtual void SnapshotBegin(const Timestamp &now) = 0;
+  virtual void SnapshotSave(RdbWriter *writer, int index) = 0;
+  virtual void SnapshotEnd() = 0;
+
+  // 读快照
+  /**
+   * @brief 打开一个读快照，之后可以分多次读到打开时刻的数据，写操作照常进行
+   * @details 用于需要一致视图的长时间读取，如大key的全量读取、按桶分批遍历。
+   * 读快照只在事件循环线程中使用，可以同时打开多个，用完必须关闭
+   */
+  virtual std::shared_ptr<ReadSnapshot> OpenReadSnapshot() = 0;
+  virtual void CloseReadSnapshot(const std::shared_ptr<ReadSnapshot> &snap) = 0;
+  /**
+   * @brief 快照时刻key的值，格式与GetKey相同
+   */
+  virtual std::string GetKeyAt(const ReadSnapshot &snap, const int type,
+                               const std::string &key) = 0;
+  /**
+   * @brief 分批遍历快照时刻type类型的所有key
+   * @param[in,out] cursor 第一次调用前置0，每次调用后更新
+   * @param[in] count 本次最多访问的桶数
+   * @param[out] keys 追加访问到的key及其过期时间(微秒，0表示不过期)，
+   * 快照时刻已过期的key不输出
+   * @return true 遍历完成
+   */
+  virtual bool ScanAt(const ReadSnapshot &snap, const int type, size_t *cursor,
+                      size_t count,
+                      std::vector<std::pair<std::string, int64_t>> *keys) = 0;
+
+  /**
+   * @brief 从cursor处继续遍历type类型的key，两次调用之间不保存任何状态
+   * @details 反向二进制游标：按桶编号的二进制位反转后递增的顺序访问桶，
+   * 两次调用之间字典扩容时，已访问过的桶中的key分到的桶仍排在游标之前。
+   * 遍历期间一直存在的key至少返回一次，扩容时可能重复返回。
+   * @param[in] cursor 第一次调用为0
+   * @param[in] count 本次大约返回的key数，最多访问10倍的空桶
+   * @param[out] keys 追加访问到的未过期的key
+   * @return 下次调用的游标，为0时遍历完成
+   */
+  virtual uint64_t Scan(const int type, uint64_t cursor, size_t count,
+                        std::vector<std::string> *keys) = 0;
+  /**
+   * @brief 从cursor处继续遍历key的值中的元素，两次调用之间不保存任何状态
+   * @details 哈希按field、有序集合按(分值, 成员)定位到上次返回的元素之后，
+   * 其间的修改不影响定位，遍历期间一直存在的元素恰好返回一次，按顺序返回；
+   * 集合使用反向二进制游标，保证同Scan。
+   * @param[in] type dbobject::kDbHash/kDbSet/kDbZSet
+   * @param[in,out] cursor 第一次调用前为默认值，每次调用后更新
+   * @param[in] count 本次大约返回的元素个数
+   * @param[out] items 追加访问到的元素
+   * @return true 遍历完成，key不存在或已过期时也返回true
+   */
+  virtual bool ScanValue(const int type, const std::string &key,
+                         ValueCursor *cursor, size_t count,
+                         std::vector<ValueItem> *items) = 0;
+
+  // 统计
+  virtual int GetKeySize() const = 0;
+  /**
+   * @brief 累计修改次数，每次成功的写操作(含过期删除)加一，只增不减
+   */
+  virtual uint64_t GetDirty() const = 0;
+  /**
+   * @brief 把引擎自己的统计项累加到stats中，各库的同名项相加后由info输出
+   */
+  virtual void AddStats(std::map<std::string, uint64_t> *stats) const = 0;
+};
+#endif
@@ -0,0 +1,67 @@
+/**
+ * @file timestamp.h
+ * @author pengchang
+ * @brief 存储引擎和嵌入接口使用的微秒时间戳
+ * @details 接口与muduo::Timestamp相同(自1970年起的微秒数)，只依赖标准库，
+ * kvdb库因此不需要muduo。服务器与事件循环交互时按微秒数互相转换。
+ */
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+
+class Timestamp
+{
+public:
+  static const int kMicroSecondsPerSecond = 1000 * 1000;
+
+  Timestamp() : us_(0) {}
+  explicit Timestamp(int64_t us) : us_(us) {}
+
+  static Timestamp now()
+  {
+    return Timestamp(std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::system_clock::now().time_since_epoch())
+                         .count());
+  }
+  static Timestamp invalid() { return Timestamp(); }
+
+  bool valid() const { return us_ > 0; }
+  int64_t microSecondsSinceEpoch() const { return us_; }
+  time_t secondsSinceEpoch() const
+  {
+    return static_cast<time_t>(us_ / kMicroSecondsPerSecond);
+  }
+
+private:
+  int64_t us_;
+};
+
+inline bool operator<(Timestamp lhs, Timestamp rhs)
+{
+  return lhs.microSecondsSinceEpoch() < rhs.microSecondsSinceEpoch();
+}
+inline bool operator>(Timestamp lhs, Timestamp rhs) { return rhs < lhs; }
+inline bool operator<=(Timestamp lhs, Timestamp rhs) { return !(rhs < lhs); }
+inline bool operator>=(Timestamp lhs, Timestamp rhs) { return !(lhs < rhs); }
+inline bool operator==(Timestamp lhs, Timestamp rhs)
+{
+  return lhs.microSecondsSinceEpoch() == rhs.microSecondsSinceEpoch();
+}
+inline bool operator!=(Timestamp lhs, Timestamp rhs) { return !(lhs == rhs); }
+
+// high - low，单位秒
+inline double timeDifference(Timestamp high, Timestamp low)
+{
+  int64_t diff = high.microSecondsSinceEpoch() - low.microSecondsSinceEpoch();
+  return static_cast<double>(diff) / Timestamp::kMicroSecondsPerSecond;
+}
+
+inline Timestamp addTime(Timestamp timestamp, double seconds)
+{
+  int64_t delta =
+      static_cast<int64_t>(seconds * Timestamp::kMicroSecondsPerSecond);
+  return Timestamp(timestamp.microSecondsSinceEpoch() + delta);
+}
+#endif
@@ -0,0 +1,151 @@
+/**
+ * @file value_log.h
+ * @author pengchang
+ * @brief 较大字符串值的值日志(键值分离)
+ * @details 值日志由若干编号递增的文件组成，只追加到编号最大的活跃文件，
+ * 活跃文件超过file_size后换新文件。文件名含进程号，热升级时新旧进程的文件互不冲突。
+ * 每条记录为
+ * 键长度(4字节小端) 值长度(4字节小端) 键 值，
+ * 键随值一起写入，垃圾回收顺序扫描文件时据此判断记录是否仍被引用。
+ *
+ * 值日志只用于把冷数据移出内存，不负责持久化：数据仍以rdb/AOF为准，
+ * 启动时删除上次运行留下的文件，载入rdb/AOF时重新写入。
+ */
+#ifndef VALUE_LOG_H
+#define VALUE_LOG_H
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+/**
+ * @brief 值在值日志中的位置
+ */
+struct ValuePointer
+{
+  ValuePointer() : file_(0), len_(0), offset_(0) {}
+
+  bool operator==(const ValuePointer &other) const
+  {
+    return file_ == other.file_ && offset_ == other.offset_ &&
+           len_ == other.len_;
+  }
+
+  uint32_t file_;
+  uint32_t len_;
+  // 值(不是记录)在文件中的偏移
+  uint64_t offset_;
+};
+
+class ValueLog
+{
+public:
+  // 活跃文件换新文件的大小
+  static const uint64_t kDefaultFileSize = 64ULL << 20;
+  // 块缓存的块大小
+  static const size_t kBlockSize = 16 * 1024;
+  // 无效数据占比达到该值的文件才会被回收
+  static constexpr double kGcRatio = 0.5;
+
+  /**
+   * @param[in] prefix 文件名前缀，文件名为prefix加进程号、文件编号和".vlog"
+   * @param[in] cache_size 块缓存的容量(字节)，0表示不缓存
+   */
+  ValueLog(const std::string &prefix, size_t cache_size,
+           uint64_t file_size = kDefaultFileSize);
+  ~ValueLog();
+  ValueLog(const ValueLog &) = delete;
+  ValueLog &operator=(const ValueLog &) = delete;
+
+  /**
+   * @brief 删除前缀相同的旧文件并创建第一个活跃文件
+   */
+  bool Open();
+
+  /**
+   * @brief 追加一条记录
+   * @param[out] ptr 值的位置
+   * @return false 写文件失败
+   */
+  bool Append(const std::string &key, const std::string &value,
+              ValuePointer *ptr);
+
+  /**
+   * @brief 读取ptr处的值
+   * @details 不超过块缓存容量1/8的值按块读取并缓存，更大的值用一次pread直接读取，
+   * 避免一次读取冲掉整个缓存
+   * @return false 读文件失败
+   */
+  bool Read(const ValuePointer &ptr, std::string *value);
+
+  /**
+   * @brief 键被覆盖或删除后调用，ptr处的记录计入所在文件的无效数据
+   */
+  void Discard(const ValuePointer &ptr, size_t key_len);
+
+  /**
+   * @brief 回收一步：从无效数据最多的非活跃文件中顺序扫描最多budget字节的记录，
+   * 仍被引用的记录重新追加到活跃文件，文件扫描完后删除
+   * @param[in] live 记录仍被键引用时返回true
+   * @param[in] moved 记录被搬移后调用，由调用者更新键的位置
+   * @return true 有文件正在回收
+   */
+  bool CollectGarbage(
+      size_t budget,
+      const std::function<bool(const std::string &key,
+                               const ValuePointer &ptr)> &live,
+      const std::function<void(const std::string &key,
+                               const ValuePointer &ptr)> &moved);
+
+  size_t FileCount() const { return files_.size(); }
+  // 所有文件的总字节数
+  uint64_t TotalBytes() const;
+  // 已被覆盖或删除的记录的字节数
+  uint64_t DeadBytes() const;
+  uint64_t CacheHits() const { return cache_hits_; }
+  uint64_t CacheMisses() const { return cache_misses_; }
+
+private:
+  struct File
+  {
+    int fd_;
+    uint64_t size_;
+    uint64_t dead_;
+  };
+
+  std::string FileName(uint32_t id) const;
+  // 创建新的活跃文件
+  bool NewFile();
+  // 删除文件，并丢弃其在块缓存中的块
+  void RemoveFile(uint32_t id);
+  bool ReadAt(int fd, uint64_t offset, size_t len, char *buf);
+  // 返回块的内容，不足kBlockSize的末尾块不缓存
+  bool ReadBlock(uint32_t id, const File &file, uint64_t block,
+                 std::string *scratch, const std::string **data);
+
+private:
+  std::string prefix_;
+  pid_t pid_;
+  uint64_t file_size_;
+  std::map<uint32_t, File> files_;
+  uint32_t active_;
+  // 正在回收的文件，0表示没有
+  uint32_t gc_file_;
+  uint64_t gc_offset_;
+
+  // 块缓存，以LRU淘汰，键为(文件编号 << 40 | 块编号)
+  size_t cache_size_;
+  size_t cache_used_;
+  std::list<std::pair<uint64_t, std::string>> lru_;
+  std::unordered_map<uint64_t,
+                     std::list<std::pair<uint64_t, std::string>>::iterator>
+      cache_;
+  uint64_t cache_hits_;
+  uint64_t cache_misses_;
+};
+#endif
@@ -0,0 +1,440 @@
+#include "aof.h"
+
+#include <fcntl.h>
+#include <muduo/base/Logging.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "db_obj.h"
+
+Aof::Aof(const std::string &path, int fsync_policy)
+    : path_(path),
+      fsync_policy_(fsync_policy),
+      fd_(-1),
+      size_(0),
+      sync_failed_(false),
+      db_(-1),
+      multi_(false),
+      multi_fed_(false),
+      base_size_(0),
+      rewriting_(false),
+      rewrite_db_(-1),
+      quit_(false),
+      dirty_(false) {}
+
+Aof::~Aof()
+{
+  if (fsync_thread_.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      quit_ = true;
+    }
+    cond_.notify_one();
+    fsync_thread_.join();
+  }
+  if (fd_ >= 0)
+  {
+    Flush();
+    if (fsync_policy_ != dbobject::kAofFsyncNo)
+    {
+      fdatasync(fd_);
+    }
+    close(fd_);
+  }
+}
+
+bool Aof::Open()
+{
+  fd_ = open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd_ < 0)
+  {
+    LOG_ERROR << "open aof file " << path_ << " error: " << strerror(errno);
+    return false;
+  }
+  struct stat st;
+  fstat(fd_, &st);
+  size_ = st.st_size;
+  base_size_ = size_;
+  if (fsync_policy_ == dbobject::kAofFsyncEverysec && !fsync_thread_.joinable())
+  {
+    fsync_thread_ = std::thread(&Aof::FsyncThread, this);
+  }
+  return true;
+}
+
+void Aof::AppendRecord(std::string *buf, const std::vector<std::string> &argv)
+{
+  *buf += '*';
+  *buf += std::to_string(argv.size());
+  *buf += "\r\n";
+  for (auto &arg : argv)
+  {
+    *buf += '$';
+    *buf += std::to_string(arg.size());
+    *buf += "\r\n";
+    *buf += arg;
+    *buf += "\r\n";
+  }
+}
+
+void Aof::BeginMulti()
+{
+  multi_ = true;
+  multi_fed_ = false;
+}
+
+void Aof::EndMulti()
+{
+  if (multi_fed_)
+  {
+    AppendRecord(&buf_, {"exec"});
+    if (rewriting_)
+    {
+      AppendRecord(&rewrite_buf_, {"exec"});
+    }
+  }
+  multi_ = false;
+  multi_fed_ = false;
+}
+
+void Aof::Feed(int db, const std::vector<std::string> &argv)
+{
+  if (multi_ && !multi_fed_)
+  {
+    AppendRecord(&buf_, {"multi"});
+    if (rewriting_)
+    {
+      AppendRecord(&rewrite_buf_, {"multi"});
+    }
+    multi_fed_ = true;
+  }
+  if (db != db_)
+  {
+    // select的库编号从1开始
+    AppendRecord(&buf_, {"select", std::to_string(db + 1)});
+    db_ = db;
+  }
+  AppendRecord(&buf_, argv);
+
+  if (rewriting_)
+  {
+    if (db != rewrite_db_)
+    {
+      AppendRecord(&rewrite_buf_, {"select", std::to_string(db + 1)});
+      rewrite_db_ = db;
+    }
+    AppendRecord(&rewrite_buf_, argv);
+  }
+}
+
+bool Aof::WriteFully(int fd, const char *data, size_t len, size_t *written)
+{
+  size_t done = 0;
+  while (done < len)
+  {
+    ssize_t n = write(fd, data + done, len - done);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      break;
+    }
+    done += n;
+  }
+  if (written)
+  {
+    *written = done;
+  }
+  return done == len;
+}
+
+void Aof::StartRewrite()
+{
+  rewriting_ = true;
+  rewrite_buf_.clear();
+  // 子进程生成的命令流结束时所在的库未知，重写缓冲区总是以select开始
+  rewrite_db_ = -1;
+}
+
+void Aof::AbortRewrite()
+{
+  rewriting_ = false;
+  std::string().swap(rewrite_buf_);
+}
+
+bool Aof::FinishRewrite(const std::string &tmp_path)
+{
+  // 旧文件先写完整，替换失败时仍可继续使用
+  Flush();
+
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_APPEND);
+  if (fd < 0 || !WriteFully(fd, rewrite_buf_.data(), rewrite_buf_.size()) ||
+      fdatasync(fd) != 0 || rename(tmp_path.c_str(), path_.c_str()) != 0)
+  {
+    LOG_ERROR << "aof rewrite failed: " << strerror(errno);
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    unlink(tmp_path.c_str());
+    AbortRewrite();
+    return false;
+  }
+
+  int old_fd;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    old_fd = fd_;
+    fd_ = fd;
+  }
+  if (old_fd >= 0)
+  {
+    close(old_fd);
+  }
+
+  struct stat st;
+  fstat(fd_, &st);
+  size_ = st.st_size;
+  base_size_ = size_;
+  // 新文件最后所在的库未知，下一条命令前重新select
+  db_ = -1;
+  // 旧文件没能写出的命令都在子进程的数据或重写缓冲区中，已写入新文件
+  buf_.clear();
+  sync_failed_ = false;
+  AbortRewrite();
+  LOG_INFO << "aof rewrite finished, new size " << size_;
+  return true;
+}
+
+bool Aof::NeedRewrite(int percentage, uint64_t min_size) const
+{
+  uint64_t size = Size();
+  if (rewriting_ || size < min_size)
+  {
+    return false;
+  }
+  uint64_t base = base_size_ > 0 ? base_size_ : 1;
+  return size > base && (size - base) * 100 / base >= static_cast<uint64_t>(percentage);
+}
+
+bool Aof::Flush()
+{
+  if (fd_ < 0 || (buf_.empty() && !sync_failed_))
+  {
+    return true;
+  }
+  size_t written = 0;
+  if (!WriteFully(fd_, buf_.data(), buf_.size(), &written))
+  {
+    LOG_ERROR << "write aof file error: " << strerror(errno);
+    // 截掉部分写入的字节，文件仍以完整的记录结尾，重试时从头写出缓冲区；
+    // 截不掉时把已写入的部分移出缓冲区，重试时从断点继续，不会重复写入
+    if (written > 0 && ftruncate(fd_, size_) != 0)
+    {
+      LOG_ERROR << "truncate aof file error: " << strerror(errno);
+      size_ += written;
+      buf_.erase(0, written);
+    }
+    return false;
+  }
+  size_ += buf_.size();
+  buf_.clear();
+
+  if (fsync_policy_ == dbobject::kAofFsyncAlways)
+  {
+    sync_failed_ = fdatasync(fd_) != 0;
+    if (sync_failed_)
+    {
+      LOG_ERROR << "fdatasync aof file error: " << strerror(errno);
+      return false;
+    }
+  }
+  else if (fsync_policy_ == dbobject::kAofFsyncEverysec)
+  {
+    dirty_ = true;
+  }
+  return true;
+}
+
+void Aof::FsyncThread()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!quit_)
+  {
+    cond_.wait_for(lock, std::chrono::seconds(1));
+    if (dirty_.exchange(false))
+    {
+      fdatasync(fd_);
+    }
+  }
+}
+
+namespace
+{
+// 记录头部损坏时避免分配过大的内存
+const long kMaxRecordArgs = 1024 * 1024;
+const long kMaxArgLength = 512L * 1024 * 1024;
+
+enum RecordStatus
+{
+  kRecordOk,
+  // 文件结束，或最后一条记录不完整
+  kRecordEof,
+  // 记录格式错误
+  kRecordBad
+};
+
+// 解析"<prefix><非负整数>\r"，getline已去掉\n
+bool ParseHeader(const std::string &line, char prefix, long *n)
+{
+  if (line.size() < 3 || line[0] != prefix || line.back() != '\r')
+  {
+    return false;
+  }
+  char *end;
+  *n = strtol(line.c_str() + 1, &end, 10);
+  return *n >= 0 && end == line.c_str() + line.size() - 1;
+}
+
+RecordStatus ReadRecord(std::istream &in, std::vector<std::string> *argv)
+{
+  argv->clear();
+  std::string line;
+  if (!std::getline(in, line) || in.eof())
+  {
+    // 没有换行符结尾的命令不完整
+    return kRecordEof;
+  }
+  if (line.empty() || line[0] != '*')
+  {
+    // 旧版本每行一条的文本命令
+    std::istringstream ss(line);
+    std::string arg;
+    while (ss >> arg)
+    {
+      argv->push_back(arg);
+    }
+    return kRecordOk;
+  }
+  long argc;
+  if (!ParseHeader(line, '*', &argc) || argc > kMaxRecordArgs)
+  {
+    return kRecordBad;
+  }
+  argv->resize(argc);
+  for (auto &arg : *argv)
+  {
+    long len;
+    if (!std::getline(in, line) || in.eof())
+    {
+      return kRecordEof;
+    }
+    if (!ParseHeader(line, '$', &len) || len > kMaxArgLength)
+    {
+      return kRecordBad;
+    }
+    arg.resize(len + 2);
+    if (!in.read(&arg[0], len + 2))
+    {
+      return kRecordEof;
+    }
+    if (arg[len] != '\r' || arg[len + 1] != '\n')
+    {
+      return kRecordBad;
+    }
+    arg.resize(len);
+  }
+  return kRecordOk;
+}
+} // namespace
+
+bool Aof::Replay(
+    const std::function<void(const std::vector<std::string> &)> &handler)
+{
+  std::ifstream in(path_, std::ios::in | std::ios::binary);
+  if (!in.is_open())
+  {
+    // 文件不存在
+    return true;
+  }
+  std::vector<std::string> argv;
+  // 最后一条完整命令或事务的结尾
+  uint64_t valid = 0;
+  uint64_t count = 0;
+  // 读到multi之后、exec之前的命令
+  bool multi = false;
+  std::vector<std::vector<std::string>> queued;
+  RecordStatus status;
+  while ((status = ReadRecord(in, &argv)) == kRecordOk)
+  {
+    if (argv.empty())
+    {
+      if (!multi)
+      {
+        valid = in.tellg();
+      }
+      continue;
+    }
+    if (argv.size() == 1 && (argv[0] == "multi" || argv[0] == "exec"))
+    {
+      if (multi == (argv[0] == "multi"))
+      {
+        // 嵌套的multi或没有multi的exec
+        status = kRecordBad;
+        break;
+      }
+      multi = !multi;
+      if (!multi)
+      {
+        for (auto &cmd : queued)
+        {
+          handler(cmd);
+        }
+        count += queued.size();
+        queued.clear();
+        valid = in.tellg();
+      }
+      continue;
+    }
+    if (multi)
+    {
+      queued.push_back(std::move(argv));
+      continue;
+    }
+    valid = in.tellg();
+    handler(argv);
+    ++count;
+  }
+  in.close();
+  if (status == kRecordBad)
+  {
+    // 不是写入时崩溃造成的，截断会丢掉之后的全部命令
+    LOG_ERROR << "aof file " << path_ << " has a bad record at offset "
+              << valid;
+    return false;
+  }
+
+  struct stat st;
+  if (stat(path_.c_str(), &st) == 0 && static_cast<uint64_t>(st.st_size) > valid)
+  {
+    LOG_WARN << "aof file " << path_ << " is truncated, discard the last "
+             << st.st_size - valid << " bytes";
+    if (truncate(path_.c_str(), valid) != 0)
+    {
+      LOG_ERROR << "truncate aof file error: " << strerror(errno);
+      return false;
+    }
+  }
+  LOG_INFO << "aof replayed " << count << " commands";
+  return true;
+}
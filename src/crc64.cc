@@ -0,0 +1,61 @@
+#include "crc64.h"
+
+#include <cstring>
+
+namespace
+{
+  // 反射形式的Jones多项式
+  const uint64_t kPoly = 0x95ac9329ac4bc9b5ULL;
+
+  struct Crc64Table
+  {
+    Crc64Table()
+    {
+      for (int i = 0; i < 256; i++)
+      {
+        uint64_t crc = i;
+        for (int j = 0; j < 8; j++)
+        {
+          crc = (crc & 1) ? (crc >> 1) ^ kPoly : crc >> 1;
+        }
+        table_[0][i] = crc;
+      }
+      for (int i = 0; i < 256; i++)
+      {
+        for (int k = 1; k < 8; k++)
+        {
+          table_[k][i] = (table_[k - 1][i] >> 8) ^
+                         table_[0][table_[k - 1][i] & 0xff];
+        }
+      }
+    }
+    uint64_t table_[8][256];
+  };
+
+  const Crc64Table kTable;
+} // namespace
+
+uint64_t Crc64(uint64_t crc, const void *data, size_t len)
+{
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  const uint64_t(*t)[256] = kTable.table_;
+
+  while (len >= 8)
+  {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    // 按小端序取8个字节
+    crc ^= word;
+    crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^
+          t[5][(crc >> 16) & 0xff] ^ t[4][(crc >> 24) & 0xff] ^
+          t[3][(crc >> 32) & 0xff] ^ t[2][(crc >> 40) & 0xff] ^
+          t[1][(crc >> 48) & 0xff] ^ t[0][crc >> 56];
+    p += 8;
+    len -= 8;
+  }
+  while (len--)
+  {
+    crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
@@ -1,18 +1,21 @@
 #include "database.h"
 
 #include <fcntl.h>
-#include <muduo/base/Logging.h>
-#include <muduo/net/EventLoop.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cfloat>
+#include <cmath>
 #include <iostream>
 
+#include "db_log.h"
 #include "db_obj.h"
 #include "db_status.h"
+#include "rdb.h"
+#include "rdb_loader.h"
 
 static const int kMicroSecondsPerSecond = 1000 * 1000;
 static const int kMilliSecondsPerSecond = 1000;
@@ -42,311 +45,895 @@ void Database::DingqiHandler()
   len4 = len4 / len * kCheckNum;
   len5 = len5 / len * kCheckNum;
 
-  //
-  for (auto &t : string_)
+  // 抽查dict中的key，检查n个后停止：DelKey会从dict中删除元素，
+  // 使遍历的迭代器失效，过期的key先收集起来，遍历结束后再删除
+  auto check = [&](auto &dict, int type, int n) {
+    std::vector<std::string> expired;
+    for (auto &t : dict)
+    {
+      if (JudgeKeyExpiredTime(type, t.first))
+      {
+        expired.push_back(t.first);
+      }
+      if ((--n) == 0)
+        break;
+    }
+    for (auto &key : expired)
+    {
+      DelKey(type, key);
+    }
+    del_cnt += static_cast<int>(expired.size());
+  };
+  check(string_, dbobject::kDbString, len1);
+  check(list_, dbobject::kDbList, len2);
+  check(hash_, dbobject::kDbHash, len3);
+  check(set_, dbobject::kDbSet, len4);
+  check(zset_, dbobject::kDbZSet, len5);
+
+  // 当过期key数量占抽查数量的一半时，立即再次触发定期删除
+  if (del_cnt > kCheckNum / 2)
   {
-    auto key = t.first;
-    if (JudgeKeyExpiredTime(dbobject::kDbString, key))
+    DingqiHandler();
+  }
+}
+
+const int Database::kExpireCycleSeconds;
+
+Database::Database(const RunAtFunc &run_at)
+    : run_at_(run_at), last_expire_cycle_(Timestamp::now()) {}
+// 惰性删除这里不用做任何事，只需要在查该key时判断一下过期没有即可，过期则删除
+// 定时删除使用宿主提供的定时器，在设置key过期时间时添加一个定时任务，时间到期就删除该key
+
+void Database::Cron(const Timestamp &now)
+{
+  // 定期删除
+  if ((del_mode_ & dbobject::kDingqiDel) &&
+      timeDifference(now, last_expire_cycle_) >= kExpireCycleSeconds)
+  {
+    last_expire_cycle_ = now;
+    DingqiHandler();
+  }
+  if (vlog_)
+  {
+    ValueLogGc();
+  }
+}
+
+void Database::SetValueLog(std::unique_ptr<ValueLog> vlog, size_t min_size)
+{
+  vlog_ = std::move(vlog);
+  vlog_min_size_ = min_size;
+}
+
+void Database::ValueLogGc()
+{
+  // 每步最多扫描的字节数，限制一次占用事件循环的时间
+  const size_t kGcBudget = 4 * 1024 * 1024;
+  vlog_->CollectGarbage(
+      kGcBudget,
+      [this](const std::string &key, const ValuePointer &ptr) {
+        auto it = string_vlog_.find(key);
+        return it != string_vlog_.end() && it->second == ptr;
+      },
+      [this](const std::string &key, const ValuePointer &ptr) {
+        string_vlog_[key] = ptr;
+      });
+}
+
+void Database::PutString(const std::string &key, StringSp value)
+{
+  auto old = string_vlog_.find(key);
+  if (old != string_vlog_.end())
+  {
+    vlog_->Discard(old->second, key.size());
+  }
+  ValuePointer ptr;
+  if (vlog_ && value->size() >= vlog_min_size_ &&
+      vlog_->Append(key, *value, &ptr))
+  {
+    // 释放原值占用的内存
+    string_[key] = nullptr;
+    if (old != string_vlog_.end())
     {
-      DelKey(dbobject::kDbString, key);
-      ++del_cnt;
+      old->second = ptr;
     }
-    if ((--len1) == 0)
-      break;
+    else
+    {
+      string_vlog_.emplace(key, ptr);
+    }
+    return;
+  }
+  if (old != string_vlog_.end())
+  {
+    string_vlog_.erase(old);
+  }
+  string_[key] = std::move(value);
+}
+
+void Database::DropString(const std::string &key)
+{
+  auto it = string_vlog_.find(key);
+  if (it != string_vlog_.end())
+  {
+    vlog_->Discard(it->second, key.size());
+    string_vlog_.erase(it);
+  }
+}
+
+const std::string &Database::StringValue(const std::string &key,
+                                         const StringSp &stored,
+                                         std::string *buf)
+{
+  if (stored)
+  {
+    return *stored;
+  }
+  buf->clear();
+  auto it = string_vlog_.find(key);
+  if (it != string_vlog_.end())
+  {
+    vlog_->Read(it->second, buf);
+  }
+  return *buf;
+}
+
+StringSp Database::SharedStringValue(const std::string &key,
+                                     const StringSp &stored)
+{
+  if (stored)
+  {
+    return stored;
+  }
+  auto value = std::make_shared<std::string>();
+  auto it = string_vlog_.find(key);
+  if (it == string_vlog_.end() || !vlog_->Read(it->second, value.get()))
+  {
+    return nullptr;
+  }
+  return value;
+}
+
+void Database::RdbLoad(int index)
+{
+  char tmp[1024]{0};
+  std::string path = getcwd(tmp, 1024);
+  path += "/dump.rdb";
+
+  std::vector<StorageEngine *> dbs(index + 1, nullptr);
+  dbs[index] = this;
+  RdbLoader loader(dbs);
+  loader.Load(path);
+}
+
+// 各类型的值写入rdb的格式
+static void PutValue(RdbWriter *writer, const std::string &value)
+{
+  writer->PutString(value);
+}
+
+static void PutValue(RdbWriter *writer, const String::mapped_type &value)
+{
+  writer->PutString(*value);
+}
+
+static void PutValue(RdbWriter *writer, const List::mapped_type &value)
+{
+  writer->PutVarint(value.size());
+  for (auto &item : value)
+  {
+    writer->PutString(item);
+  }
+}
+
+static void PutValue(RdbWriter *writer, const Hash::mapped_type &value)
+{
+  writer->PutVarint(value->size());
+  for (auto &field : *value)
+  {
+    writer->PutString(field.first);
+    writer->PutString(field.second);
+  }
+}
+
+static void PutValue(RdbWriter *writer, const Set::mapped_type &value)
+{
+  writer->PutVarint(value->size());
+  for (auto &member : *value)
+  {
+    writer->PutString(member);
+  }
+}
+
+static void PutValue(RdbWriter *writer, const ZSet::mapped_type &value)
+{
+  writer->PutVarint(value->GetLength());
+  // 按(分值, 成员)升序写入，载入时可一次构建跳表
+  for (auto node = value->First(); node; node = node->levels_[0]->forward_)
+  {
+    writer->PutString(node->obj_);
+    writer->PutDouble(node->score_);
+  }
+}
+
+// 快照保存的值与字典中的值互不影响：列表整体复制，其余类型以引用计数共享，
+// 字符串不可变，哈希、集合、有序集合原地修改前经Unshare复制
+template <typename T>
+static T CopyValue(const T &value)
+{
+  return value;
+}
+
+// 深复制值：列表按值存放，直接复制
+template <typename T>
+static T CloneValue(const T &value)
+{
+  return value;
+}
+
+template <typename T>
+static std::shared_ptr<T> CloneValue(const std::shared_ptr<T> &value)
+{
+  return std::make_shared<T>(*value);
+}
+
+static SkipListSp CloneValue(const SkipListSp &value)
+{
+  std::vector<std::pair<std::string, double>> elems;
+  elems.reserve(value->GetLength());
+  for (auto node = value->First(); node; node = node->levels_[0]->forward_)
+  {
+    elems.emplace_back(node->obj_, node->score_);
+  }
+  return Skiplist::BuildFromSorted(std::move(elems));
+}
+
+template <typename T>
+T &Database::Unshare(std::shared_ptr<T> &value)
+{
+  if (!Exclusive(value.get()))
+  {
+    value = CloneValue(value);
+    MarkFresh(value.get());
+  }
+  return *value;
+}
+
+bool Database::Exclusive(const void *value) const
+{
+  if (lent_.count(value) != 0)
+  {
+    return false;
+  }
+  return !snapshotting_ || fresh_.count(value) != 0;
+}
+
+void Database::MarkFresh(const void *value)
+{
+  if (snapshotting_)
+  {
+    fresh_.insert(value);
   }
-  for (auto &t : list_)
+}
+
+// 过期时间(微秒)，0表示不过期
+static int64_t ExpireOf(const Expire &expire, const std::string &key)
+{
+  auto it = expire.find(key);
+  return it == expire.end() ? 0 : it->second.microSecondsSinceEpoch();
+}
+
+void Database::RdbSave(RdbWriter *writer, int index)
+{
+  int64_t now = Timestamp::now().microSecondsSinceEpoch();
+  // 已过期的key不再写入，value_of取出条目的值
+  auto save = [&](const int type, const Expire &expire, const auto &dict,
+                  auto value_of) {
+    writer->BeginSection(index, type);
+    for (auto &it : dict)
+    {
+      int64_t expire_at = ExpireOf(expire, it.first);
+      if (expire_at != 0 && expire_at < now)
+      {
+        continue;
+      }
+      writer->PutEntry(expire_at, it.first);
+      PutValue(writer, value_of(it));
+    }
+    writer->EndSection();
+  };
+  auto stored = [](const auto &it) -> const auto & { return it.second; };
+  std::string buf;
+  save(dbobject::kDbString, string_expire_, string_,
+       [&](const String::value_type &it) -> const std::string & {
+         return StringValue(it.first, it.second, &buf);
+       });
+  save(dbobject::kDbList, list_expire_, list_, stored);
+  save(dbobject::kDbHash, hash_expire_, hash_, stored);
+  save(dbobject::kDbSet, set_expire_, set_, stored);
+  save(dbobject::kDbZSet, zset_expire_, zset_, stored);
+}
+
+void Database::AofRewrite(
+    const std::function<void(const std::vector<std::string> &)> &emit)
+{
+  // 一条rpush命令最多携带的元素数
+  const size_t kItemsPerCmd = 64;
+  Timestamp now = Timestamp::now();
+  char score[32];
+
+  auto emit_expire = [&](const int type, const std::string &key) {
+    Timestamp expire = GetKeyExpiredTime(type, key);
+    if (expire != Timestamp::invalid())
+    {
+      emit({"pexpireat", key,
+            std::to_string(expire.microSecondsSinceEpoch() /
+                           kMicroSecondsPerMilliSecond)});
+    }
+  };
+  auto expired = [&](const int type, const std::string &key) {
+    Timestamp expire = GetKeyExpiredTime(type, key);
+    return expire != Timestamp::invalid() && expire < now;
+  };
+
+  std::string buf;
+  for (auto &it : string_)
   {
-    auto key = t.first;
-    if (JudgeKeyExpiredTime(dbobject::kDbList, key))
+    if (expired(dbobject::kDbString, it.first))
     {
-      DelKey(dbobject::kDbList, key);
-      ++del_cnt;
+      continue;
     }
-    if ((--len2) == 0)
-      break;
+    emit({"set", it.first, StringValue(it.first, it.second, &buf)});
+    emit_expire(dbobject::kDbString, it.first);
   }
-  for (auto &t : hash_)
+  std::vector<std::string> argv;
+  for (auto &it : list_)
   {
-    auto key = t.first;
-    if (JudgeKeyExpiredTime(dbobject::kDbHash, key))
+    if (expired(dbobject::kDbList, it.first) || it.second.empty())
     {
-      DelKey(dbobject::kDbHash, key);
-      ++del_cnt;
+      continue;
     }
-    if ((--len3) == 0)
-      break;
+    for (auto &value : it.second)
+    {
+      if (argv.empty())
+      {
+        argv = {"rpush", it.first};
+      }
+      argv.push_back(value);
+      if (argv.size() == kItemsPerCmd + 2)
+      {
+        emit(argv);
+        argv.clear();
+      }
+    }
+    if (!argv.empty())
+    {
+      emit(argv);
+      argv.clear();
+    }
+    emit_expire(dbobject::kDbList, it.first);
   }
-  for (auto &t : set_)
+  for (auto &it : hash_)
   {
-    auto key = t.first;
-    if (JudgeKeyExpiredTime(dbobject::kDbSet, key))
+    if (expired(dbobject::kDbHash, it.first))
     {
-      DelKey(dbobject::kDbSet, key);
-      ++del_cnt;
+      continue;
     }
-    if ((--len4) == 0)
-      break;
+    for (auto &field : *it.second)
+    {
+      emit({"hset", it.first, field.first, field.second});
+    }
+    emit_expire(dbobject::kDbHash, it.first);
   }
-  for (auto &t : zset_)
+  for (auto &it : set_)
   {
-    auto key = t.first;
-    if (JudgeKeyExpiredTime(dbobject::kDbZSet, key))
+    if (expired(dbobject::kDbSet, it.first))
     {
-      DelKey(dbobject::kDbZSet, key);
-      ++del_cnt;
+      continue;
     }
-    if ((--len5) == 0)
-      break;
+    for (auto &member : *it.second)
+    {
+      emit({"sadd", it.first, member});
+    }
+    emit_expire(dbobject::kDbSet, it.first);
+  }
+  for (auto &it : zset_)
+  {
+    if (expired(dbobject::kDbZSet, it.first))
+    {
+      continue;
+    }
+    for (auto node = it.second->First(); node;
+         node = node->levels_[0]->forward_)
+    {
+      // 17位有效数字保证分值精确还原
+      snprintf(score, sizeof(score), "%.17g", node->score_);
+      emit({"zadd", it.first, node->obj_, score});
+    }
+    emit_expire(dbobject::kDbZSet, it.first);
   }
+}
 
-  // 当过期key数量占抽查数量的一半时，立即再次触发定期删除
-  if (del_cnt > kCheckNum / 2)
+// 快照期间字典的最大负载因子，足够大使插入不触发扩容
+static const float kSnapshotLoadFactor = 1e6f;
+static const float kDefaultLoadFactor = 1.0f;
+
+void Database::SnapshotBegin(const Timestamp &now)
+{
+  // 快照复制的是字典中的值，值日志中的值在字典中只是空串
+  assert(!vlog_);
+  snapshotting_ = true;
+  snapshot_time_ = now;
+  for (auto &state : snapshot_)
   {
-    DingqiHandler();
+    state = SnapshotState();
   }
+  std::unordered_set<const void *>().swap(fresh_);
+  UpdateLoadFactor();
 }
 
-Database::Database()
+void Database::SnapshotEnd()
 {
-  // 添加定期删除策略的定时任务
-  int expire_del_time = 3; // 定期删除的时间
-  muduo::net::EventLoop::getEventLoopOfCurrentThread()->runEvery(
-      expire_del_time, std::bind(&Database::DingqiHandler, this));
+  snapshotting_ = false;
+  for (auto &state : snapshot_)
+  {
+    state = SnapshotState();
+  }
+  std::unordered_set<const void *>().swap(fresh_);
+  UpdateLoadFactor();
 }
-// 惰性删除这里不用做任何事，只需要在查该key时判断一下过期没有即可，过期则删除
-// 定时删除使用Muduo提供的定时器模块，在设置key过期时间时添加一个定时任务，时间到期就删除该key
 
-void Database::RdbLoad(int index)
+void Database::UpdateLoadFactor()
 {
-  char tmp[1024]{0};
-  std::string path = getcwd(tmp, 1024);
-  path += "/dump.rdb";
-  int fd = open(path.c_str(), O_CREAT | O_RDONLY, 0644);
-  assert(fd != -1);
+  // 只修改负载因子不会立即rehash，快照期间桶的数目保持不变，
+  // 快照结束后下次插入时按正常负载因子扩容
+  float factor = snapshotting_ || !read_snapshots_.empty()
+                     ? kSnapshotLoadFactor
+                     : kDefaultLoadFactor;
+  string_.max_load_factor(factor);
+  list_.max_load_factor(factor);
+  hash_.max_load_factor(factor);
+  set_.max_load_factor(factor);
+  zset_.max_load_factor(factor);
+}
 
-  // 获取文件信息
-  struct stat buf;
-  fstat(fd, &buf);
-  if (buf.st_size == 0)
-    return;
+std::unique_lock<std::mutex> Database::PrepareWrite(const int type,
+                                                    const std::string &key)
+{
+  if (!read_snapshots_.empty())
+  {
+    switch (type)
+    {
+    case dbobject::kDbString:
+      ReadSnapshotPreserve(string_, string_expire_, &DictReadSnapshot::strings_,
+                           key);
+      break;
+    case dbobject::kDbList:
+      ReadSnapshotPreserve(list_, list_expire_, &DictReadSnapshot::lists_, key);
+      break;
+    case dbobject::kDbHash:
+      ReadSnapshotPreserve(hash_, hash_expire_, &DictReadSnapshot::hashes_,
+                           key);
+      break;
+    case dbobject::kDbSet:
+      ReadSnapshotPreserve(set_, set_expire_, &DictReadSnapshot::sets_, key);
+      break;
+    case dbobject::kDbZSet:
+      ReadSnapshotPreserve(zset_, zset_expire_, &DictReadSnapshot::zsets_, key);
+      break;
+    default:
+      break;
+    }
+  }
+  if (!snapshotting_)
+  {
+    return std::unique_lock<std::mutex>();
+  }
+  std::unique_lock<std::mutex> lock(snapshot_mutex_);
+  switch (type)
+  {
+  case dbobject::kDbString:
+    SnapshotPreserve(string_, string_expire_, &RdbStage::strings_,
+                     snapshot_[type], key);
+    break;
+  case dbobject::kDbList:
+    SnapshotPreserve(list_, list_expire_, &RdbStage::lists_, snapshot_[type],
+                     key);
+    break;
+  case dbobject::kDbHash:
+    SnapshotPreserve(hash_, hash_expire_, &RdbStage::hashes_, snapshot_[type],
+                     key);
+    break;
+  case dbobject::kDbSet:
+    SnapshotPreserve(set_, set_expire_, &RdbStage::sets_, snapshot_[type],
+                     key);
+    break;
+  case dbobject::kDbZSet:
+    SnapshotPreserve(zset_, zset_expire_, &RdbStage::zsets_, snapshot_[type],
+                     key);
+    break;
+  default:
+    break;
+  }
+  return lock;
+}
 
-  char *addr = static_cast<char *>(
-      mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0));
-  if (addr == MAP_FAILED)
+template <typename D>
+void Database::SnapshotPreserve(
+    D &dict, Expire &expire,
+    std::vector<typename D::mapped_type> RdbStage::*values,
+    SnapshotState &state, const std::string &key)
+{
+  // 桶已访问过时快照线程已复制了该key，或者key在快照开始后才插入
+  if (dict.bucket(key) < state.cursor_ ||
+      !state.done_.insert(key).second)
   {
-    close(fd);
-    LOG_FATAL << "RdbSave error";
+    return;
   }
-  close(fd);
+  auto it = dict.find(key);
+  if (it == dict.end())
+  {
+    return;
+  }
+  int64_t expire_at = ExpireOf(expire, key);
+  if (expire_at != 0 && expire_at < snapshot_time_.microSecondsSinceEpoch())
+  {
+    return;
+  }
+  state.pending_.keys_.emplace_back(key, expire_at);
+  (state.pending_.*values).emplace_back(CopyValue(it->second));
+}
 
-  std::string data(addr, addr + buf.st_size);
-  assert(munmap(addr, buf.st_size) != -1);
+StringSp Database::VersionValue(const std::string &key,
+                                const StringSp &stored)
+{
+  StringSp value = SharedStringValue(key, stored);
+  return value ? value : std::make_shared<std::string>();
+}
 
-  int p1 = 0, p2 = 0;
-  int dbIdx = 0;
-  do
+template <typename T>
+T Database::VersionValue(const std::string &, const T &stored)
+{
+  return CloneValue(stored);
+}
+
+template <typename D>
+void Database::ReadSnapshotPreserve(
+    D &dict, Expire &expire,
+    VersionTable<typename D::mapped_type> DictReadSnapshot::*table,
+    const std::string &key)
+{
+  std::shared_ptr<VersionedValue<typename D::mapped_type>> version;
+  for (auto &it : read_snapshots_)
   {
-    p1 = data.find("SD", p2);
-    // 没有数据需要载入
-    if (p1 == data.npos)
+    VersionTable<typename D::mapped_type> &versions = (*it.second).*table;
+    // 该快照已保存过key在其快照时刻的值
+    if (versions.versions_.count(key) != 0)
     {
-      return;
+      continue;
     }
-    p2 = data.find('^', p1);
-    dbIdx = atoi(InterceptString(data, p1 + 2, p2).c_str());
-  } while (dbIdx != index);
+    if (!version)
+    {
+      version = std::make_shared<VersionedValue<typename D::mapped_type>>();
+      auto value = dict.find(key);
+      if (value != dict.end())
+      {
+        version->exists_ = true;
+        version->expire_at_ = ExpireOf(expire, key);
+        version->value_ = VersionValue(key, value->second);
+      }
+    }
+    versions.versions_.emplace(key, version);
+    versions.by_bucket_.emplace(dict.bucket(key), key);
+  }
+}
+
+template <typename D>
+bool Database::SnapshotCollect(
+    D &dict, Expire &expire,
+    std::vector<typename D::mapped_type> RdbStage::*values,
+    SnapshotState &state, RdbStage *out)
+{
+  // 每批最多复制的key数，限制主线程等锁的时间
+  const size_t kBatchKeys = 128;
+  std::lock_guard<std::mutex> lock(snapshot_mutex_);
 
-  int end = data.find("SD", p2);
-  if (end == data.npos)
+  for (size_t i = 0; i < state.pending_.keys_.size(); ++i)
   {
-    end = data.find("EOF");
+    out->keys_.emplace_back(std::move(state.pending_.keys_[i]));
+    (out->*values).emplace_back(std::move((state.pending_.*values)[i]));
   }
+  state.pending_.keys_.clear();
+  (state.pending_.*values).clear();
 
-  while (p1 < end && p2 < end)
+  size_t buckets = dict.bucket_count();
+  while (state.cursor_ < buckets && out->keys_.size() < kBatchKeys)
   {
-    p2 = data.find('^', p1);
-    p1 = data.find("ST", p2);
-    int type = atoi(InterceptString(data, p2 + 1, p1).c_str());
-
-    if (type == dbobject::kDbString)
+    for (auto it = dict.begin(state.cursor_); it != dict.end(state.cursor_);
+         ++it)
     {
-      do
+      if (state.done_.count(it->first) != 0)
+      {
+        continue;
+      }
+      int64_t expire_at = ExpireOf(expire, it->first);
+      if (expire_at != 0 &&
+          expire_at < snapshot_time_.microSecondsSinceEpoch())
       {
-        p2 = data.find('!', p1);
-        Timestamp expireTime(atoi(InterceptString(data, p1 + 2, p2).c_str()));
-        p1 = data.find('#', p2);
+        continue;
+      }
+      out->keys_.emplace_back(it->first, expire_at);
+      (out->*values).emplace_back(CopyValue(it->second));
+    }
+    ++state.cursor_;
+  }
+  if (state.cursor_ < buckets)
+  {
+    return false;
+  }
+  // 所有桶均已访问，之后的修改无需再保存
+  std::unordered_set<std::string>().swap(state.done_);
+  return true;
+}
+
+template <typename D>
+void Database::SnapshotSaveType(
+    RdbWriter *writer, int index, const int type, D &dict, Expire &expire,
+    std::vector<typename D::mapped_type> RdbStage::*values)
+{
+  writer->BeginSection(index, type);
+  bool finished = false;
+  while (!finished)
+  {
+    RdbStage batch;
+    finished = SnapshotCollect(dict, expire, values, snapshot_[type], &batch);
+    // 序列化和写文件时不持锁
+    for (size_t i = 0; i < batch.keys_.size(); ++i)
+    {
+      writer->PutEntry(batch.keys_[i].second, batch.keys_[i].first);
+      PutValue(writer, (batch.*values)[i]);
+    }
+  }
+  writer->EndSection();
+}
 
-        int keyLen = atoi(InterceptString(data, p2 + 1, p1).c_str());
-        std::string key = data.substr(p1 + 1, keyLen);
+void Database::SnapshotSave(RdbWriter *writer, int index)
+{
+  SnapshotSaveType(writer, index, dbobject::kDbString, string_, string_expire_,
+                   &RdbStage::strings_);
+  SnapshotSaveType(writer, index, dbobject::kDbList, list_, list_expire_,
+                   &RdbStage::lists_);
+  SnapshotSaveType(writer, index, dbobject::kDbHash, hash_, hash_expire_,
+                   &RdbStage::hashes_);
+  SnapshotSaveType(writer, index, dbobject::kDbSet, set_, set_expire_,
+                   &RdbStage::sets_);
+  SnapshotSaveType(writer, index, dbobject::kDbZSet, zset_, zset_expire_,
+                   &RdbStage::zsets_);
+}
 
-        p2 = data.find('!', p1);
-        p1 = data.find('$', p2);
-        int valueLen = atoi(InterceptString(data, p2 + 1, p1).c_str());
-        std::string value = data.substr(p1 + 1, valueLen);
+bool Database::RdbParseSection(const RdbSection &section, RdbStage *stage)
+{
+  // 压缩的段在各自的解析线程中解压
+  std::string raw;
+  const char *payload = section.payload_;
+  size_t len = section.len_;
+  if (section.encoding_ == rdb::kEncLzf)
+  {
+    if (!section.Decompress(&raw))
+    {
+      return false;
+    }
+    payload = raw.data();
+    len = raw.size();
+  }
+  else if (section.encoding_ != rdb::kEncRaw)
+  {
+    return false;
+  }
+  RdbReader reader(payload, len);
+  int64_t now = Timestamp::now().microSecondsSinceEpoch();
+  std::string key, value, field;
+  uint64_t expire, size;
 
-        AddKey(dbobject::kDbString, key, value, dbobject::kDefaultObjValue);
-        if (expireTime > Timestamp::now())
+  stage->db_ = section.db_;
+  stage->type_ = section.type_;
+  if (section.type_ < dbobject::kDbString || section.type_ > dbobject::kDbZSet)
+  {
+    return false;
+  }
+  stage->keys_.reserve(section.count_);
+
+  for (uint64_t n = 0; n < section.count_; ++n)
+  {
+    if (!reader.GetVarint(&expire) || !reader.GetString(&key))
+    {
+      return false;
+    }
+    // 载入前已过期的key仍需解析以跳过
+    bool live = expire == 0 || static_cast<int64_t>(expire) > now;
+
+    if (section.type_ == dbobject::kDbString)
+    {
+      if (!reader.GetString(&value))
+      {
+        return false;
+      }
+      if (live)
+      {
+        stage->strings_.emplace_back(
+            std::make_shared<std::string>(std::move(value)));
+      }
+    }
+    else if (section.type_ == dbobject::kDbList)
+    {
+      List::mapped_type list;
+      if (!reader.GetVarint(&size))
+      {
+        return false;
+      }
+      while (size--)
+      {
+        if (!reader.GetString(&value))
         {
-          SetPExpireTime(dbobject::kDbString, key, expireTime);
+          return false;
         }
-        p1 += valueLen + 1;
-      } while (data.substr(p1, 2) == "ST");
-      continue;
+        list.emplace_back(std::move(value));
+      }
+      if (live)
+      {
+        stage->lists_.emplace_back(std::move(list));
+      }
     }
-    if (type == dbobject::kDbList)
+    else if (section.type_ == dbobject::kDbHash)
     {
-      do
+      HashSp hash = std::make_shared<HashValue>();
+      if (!reader.GetVarint(&size))
       {
-        p2 = data.find('!', p1);
-        Timestamp expireTime(atoi(InterceptString(data, p1 + 2, p2).c_str()));
-        p1 = data.find('#', p2);
-
-        int keyLen = atoi(InterceptString(data, p2 + 1, p1).c_str());
-        std::string key = data.substr(p1 + 1, keyLen);
-
-        p2 = data.find('!', p1);
-        p1 = data.find('$', p2);
-        int valueSize = atoi(InterceptString(data, p2 + 1, p1).c_str());
-        int valueLen = 0;
-        while (valueSize--)
+        return false;
+      }
+      while (size--)
+      {
+        if (!reader.GetString(&field) || !reader.GetString(&value))
         {
-          p2 = p1;
-          p1 = data.find('$', p2);
-          valueLen = atoi(InterceptString(data, p2 + 1, p1).c_str());
-          std::string value = data.substr(p1 + 1, valueLen);
-          if (valueSize > 1)
-          {
-            p1 = data.find('!', p2 + 1);
-          }
-          AddKey(dbobject::kDbList, key, value, dbobject::kDefaultObjValue);
+          return false;
         }
-        if (expireTime > Timestamp::now())
+        // field按升序写入，以end()为提示插入为常数时间
+        hash->emplace_hint(hash->end(), std::move(field), std::move(value));
+      }
+      if (live)
+      {
+        stage->hashes_.emplace_back(std::move(hash));
+      }
+    }
+    else if (section.type_ == dbobject::kDbSet)
+    {
+      SetSp set = std::make_shared<SetValue>();
+      if (!reader.GetVarint(&size))
+      {
+        return false;
+      }
+      set->reserve(size);
+      while (size--)
+      {
+        if (!reader.GetString(&value))
         {
-          SetPExpireTime(dbobject::kDbList, key, expireTime);
+          return false;
         }
-        p1 += valueLen + 1;
-      } while (data.substr(p1, 2) == "ST");
-      continue;
+        set->emplace(std::move(value));
+      }
+      if (live)
+      {
+        stage->sets_.emplace_back(std::move(set));
+      }
     }
-    if (type == dbobject::kDbHash)
+    else
     {
-      do
+      if (!reader.GetVarint(&size))
       {
-        p2 = data.find('!', p1);
-        Timestamp expireTime(atoi(InterceptString(data, p1 + 2, p2).c_str()));
-        p1 = data.find('#', p2);
-        int keyLen = atoi(InterceptString(data, p2 + 1, p1).c_str());
-        std::string key = data.substr(p1 + 1, keyLen);
-        p2 = data.find('!', p1);
-        p1 = data.find('!', p2 + 1);
-        int valueSize = atoi(InterceptString(data, p2 + 1, p1).c_str());
-        int valueLen = 0;
-        while (valueSize--)
+        return false;
+      }
+      std::vector<std::pair<std::string, double>> elems;
+      elems.reserve(size);
+      bool sorted = true;
+      while (size--)
+      {
+        double score;
+        if (!reader.GetString(&value) || !reader.GetDouble(&score))
         {
-          p2 = data.find('#', p1);
-          int valueKeyLen = atoi(InterceptString(data, p1 + 1, p2).c_str());
-          std::string valueKey = data.substr(p2 + 1, valueKeyLen);
-          p1 = data.find('!', p2);
-          p2 = p1;
-          p1 = data.find('$', p2);
-          valueLen = atoi(InterceptString(data, p2 + 1, p1).c_str());
-          std::string value = data.substr(p1 + 1, valueLen);
-          if (valueSize > 1)
-          {
-            p1 = data.find('!', p2 + 1);
-          }
-          AddKey(dbobject::kDbHash, key, valueKey, value);
+          return false;
         }
-        if (expireTime > Timestamp::now())
+        if (!elems.empty() &&
+            (elems.back().second > score ||
+             (elems.back().second == score && elems.back().first >= value)))
         {
-          SetPExpireTime(dbobject::kDbList, key, expireTime);
+          sorted = false;
         }
-        p1 += 1 + valueLen;
-      } while (data.substr(p1, 2) == "ST");
-      continue;
-    }
-    if (type == dbobject::kDbSet)
-    {
-      do
+        elems.emplace_back(std::move(value), score);
+      }
+      if (live)
       {
-        p2 = data.find('!', p1);
-        Timestamp expireTime(atoi(InterceptString(data, p1 + 2, p2).c_str()));
-        p1 = data.find('#', p2);
-        int keyLen = atoi(InterceptString(data, p2 + 1, p1).c_str());
-        std::string key = data.substr(p1 + 1, keyLen);
-        p2 = data.find('!', p1);
-        p1 = data.find('!', p2 + 1);
-        int valueSize = atoi(InterceptString(data, p2 + 1, p1).c_str());
-        int valueLen = 0;
-        while (valueSize--)
+        if (sorted)
         {
-          p2 = p1;
-          p1 = data.find('$', p2);
-          valueLen = atoi(InterceptString(data, p2 + 1, p1).c_str());
-          std::string value = data.substr(p1 + 1, valueLen);
-
-          if (valueSize > 1)
-          {
-            p1 = data.find('!', p2 + 1);
-          }
-          AddKey(dbobject::kDbSet, key, value, dbobject::kDefaultObjValue);
+          stage->zsets_.emplace_back(
+              Skiplist::BuildFromSorted(std::move(elems)));
         }
-        if (expireTime > Timestamp::now())
+        else
         {
-          SetPExpireTime(dbobject::kDbSet, key, expireTime);
+          SkipListSp list(new Skiplist());
+          for (auto &elem : elems)
+          {
+            list->InsertNode(elem.first, elem.second);
+          }
+          stage->zsets_.emplace_back(std::move(list));
         }
-        p1 += 1 + valueLen;
-      } while (data.substr(p1, 2) == "ST");
-      continue;
+      }
     }
-    if (type == dbobject::kDbZSet)
+
+    if (live)
     {
-      do
+      stage->keys_.emplace_back(std::move(key), static_cast<int64_t>(expire));
+    }
+  }
+  return reader.Eof();
+}
+
+void Database::RdbMergeStage(RdbStage &&stage)
+{
+  size_t n = stage.keys_.size();
+  // 后台载入时快照或读快照可能正在进行：并入与写操作相同，
+  // 每个key都在PrepareWrite返回的锁下写入；此时字典不预先扩容，桶的编号保持不变
+  bool quiet = !snapshotting_ && read_snapshots_.empty();
+  auto merge = [&](auto &dict, auto &values, Expire &expire) {
+    if (quiet)
+    {
+      dict.reserve(dict.size() + n);
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+      const std::string &key = stage.keys_[i].first;
+      auto lock = PrepareWrite(stage.type_, key);
+      if (vlog_ && stage.type_ == dbobject::kDbString)
       {
-        p2 = data.find('!', p1);
-        Timestamp expireTime(atoi(InterceptString(data, p1 + 2, p2).c_str()));
-        p1 = data.find('#', p2);
-        int keyLen = atoi(InterceptString(data, p2 + 1, p1).c_str());
-        std::string key = data.substr(p1 + 1, keyLen);
-        p2 = data.find('!', p1);
-        p1 = data.find('!', p2 + 1);
-        int valueSize = atoi(InterceptString(data, p2 + 1, p1).c_str());
-        int valueLen = 0;
-        while (valueSize--)
-        {
-          p2 = data.find('#', p1);
-          int valueKeyLen = atoi(InterceptString(data, p1 + 1, p2).c_str());
-          std::string valueKey = data.substr(p2 + 1, valueKeyLen);
-          p1 = data.find('!', p2);
-          p2 = p1;
-          p1 = data.find('$', p2);
-          valueLen = atoi(InterceptString(data, p2 + 1, p1).c_str());
-          std::string value = data.substr(p1 + 1, valueLen);
-          if (valueSize > 1)
-            p1 = data.find('!', p2 + 1);
-          AddKey(dbobject::kDbZSet, key, valueKey, value);
-        }
-        p1 += 1 + valueLen;
-      } while (data.substr(p1, 2) == "ST");
-      continue;
+        PutString(key, std::move(stage.strings_[i]));
+      }
+      else
+      {
+        dict[key] = std::move(values[i]);
+      }
+      if (stage.keys_[i].second != 0)
+      {
+        expire[key] = Timestamp(stage.keys_[i].second);
+      }
     }
+  };
+  switch (stage.type_)
+  {
+  case dbobject::kDbString:
+    merge(string_, stage.strings_, string_expire_);
+    break;
+  case dbobject::kDbList:
+    merge(list_, stage.lists_, list_expire_);
+    break;
+  case dbobject::kDbHash:
+    merge(hash_, stage.hashes_, hash_expire_);
+    break;
+  case dbobject::kDbSet:
+    merge(set_, stage.sets_, set_expire_);
+    break;
+  case dbobject::kDbZSet:
+    merge(zset_, stage.zsets_, zset_expire_);
+    break;
+  default:
+    break;
   }
 }
 
 bool Database::AddKey(const int type, const std::string &key,
                       const std::string &objKey, const std::string &objValue)
 {
+  auto lock = PrepareWrite(type, key);
   if (type == dbobject::kDbString)
   {
-    auto it = string_.find(key);
-    if (it == string_.end())
-    {
-      string_.insert(std::make_pair(key, objKey));
-    }
-    else
-    {
-      string_[key] = objKey;
-    }
+    PutString(key, std::make_shared<std::string>(objKey));
   }
   else if (type == dbobject::kDbList)
   {
@@ -367,16 +954,14 @@ bool Database::AddKey(const int type, const std::string &key,
     auto it = hash_.find(key);
     if (it == hash_.end())
     {
-      std::map<
-          std::string, std::string, std::less<>,
-          __gnu_cxx::__pool_alloc<std::pair<const std::string, std::string>>>
-          tmp;
-      tmp.insert(std::make_pair(objKey, objValue));
+      HashSp tmp = std::make_shared<HashValue>();
+      tmp->insert(std::make_pair(objKey, objValue));
+      MarkFresh(tmp.get());
       hash_.insert(std::make_pair(key, tmp));
     }
     else
     {
-      it->second[objKey] = objValue;
+      Unshare(it->second)[objKey] = objValue;
     }
   }
   else if (type == dbobject::kDbSet)
@@ -384,15 +969,14 @@ bool Database::AddKey(const int type, const std::string &key,
     auto it = set_.find(key);
     if (it == set_.end())
     {
-      std::unordered_set<std::string, std::hash<std::string>, std::equal_to<>,
-                         __gnu_cxx::__pool_alloc<std::string>>
-          tmp;
-      tmp.insert(objKey);
+      SetSp tmp = std::make_shared<SetValue>();
+      tmp->insert(objKey);
+      MarkFresh(tmp.get());
       set_.insert(std::make_pair(key, tmp));
     }
     else
     {
-      it->second.insert(objKey);
+      Unshare(it->second).insert(objKey);
     }
   }
   else if (type == dbobject::kDbZSet)
@@ -401,14 +985,13 @@ bool Database::AddKey(const int type, const std::string &key,
     if (it == zset_.end())
     {
       SkipListSp skipList(new Skiplist());
-      skipList->InsertNode(objKey, atoi(objValue.c_str()));
-
+      skipList->InsertNode(objKey, strtod(objValue.c_str(), nullptr));
+      MarkFresh(skipList.get());
       zset_.insert(std::make_pair(key, skipList));
     }
     else
     {
-      auto iter = zset_.find(key);
-      iter->second->InsertNode(objKey, atoi(objValue.c_str()));
+      Unshare(it->second).InsertNode(objKey, strtod(objValue.c_str(), nullptr));
     }
   }
   else
@@ -416,17 +999,19 @@ bool Database::AddKey(const int type, const std::string &key,
     std::cout << "Unknown type" << std::endl;
     return false;
   }
-  std::cout << "Add key successfully" << std::endl;
+  ++dirty_;
   return true;
 }
 
 bool Database::DelKey(const int type, const std::string &key)
 {
+  auto lock = PrepareWrite(type, key);
   if (type == dbobject::kDbString)
   {
     auto it = string_.find(key);
     if (it != string_.end())
     {
+      DropString(key);
       string_.erase(key);
       string_expire_.erase(key);
     }
@@ -474,106 +1059,505 @@ bool Database::DelKey(const int type, const std::string &key)
       return false;
     }
   }
-  std::cout << "Del key successfully" << std::endl;
+  else if (type == dbobject::kDbZSet)
+  {
+    auto it = zset_.find(key);
+    if (it != zset_.end())
+    {
+      zset_.erase(key);
+      zset_expire_.erase(key);
+    }
+    else
+    {
+      return false;
+    }
+  }
+  ++dirty_;
   return true;
 }
 
-std::string Database::GetKey(const int type, const std::string &key)
+// GetKey和GetKeyAt输出的值的文本格式
+static std::string FormatValue(const HashValue &value)
+{
+  std::string res;
+  for (auto &field : value)
+  {
+    res += field.first + ':' + field.second + ' ';
+  }
+  return res;
+}
+
+static std::string FormatValue(const SetValue &value)
+{
+  std::string res;
+  for (auto &member : value)
+  {
+    res += member + ' ';
+  }
+  return res;
+}
+
+// 有序集合分值在[low, high]内的成员
+static std::string FormatRange(const SkipListSp &value, double low,
+                               double high)
+{
+  std::string res;
+  RangeSpec range(low, high);
+  std::vector<SkiplistNode *> nodes(value->GetNodeInRange(range));
+  for (auto node : nodes)
+  {
+    res += node->obj_ + ':' + std::to_string(node->score_) + '\n';
+  }
+  if (!res.empty())
+  {
+    res.pop_back();
+  }
+  return res;
+}
+
+// ZSet中的key可能包含range范围，格式为key:low@high或key，返回其中的key
+static std::string ParseZSetKey(const std::string &key, double *low,
+                                double *high)
+{
+  *low = -DBL_MAX;
+  *high = DBL_MAX;
+  size_t p1 = key.find(':');
+  if (p1 == std::string::npos)
+  {
+    return key;
+  }
+  size_t p2 = key.find('@');
+  *low = std::stod(key.substr(p1 + 1, p2 - p1 - 1));
+  *high = std::stod(key.substr(p2 + 1, key.size() - p2));
+  return key.substr(0, p1);
+}
+
+std::string Database::GetKey(const int type, const std::string &key)
+{
+  std::string res;
+
+  if (!JudgeKeyExpiredTime(type, key))
+  { // key没有过期
+    if (type == dbobject::kDbString)
+    {
+      auto it = string_.find(key);
+      if (it == string_.end())
+      {
+        res = dbreply::kKeyNotFound;
+      }
+      else
+      {
+        const std::string &value = StringValue(key, it->second, &res);
+        if (&value != &res)
+        {
+          res = value;
+        }
+      }
+    }
+    else if (type == dbobject::kDbHash)
+    {
+      auto it = hash_.find(key);
+      res = it == hash_.end() ? dbreply::kKeyNotFound
+                              : FormatValue(*it->second);
+    }
+    else if (type == dbobject::kDbSet)
+    {
+      auto it = set_.find(key);
+      res = it == set_.end() ? dbreply::kKeyNotFound
+                             : FormatValue(*it->second);
+    }
+    else if (type == dbobject::kDbZSet)
+    {
+      double low, high;
+      auto it = zset_.find(ParseZSetKey(key, &low, &high));
+      res = it == zset_.end() ? dbreply::kKeyNotFound
+                              : FormatRange(it->second, low, high);
+    }
+  }
+  else
+  { // key过期的情况
+    // 惰性删除策略
+    if (del_mode_ & dbobject::kDuoxingDel)
+    {
+      DelKey(type, key);
+      res = "The key has expired and will be deleted";
+    }
+  }
+  return res;
+}
+
+PreparedRead Database::PrepareRead(const int type, const std::string &key,
+                                   size_t min_size)
+{
+  std::string name = key;
+  PreparedRead prepared;
+  std::shared_ptr<const void> held;
+  if (type == dbobject::kDbHash)
+  {
+    auto it = hash_.find(key);
+    if (it == hash_.end() || it->second->size() < min_size)
+    {
+      return PreparedRead();
+    }
+    HashSp value = it->second;
+    prepared.read_ = [value]() { return FormatValue(*value); };
+    held = value;
+  }
+  else if (type == dbobject::kDbSet)
+  {
+    auto it = set_.find(key);
+    if (it == set_.end() || it->second->size() < min_size)
+    {
+      return PreparedRead();
+    }
+    SetSp value = it->second;
+    prepared.read_ = [value]() { return FormatValue(*value); };
+    held = value;
+  }
+  else if (type == dbobject::kDbZSet)
+  {
+    double low, high;
+    name = ParseZSetKey(key, &low, &high);
+    auto it = zset_.find(name);
+    if (it == zset_.end() || it->second->GetLength() < min_size)
+    {
+      return PreparedRead();
+    }
+    SkipListSp value = it->second;
+    prepared.read_ = [value, low, high]() {
+      return FormatRange(value, low, high);
+    };
+    held = value;
+  }
+  else
+  {
+    return PreparedRead();
+  }
+  // 已过期的key由GetKey惰性删除
+  if (JudgeKeyExpiredTime(type, name))
+  {
+    return PreparedRead();
+  }
+  // 值借出到done_被调用为止，期间的修改由Unshare复制；done_持有一份引用，
+  // 登记的地址在归还前不会被其他值重用
+  ++lent_[held.get()];
+  prepared.done_ = [this, held]() {
+    auto it = lent_.find(held.get());
+    if (--it->second == 0)
+    {
+      lent_.erase(it);
+    }
+  };
+  return prepared;
+}
+
+std::shared_ptr<ReadSnapshot> Database::OpenReadSnapshot()
+{
+  auto snap = std::make_shared<DictReadSnapshot>();
+  snap->epoch_ = ++epoch_;
+  snap->time_ = Timestamp::now();
+  read_snapshots_[snap->epoch_] = snap;
+  UpdateLoadFactor();
+  return snap;
+}
+
+void Database::CloseReadSnapshot(const std::shared_ptr<ReadSnapshot> &snap)
+{
+  read_snapshots_.erase(snap->epoch_);
+  UpdateLoadFactor();
+}
+
+// 快照时刻key的值，不存在或已过期时返回nullptr
+template <typename D>
+static const typename D::mapped_type *ValueAt(
+    const D &dict, const Expire &expire,
+    const VersionTable<typename D::mapped_type> &table, int64_t at,
+    const std::string &key)
+{
+  const typename D::mapped_type *value = nullptr;
+  int64_t expire_at = 0;
+  auto version = table.versions_.find(key);
+  if (version != table.versions_.end())
+  {
+    if (!version->second->exists_)
+    {
+      return nullptr;
+    }
+    value = &version->second->value_;
+    expire_at = version->second->expire_at_;
+  }
+  else
+  {
+    auto it = dict.find(key);
+    if (it == dict.end())
+    {
+      return nullptr;
+    }
+    value = &it->second;
+    expire_at = ExpireOf(expire, key);
+  }
+  return expire_at != 0 && expire_at < at ? nullptr : value;
+}
+
+std::string Database::GetKeyAt(const ReadSnapshot &snap, const int type,
+                               const std::string &key)
+{
+  auto &versions = static_cast<const DictReadSnapshot &>(snap);
+  int64_t at = snap.time_.microSecondsSinceEpoch();
+  std::string res;
+  if (type == dbobject::kDbString)
+  {
+    auto value = ValueAt(string_, string_expire_, versions.strings_, at, key);
+    if (value == nullptr)
+    {
+      return dbreply::kKeyNotFound;
+    }
+    // 版本中保存的是值本身，字典中的值可能在值日志中
+    const std::string &stored = StringValue(key, *value, &res);
+    if (&stored != &res)
+    {
+      res = stored;
+    }
+  }
+  else if (type == dbobject::kDbHash)
+  {
+    auto value = ValueAt(hash_, hash_expire_, versions.hashes_, at, key);
+    res = value == nullptr ? dbreply::kKeyNotFound
+                           : FormatValue(**value);
+  }
+  else if (type == dbobject::kDbSet)
+  {
+    auto value = ValueAt(set_, set_expire_, versions.sets_, at, key);
+    res = value == nullptr ? dbreply::kKeyNotFound
+                           : FormatValue(**value);
+  }
+  else if (type == dbobject::kDbZSet)
+  {
+    double low, high;
+    std::string name = ParseZSetKey(key, &low, &high);
+    auto value = ValueAt(zset_, zset_expire_, versions.zsets_, at, name);
+    res = value == nullptr ? dbreply::kKeyNotFound
+                           : FormatRange(*value, low, high);
+  }
+  return res;
+}
+
+// 访问快照中type类型从*cursor开始的count个桶
+template <typename D>
+static bool ScanDictAt(const D &dict, const Expire &expire,
+                       const VersionTable<typename D::mapped_type> &table,
+                       int64_t at, size_t *cursor, size_t count,
+                       std::vector<std::pair<std::string, int64_t>> *keys)
 {
-  std::string res;
-
-  if (!JudgeKeyExpiredTime(type, key))
-  { // key没有过期
-    if (type == dbobject::kDbString)
+  size_t buckets = dict.bucket_count();
+  size_t end = std::min(buckets, *cursor + count);
+  auto alive = [at](int64_t expire_at) {
+    return expire_at == 0 || expire_at >= at;
+  };
+  for (; *cursor < end; ++*cursor)
+  {
+    // 没有版本的key在快照时刻之后未被修改
+    for (auto it = dict.begin(*cursor); it != dict.end(*cursor); ++it)
     {
-      auto it = string_.find(key);
-      if (it == string_.end())
-      {
-        res = DbStatus::NotFound("key").ToString();
-      }
-      else
+      int64_t expire_at = ExpireOf(expire, it->first);
+      if (table.versions_.count(it->first) == 0 && alive(expire_at))
       {
-        res = it->second;
+        keys->emplace_back(it->first, expire_at);
       }
     }
-    else if (type == dbobject::kDbHash)
+    // 有版本的key无论是否还在字典中都按版本输出
+    auto range = table.by_bucket_.equal_range(*cursor);
+    for (auto it = range.first; it != range.second; ++it)
     {
-      auto it = hash_.find(key);
-      if (it == hash_.end())
-      {
-        res = DbStatus::NotFound("key").ToString();
-      }
-      else
+      auto &version = table.versions_.find(it->second)->second;
+      if (version->exists_ && alive(version->expire_at_))
       {
-        std::map<std::string, std::string>::iterator iter;
-        for (iter = it->second.begin(); iter != it->second.end(); iter++)
-        {
-          res += iter->first + ':' + iter->second + ' ';
-        }
+        keys->emplace_back(it->second, version->expire_at_);
       }
     }
-    else if (type == dbobject::kDbSet)
+  }
+  return *cursor >= buckets;
+}
+
+bool Database::ScanAt(const ReadSnapshot &snap, const int type,
+                      size_t *cursor, size_t count,
+                      std::vector<std::pair<std::string, int64_t>> *keys)
+{
+  auto &versions = static_cast<const DictReadSnapshot &>(snap);
+  int64_t at = snap.time_.microSecondsSinceEpoch();
+  switch (type)
+  {
+  case dbobject::kDbString:
+    return ScanDictAt(string_, string_expire_, versions.strings_, at, cursor,
+                      count, keys);
+  case dbobject::kDbList:
+    return ScanDictAt(list_, list_expire_, versions.lists_, at, cursor, count,
+                      keys);
+  case dbobject::kDbHash:
+    return ScanDictAt(hash_, hash_expire_, versions.hashes_, at, cursor, count,
+                      keys);
+  case dbobject::kDbSet:
+    return ScanDictAt(set_, set_expire_, versions.sets_, at, cursor, count,
+                      keys);
+  case dbobject::kDbZSet:
+    return ScanDictAt(zset_, zset_expire_, versions.zsets_, at, cursor, count,
+                      keys);
+  default:
+    return true;
+  }
+}
+
+static uint64_t ReverseBits(uint64_t v)
+{
+  v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+  v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+  v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  return __builtin_bswap64(v);
+}
+
+// 从cursor处按反向二进制顺序访问dict的桶，visit返回加入结果的元素数。
+// 返回的元素数达到count、访问了10 * count个桶或遍历完时停止
+template <typename D, typename F>
+static uint64_t ScanBuckets(const D &dict, uint64_t cursor, size_t count,
+                            F visit)
+{
+  if (dict.empty())
+  {
+    return 0;
+  }
+  // 桶数为2的幂，游标的低位即桶编号
+  const uint64_t mask = dict.bucket_count() - 1;
+  size_t found = 0;
+  size_t buckets = std::max<size_t>(count, 1) * 10;
+  do
+  {
+    size_t bucket = cursor & mask;
+    for (auto it = dict.begin(bucket); it != dict.end(bucket); ++it)
     {
-      auto it = set_.find(key);
-      if (it == set_.end())
-      {
-        res = DbStatus::NotFound("key").ToString();
-      }
-      else
-      {
-        for (const auto &iter : it->second)
-        {
-          res += iter + ' ';
-        }
-      }
+      found += visit(*it);
     }
-    else if (type ==
-             dbobject::kDbZSet)
-    { // ZSet中的key,可能包含range范围,格式为
-      // key:low@high 或 key
-      double low = -DBL_MAX;
-      double high = DBL_MAX;
-      std::string curKey = key;
+    // 反转后加一再反转回来，高于mask的位先置1使进位只发生在桶编号内
+    cursor = ReverseBits(ReverseBits(cursor | ~mask) + 1);
+  } while (cursor != 0 && found < count && --buckets > 0);
+  return cursor;
+}
 
-      if (key.find(':') != std::string::npos)
-      {
-        int p1 = key.find(':');
-        int p2 = key.find('@');
-        curKey = key.substr(0, p1);
-        low = std::stod(key.substr(p1 + 1, p2 - p1 - 1));
-        high = std::stod(key.substr(p2 + 1, key.size() - p2));
-      }
-      auto it = zset_.find(curKey);
-      if (it == zset_.end())
-      {
-        res = DbStatus::NotFound("key").ToString();
-      }
-      else
+uint64_t Database::Scan(const int type, uint64_t cursor, size_t count,
+                        std::vector<std::string> *keys)
+{
+  int64_t now = Timestamp::now().microSecondsSinceEpoch();
+  auto scan = [&](const auto &dict, const Expire &expire) {
+    return ScanBuckets(dict, cursor, count, [&](const auto &entry) {
+      int64_t expire_at = ExpireOf(expire, entry.first);
+      if (expire_at != 0 && expire_at < now)
       {
-        RangeSpec range(low, high);
-        std::vector<SkiplistNode *> nodes(it->second->GetNodeInRange(range));
-        for (auto node : nodes)
-        {
-          res += node->obj_ + ':' + std::to_string(node->score_) + '\n';
-        }
-        res.pop_back();
+        return 0;
       }
+      keys->push_back(entry.first);
+      return 1;
+    });
+  };
+  switch (type)
+  {
+  case dbobject::kDbString:
+    return scan(string_, string_expire_);
+  case dbobject::kDbList:
+    return scan(list_, list_expire_);
+  case dbobject::kDbHash:
+    return scan(hash_, hash_expire_);
+  case dbobject::kDbSet:
+    return scan(set_, set_expire_);
+  case dbobject::kDbZSet:
+    return scan(zset_, zset_expire_);
+  default:
+    return 0;
+  }
+}
+
+bool Database::ScanValue(const int type, const std::string &key,
+                         ValueCursor *cursor, size_t count,
+                         std::vector<ValueItem> *items)
+{
+  if (JudgeKeyExpiredTime(type, key))
+  {
+    return true;
+  }
+  count = std::max<size_t>(count, 1);
+  ValueItem item;
+  if (type == dbobject::kDbHash)
+  {
+    auto value = hash_.find(key);
+    if (value == hash_.end())
+    {
+      return true;
+    }
+    auto &fields = *value->second;
+    auto it = cursor->started_ ? fields.upper_bound(cursor->member_)
+                               : fields.begin();
+    for (size_t i = 0; i < count && it != fields.end(); ++i, ++it)
+    {
+      item.member_ = it->first;
+      item.value_ = it->second;
+      items->push_back(item);
+    }
+    if (it == fields.end())
+    {
+      return true;
     }
+    cursor->started_ = true;
+    cursor->member_ = std::prev(it)->first;
+    return false;
   }
-  else
-  { // key过期的情况
-    // 惰性删除策略
-    if (del_mode_ & dbobject::kDuoxingDel)
+  if (type == dbobject::kDbSet)
+  {
+    auto value = set_.find(key);
+    if (value == set_.end())
     {
-      DelKey(type, key);
-      res = "The key has expired and will be deleted";
+      return true;
     }
+    cursor->started_ = true;
+    cursor->bucket_ = ScanBuckets(*value->second, cursor->bucket_, count,
+                                  [&](const std::string &member) {
+                                    item.member_ = member;
+                                    items->push_back(item);
+                                    return 1;
+                                  });
+    return cursor->bucket_ == 0;
   }
-  return res;
+  if (type == dbobject::kDbZSet)
+  {
+    auto value = zset_.find(key);
+    if (value == zset_.end())
+    {
+      return true;
+    }
+    SkiplistNode *node =
+        cursor->started_
+            ? value->second->GetNodeAfter(cursor->score_, cursor->member_)
+            : value->second->First();
+    for (size_t i = 0; i < count && node; ++i)
+    {
+      item.member_ = node->obj_;
+      item.score_ = node->score_;
+      items->push_back(item);
+      node = node->levels_[0]->forward_;
+    }
+    if (node == nullptr)
+    {
+      return true;
+    }
+    cursor->started_ = true;
+    cursor->member_ = item.member_;
+    cursor->score_ = item.score_;
+    return false;
+  }
+  return true;
 }
+
 bool Database::SetPExpireTime(const int type, const std::string &key,
                               double expiredTime /* milliSeconds*/)
 {
+  auto lock = PrepareWrite(type, key);
   if (type == dbobject::kDbString)
   {
     auto it = string_.find(key);
@@ -583,12 +1567,11 @@ bool Database::SetPExpireTime(const int type, const std::string &key,
           addTime(Timestamp::now(), expiredTime / kMilliSecondsPerSecond);
       string_expire_[key] = now;
       // 如果过期策略采用定时删除
-      if (del_mode_ & dbobject::kDingshiDel)
+      if ((del_mode_ & dbobject::kDingshiDel) && run_at_)
       {
-        auto it = muduo::net::EventLoop::getEventLoopOfCurrentThread();
-        it->runAt(now,
-                  std::bind(&Database::DelKey, this, dbobject::kDbString, key));
+        run_at_(now, std::bind(&Database::DelKey, this, dbobject::kDbString, key));
       }
+      ++dirty_;
       return true;
     }
   }
@@ -601,12 +1584,11 @@ bool Database::SetPExpireTime(const int type, const std::string &key,
           addTime(Timestamp::now(), expiredTime / kMilliSecondsPerSecond);
       list_expire_[key] = now;
       // 如果过期策略采用定时删除
-      if (del_mode_ & dbobject::kDingshiDel)
+      if ((del_mode_ & dbobject::kDingshiDel) && run_at_)
       {
-        auto it = muduo::net::EventLoop::getEventLoopOfCurrentThread();
-        it->runAt(now,
-                  std::bind(&Database::DelKey, this, dbobject::kDbList, key));
+        run_at_(now, std::bind(&Database::DelKey, this, dbobject::kDbList, key));
       }
+      ++dirty_;
       return true;
     }
   }
@@ -619,12 +1601,11 @@ bool Database::SetPExpireTime(const int type, const std::string &key,
           addTime(Timestamp::now(), expiredTime / kMilliSecondsPerSecond);
       hash_expire_[key] = now;
       // 如果过期策略采用定时删除
-      if (del_mode_ & dbobject::kDingshiDel)
+      if ((del_mode_ & dbobject::kDingshiDel) && run_at_)
       {
-        auto it = muduo::net::EventLoop::getEventLoopOfCurrentThread();
-        it->runAt(now,
-                  std::bind(&Database::DelKey, this, dbobject::kDbHash, key));
+        run_at_(now, std::bind(&Database::DelKey, this, dbobject::kDbHash, key));
       }
+      ++dirty_;
       return true;
     }
   }
@@ -637,12 +1618,11 @@ bool Database::SetPExpireTime(const int type, const std::string &key,
           addTime(Timestamp::now(), expiredTime / kMilliSecondsPerSecond);
       set_expire_[key] = now;
       // 如果过期策略采用定时删除
-      if (del_mode_ & dbobject::kDingshiDel)
+      if ((del_mode_ & dbobject::kDingshiDel) && run_at_)
       {
-        auto it = muduo::net::EventLoop::getEventLoopOfCurrentThread();
-        it->runAt(now,
-                  std::bind(&Database::DelKey, this, dbobject::kDbSet, key));
+        run_at_(now, std::bind(&Database::DelKey, this, dbobject::kDbSet, key));
       }
+      ++dirty_;
       return true;
     }
   }
@@ -655,12 +1635,11 @@ bool Database::SetPExpireTime(const int type, const std::string &key,
           addTime(Timestamp::now(), expiredTime / kMilliSecondsPerSecond);
       zset_expire_[key] = now;
       // 如果过期策略采用定时删除
-      if (del_mode_ & dbobject::kDingshiDel)
+      if ((del_mode_ & dbobject::kDingshiDel) && run_at_)
       {
-        auto it = muduo::net::EventLoop::getEventLoopOfCurrentThread();
-        it->runAt(now,
-                  std::bind(&Database::DelKey, this, dbobject::kDbZSet, key));
+        run_at_(now, std::bind(&Database::DelKey, this, dbobject::kDbZSet, key));
       }
+      ++dirty_;
       return true;
     }
   }
@@ -670,8 +1649,11 @@ bool Database::SetPExpireTime(const int type, const std::string &key,
 bool Database::SetPExpireTime(const int type, const std::string &key,
                               const Timestamp &expiredTime)
 {
-  double expired_time =
-      expiredTime.microSecondsSinceEpoch() / kMicroSecondsPerMilliSecond;
+  // 绝对时间换算为距现在的毫秒数
+  double expired_time = static_cast<double>(
+                            expiredTime.microSecondsSinceEpoch() -
+                            Timestamp::now().microSecondsSinceEpoch()) /
+                        kMicroSecondsPerMilliSecond;
   return SetPExpireTime(type, key, expired_time);
 }
 
@@ -754,26 +1736,350 @@ bool Database::JudgeKeyExpiredTime(const int type, const std::string &key)
   return now > expired;
 }
 
-const std::string Database::RPopList(const std::string &key)
+bool Database::GetString(const std::string &key, std::string *value)
 {
-  auto iter = list_.find(key);
-  if (iter != list_.end())
+  if (JudgeKeyExpiredTime(dbobject::kDbString, key))
+  {
+    if (del_mode_ & dbobject::kDuoxingDel)
+    {
+      DelKey(dbobject::kDbString, key);
+    }
+    return false;
+  }
+  auto it = string_.find(key);
+  if (it == string_.end())
+  {
+    return false;
+  }
+  const std::string &stored = StringValue(key, it->second, value);
+  if (&stored != value)
+  {
+    *value = stored;
+  }
+  return true;
+}
+
+bool Database::GetSharedString(const std::string &key, StringSp *value)
+{
+  if (JudgeKeyExpiredTime(dbobject::kDbString, key))
+  {
+    return false;
+  }
+  auto it = string_.find(key);
+  if (it == string_.end())
+  {
+    return false;
+  }
+  *value = SharedStringValue(key, it->second);
+  return static_cast<bool>(*value);
+}
+
+bool Database::HGet(const std::string &key, const std::string &field,
+                    std::string *value)
+{
+  if (JudgeKeyExpiredTime(dbobject::kDbHash, key))
+  {
+    if (del_mode_ & dbobject::kDuoxingDel)
+    {
+      DelKey(dbobject::kDbHash, key);
+    }
+    return false;
+  }
+  auto it = hash_.find(key);
+  if (it == hash_.end())
+  {
+    return false;
+  }
+  auto iter = it->second->find(field);
+  if (iter == it->second->end())
   {
-    if (iter->second.empty())
+    return false;
+  }
+  *value = iter->second;
+  return true;
+}
+
+long Database::ZCard(const std::string &key)
+{
+  if (JudgeKeyExpiredTime(dbobject::kDbZSet, key))
+  {
+    if (del_mode_ & dbobject::kDuoxingDel)
     {
-      return DbStatus::NotFound("nil").ToString();
+      DelKey(dbobject::kDbZSet, key);
     }
-    std::string res = iter->second.back();
-    iter->second.pop_back();
+    return -1;
+  }
+  auto it = zset_.find(key);
+  return it == zset_.end() ? -1 : static_cast<long>(it->second->GetLength());
+}
+
+size_t Database::GetValueSize(const int type, const std::string &key)
+{
+  if (JudgeKeyExpiredTime(type, key))
+  {
+    return 0;
+  }
+  switch (type)
+  {
+  case dbobject::kDbList:
+  {
+    auto it = list_.find(key);
+    return it == list_.end() ? 0 : it->second.size();
+  }
+  case dbobject::kDbHash:
+  {
+    auto it = hash_.find(key);
+    return it == hash_.end() ? 0 : it->second->size();
+  }
+  case dbobject::kDbSet:
+  {
+    auto it = set_.find(key);
+    return it == set_.end() ? 0 : it->second->size();
+  }
+  case dbobject::kDbZSet:
+  {
+    auto it = zset_.find(key);
+    return it == zset_.end() ? 0 : it->second->GetLength();
+  }
+  default:
+    return 0;
+  }
+}
+
+void Database::AddStats(std::map<std::string, uint64_t> *stats) const
+{
+  (*stats)["keys_string"] += string_.size();
+  (*stats)["keys_list"] += list_.size();
+  (*stats)["keys_hash"] += hash_.size();
+  (*stats)["keys_set"] += set_.size();
+  (*stats)["keys_zset"] += zset_.size();
+  if (vlog_)
+  {
+    (*stats)["vlog_keys"] += string_vlog_.size();
+    (*stats)["vlog_files"] += vlog_->FileCount();
+    (*stats)["vlog_bytes"] += vlog_->TotalBytes();
+    (*stats)["vlog_dead_bytes"] += vlog_->DeadBytes();
+    (*stats)["vlog_cache_hits"] += vlog_->CacheHits();
+    (*stats)["vlog_cache_misses"] += vlog_->CacheMisses();
+  }
+  (*stats)["lent_values"] += lent_.size();
+  (*stats)["read_snapshots"] += read_snapshots_.size();
+  for (auto &it : read_snapshots_)
+  {
+    (*stats)["read_snapshot_versions"] += it.second->Versions();
+  }
+}
+
+const std::string Database::RPopList(const std::string &key)
+{
+  std::string res;
+  if (RPop(key, &res))
+  {
     return res;
   }
-  else
+  return list_.find(key) != list_.end() ? DbStatus::NotFound("nil").ToString()
+                                        : dbreply::kKeyNotFound;
+}
+
+bool Database::RPop(const std::string &key, std::string *value)
+{
+  if (JudgeKeyExpiredTime(dbobject::kDbList, key))
+  {
+    if (del_mode_ & dbobject::kDuoxingDel)
+    {
+      DelKey(dbobject::kDbList, key);
+    }
+    return false;
+  }
+  auto lock = PrepareWrite(dbobject::kDbList, key);
+  auto iter = list_.find(key);
+  if (iter == list_.end() || iter->second.empty())
+  {
+    return false;
+  }
+  *value = std::move(iter->second.back());
+  iter->second.pop_back();
+  ++dirty_;
+  return true;
+}
+
+bool Database::ZRangeAggregate(const std::string &key, RangeSpec &range,
+                               RangeAggregate *agg)
+{
+  auto it = zset_.find(key);
+  if (it == zset_.end() || JudgeKeyExpiredTime(dbobject::kDbZSet, key))
+  {
+    return false;
+  }
+  *agg = it->second->GetAggregateInRange(range);
+  return true;
+}
+
+// 带权分值，inf * 0得到的nan按0处理
+static double WeightedScore(double score, double weight)
+{
+  double value = score * weight;
+  return std::isnan(value) ? 0 : value;
+}
+
+static double AggregateScore(double acc, double value, const int aggregate)
+{
+  if (aggregate == dbobject::kAggregateMin)
+  {
+    return std::min(acc, value);
+  }
+  if (aggregate == dbobject::kAggregateMax)
   {
-    return DbStatus::NotFound("key").ToString();
+    return std::max(acc, value);
   }
+  double sum = acc + value;
+  return std::isnan(sum) ? 0 : sum;
 }
 
-std::string Database::InterceptString(const std::string &ss, int p1, int p2)
+long Database::ZSetStore(const int op, const std::string &dest,
+                         const std::vector<std::string> &keys,
+                         const std::vector<double> &weights,
+                         const int aggregate)
 {
-  return ss.substr(std::min(p1, p2), abs(p2 - p1));
-}
\ No newline at end of file
+  // 输入集合及其权重，不存在或已过期的key为nullptr
+  std::vector<std::pair<Skiplist *, double>> inputs;
+  inputs.reserve(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i)
+  {
+    Skiplist *list = nullptr;
+    auto it = zset_.find(keys[i]);
+    if (it != zset_.end() &&
+        !JudgeKeyExpiredTime(dbobject::kDbZSet, keys[i]))
+    {
+      list = it->second.get();
+    }
+    inputs.emplace_back(list, weights.empty() ? 1.0 : weights[i]);
+  }
+
+  std::vector<std::pair<std::string, double>> elems;
+  // 差集按第一个集合的顺序产生结果，本身已有序
+  bool sorted = false;
+  if (op == dbobject::kZSetUnion)
+  {
+    std::unordered_map<std::string, double> acc;
+    size_t max_len = 0;
+    for (auto &input : inputs)
+    {
+      if (input.first != nullptr)
+      {
+        max_len = std::max(max_len, input.first->GetLength());
+      }
+    }
+    acc.reserve(max_len);
+    for (auto &input : inputs)
+    {
+      if (input.first == nullptr)
+      {
+        continue;
+      }
+      for (auto node = input.first->First(); node;
+           node = node->levels_[0]->forward_)
+      {
+        double value = WeightedScore(node->score_, input.second);
+        auto res = acc.emplace(node->obj_, value);
+        if (!res.second)
+        {
+          res.first->second =
+              AggregateScore(res.first->second, value, aggregate);
+        }
+      }
+    }
+    elems.reserve(acc.size());
+    for (auto &member : acc)
+    {
+      elems.emplace_back(member.first, member.second);
+    }
+  }
+  else if (op == dbobject::kZSetInter)
+  {
+    bool has_empty = inputs.empty();
+    for (auto &input : inputs)
+    {
+      if (input.first == nullptr || input.first->GetLength() == 0)
+      {
+        has_empty = true;
+      }
+    }
+    if (!has_empty)
+    {
+      // 遍历最小的集合，在其余集合中探测成员
+      std::sort(inputs.begin(), inputs.end(),
+                [](const std::pair<Skiplist *, double> &a,
+                   const std::pair<Skiplist *, double> &b) {
+                  return a.first->GetLength() < b.first->GetLength();
+                });
+      elems.reserve(inputs[0].first->GetLength());
+      for (auto node = inputs[0].first->First(); node;
+           node = node->levels_[0]->forward_)
+      {
+        double value = WeightedScore(node->score_, inputs[0].second);
+        size_t j = 1;
+        for (; j < inputs.size(); ++j)
+        {
+          double score;
+          if (!inputs[j].first->GetScore(node->obj_, &score))
+          {
+            break;
+          }
+          value = AggregateScore(
+              value, WeightedScore(score, inputs[j].second), aggregate);
+        }
+        if (j == inputs.size())
+        {
+          elems.emplace_back(node->obj_, value);
+        }
+      }
+    }
+  }
+  else if (op == dbobject::kZSetDiff)
+  {
+    sorted = true;
+    if (!inputs.empty() && inputs[0].first != nullptr)
+    {
+      for (auto node = inputs[0].first->First(); node;
+           node = node->levels_[0]->forward_)
+      {
+        size_t j = 1;
+        for (; j < inputs.size(); ++j)
+        {
+          double score;
+          if (inputs[j].first != nullptr &&
+              inputs[j].first->GetScore(node->obj_, &score))
+          {
+            break;
+          }
+        }
+        if (j == inputs.size())
+        {
+          elems.emplace_back(node->obj_, node->score_);
+        }
+      }
+    }
+  }
+
+  long len = elems.size();
+  if (len == 0)
+  {
+    DelKey(dbobject::kDbZSet, dest);
+    return 0;
+  }
+  if (!sorted)
+  {
+    std::sort(elems.begin(), elems.end(),
+              [](const std::pair<std::string, double> &a,
+                 const std::pair<std::string, double> &b) {
+                return a.second < b.second ||
+                       (a.second == b.second && a.first < b.first);
+              });
+  }
+  auto lock = PrepareWrite(dbobject::kDbZSet, dest);
+  zset_[dest] = Skiplist::BuildFromSorted(std::move(elems));
+  zset_expire_.erase(dest);
+  ++dirty_;
+  return len;
+}
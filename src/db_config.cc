@@ -0,0 +1,185 @@
+#include "db_config.h"
+
+#include <strings.h>
+
+#include <cstdlib>
+#include <sstream>
+
+bool DbConfig::ParseArgs(int argc, char *argv[], std::string *err)
+{
+  for (int i = 1; i < argc; i += 2)
+  {
+    std::string name = argv[i];
+    if (i + 1 >= argc)
+    {
+      *err = "missing value for " + name;
+      return false;
+    }
+    const char *value = argv[i + 1];
+
+    if (name == "--port")
+    {
+      port_ = atoi(value);
+      if (port_ <= 0 || port_ > 65535)
+      {
+        *err = "invalid port";
+        return false;
+      }
+    }
+    else if (name == "--save")
+    {
+      // 形如 "3600 1 300 100"，空串表示不自动保存
+      save_rules_.clear();
+      std::istringstream ss(value);
+      long seconds;
+      long long changes;
+      while (ss >> seconds)
+      {
+        if (!(ss >> changes) || seconds <= 0 || changes <= 0)
+        {
+          *err = "save must be pairs of <seconds> <changes>";
+          return false;
+        }
+        save_rules_.emplace_back(seconds, changes);
+      }
+      if (!ss.eof())
+      {
+        *err = "save must be pairs of <seconds> <changes>";
+        return false;
+      }
+    }
+    else if (name == "--snapshot-mode")
+    {
+      if (strcasecmp(value, "fork") == 0)
+      {
+        snapshot_mode_ = dbobject::kSnapshotFork;
+      }
+      else if (strcasecmp(value, "thread") == 0)
+      {
+        snapshot_mode_ = dbobject::kSnapshotThread;
+      }
+      else
+      {
+        *err = "snapshot-mode must be fork or thread";
+        return false;
+      }
+    }
+    else if (name == "--rdbcompression")
+    {
+      rdb_compression_ = strcasecmp(value, "yes") == 0;
+    }
+    else if (name == "--rdb-rate-limit")
+    {
+      rdb_rate_limit_ = strtoull(value, nullptr, 10);
+    }
+    else if (name == "--rdb-sync-bytes")
+    {
+      rdb_sync_bytes_ = strtoull(value, nullptr, 10);
+    }
+    else if (name == "--engine")
+    {
+      engine_ = value;
+    }
+    else if (name == "--vlog-min-size")
+    {
+      vlog_min_size_ = strtoull(value, nullptr, 10);
+    }
+    else if (name == "--vlog-dir")
+    {
+      vlog_dir_ = value;
+    }
+    else if (name == "--vlog-cache-size")
+    {
+      vlog_cache_size_ = strtoull(value, nullptr, 10);
+    }
+    else if (name == "--async-load")
+    {
+      async_load_ = strcasecmp(value, "yes") == 0;
+    }
+    else if (name == "--worker-threads")
+    {
+      worker_threads_ = atoi(value);
+      if (worker_threads_ < 0)
+      {
+        *err = "invalid worker-threads";
+        return false;
+      }
+    }
+    else if (name == "--offload-min-size")
+    {
+      offload_min_size_ = strtoull(value, nullptr, 10);
+    }
+    else if (name == "--slice-min-size")
+    {
+      slice_min_size_ = strtoull(value, nullptr, 10);
+    }
+    else if (name == "--slice-us")
+    {
+      slice_us_ = atoll(value);
+      if (slice_us_ <= 0)
+      {
+        *err = "invalid slice-us";
+        return false;
+      }
+    }
+    else if (name == "--handover-socket")
+    {
+      handover_socket_ = value;
+    }
+    else if (name == "--upgrade-from")
+    {
+      upgrade_from_ = value;
+    }
+    else if (name == "--handover-image-dir")
+    {
+      handover_image_dir_ = value;
+    }
+    else if (name == "--appendonly")
+    {
+      appendonly_ = strcasecmp(value, "yes") == 0;
+    }
+    else if (name == "--appendfilename")
+    {
+      aof_path_ = value;
+    }
+    else if (name == "--appendfsync")
+    {
+      if (strcasecmp(value, "always") == 0)
+      {
+        aof_fsync_ = dbobject::kAofFsyncAlways;
+      }
+      else if (strcasecmp(value, "everysec") == 0)
+      {
+        aof_fsync_ = dbobject::kAofFsyncEverysec;
+      }
+      else if (strcasecmp(value, "no") == 0)
+      {
+        aof_fsync_ = dbobject::kAofFsyncNo;
+      }
+      else
+      {
+        *err = "appendfsync must be always, everysec or no";
+        return false;
+      }
+    }
+    else if (name == "--auto-aof-rewrite-percentage")
+    {
+      aof_rewrite_percentage_ = atoi(value);
+      if (aof_rewrite_percentage_ < 0)
+      {
+        *err = "invalid auto-aof-rewrite-percentage";
+        return false;
+      }
+    }
+    else if (name == "--auto-aof-rewrite-min-size")
+    {
+      aof_rewrite_min_size_ = strtoull(value, nullptr, 10);
+    }
+    else
+    {
+      *err = "unknown option " + name;
+      return false;
+    }
+  }
+  return true;
+}
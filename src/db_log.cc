@@ -0,0 +1,29 @@
+#include "db_log.h"
+
+#include <cstdio>
+
+namespace dblog
+{
+    static LogOutput g_output;
+    static LogLevel g_min_level = kInfo;
+
+    void SetLogOutput(const LogOutput &output, LogLevel min_level)
+    {
+        g_output = output;
+        g_min_level = min_level;
+    }
+
+    bool LevelEnabled(LogLevel level) { return level >= g_min_level; }
+
+    LogLine::~LogLine()
+    {
+        if (g_output)
+        {
+            g_output(level_, file_, line_, stream_.str());
+            return;
+        }
+        static const char *const kNames[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+        fprintf(stderr, "%s %s - %s:%d\n", kNames[level_],
+                stream_.str().c_str(), file_, line_);
+    }
+} // namespace dblog
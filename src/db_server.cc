@@ -1,23 +1,69 @@
 #include "db_server.h"
 
+#include <boost/any.hpp>
+#include <fcntl.h>
 #include <muduo/base/Logging.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include <cerrno>
 #include <cfloat>
-#include <fstream>
+#include <cmath>
+#include <cstring>
 #include <sstream>
+#include <unordered_set>
 
 #include "db_obj.h"
 #include "db_status.h"
+#include "glob.h"
+#include "handover.h"
+#include "rdb.h"
+#include "rdb_loader.h"
+#include "skiplist.h"
 static const int kMicroSecondsPerSecond = 1000 * 1000;
 static const int kMilliSecondsPerSecond = 1000;
 static const int kMicroSecondsPerMilliSecond = 1000;
 
+// 修改数据的命令，执行后追加到AOF
+static const std::unordered_set<std::string> kWriteCommands = {
+    "set",  "pexpire", "expire", "pexpireat",   "rpush",       "rpop",
+    "hset", "sadd",    "zadd",   "zunionstore", "zinterstore", "zdiffstore"};
+// AOF写出失败时写命令的响应
+static const std::string kAofWriteError =
+    DbStatus::IOError("aof write error, write commands are refused")
+        .ToString();
+
 DbServer::DbServer(muduo::net::EventLoop *loop,
-                   const muduo::net::InetAddress &localAddr)
-    : loop_(loop),
+                   const muduo::net::InetAddress &localAddr,
+                   const DbConfig &config)
+    : last_save_(Timestamp::invalid()),
+      last_save_try_(Timestamp::invalid()),
+      last_save_ok_(true),
+      last_save_duration_us_(-1),
+      last_fork_us_(-1),
+      dirty_at_last_save_(0),
+      dirty_at_save_start_(0),
+      config_(config),
+      snapshot_done_(false),
+      snapshot_ok_(false),
+      rdb_child_(-1),
+      rdb_progress_(nullptr),
+      aof_flush_pending_(false),
+      aof_write_error_(false),
+      aof_rewrite_child_(-1),
+      offloaded_reads_(0),
+      offloaded_in_flight_(0),
+      slices_pending_(false),
+      sliced_reads_(0),
+      slices_(0),
+      slice_max_us_(0),
+      loop_(loop),
       server_(loop_, localAddr, "DbServer"),
-      last_save_(Timestamp::invalid())
+      handover_fd_(-1)
 {
   server_.setConnectionCallback(
       std::bind(&DbServer::OnConnection, this, std::placeholders::_1));
@@ -26,64 +72,364 @@ DbServer::DbServer(muduo::net::EventLoop *loop,
                 std::placeholders::_2, std::placeholders::_3));
   // 绑定命令处理函数
   cmd_dict_.insert(std::make_pair(
-      "set", std::bind(&DbServer::SetCommand, this, std::placeholders::_1)));
+      "set", std::bind(&DbServer::SetCommand, this, std::placeholders::_1,
+                       std::placeholders::_2)));
   cmd_dict_.insert(std::make_pair(
-      "get", std::bind(&DbServer::GetCommand, this, std::placeholders::_1)));
+      "get", std::bind(&DbServer::GetCommand, this, std::placeholders::_1,
+                       std::placeholders::_2)));
   cmd_dict_.insert(std::make_pair(
       "pexpire",
-      std::bind(&DbServer::PExpiredCommand, this, std::placeholders::_1)));
+      std::bind(&DbServer::PExpiredCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
   cmd_dict_.insert(std::make_pair(
       "expire",
-      std::bind(&DbServer::ExpiredCommand, this, std::placeholders::_1)));
+      std::bind(&DbServer::ExpiredCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
+  cmd_dict_.insert(std::make_pair(
+      "pexpireat",
+      std::bind(&DbServer::PExpireAtCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
   cmd_dict_.insert(std::make_pair(
       "bgsave",
-      std::bind(&DbServer::BgsaveCommand, this, std::placeholders::_1)));
+      std::bind(&DbServer::BgsaveCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
+  cmd_dict_.insert(std::make_pair(
+      "bgrewriteaof",
+      std::bind(&DbServer::BgRewriteAofCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
+  cmd_dict_.insert(std::make_pair(
+      "info", std::bind(&DbServer::InfoCommand, this, std::placeholders::_1,
+                        std::placeholders::_2)));
+  cmd_dict_.insert(std::make_pair(
+      "lastsave",
+      std::bind(&DbServer::LastSaveCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
+  cmd_dict_.insert(std::make_pair(
+      "ping", std::bind(&DbServer::PingCommand, this, std::placeholders::_1,
+                        std::placeholders::_2)));
   cmd_dict_.insert(std::make_pair(
       "select",
-      std::bind(&DbServer::SelectCommand, this, std::placeholders::_1)));
+      std::bind(&DbServer::SelectCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
   cmd_dict_.insert(std::make_pair(
       "rpush",
-      std::bind(&DbServer::RpushCommand, this, std::placeholders::_1)));
+      std::bind(&DbServer::RpushCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
   cmd_dict_.insert(std::make_pair(
-      "rpop", std::bind(&DbServer::RpopCommand, this, std::placeholders::_1)));
+      "rpop", std::bind(&DbServer::RpopCommand, this, std::placeholders::_1,
+                        std::placeholders::_2)));
   cmd_dict_.insert(std::make_pair(
-      "hset", std::bind(&DbServer::HSetCommand, this, std::placeholders::_1)));
+      "hset", std::bind(&DbServer::HSetCommand, this, std::placeholders::_1,
+                        std::placeholders::_2)));
   cmd_dict_.insert(std::make_pair(
-      "hget", std::bind(&DbServer::HGetCommand, this, std::placeholders::_1)));
+      "hget", std::bind(&DbServer::HGetCommand, this, std::placeholders::_1,
+                        std::placeholders::_2)));
   cmd_dict_.insert(std::make_pair(
       "hgetall",
-      std::bind(&DbServer::HGetAllCommand, this, std::placeholders::_1)));
+      std::bind(&DbServer::HGetAllCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
   cmd_dict_.insert(std::make_pair(
-      "sadd", std::bind(&DbServer::SAddCommand, this, std::placeholders::_1)));
+      "sadd", std::bind(&DbServer::SAddCommand, this, std::placeholders::_1,
+                        std::placeholders::_2)));
   cmd_dict_.insert(std::make_pair(
       "smembers",
-      std::bind(&DbServer::SMembersCommand, this, std::placeholders::_1)));
+      std::bind(&DbServer::SMembersCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
   cmd_dict_.insert(std::make_pair(
-      "zadd", std::bind(&DbServer::ZAddCommand, this, std::placeholders::_1)));
+      "zadd", std::bind(&DbServer::ZAddCommand, this, std::placeholders::_1,
+                        std::placeholders::_2)));
   cmd_dict_.insert(std::make_pair(
       "zcard",
-      std::bind(&DbServer::ZCardCommand, this, std::placeholders::_1)));
+      std::bind(&DbServer::ZCardCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
   cmd_dict_.insert(std::make_pair(
       "zrange",
-      std::bind(&DbServer::ZRangeCommand, this, std::placeholders::_1)));
+      std::bind(&DbServer::ZRangeCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
   cmd_dict_.insert(std::make_pair(
       "zcount",
-      std::bind(&DbServer::ZCountCommand, this, std::placeholders::_1)));
+      std::bind(&DbServer::ZCountCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
+  cmd_dict_.insert(std::make_pair(
+      "zsumrange",
+      std::bind(&DbServer::ZSumRangeCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
+  cmd_dict_.insert(std::make_pair(
+      "zavgrange",
+      std::bind(&DbServer::ZAvgRangeCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
   cmd_dict_.insert(std::make_pair(
       "zgetall",
-      std::bind(&DbServer::ZGetAllCommand, this, std::placeholders::_1)));
+      std::bind(&DbServer::ZGetAllCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
+  cmd_dict_.insert(std::make_pair(
+      "zunionstore",
+      std::bind(&DbServer::ZUnionStoreCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
+  cmd_dict_.insert(std::make_pair(
+      "zinterstore",
+      std::bind(&DbServer::ZInterStoreCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
+  cmd_dict_.insert(std::make_pair(
+      "zdiffstore",
+      std::bind(&DbServer::ZDiffStoreCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
+  cmd_dict_.insert(std::make_pair(
+      "scan", std::bind(&DbServer::ScanCommand, this, std::placeholders::_1,
+                        std::placeholders::_2)));
+  cmd_dict_.insert(std::make_pair(
+      "hscan", std::bind(&DbServer::HScanCommand, this, std::placeholders::_1,
+                         std::placeholders::_2)));
+  cmd_dict_.insert(std::make_pair(
+      "sscan", std::bind(&DbServer::SScanCommand, this, std::placeholders::_1,
+                         std::placeholders::_2)));
+  cmd_dict_.insert(std::make_pair(
+      "zscan", std::bind(&DbServer::ZScanCommand, this, std::placeholders::_1,
+                         std::placeholders::_2)));
+  cmd_dict_.insert(std::make_pair(
+      "client",
+      std::bind(&DbServer::ClientCommand, this, std::placeholders::_1,
+                std::placeholders::_2)));
+  // 写出进度放在共享内存中，fork出的rdb子进程更新后父进程可以直接读到
+  void *shared = mmap(nullptr, sizeof(RdbProgress), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED)
+  {
+    LOG_FATAL << "mmap rdb progress failed: " << strerror(errno);
+  }
+  rdb_progress_ = new (shared) RdbProgress();
+  rdb_progress_->in_progress_ = false;
   InitDB();
+  if (config_.worker_threads_ > 0)
+  {
+    workers_.reset(new muduo::ThreadPool("DbWorker"));
+    workers_->start(config_.worker_threads_);
+  }
+  // 启动时载入的数据视为已保存
+  last_save_ = Timestamp::now();
+  dirty_at_last_save_ = TotalDirty();
+  loop_->runEvery(0.1, std::bind(&DbServer::ServerCron, this));
+
+  if (!config_.handover_socket_.empty())
+  {
+    handover_fd_ = handover::Listen(config_.handover_socket_);
+    if (handover_fd_ >= 0)
+    {
+      handover_channel_.reset(new muduo::net::Channel(loop_, handover_fd_));
+      handover_channel_->setReadCallback(
+          std::bind(&DbServer::HandleHandover, this));
+      handover_channel_->enableReading();
+    }
+  }
+}
+
+DbServer::~DbServer()
+{
+  // 工作线程读取的值属于各库，先于库停止
+  if (workers_)
+  {
+    workers_->stop();
+  }
+  if (snapshot_thread_.joinable())
+  {
+    snapshot_thread_.join();
+  }
+  rdb_progress_->~RdbProgress();
+  munmap(rdb_progress_, sizeof(RdbProgress));
+  if (handover_channel_)
+  {
+    handover_channel_->disableAll();
+    handover_channel_->remove();
+  }
+  if (handover_fd_ >= 0)
+  {
+    close(handover_fd_);
+  }
 }
 
 void DbServer::InitDB()
 {
-  // 初始化16个库
+  // 初始化16个库，定时删除使用事件循环的定时器
+  // 引擎的时间戳不依赖muduo，按微秒数转换
+  auto run_at = [this](const Timestamp &when, const std::function<void()> &cb) {
+    loop_->runAt(muduo::Timestamp(when.microSecondsSinceEpoch()), cb);
+  };
+  std::vector<StorageEngine *> dbs;
   for (int i = 0; i < kDefaultDbNum; ++i)
   {
-    database_.emplace_back(std::make_unique<Database>());
+    database_.emplace_back(
+        StorageEngine::Create(config_, i, kDefaultDbNum, run_at));
+    if (!database_.back())
+    {
+      LOG_FATAL << "create storage engine " << config_.engine_ << " failed";
+    }
+    dbs.push_back(database_.back().get());
+  }
+  if (config_.snapshot_mode_ == dbobject::kSnapshotThread &&
+      !database_[0]->SupportsThreadSnapshot())
+  {
+    LOG_WARN << "storage engine does not support snapshot-mode thread, "
+                "use fork";
+    config_.snapshot_mode_ = dbobject::kSnapshotFork;
+  }
+
+  bool aof_exists = false;
+  if (config_.appendonly_)
+  {
+    aof_.reset(new Aof(config_.aof_path_, config_.aof_fsync_));
+    struct stat st;
+    aof_exists = stat(config_.aof_path_.c_str(), &st) == 0 && st.st_size > 0;
+    // 热升级时镜像与AOF一致，直接载入镜像更快
+    if (aof_exists && config_.restart_image_.empty())
+    {
+      // AOF记录了全部写命令，有AOF时只从AOF恢复；
+      // 重放用的会话只记录AOF中select切换到的库
+      ClientSession replay;
+      if (!aof_->Replay(
+              [&](const VecS &argv) { ReplayAofCommand(replay, argv); }))
+      {
+        LOG_FATAL << "replay aof file failed";
+      }
+      if (!aof_->Open())
+      {
+        LOG_FATAL << "open aof file failed";
+      }
+      return;
+    }
+  }
+
+  // 启动时载入所有库(同步或在后台)，之后select只切换当前库
+  std::string path = config_.restart_image_;
+  if (path.empty())
+  {
+    char buf[1024]{0};
+    path = getcwd(buf, 1024);
+    path += "/dump.rdb";
+  }
+  // 新建的AOF要写入rdb中的全部数据，这种情况只能同步载入
+  if (config_.async_load_ && !(aof_ && !aof_exists))
+  {
+    loader_.reset(new AsyncRdbLoader(dbs));
+    auto ready = [this]() {
+      loop_->queueInLoop([this]() {
+        if (loader_)
+        {
+          loader_->MergeReady();
+        }
+      });
+    };
+    if (loader_->Start(path, ready,
+                       std::bind(&DbServer::DoneAsyncLoad, this,
+                                 std::placeholders::_1)))
+    {
+      LOG_INFO << "loading " << path << " in background";
+    }
+    else
+    {
+      loader_.reset();
+      if (!config_.restart_image_.empty())
+      {
+        unlink(path.c_str());
+      }
+    }
+  }
+  else
+  {
+    RdbLoader loader(dbs);
+    bool loaded = loader.Load(path);
+    if (!config_.restart_image_.empty())
+    {
+      unlink(path.c_str());
+      if (!loaded)
+      {
+        LOG_FATAL << "load restart image " << path << " failed";
+      }
+    }
+  }
+
+  if (aof_)
+  {
+    if (!aof_->Open())
+    {
+      LOG_FATAL << "open aof file failed";
+    }
+    if (aof_exists)
+    {
+      return;
+    }
+    // 新建的AOF先写入rdb中已有的数据，否则下次启动只重放AOF会丢失这些数据
+    for (int i = 0; i < kDefaultDbNum; ++i)
+    {
+      database_[i]->AofRewrite(
+          [this, i](const VecS &argv) { aof_->Feed(i, argv); });
+      aof_->Flush();
+    }
+  }
+}
+
+void DbServer::DoneAsyncLoad(bool ok)
+{
+  if (!config_.restart_image_.empty())
+  {
+    unlink(config_.restart_image_.c_str());
+  }
+  if (!ok)
+  {
+    LOG_ERROR << "some rdb sections are corrupted and were skipped";
+  }
+  // 可能在载入器的成员函数中调用，下一轮事件循环再释放
+  loop_->queueInLoop([this]() { loader_.reset(); });
+}
+
+void DbServer::EnsureLoaded(const int db, const std::string &cmd)
+{
+  // 命令 -> 访问的值类型的位掩码
+  static const int kAllTypes = (1 << (dbobject::kDbZSet + 1)) - 1;
+  static const std::unordered_map<std::string, int> kCommandTypes = {
+      {"set", 1 << dbobject::kDbString},
+      {"get", 1 << dbobject::kDbString},
+      {"pexpire", kAllTypes},
+      {"expire", kAllTypes},
+      {"pexpireat", kAllTypes},
+      {"rpush", 1 << dbobject::kDbList},
+      {"rpop", 1 << dbobject::kDbList},
+      {"hset", 1 << dbobject::kDbHash},
+      {"hget", 1 << dbobject::kDbHash},
+      {"hgetall", 1 << dbobject::kDbHash},
+      {"sadd", 1 << dbobject::kDbSet},
+      {"smembers", 1 << dbobject::kDbSet},
+      {"zadd", 1 << dbobject::kDbZSet},
+      {"zcard", 1 << dbobject::kDbZSet},
+      {"zrange", 1 << dbobject::kDbZSet},
+      {"zcount", 1 << dbobject::kDbZSet},
+      {"zsumrange", 1 << dbobject::kDbZSet},
+      {"zavgrange", 1 << dbobject::kDbZSet},
+      {"zgetall", 1 << dbobject::kDbZSet},
+      {"zunionstore", 1 << dbobject::kDbZSet},
+      {"zinterstore", 1 << dbobject::kDbZSet},
+      {"zdiffstore", 1 << dbobject::kDbZSet},
+      {"scan", kAllTypes},
+      {"hscan", 1 << dbobject::kDbHash},
+      {"sscan", 1 << dbobject::kDbSet},
+      {"zscan", 1 << dbobject::kDbZSet}};
+
+  if (cmd == "bgsave" || cmd == "bgrewriteaof")
+  {
+    loader_->EnsureAllLoaded();
+    return;
+  }
+  auto it = kCommandTypes.find(cmd);
+  if (it == kCommandTypes.end())
+  {
+    return;
+  }
+  for (int type = dbobject::kDbString; type <= dbobject::kDbZSet; ++type)
+  {
+    if (it->second & (1 << type))
+    {
+      loader_->EnsureLoaded(db, type);
+    }
   }
-  db_idx_ = 0;
-  database_[db_idx_]->RdbLoad(db_idx_);
 }
 
 void DbServer::OnConnection(const muduo::net::TcpConnectionPtr &conn)
@@ -91,161 +437,984 @@ void DbServer::OnConnection(const muduo::net::TcpConnectionPtr &conn)
   LOG_INFO << "StoreServer - " << conn->peerAddress().toIpPort() << " -> "
            << conn->localAddress().toIpPort() << " is "
            << (conn->connected() ? "UP" : "DOWN");
+  if (conn->connected())
+  {
+    auto session = std::make_shared<ClientSession>();
+    session->stats_.since_ = Timestamp::now();
+    conn->setContext(session);
+    sessions_[conn->name()] = std::move(session);
+  }
+  else
+  {
+    // 未exec的事务和排队的命令随会话丢弃，分片命令在下一片时结束
+    sessions_.erase(conn->name());
+  }
+}
+
+DbServer::ClientSession &DbServer::Session(
+    const muduo::net::TcpConnectionPtr &conn)
+{
+  return **boost::any_cast<std::shared_ptr<ClientSession>>(
+      conn->getMutableContext());
 }
 
 void DbServer::OnMessage(const muduo::net::TcpConnectionPtr &conn,
                          muduo::net::Buffer *buf, muduo::Timestamp timestamp)
 {
   auto msg = buf->retrieveAllAsString();
-  auto res = ParseMsg(msg);
-  conn->send(res);
+  // 有命令在工作线程中或分片执行时，后续命令等它的响应发出后再处理
+  ClientSession &session = Session(conn);
+  if (session.busy_)
+  {
+    session.queued_.emplace_back(
+        Timestamp(timestamp.microSecondsSinceEpoch()), std::move(msg));
+    ++session.stats_.queued_;
+    return;
+  }
+  HandleMessage(conn, msg);
 }
 
-void DbServer::Start()
+void DbServer::HandleMessage(const muduo::net::TcpConnectionPtr &conn,
+                             const std::string &msg)
 {
-  server_.start();
+  Timestamp start = Timestamp::now();
+  ClientSession &session = Session(conn);
+  ++session.stats_.cmds_;
+  std::string res;
+  bool replied = false;
+  if (!HandleTransaction(conn, msg, &res))
+  {
+    // 交给工作线程或分片执行的命令由Resume发送响应
+    replied = Offload(conn, msg) || StartSliced(conn, msg) ||
+              SendString(conn, msg);
+    if (!replied)
+    {
+      res = Execute(session, msg);
+    }
+  }
+  session.stats_.usec_ += Timestamp::now().microSecondsSinceEpoch() -
+                          start.microSecondsSinceEpoch();
+  if (!replied)
+  {
+    Reply(conn, res);
+  }
+}
 
-  LOG_INFO << "StoreServer started at " << server_.ipPort();
+bool DbServer::SendString(const muduo::net::TcpConnectionPtr &conn,
+                          const std::string &msg)
+{
+  // 与ParseMsg相同，get只取第一个参数
+  std::istringstream ss(msg);
+  std::string cmd, key;
+  ss >> cmd >> key;
+  if (cmd != "get" || key.empty())
+  {
+    return false;
+  }
+  int db = Session(conn).db_;
+  if (loader_)
+  {
+    EnsureLoaded(db, cmd);
+  }
+  // 值不可变，Reply返回前key不会被修改；没有立即写出的部分由Reply复制
+  std::shared_ptr<const std::string> value;
+  if (!database_[db]->GetSharedString(key, &value) || value->empty())
+  {
+    return false;
+  }
+  Reply(conn, *value);
+  return true;
 }
 
-void DbServer::RdbSave()
+void DbServer::Reply(const muduo::net::TcpConnectionPtr &conn,
+                     const std::string &res)
 {
-  pid_t pid = fork();
-  if (pid == 0)
+  if (aof_flush_pending_)
   {
-    LOG_INFO << "this is child process";
+    ClientSession &session = Session(conn);
+    if (session.pending_count_ == 0)
+    {
+      pending_replies_.push_back(conn);
+    }
+    session.pending_reply_ += res;
+    ++session.pending_count_;
+  }
+  else
+  {
+    conn->send(res);
+  }
+}
 
-    char buf[1024]{0};
-    std::string path = getcwd(buf, 1024);
-    assert(!path.empty());
-    path += "/dump.rdb";
+// hgetall/smembers/zgetall/zrange的响应，值为空时返回错误
+static std::string ReadReply(const std::string &cmd, std::string &&res)
+{
+  if (!res.empty())
+  {
+    return std::move(res);
+  }
+  return cmd == "hgetall" ? DbStatus::IOError("Empty Content").ToString()
+                          : DbStatus::NotFound("Empty Content").ToString();
+}
+
+/*
+ * 解析读取整个值的命令hgetall/smembers/zgetall/zrange，key为GetKey的格式，
+ * zrange为key:low@high。参数个数不对时返回false，由命令自己返回错误
+ */
+static bool ParseWholeRead(const std::string &msg, std::string *cmd,
+                           int *type, std::string *key)
+{
+  std::istringstream ss(msg);
+  std::string low, high, extra;
+  ss >> *cmd >> *key;
+  if (*cmd == "hgetall")
+  {
+    *type = dbobject::kDbHash;
+  }
+  else if (*cmd == "smembers")
+  {
+    *type = dbobject::kDbSet;
+  }
+  else if (*cmd == "zgetall")
+  {
+    *type = dbobject::kDbZSet;
+  }
+  else if (*cmd == "zrange" && ss >> low >> high)
+  {
+    *type = dbobject::kDbZSet;
+    *key += ':' + low + '@' + high;
+  }
+  else
+  {
+    return false;
+  }
+  return !key->empty() && !(ss >> extra);
+}
+
+bool DbServer::Offload(const muduo::net::TcpConnectionPtr &conn,
+                       const std::string &msg)
+{
+  if (!workers_)
+  {
+    return false;
+  }
+  std::string cmd, key;
+  int type;
+  if (!ParseWholeRead(msg, &cmd, &type, &key))
+  {
+    return false;
+  }
+  ClientSession &session = Session(conn);
+  if (loader_)
+  {
+    EnsureLoaded(session.db_, cmd);
+  }
+  PreparedRead read = database_[session.db_]->PrepareRead(
+      type, key, config_.offload_min_size_);
+  if (!read)
+  {
+    return false;
+  }
+  session.busy_ = true;
+  ++offloaded_reads_;
+  ++offloaded_in_flight_;
+  auto done = std::move(read.done_);
+  workers_->run([this, conn, cmd, read, done]() {
+    std::string res = read.read_();
+    // 值在事件循环中归还，此后主线程才可原地修改
+    loop_->queueInLoop([this, conn, cmd, res, done]() mutable {
+      done();
+      DoneOffload(conn, cmd, std::move(res));
+    });
+  });
+  return true;
+}
+
+void DbServer::DoneOffload(const muduo::net::TcpConnectionPtr &conn,
+                           const std::string &cmd, std::string &&res)
+{
+  --offloaded_in_flight_;
+  Resume(conn, ReadReply(cmd, std::move(res)));
+}
+
+bool DbServer::StartSliced(const muduo::net::TcpConnectionPtr &conn,
+                           const std::string &msg)
+{
+  if (config_.slice_min_size_ == 0)
+  {
+    return false;
+  }
+  SlicedRead job;
+  if (!ParseWholeRead(msg, &job.cmd_, &job.type_, &job.key_))
+  {
+    return false;
+  }
+  job.db_ = Session(conn).db_;
+  if (loader_)
+  {
+    EnsureLoaded(job.db_, job.cmd_);
+  }
+  StorageEngine *db = database_[job.db_].get();
+  job.low_ = -DBL_MAX;
+  job.high_ = DBL_MAX;
+  if (job.cmd_ == "zrange")
+  {
+    // 范围不是数字时由命令自己返回错误
+    size_t p1 = job.key_.rfind(':');
+    size_t p2 = job.key_.rfind('@');
+    char *end1, *end2;
+    job.low_ = strtod(job.key_.c_str() + p1 + 1, &end1);
+    job.high_ = strtod(job.key_.c_str() + p2 + 1, &end2);
+    if (end1 != job.key_.c_str() + p2 || *end2 != '\0')
+    {
+      return false;
+    }
+    job.key_.resize(p1);
+  }
+  if (db->GetValueSize(job.type_, job.key_) < config_.slice_min_size_)
+  {
+    return false;
+  }
+  job.conn_ = conn;
+  if (job.type_ == dbobject::kDbZSet && job.low_ != -DBL_MAX)
+  {
+    // 从分值大于low的第一个成员开始，分值等于low的成员由RunSlice跳过
+    job.cursor_.started_ = true;
+    job.cursor_.score_ = job.low_;
+  }
+  ClientSession &session = Session(conn);
+  session.busy_ = true;
+  ++session.stats_.sliced_;
+  ++sliced_reads_;
+  sliced_.push_back(std::move(job));
+  if (!slices_pending_)
+  {
+    slices_pending_ = true;
+    loop_->queueInLoop(std::bind(&DbServer::RunSlices, this));
+  }
+  return true;
+}
 
-    std::ofstream out;
-    out.open(path, std::ios::out | std::ios::trunc | std::ios::binary);
-    LOG_INFO << "rdb文件路径:" << path;
-    if (!out.is_open())
+void DbServer::RunSlices()
+{
+  slices_pending_ = false;
+  // 本轮只执行已在队列中的命令，其间新加入的下一轮再执行
+  for (size_t n = sliced_.size(); n > 0; --n)
+  {
+    SlicedRead job = std::move(sliced_.front());
+    sliced_.pop_front();
+    if (!job.conn_->connected())
+    {
+      continue;
+    }
+    if (!RunSlice(job))
+    {
+      sliced_.push_back(std::move(job));
+      continue;
+    }
+    if (job.type_ == dbobject::kDbZSet && !job.res_.empty())
     {
-      LOG_FATAL << "RDB持久化失败...";
+      job.res_.pop_back();
     }
+    Resume(job.conn_, ReadReply(job.cmd_, std::move(job.res_)));
+  }
+  // 排到下一轮事件循环，先处理其间到达的其他连接的命令
+  if (!sliced_.empty() && !slices_pending_)
+  {
+    slices_pending_ = true;
+    loop_->queueInLoop(std::bind(&DbServer::RunSlices, this));
+  }
+}
 
-    std::string str;
-    // 存储RDB头
-    str = SaveHead();
-    for (int i = 0; i < kDefaultDbNum; ++i)
+bool DbServer::RunSlice(SlicedRead &job)
+{
+  // 每批访问的元素个数，每批之后检查是否用完这一片的时间
+  const size_t kBatchItems = 256;
+  int64_t start = Timestamp::now().microSecondsSinceEpoch();
+  int64_t elapsed = 0;
+  StorageEngine *db = database_[job.db_].get();
+  std::vector<ValueItem> items;
+  bool done = false;
+  while (!done && elapsed < config_.slice_us_)
+  {
+    items.clear();
+    // 每片从上一片返回的最后一个元素之后重新定位，片与片之间不持有任何引用
+    done = db->ScanValue(job.type_, job.key_, &job.cursor_, kBatchItems,
+                         &items);
+    // 格式与GetKey相同
+    for (auto &item : items)
     {
-      if (database_[i]->GetKeySize() == 0)
+      if (job.type_ == dbobject::kDbHash)
       {
-        continue;
+        job.res_ += item.member_ + ':' + item.value_ + ' ';
       }
-      str += SaveSelectDB(i);
-      // String
-      if (database_[i]->GetKeyStringSize() != 0)
+      else if (job.type_ == dbobject::kDbSet)
       {
-        str += SaveType(dbobject::kDbString);
-        auto obj = database_[i]->GetKeyStringObj();
-        for (auto it = obj.begin(); it != obj.end(); it++)
-        {
-          str += SaveExpiredTime(
-              database_[i]->GetKeyExpiredTime(dbobject::kDbString, it->first));
-          str += SaveKV(it->first, it->second);
-        }
+        job.res_ += item.member_ + ' ';
       }
-      // List
-      if (database_[i]->GetKeyListSize() != 0)
+      else
       {
-        str += SaveType(dbobject::kDbList);
-        auto obj = database_[i]->GetKeyListObj();
-        for (auto it = obj.begin(); it != obj.end(); it++)
+        if (item.score_ >= job.high_)
         {
-          str += SaveExpiredTime(
-              database_[i]->GetKeyExpiredTime(dbobject::kDbList, it->first));
-          auto iter = it->second.begin();
-          std::string tmp = '!' + std::to_string(it->second.size());
-          for (; iter != it->second.end(); iter++)
-          {
-            tmp += '!' + std::to_string(iter->size()) + '$' + iter->c_str();
-          }
-          str += '!' + std::to_string(it->first.size()) + '#' +
-                 it->first.c_str() + tmp;
+          done = true;
+          break;
         }
+        if (item.score_ > job.low_)
+        {
+          job.res_ += item.member_ + ':' + std::to_string(item.score_) + '\n';
+        }
+      }
+    }
+    elapsed = Timestamp::now().microSecondsSinceEpoch() - start;
+  }
+  ++slices_;
+  slice_max_us_ = std::max(slice_max_us_, elapsed);
+  ClientStats &stats = Session(job.conn_).stats_;
+  ++stats.slices_;
+  stats.usec_ += elapsed;
+  return done;
+}
+
+void DbServer::Resume(const muduo::net::TcpConnectionPtr &conn,
+                      std::string &&res)
+{
+  if (!conn->connected())
+  {
+    return;
+  }
+  ClientSession &session = Session(conn);
+  session.busy_ = false;
+  Reply(conn, res);
+  // 依次处理排队的命令，又有命令交给工作线程或分片执行时其余的继续排队
+  while (!session.busy_ && !session.queued_.empty())
+  {
+    int64_t wait = Timestamp::now().microSecondsSinceEpoch() -
+                   session.queued_.front().first.microSecondsSinceEpoch();
+    session.stats_.max_wait_us_ =
+        std::max(session.stats_.max_wait_us_, wait);
+    std::string msg = std::move(session.queued_.front().second);
+    session.queued_.pop_front();
+    HandleMessage(conn, msg);
+  }
+}
+
+std::string DbServer::Execute(ClientSession &session, const std::string &msg)
+{
+  if (aof_write_error_)
+  {
+    std::istringstream ss(msg);
+    std::string cmd;
+    ss >> cmd;
+    if (kWriteCommands.count(cmd) != 0)
+    {
+      return kAofWriteError;
+    }
+  }
+  if (!aof_)
+  {
+    return ParseMsg(session, msg, nullptr);
+  }
+  // AOF记录实际执行的参数，不是收到的原始命令：多余的参数不执行也不记录
+  std::vector<VecS> executed;
+  auto res = ParseMsg(session, msg, &executed);
+  bool fed = false;
+  for (auto &argv : executed)
+  {
+    fed = FeedAof(session.db_, argv) || fed;
+  }
+  if (fed && !aof_flush_pending_)
+  {
+    // 本轮事件循环处理完所有连接的数据后，用一次write写出所有写命令
+    aof_flush_pending_ = true;
+    loop_->queueInLoop(std::bind(&DbServer::FlushAof, this));
+  }
+  return res;
+}
+
+bool DbServer::HandleTransaction(const muduo::net::TcpConnectionPtr &conn,
+                                 const std::string &msg, std::string *res)
+{
+  std::istringstream ss(msg);
+  std::string cmd, arg;
+  ss >> cmd;
+  bool has_arg = static_cast<bool>(ss >> arg);
+  std::unique_ptr<MultiState> &multi = Session(conn).multi_;
+
+  if (cmd == "multi")
+  {
+    if (has_arg)
+    {
+      *res = dbreply::kParameterError;
+    }
+    else if (multi)
+    {
+      *res = DbStatus::IOError("multi calls can not be nested").ToString();
+    }
+    else
+    {
+      multi.reset(new MultiState());
+      *res = dbreply::kOk;
+    }
+    return true;
+  }
+  if (cmd == "exec" || cmd == "discard")
+  {
+    if (!multi)
+    {
+      *res = DbStatus::IOError(cmd + " without multi").ToString();
+      return true;
+    }
+    MultiState state = std::move(*multi);
+    multi.reset();
+    if (cmd == "discard")
+    {
+      *res = dbreply::kOk;
+    }
+    else if (state.aborted_)
+    {
+      *res = DbStatus::IOError(
+                 "transaction discarded because of previous errors")
+                 .ToString();
+    }
+    else if (state.cmds_.empty())
+    {
+      *res = dbreply::kOk;
+    }
+    else
+    {
+      // 依次执行，响应按顺序合并为一个，没有以换行结尾的响应之后补一个换行
+      res->clear();
+      if (aof_)
+      {
+        // 事务中的写命令在AOF中整体重放或丢弃
+        aof_->BeginMulti();
       }
-      // Hash
-      if (database_[i]->GetKeyHashSize() != 0)
+      for (size_t i = 0; i < state.cmds_.size(); ++i)
       {
-        str += SaveType(dbobject::kDbHash);
-        auto obj = database_[i]->GetKeyHashObj();
-        auto it = obj.begin();
-        for (; it != obj.end(); it++)
+        if (i > 0 && (res->empty() || res->back() != '\n'))
         {
-          str += SaveExpiredTime(
-              database_[i]->GetKeyExpiredTime(dbobject::kDbHash, it->first));
-          auto iter = it->second.begin();
-          std::string tmp = '!' + std::to_string(it->second.size());
-          for (; iter != it->second.end(); iter++)
-          {
-            tmp += SaveKV(iter->first, iter->second);
-          }
-          str += '!' + std::to_string(it->first.size()) + '#' +
-                 it->first.c_str() + tmp;
+          *res += '\n';
         }
+        *res += Execute(Session(conn), state.cmds_[i]);
       }
-      // Set
-      if (database_[i]->GetKeySetSize() != 0)
+      if (aof_)
       {
-        str += SaveType(dbobject::kDbSet);
-        auto it = database_[i]->GetKeySetObj().begin();
-        for (; it != database_[i]->GetKeySetObj().end(); it++)
+        aof_->EndMulti();
+      }
+    }
+    return true;
+  }
+  if (!multi)
+  {
+    return false;
+  }
+
+  // 事务中：命令名在排队时检查，其余错误在exec时由各命令返回
+  if (cmd_dict_.find(cmd) == cmd_dict_.end())
+  {
+    multi->aborted_ = true;
+    *res = dbreply::kCommandNotFound;
+  }
+  else
+  {
+    multi->cmds_.push_back(msg);
+    *res = dbreply::kQueued;
+  }
+  return true;
+}
+
+bool DbServer::FeedAof(const int db, const VecS &argv)
+{
+  if (argv.empty() || kWriteCommands.find(argv[0]) == kWriteCommands.end())
+  {
+    return false;
+  }
+
+  const std::string &cmd = argv[0];
+  if (cmd == "expire" || cmd == "pexpire" || cmd == "pexpireat")
+  {
+    if (argv.size() < 2)
+    {
+      return false;
+    }
+    const std::string &key = argv[1];
+    for (int type = dbobject::kDbString; type <= dbobject::kDbZSet; ++type)
+    {
+      Timestamp expire = database_[db]->GetKeyExpiredTime(type, key);
+      if (expire != Timestamp::invalid())
+      {
+        aof_->Feed(db, {"pexpireat", key,
+                        std::to_string(expire.microSecondsSinceEpoch() /
+                                       kMicroSecondsPerMilliSecond)});
+        return true;
+      }
+    }
+    return false;
+  }
+
+  aof_->Feed(db, argv);
+  return true;
+}
+
+void DbServer::ReplayAofCommand(ClientSession &session, const VecS &argv)
+{
+  auto it = cmd_dict_.find(argv[0]);
+  if (it == cmd_dict_.end())
+  {
+    LOG_WARN << "unknown command in aof file: " << argv[0];
+    return;
+  }
+  it->second(session, VecS(argv));
+}
+
+void DbServer::FlushAof()
+{
+  aof_flush_pending_ = false;
+  bool ok = aof_->Flush();
+  if (!ok)
+  {
+    aof_write_error_ = true;
+  }
+  for (auto &conn : pending_replies_)
+  {
+    ClientSession &session = Session(conn);
+    if (conn->connected())
+    {
+      if (ok)
+      {
+        conn->send(session.pending_reply_);
+      }
+      else
+      {
+        // 暂存的响应对应的命令没有写入AOF，不能回复成功
+        for (size_t i = 0; i < session.pending_count_; ++i)
         {
-          str += SaveExpiredTime(
-              database_[i]->GetKeyExpiredTime(dbobject::kDbSet, it->first));
-          auto iter = it->second.begin();
-          std::string tmp = '!' + std::to_string(it->second.size());
-          for (; iter != it->second.end(); iter++)
-          {
-            tmp += '!' + std::to_string(iter->size()) + '$' + iter->c_str();
-          }
-          str += '!' + std::to_string(it->first.size()) + '#' +
-                 it->first.c_str() + tmp;
+          conn->send(kAofWriteError);
         }
       }
-      // ZSet
-      if (database_[i]->GetKeyZSetSize() != 0)
+    }
+    session.pending_reply_.clear();
+    session.pending_count_ = 0;
+  }
+  pending_replies_.clear();
+}
+
+void DbServer::ServerCron()
+{
+  int status;
+  pid_t pid;
+  // 回收所有已退出的后台子进程，rdb子进程也在这里回收，避免成为僵尸进程
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+  {
+    if (pid == aof_rewrite_child_)
+    {
+      DoneRewriteAof(status);
+    }
+    else if (pid == rdb_child_)
+    {
+      rdb_child_ = -1;
+      DoneRdbSave(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    else
+    {
+      LOG_INFO << "background child " << pid << " exited with status "
+               << (WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    }
+  }
+
+  if (aof_write_error_ && aof_->Flush())
+  {
+    aof_write_error_ = false;
+    LOG_INFO << "aof write recovered, accepting write commands again";
+  }
+
+  Timestamp now = Timestamp::now();
+  for (auto &db : database_)
+  {
+    db->Cron(now);
+  }
+
+  if (snapshot_thread_.joinable() && snapshot_done_)
+  {
+    snapshot_thread_.join();
+    for (auto &db : database_)
+    {
+      db->SnapshotEnd();
+    }
+    DoneRdbSave(snapshot_ok_);
+  }
+
+  // 后台载入期间数据不完整，不自动保存或重写
+  if (loader_)
+  {
+    return;
+  }
+
+  if (!rdb_progress_->in_progress_ && aof_rewrite_child_ == -1 &&
+      CheckSaveCondition())
+  {
+    RdbSave();
+  }
+
+  if (aof_ && aof_rewrite_child_ == -1 && !rdb_progress_->in_progress_ &&
+      config_.aof_rewrite_percentage_ > 0 &&
+      aof_->NeedRewrite(config_.aof_rewrite_percentage_,
+                        config_.aof_rewrite_min_size_))
+  {
+    LOG_INFO << "starting automatic aof rewrite, size " << aof_->Size()
+             << " base size " << aof_->BaseSize();
+    RewriteAof();
+  }
+}
+
+bool DbServer::RewriteAof()
+{
+  if (!aof_ || aof_rewrite_child_ != -1)
+  {
+    return false;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    std::string tmp_path = aof_->RewriteTmpPath(getpid());
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+      LOG_ERROR << "AOF重写失败: " << strerror(errno);
+      _exit(1);
+    }
+
+    // 累积到kRewriteBufferSize再写出，内存占用与数据量无关
+    static const size_t kRewriteBufferSize = 1 << 20;
+    std::string buf;
+    bool ok = true;
+    auto write_buf = [&]() {
+      ok = ok && Aof::WriteFully(fd, buf.data(), buf.size());
+      buf.clear();
+    };
+    for (int i = 0; i < kDefaultDbNum; ++i)
+    {
+      if (database_[i]->GetKeySize() == 0)
       {
-        str += SaveType(dbobject::kDbZSet);
-        auto it = database_[i]->GetKeyZSetObj().begin();
-        for (; it != database_[i]->GetKeyZSetObj().end(); it++)
+        continue;
+      }
+      Aof::AppendRecord(&buf, {"select", std::to_string(i + 1)});
+      database_[i]->AofRewrite([&](const VecS &argv) {
+        Aof::AppendRecord(&buf, argv);
+        if (buf.size() >= kRewriteBufferSize)
         {
-          str += SaveExpiredTime(
-              database_[i]->GetKeyExpiredTime(dbobject::kDbZSet, it->first));
-          std::string tmp = '!' + std::to_string(it->second->GetLength());
-          RangeSpec spec(DBL_MIN, DBL_MAX);
-          std::vector<SkiplistNode *> vecSkip(it->second->GetNodeInRange(spec));
-          for (int j = 0; j < vecSkip.size(); j++)
-          {
-            tmp += SaveKV(vecSkip[j]->obj_, std::to_string(vecSkip[j]->score_));
-          }
-          str += '!' + std::to_string(it->first.size()) + '#' +
-                 it->first.c_str() + tmp;
+          write_buf();
         }
-      }
-      str.append("EOF");
-      out.write(str.c_str(), str.size());
+      });
+    }
+    write_buf();
+
+    if (!ok || fdatasync(fd) != 0 || close(fd) != 0)
+    {
+      LOG_ERROR << "AOF重写失败: " << strerror(errno);
+      unlink(tmp_path.c_str());
+      _exit(1);
     }
-    out.close();
-    exit(0);
+    _exit(0);
   }
   else if (pid > 0)
   {
-    LOG_INFO << "this is parent process, the child process pid is " << pid;
+    LOG_INFO << "aof rewrite started by child " << pid;
+    aof_rewrite_child_ = pid;
+    // fork之后的写命令不在子进程的数据中，需记入重写缓冲区
+    aof_->StartRewrite();
+    return true;
+  }
+  LOG_ERROR << "fork error";
+  return false;
+}
+
+void DbServer::DoneRewriteAof(int status)
+{
+  std::string tmp_path = aof_->RewriteTmpPath(aof_rewrite_child_);
+  aof_rewrite_child_ = -1;
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+  {
+    aof_->FinishRewrite(tmp_path);
   }
   else
   {
-    LOG_ERROR << "fork error";
+    LOG_ERROR << "aof rewrite child failed";
+    unlink(tmp_path.c_str());
+    aof_->AbortRewrite();
   }
 }
 
+void DbServer::Start()
+{
+  server_.start();
+
+  LOG_INFO << "StoreServer started at " << server_.ipPort();
+}
+
+void DbServer::ResetRdbProgress()
+{
+  uint64_t keys = 0;
+  for (auto &db : database_)
+  {
+    keys += db->GetKeySize();
+  }
+  rdb_progress_->start_us_ = Timestamp::now().microSecondsSinceEpoch();
+  rdb_progress_->keys_total_ = keys;
+  rdb_progress_->keys_saved_ = 0;
+  rdb_progress_->bytes_written_ = 0;
+  rdb_progress_->in_progress_ = true;
+}
+
+uint64_t DbServer::TotalDirty() const
+{
+  uint64_t dirty = 0;
+  for (auto &db : database_)
+  {
+    dirty += db->GetDirty();
+  }
+  return dirty;
+}
+
+bool DbServer::RdbSave()
+{
+  if (rdb_progress_->in_progress_)
+  {
+    LOG_INFO << "rdb save already in progress";
+    return false;
+  }
+  last_save_try_ = Timestamp::now();
+  dirty_at_save_start_ = TotalDirty();
+  if (config_.snapshot_mode_ == dbobject::kSnapshotThread)
+  {
+    RdbSaveInThread();
+    return true;
+  }
+
+  ResetRdbProgress();
+  Timestamp fork_start = Timestamp::now();
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    LOG_INFO << "this is child process";
+    _exit(WriteRdbFile(false) ? 0 : 1);
+  }
+  else if (pid > 0)
+  {
+    last_fork_us_ = Timestamp::now().microSecondsSinceEpoch() -
+                    fork_start.microSecondsSinceEpoch();
+    LOG_INFO << "this is parent process, the child process pid is " << pid
+             << ", fork took " << last_fork_us_ << "us";
+    rdb_child_ = pid;
+    return true;
+  }
+  LOG_ERROR << "fork error";
+  rdb_progress_->in_progress_ = false;
+  last_save_ok_ = false;
+  return false;
+}
+
+void DbServer::DoneRdbSave(bool ok)
+{
+  rdb_progress_->in_progress_ = false;
+  last_save_duration_us_ = Timestamp::now().microSecondsSinceEpoch() -
+                           rdb_progress_->start_us_;
+  last_save_ok_ = ok;
+  if (ok)
+  {
+    // 保存期间的修改不在这次保存的数据中，仍计入下次
+    last_save_ = Timestamp::now();
+    dirty_at_last_save_ = dirty_at_save_start_;
+    LOG_INFO << "background saving finished in " << last_save_duration_us_
+             << "us";
+  }
+  else
+  {
+    LOG_ERROR << "background saving failed";
+  }
+}
+
+void DbServer::RdbSaveInThread()
+{
+  if (snapshot_thread_.joinable())
+  {
+    LOG_INFO << "snapshot already in progress";
+    return;
+  }
+  ResetRdbProgress();
+  Timestamp now = Timestamp::now();
+  for (auto &db : database_)
+  {
+    db->SnapshotBegin(now);
+  }
+  snapshot_done_ = false;
+  snapshot_thread_ = std::thread([this]() {
+    snapshot_ok_ = WriteRdbFile(true);
+    snapshot_done_ = true;
+  });
+}
+
+void DbServer::HandleHandover()
+{
+  int conn = accept4(handover_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+  if (conn < 0)
+  {
+    return;
+  }
+  std::string reply;
+  int listen_fd = -1;
+  if (!handover::ReadRequest(conn))
+  {
+    reply = "err bad request";
+  }
+  else if (rdb_child_ != -1 || aof_rewrite_child_ != -1 ||
+           snapshot_thread_.joinable())
+  {
+    reply = "err background save or rewrite in progress, retry later";
+  }
+  else if ((listen_fd = handover::FindTcpSocket(config_.port_, true)) < 0)
+  {
+    reply = "err listening socket not found";
+  }
+  else
+  {
+    // 写镜像期间事件循环阻塞，不再有写命令，镜像即为最终状态
+    std::string image;
+    if (loader_)
+    {
+      loader_->EnsureAllLoaded();
+    }
+    if (aof_)
+    {
+      aof_->Flush();
+    }
+    if (WriteRestartImage(&image))
+    {
+      reply = "ok " + image;
+    }
+    else
+    {
+      reply = "err write restart image failed";
+    }
+  }
+
+  bool ok = reply.compare(0, 3, "ok ") == 0;
+  if (handover::Reply(conn, reply, ok ? listen_fd : -1) && ok)
+  {
+    LOG_INFO << "handed over to the new process, exiting";
+    loop_->quit();
+  }
+  else
+  {
+    LOG_WARN << "handover failed: " << reply;
+  }
+  close(conn);
+}
+
+bool DbServer::WriteRestartImage(std::string *path)
+{
+  *path = config_.handover_image_dir_ + "/kvdb-" +
+          std::to_string(config_.port_) + '-' + std::to_string(getpid()) +
+          ".rdb";
+  int fd = open(path->c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+  {
+    LOG_ERROR << "open restart image " << *path << " error: "
+              << strerror(errno);
+    return false;
+  }
+  // 镜像在内存中只存在片刻，不压缩、不限速、不落盘
+  RdbWriter writer(fd);
+  writer.WriteHeader();
+  for (int i = 0; i < kDefaultDbNum; ++i)
+  {
+    if (database_[i]->GetKeySize() == 0)
+    {
+      continue;
+    }
+    database_[i]->RdbSave(&writer, i);
+  }
+  writer.WriteEof();
+  bool ok = close(fd) == 0 && writer.Ok();
+  if (!ok)
+  {
+    unlink(path->c_str());
+  }
+  return ok;
+}
+
+bool DbServer::WriteRdbFile(bool snapshot)
+{
+  char buf[1024]{0};
+  std::string dir = getcwd(buf, 1024);
+  assert(!dir.empty());
+  std::string path = dir + "/dump.rdb";
+  // 先写临时文件，落盘后再原子地替换dump.rdb，写入中途崩溃不会破坏旧文件
+  std::string tmp_path = dir + "/temp-" + std::to_string(getpid()) +
+                         (snapshot ? "-snapshot" : "") + ".rdb";
+
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  LOG_INFO << "rdb文件路径:" << path;
+  if (fd < 0)
+  {
+    LOG_ERROR << "RDB持久化失败: " << strerror(errno);
+    return false;
+  }
+
+  // 直接从各个字典序列化，内存占用以写缓冲区大小为界
+  RdbWriter writer(fd);
+  writer.SetCompression(config_.rdb_compression_);
+  writer.SetRateLimit(config_.rdb_rate_limit_);
+  writer.SetSyncInterval(config_.rdb_sync_bytes_);
+  writer.SetProgress(rdb_progress_);
+  // 存储RDB头
+  writer.WriteHeader();
+  for (int i = 0; i < kDefaultDbNum; ++i)
+  {
+    if (snapshot)
+    {
+      database_[i]->SnapshotSave(&writer, i);
+      continue;
+    }
+    if (database_[i]->GetKeySize() == 0)
+    {
+      continue;
+    }
+    database_[i]->RdbSave(&writer, i);
+  }
+  writer.WriteEof();
+
+  bool ok = writer.Ok() && fsync(fd) == 0;
+  if (ok && config_.rdb_sync_bytes_ > 0)
+  {
+    // 已全部落盘，快照文件不再占用页缓存
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+  // 在线程中写时失败也要关闭文件，不能依赖进程退出
+  ok = close(fd) == 0 && ok;
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0)
+  {
+    LOG_ERROR << "RDB持久化失败: " << strerror(errno);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  LOG_INFO << "rdb saved";
+  return true;
+}
+
 // 解析命令
-std::string DbServer::ParseMsg(const std::string &msg)
+std::string DbServer::Dispatch(const CommandFunc &func, ClientSession &session,
+                               VecS &&argv, std::vector<VecS> *executed)
+{
+  if (executed)
+  {
+    executed->push_back(argv);
+  }
+  return func(session, std::move(argv));
+}
+
+std::string DbServer::ParseMsg(ClientSession &session, const std::string &msg,
+                               std::vector<VecS> *executed)
 {
   std::string res;
   std::istringstream ss(msg);
@@ -256,19 +1425,23 @@ std::string DbServer::ParseMsg(const std::string &msg)
   {
     return DbStatus::NotFound(" ").ToString();
   }
+  if (loader_)
+  {
+    EnsureLoaded(session.db_, cmd);
+  }
   if (cmd == "set")
   {
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
       ss >> key;
       ss >> objKey;
       VecS vs = {cmd, key, objKey};
-      res = it->second(std::move(vs));
+      res = Dispatch(it->second, session, std::move(vs), executed);
     }
   }
   else if (cmd == "get")
@@ -276,13 +1449,13 @@ std::string DbServer::ParseMsg(const std::string &msg)
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
       ss >> key;
       VecS vs = {cmd, key};
-      res = it->second(std::move(vs));
+      res = Dispatch(it->second, session, std::move(vs), executed);
     }
   }
   else if (cmd == "pexpire")
@@ -290,42 +1463,43 @@ std::string DbServer::ParseMsg(const std::string &msg)
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
       ss >> key;
       ss >> objKey;
       VecS vs = {cmd, key, objKey};
-      res = it->second(std::move(vs));
+      res = Dispatch(it->second, session, std::move(vs), executed);
     }
   }
-  else if (cmd == "expire")
+  else if (cmd == "expire" || cmd == "pexpireat")
   {
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
       ss >> key;
       ss >> objKey;
       VecS vs = {cmd, key, objKey};
-      res = it->second(std::move(vs));
+      res = Dispatch(it->second, session, std::move(vs), executed);
     }
   }
-  else if (cmd == "bgsave")
+  else if (cmd == "bgsave" || cmd == "bgrewriteaof" || cmd == "info" ||
+           cmd == "lastsave" || cmd == "ping")
   {
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
       VecS vs = {cmd};
-      res = it->second(std::move(vs));
+      res = Dispatch(it->second, session, std::move(vs), executed);
     }
   }
   else if (cmd == "select")
@@ -333,13 +1507,13 @@ std::string DbServer::ParseMsg(const std::string &msg)
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
       ss >> key;
       VecS vs = {cmd, key};
-      res = it->second(std::move(vs));
+      res = Dispatch(it->second, session, std::move(vs), executed);
     }
   }
   else if (cmd == "rpush")
@@ -347,7 +1521,7 @@ std::string DbServer::ParseMsg(const std::string &msg)
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
@@ -355,7 +1529,7 @@ std::string DbServer::ParseMsg(const std::string &msg)
       while (ss >> objKey)
       {
         VecS vs = {cmd, key, objKey};
-        res = it->second(std::move(vs));
+        res = Dispatch(it->second, session, std::move(vs), executed);
       }
     }
   }
@@ -364,13 +1538,13 @@ std::string DbServer::ParseMsg(const std::string &msg)
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
       ss >> key;
       VecS vs = {cmd, key};
-      res = it->second(std::move(vs));
+      res = Dispatch(it->second, session, std::move(vs), executed);
     }
   }
   else if (cmd == "hset")
@@ -378,7 +1552,7 @@ std::string DbServer::ParseMsg(const std::string &msg)
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
@@ -386,7 +1560,7 @@ std::string DbServer::ParseMsg(const std::string &msg)
       ss >> objKey;
       ss >> objValue;
       VecS vs = {cmd, key, objKey, objValue};
-      res = it->second(std::move(vs));
+      res = Dispatch(it->second, session, std::move(vs), executed);
     }
   }
   else if (cmd == "hget")
@@ -394,14 +1568,14 @@ std::string DbServer::ParseMsg(const std::string &msg)
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
       ss >> key;
       ss >> objKey;
       VecS vs = {cmd, key, objKey};
-      res = it->second(std::move(vs));
+      res = Dispatch(it->second, session, std::move(vs), executed);
     }
   }
   else if (cmd == "hgetall")
@@ -409,13 +1583,13 @@ std::string DbServer::ParseMsg(const std::string &msg)
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
       ss >> key;
       VecS vs = {cmd, key};
-      res = it->second(std::move(vs));
+      res = Dispatch(it->second, session, std::move(vs), executed);
     }
   }
   else if (cmd == "sadd")
@@ -423,14 +1597,14 @@ std::string DbServer::ParseMsg(const std::string &msg)
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
       ss >> key;
       ss >> objKey;
       VecS vs = {cmd, key, objKey};
-      res = it->second(std::move(vs));
+      res = Dispatch(it->second, session, std::move(vs), executed);
     }
   }
   else if (cmd == "smembers")
@@ -438,13 +1612,13 @@ std::string DbServer::ParseMsg(const std::string &msg)
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
       ss >> key;
       VecS vs = {cmd, key};
-      res = it->second(std::move(vs));
+      res = Dispatch(it->second, session, std::move(vs), executed);
     }
   }
   else if (cmd == "zadd")
@@ -452,7 +1626,7 @@ std::string DbServer::ParseMsg(const std::string &msg)
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
@@ -460,7 +1634,7 @@ std::string DbServer::ParseMsg(const std::string &msg)
       ss >> objKey;
       ss >> objValue;
       VecS vs = {cmd, key, objKey, objValue};
-      res = it->second(std::move(vs));
+      res = Dispatch(it->second, session, std::move(vs), executed);
     }
   }
   else if (cmd == "zcard")
@@ -468,13 +1642,13 @@ std::string DbServer::ParseMsg(const std::string &msg)
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
       ss >> key;
       VecS vs = {cmd, key};
-      res = it->second(std::move(vs));
+      res = Dispatch(it->second, session, std::move(vs), executed);
     }
   }
   else if (cmd == "zrange")
@@ -482,7 +1656,7 @@ std::string DbServer::ParseMsg(const std::string &msg)
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
@@ -490,15 +1664,15 @@ std::string DbServer::ParseMsg(const std::string &msg)
       ss >> objKey;   // range Start
       ss >> objValue; // range end
       VecS vs = {cmd, key, objKey, objValue};
-      res = it->second(std::move(vs));
+      res = Dispatch(it->second, session, std::move(vs), executed);
     }
   }
-  else if (cmd == "zcount")
+  else if (cmd == "zcount" || cmd == "zsumrange" || cmd == "zavgrange")
   {
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
@@ -506,7 +1680,7 @@ std::string DbServer::ParseMsg(const std::string &msg)
       ss >> objKey;   // range Start
       ss >> objValue; // range end
       VecS vs = {cmd, key, objKey, objValue};
-      res = it->second(std::move(vs));
+      res = Dispatch(it->second, session, std::move(vs), executed);
     }
   }
   else if (cmd == "zgetall")
@@ -514,199 +1688,408 @@ std::string DbServer::ParseMsg(const std::string &msg)
     auto it = cmd_dict_.find(cmd);
     if (it == cmd_dict_.end())
     {
-      return DbStatus::NotFound("command").ToString();
+      return dbreply::kCommandNotFound;
     }
     else
     {
       ss >> key;
       VecS vs = {cmd, key};
-      res = it->second(std::move(vs));
+      res = Dispatch(it->second, session, std::move(vs), executed);
+    }
+  }
+  else if (cmd == "zunionstore" || cmd == "zinterstore" ||
+           cmd == "zdiffstore" || cmd == "scan" || cmd == "hscan" ||
+           cmd == "sscan" || cmd == "zscan" || cmd == "client")
+  {
+    auto it = cmd_dict_.find(cmd);
+    if (it == cmd_dict_.end())
+    {
+      return dbreply::kCommandNotFound;
+    }
+    else
+    {
+      VecS vs = {cmd};
+      while (ss >> objKey)
+      {
+        vs.emplace_back(objKey);
+      }
+      res = Dispatch(it->second, session, std::move(vs), executed);
     }
   }
   else
   {
-    return DbStatus::NotFound("command").ToString();
+    return dbreply::kCommandNotFound;
   }
   return res;
 }
 
-std::string DbServer::SetCommand(VecS &&argv)
+std::string DbServer::SetCommand(ClientSession &session, VecS &&argv)
 {
+  StorageEngine *db = database_[session.db_].get();
   if (argv.size() != 3)
   {
-    return DbStatus::IOError("Parameter error").ToString();
+    return dbreply::kParameterError;
   }
   // 处理过期时间
-  bool expired =
-      database_[db_idx_]->JudgeKeyExpiredTime(dbobject::kDbString, argv[1]);
+  bool expired = db->JudgeKeyExpiredTime(dbobject::kDbString, argv[1]);
   if (expired)
   {
-    database_[db_idx_]->DelKey(dbobject::kDbString, argv[1]);
+    db->DelKey(dbobject::kDbString, argv[1]);
   }
 
-  bool res = database_[db_idx_]->AddKey(dbobject::kDbString, argv[1], argv[2],
-                                        dbobject::kDefaultObjValue);
+  bool res = db->AddKey(dbobject::kDbString, argv[1], argv[2],
+                        dbobject::kDefaultObjValue);
 
-  return res ? DbStatus::Ok().ToString()
+  return res ? dbreply::kOk
              : DbStatus::IOError("set error").ToString();
 }
 
-std::string DbServer::GetCommand(VecS &&argv)
+std::string DbServer::GetCommand(ClientSession &session, VecS &&argv)
 {
+  StorageEngine *db = database_[session.db_].get();
   if (argv.size() != 2)
   {
-    return DbStatus::IOError("Parameter error").ToString();
+    return dbreply::kParameterError;
   }
   // 处理过期时间
   // TODO: 删除策略， 是不是应该放到database里？
   // bool expired =
-  //     database_[db_idx_]->JudgeKeyExpiredTime(dbobject::kDbString, argv[1]);
+  //     db->JudgeKeyExpiredTime(dbobject::kDbString, argv[1]);
   // if (expired) {
-  //   database_[db_idx_]->DelKey(dbobject::kDbString, argv[1]);
+  //   db->DelKey(dbobject::kDbString, argv[1]);
   //   return DbStatus::IOError("Empty Content").ToString();
   // }
 
-  std::string res = database_[db_idx_]->GetKey(dbobject::kDbString, argv[1]);
+  std::string res = db->GetKey(dbobject::kDbString, argv[1]);
 
   return res.empty() ? DbStatus::IOError("Empty Content").ToString() : res;
 }
 
-std::string DbServer::PExpiredCommand(VecS &&argv)
+std::string DbServer::PExpiredCommand(ClientSession &session, VecS &&argv)
 {
+  StorageEngine *db = database_[session.db_].get();
   if (argv.size() != 3)
   {
-    return DbStatus::IOError("Parameter error").ToString();
+    return dbreply::kParameterError;
   }
   // kDbString
-  bool res = database_[db_idx_]->SetPExpireTime(dbobject::kDbString, argv[1],
-                                                atof(argv[2].c_str()));
+  bool res = db->SetPExpireTime(dbobject::kDbString, argv[1],
+                                atof(argv[2].c_str()));
   if (!res)
   {
     // kDbList
-    res = database_[db_idx_]->SetPExpireTime(dbobject::kDbList, argv[1],
-                                             atof(argv[2].c_str()));
+    res = db->SetPExpireTime(dbobject::kDbList, argv[1], atof(argv[2].c_str()));
   }
   if (!res)
   {
     // kDbHash
-    res = database_[db_idx_]->SetPExpireTime(dbobject::kDbHash, argv[1],
-                                             atof(argv[2].c_str()));
+    res = db->SetPExpireTime(dbobject::kDbHash, argv[1], atof(argv[2].c_str()));
   }
   if (!res)
   {
     // kDbSet
-    res = database_[db_idx_]->SetPExpireTime(dbobject::kDbSet, argv[1],
-                                             atof(argv[2].c_str()));
+    res = db->SetPExpireTime(dbobject::kDbSet, argv[1], atof(argv[2].c_str()));
   }
   if (!res)
   {
     // kDbZSet
-    res = database_[db_idx_]->SetPExpireTime(dbobject::kDbZSet, argv[1],
-                                             atof(argv[2].c_str()));
+    res = db->SetPExpireTime(dbobject::kDbZSet, argv[1], atof(argv[2].c_str()));
   }
 
-  return res ? DbStatus::Ok().ToString()
+  return res ? dbreply::kOk
              : DbStatus::IOError("pExpire error").ToString();
 }
 
-std::string DbServer::ExpiredCommand(VecS &&argv)
+std::string DbServer::ExpiredCommand(ClientSession &session, VecS &&argv)
 {
+  StorageEngine *db = database_[session.db_].get();
   if (argv.size() != 3)
   {
-    return DbStatus::IOError("Parameter error").ToString();
+    return dbreply::kParameterError;
   }
   // kDbString
-  bool res = database_[db_idx_]->SetPExpireTime(
+  bool res = db->SetPExpireTime(
       dbobject::kDbString, argv[1],
       atof(argv[2].c_str()) * kMicroSecondsPerMilliSecond);
   if (!res)
   {
     // kDbList
-    res = database_[db_idx_]->SetPExpireTime(
+    res = db->SetPExpireTime(
         dbobject::kDbList, argv[1],
         atof(argv[2].c_str()) * kMicroSecondsPerMilliSecond);
   }
   if (!res)
   {
     // kDbHash
-    res = database_[db_idx_]->SetPExpireTime(
+    res = db->SetPExpireTime(
         dbobject::kDbHash, argv[1],
         atof(argv[2].c_str()) * kMicroSecondsPerMilliSecond);
   }
   if (!res)
   {
     // kDbSet
-    res = database_[db_idx_]->SetPExpireTime(
+    res = db->SetPExpireTime(
         dbobject::kDbSet, argv[1],
         atof(argv[2].c_str()) * kMicroSecondsPerMilliSecond);
   }
   if (!res)
   {
     // kDbZSet
-    res = database_[db_idx_]->SetPExpireTime(
+    res = db->SetPExpireTime(
         dbobject::kDbZSet, argv[1],
         atof(argv[2].c_str()) * kMicroSecondsPerMilliSecond);
   }
-  return res ? DbStatus::Ok().ToString()
+  return res ? dbreply::kOk
              : DbStatus::IOError("expire error").ToString();
 }
 
-std::string DbServer::BgsaveCommand(VecS &&argv)
+std::string DbServer::PExpireAtCommand(ClientSession &session, VecS &&argv)
+{
+  StorageEngine *db = database_[session.db_].get();
+  if (argv.size() != 3)
+  {
+    return dbreply::kParameterError;
+  }
+  // 毫秒时间戳
+  Timestamp expire(static_cast<int64_t>(atof(argv[2].c_str()) *
+                                        kMicroSecondsPerMilliSecond));
+  bool res = false;
+  for (int type = dbobject::kDbString; type <= dbobject::kDbZSet && !res;
+       ++type)
+  {
+    res = db->SetPExpireTime(type, argv[1], expire);
+  }
+  return res ? dbreply::kOk
+             : DbStatus::IOError("pexpireat error").ToString();
+}
+
+std::string DbServer::BgsaveCommand(ClientSession &, VecS &&argv)
 {
   if (argv.size() != 1)
   {
-    return DbStatus::IOError("Parameter error").ToString();
+    return dbreply::kParameterError;
   }
-  bool res = CheckSaveCondition();
-  return res ? DbStatus::Ok().ToString()
+  bool res = RdbSave();
+  return res ? dbreply::kOk
              : DbStatus::IOError("bgsave error").ToString();
 }
 
-std::string DbServer::SelectCommand(VecS &&argv)
+std::string DbServer::LastSaveCommand(ClientSession &, VecS &&argv)
+{
+  if (argv.size() != 1)
+  {
+    return dbreply::kParameterError;
+  }
+  return std::to_string(last_save_.secondsSinceEpoch());
+}
+
+std::string DbServer::PingCommand(ClientSession &, VecS &&argv)
+{
+  if (argv.size() != 1)
+  {
+    return dbreply::kParameterError;
+  }
+  // 健康检查：后台载入期间返回进度，负载均衡可据此暂不分配流量
+  if (loader_)
+  {
+    return "LOADING " +
+           std::to_string(loader_->SectionsMerged() * 100 /
+                          loader_->SectionsTotal()) +
+           '%';
+  }
+  return "PONG";
+}
+
+std::string DbServer::BgRewriteAofCommand(ClientSession &, VecS &&argv)
+{
+  if (argv.size() != 1)
+  {
+    return dbreply::kParameterError;
+  }
+  if (!aof_)
+  {
+    return DbStatus::IOError("appendonly is off").ToString();
+  }
+  return RewriteAof() ? dbreply::kOk
+                      : DbStatus::IOError("bgrewriteaof error").ToString();
+}
+
+std::string DbServer::InfoCommand(ClientSession &, VecS &&argv)
+{
+  if (argv.size() != 1)
+  {
+    return dbreply::kParameterError;
+  }
+  std::ostringstream info;
+  info << "# Persistence\n";
+  bool saving = rdb_progress_->in_progress_;
+  info << "rdb_bgsave_in_progress:" << saving << '\n';
+  if (saving)
+  {
+    double elapsed = static_cast<double>(
+                         Timestamp::now().microSecondsSinceEpoch() -
+                         rdb_progress_->start_us_) /
+                     kMicroSecondsPerSecond;
+    uint64_t bytes = rdb_progress_->bytes_written_;
+    uint64_t saved = rdb_progress_->keys_saved_;
+    uint64_t total = rdb_progress_->keys_total_;
+    info << "rdb_current_bgsave_time_sec:" << elapsed << '\n';
+    info << "rdb_current_bgsave_bytes:" << bytes << '\n';
+    info << "rdb_current_bgsave_keys_saved:" << saved << '\n';
+    info << "rdb_current_bgsave_keys_total:" << total << '\n';
+    info << "rdb_current_bgsave_rate_bytes_per_sec:"
+         << (elapsed > 0 ? static_cast<uint64_t>(bytes / elapsed) : 0) << '\n';
+    // 按已写键数的速度估算剩余时间，还未写完任何段时未知
+    info << "rdb_current_bgsave_eta_sec:";
+    if (saved > 0 && total >= saved)
+    {
+      info << elapsed * (total - saved) / saved;
+    }
+    else
+    {
+      info << -1;
+    }
+    info << '\n';
+  }
+  info << "rdb_changes_since_last_save:" << TotalDirty() - dirty_at_last_save_
+       << '\n';
+  info << "rdb_last_save_time:" << last_save_.secondsSinceEpoch() << '\n';
+  info << "rdb_last_bgsave_status:" << (last_save_ok_ ? "ok" : "err") << '\n';
+  info << "rdb_last_bgsave_time_sec:"
+       << (last_save_duration_us_ < 0
+               ? -1.0
+               : static_cast<double>(last_save_duration_us_) /
+                     kMicroSecondsPerSecond)
+       << '\n';
+  info << "rdb_last_fork_usec:" << last_fork_us_ << '\n';
+  info << "rdb_save_rules:";
+  for (auto &rule : config_.save_rules_)
+  {
+    info << rule.first << ' ' << rule.second << ' ';
+  }
+  info << '\n';
+  info << "rdb_rate_limit:" << config_.rdb_rate_limit_ << '\n';
+  info << "aof_enabled:" << (aof_ != nullptr) << '\n';
+  if (aof_)
+  {
+    info << "aof_rewrite_in_progress:" << (aof_rewrite_child_ != -1) << '\n';
+    info << "aof_current_size:" << aof_->Size() << '\n';
+    info << "aof_base_size:" << aof_->BaseSize() << '\n';
+    info << "aof_last_write_status:" << (aof_write_error_ ? "err" : "ok")
+         << '\n';
+  }
+  info << "# Loading\n";
+  info << "loading:" << (loader_ != nullptr) << '\n';
+  if (loader_)
+  {
+    double elapsed = timeDifference(Timestamp::now(), loader_->StartTime());
+    uint64_t parsed = loader_->BytesParsed();
+    uint64_t total = loader_->BytesTotal();
+    info << "loading_start_time:" << loader_->StartTime().secondsSinceEpoch()
+         << '\n';
+    info << "loading_total_bytes:" << total << '\n';
+    info << "loading_loaded_bytes:" << parsed << '\n';
+    info << "loading_loaded_perc:"
+         << (total > 0 ? 100.0 * parsed / total : 100.0) << '\n';
+    info << "loading_sections:" << loader_->SectionsMerged() << '/'
+         << loader_->SectionsTotal() << '\n';
+    info << "loading_keys:" << loader_->KeysLoaded() << '\n';
+    info << "loading_eta_seconds:";
+    if (parsed > 0)
+    {
+      info << elapsed * (total - parsed) / parsed;
+    }
+    else
+    {
+      info << -1;
+    }
+    info << '\n';
+  }
+  info << "# Workers\n";
+  info << "worker_threads:" << (workers_ ? config_.worker_threads_ : 0)
+       << '\n';
+  info << "offload_min_size:" << config_.offload_min_size_ << '\n';
+  info << "offloaded_reads:" << offloaded_reads_ << '\n';
+  info << "offloaded_in_flight:" << offloaded_in_flight_ << '\n';
+  info << "worker_queue_length:" << (workers_ ? workers_->queueSize() : 0)
+       << '\n';
+  info << "# Scheduler\n";
+  info << "slice_min_size:" << config_.slice_min_size_ << '\n';
+  info << "slice_us:" << config_.slice_us_ << '\n';
+  info << "sliced_in_progress:" << sliced_.size() << '\n';
+  info << "sliced_reads:" << sliced_reads_ << '\n';
+  info << "slices:" << slices_ << '\n';
+  info << "slice_max_us:" << slice_max_us_ << '\n';
+  size_t busy = 0;
+  for (auto &session : sessions_)
+  {
+    busy += session.second->busy_ ? 1 : 0;
+  }
+  info << "busy_clients:" << busy << '\n';
+  info << "# Engine\n";
+  info << "engine:" << database_[0]->Name() << '\n';
+  std::map<std::string, uint64_t> stats;
+  for (auto &db : database_)
+  {
+    db->AddStats(&stats);
+  }
+  for (auto &stat : stats)
+  {
+    info << stat.first << ':' << stat.second << '\n';
+  }
+  return info.str();
+}
+
+std::string DbServer::SelectCommand(ClientSession &session, VecS &&argv)
 {
   if (argv.size() != 2)
   {
-    return DbStatus::IOError("Parameter error").ToString();
+    return dbreply::kParameterError;
   }
   int idx = atoi(argv[1].c_str());
-  db_idx_ = idx - 1;
-  database_[db_idx_]->RdbLoad(db_idx_); // 加载rdb文件
-  return DbStatus::Ok().ToString();
+  if (idx < 1 || idx > kDefaultDbNum)
+  {
+    return DbStatus::IOError("DB index is out of range").ToString();
+  }
+  // 所有库已在启动时载入，或在后台载入中由EnsureLoaded按需载入
+  session.db_ = idx - 1;
+  return dbreply::kOk;
 }
 
-std::string DbServer::RpushCommand(VecS &&argv)
+std::string DbServer::RpushCommand(ClientSession &session, VecS &&argv)
 {
+  StorageEngine *db = database_[session.db_].get();
   if (argv.size() < 3)
   {
-    return DbStatus::IOError("Parameter error").ToString();
+    return dbreply::kParameterError;
   }
   int flag;
-  for (int i = 2; i < argv.size(); i++)
+  for (size_t i = 2; i < argv.size(); i++)
   {
-    flag = database_[db_idx_]->AddKey(dbobject::kDbList, argv[1], argv[i],
-                                      dbobject::kDefaultObjValue);
+    flag = db->AddKey(dbobject::kDbList, argv[1], argv[i],
+                      dbobject::kDefaultObjValue);
   }
 
-  return flag ? DbStatus::Ok().ToString()
+  return flag ? dbreply::kOk
               : DbStatus::IOError("rpush error").ToString();
 }
 
-std::string DbServer::RpopCommand(VecS &&argv)
+std::string DbServer::RpopCommand(ClientSession &session, VecS &&argv)
 {
+  StorageEngine *db = database_[session.db_].get();
   if (argv.size() != 2)
   {
-    return DbStatus::IOError("Parameter error").ToString();
+    return dbreply::kParameterError;
   }
   // 处理过期时间
-  bool expired =
-      database_[db_idx_]->JudgeKeyExpiredTime(dbobject::kDbList, argv[1]);
+  bool expired = db->JudgeKeyExpiredTime(dbobject::kDbList, argv[1]);
   if (expired)
   {
-    database_[db_idx_]->DelKey(dbobject::kDbList, argv[1]);
+    db->DelKey(dbobject::kDbList, argv[1]);
     return DbStatus::IOError("Empty Content").ToString();
   }
 
-  std::string res = database_[db_idx_]->RPopList(argv[1]);
+  std::string res = db->RPopList(argv[1]);
   if (res.empty())
   {
     return DbStatus::IOError("rpop error").ToString();
@@ -717,197 +2100,576 @@ std::string DbServer::RpopCommand(VecS &&argv)
   }
 }
 
-std::string DbServer::HSetCommand(VecS &&argv)
+std::string DbServer::HSetCommand(ClientSession &session, VecS &&argv)
 {
+  StorageEngine *db = database_[session.db_].get();
   if (argv.size() != 4)
   {
-    return DbStatus::IOError("Parameter error").ToString();
+    return dbreply::kParameterError;
   }
-  bool flag =
-      database_[db_idx_]->AddKey(dbobject::kDbHash, argv[1], argv[2], argv[3]);
+  bool flag = db->AddKey(dbobject::kDbHash, argv[1], argv[2], argv[3]);
 
-  return flag ? DbStatus::Ok().ToString()
+  return flag ? dbreply::kOk
               : DbStatus::IOError("hset error").ToString();
 }
 
-std::string DbServer::HGetCommand(VecS &&argv)
+std::string DbServer::HGetCommand(ClientSession &session, VecS &&argv)
 {
+  StorageEngine *db = database_[session.db_].get();
   if (argv.size() != 3)
   {
-    return DbStatus::IOError("Parameter error").ToString();
+    return dbreply::kParameterError;
   }
-  auto tmp = database_[db_idx_]->GetKeyHashObj();
-  auto it = tmp.find(argv[1]);
-  if (it == tmp.end())
+  std::string value;
+  if (!db->HGet(argv[1], argv[2], &value))
   {
     return DbStatus::NotFound("Empty Content").ToString();
   }
-  else
-  {
-    auto iter = it->second.find(argv[2]);
-    if (iter == it->second.end())
-    {
-      return DbStatus::NotFound("Empty Content").ToString();
-    }
-    else
-    {
-      return iter->second;
-    }
-  }
+  return value;
 }
 
-std::string DbServer::HGetAllCommand(VecS &&argv)
+std::string DbServer::HGetAllCommand(ClientSession &session, VecS &&argv)
 {
+  StorageEngine *db = database_[session.db_].get();
   if (argv.size() != 2)
   {
-    return DbStatus::IOError("Parameter error").ToString();
+    return dbreply::kParameterError;
   }
-  std::string res = database_[db_idx_]->GetKey(dbobject::kDbHash, argv[1]);
-
-  return res.empty() ? DbStatus::IOError("Empty Content").ToString() : res;
+  return ReadReply(argv[0], db->GetKey(dbobject::kDbHash, argv[1]));
 }
 
-std::string DbServer::SAddCommand(VecS &&argv)
+std::string DbServer::SAddCommand(ClientSession &session, VecS &&argv)
 {
+  StorageEngine *db = database_[session.db_].get();
   if (argv.size() != 3)
   {
-    return DbStatus::IOError("Parameter error").ToString();
+    return dbreply::kParameterError;
   }
-  bool flag = database_[db_idx_]->AddKey(dbobject::kDbSet, argv[1], argv[2],
-                                         dbobject::kDefaultObjValue);
+  bool flag = db->AddKey(dbobject::kDbSet, argv[1], argv[2],
+                         dbobject::kDefaultObjValue);
 
-  return flag ? DbStatus::Ok().ToString()
+  return flag ? dbreply::kOk
               : DbStatus::IOError("sadd error").ToString();
 }
 
-std::string DbServer::SMembersCommand(VecS &&argv)
+std::string DbServer::SMembersCommand(ClientSession &session, VecS &&argv)
 {
+  StorageEngine *db = database_[session.db_].get();
   if (argv.size() != 2)
   {
-    return DbStatus::IOError("Parameter error").ToString();
+    return dbreply::kParameterError;
   }
-  std::string res = database_[db_idx_]->GetKey(dbobject::kDbSet, argv[1]);
-
-  return res.empty() ? DbStatus::NotFound("Empty Content").ToString() : res;
+  return ReadReply(argv[0], db->GetKey(dbobject::kDbSet, argv[1]));
 }
 
-std::string DbServer::ZAddCommand(VecS &&argv)
+std::string DbServer::ZAddCommand(ClientSession &session, VecS &&argv)
 {
+  StorageEngine *db = database_[session.db_].get();
   if (argv.size() != 4)
   {
-    return DbStatus::IOError("Parameter error").ToString();
+    return dbreply::kParameterError;
+  }
+  // NaN无法排序，会破坏跳表的顺序
+  double score;
+  if (!ParseScore(argv[3], &score))
+  {
+    return DbStatus::IOError("score is not a float").ToString();
   }
-  bool flag =
-      database_[db_idx_]->AddKey(dbobject::kDbZSet, argv[1], argv[2], argv[3]);
+  bool flag = db->AddKey(dbobject::kDbZSet, argv[1], argv[2], argv[3]);
 
-  return flag ? DbStatus::Ok().ToString()
+  return flag ? dbreply::kOk
               : DbStatus::IOError("zadd error").ToString();
 }
 
-std::string DbServer::ZCardCommand(VecS &&argv)
+std::string DbServer::ZCardCommand(ClientSession &session, VecS &&argv)
 {
+  StorageEngine *db = database_[session.db_].get();
   if (argv.size() != 2)
   {
-    return DbStatus::IOError("Parameter error").ToString();
-  }
-  auto tmpZset = database_[db_idx_]->GetKeyZSetObj();
-  auto it = tmpZset.find(argv[1]);
-  if (it == tmpZset.end())
-  {
-    return DbStatus::NotFound("key").ToString();
+    return dbreply::kParameterError;
   }
-  else
+  long card = db->ZCard(argv[1]);
+  if (card < 0)
   {
-    return std::to_string(it->second->GetLength());
+    return dbreply::kKeyNotFound;
   }
+  return std::to_string(card);
 }
 
-std::string DbServer::ZRangeCommand(VecS &&argv)
+std::string DbServer::ZRangeCommand(ClientSession &session, VecS &&argv)
 {
+  StorageEngine *db = database_[session.db_].get();
   if (argv.size() != 4 || argv[2].empty() || argv[3].empty())
   {
-    return DbStatus::IOError("Parameter error").ToString();
+    return dbreply::kParameterError;
+  }
+  double min, max;
+  if (!ParseScore(argv[2], &min) || !ParseScore(argv[3], &max))
+  {
+    return DbStatus::IOError("min or max is not a float").ToString();
   }
-  std::string res;
   // zset的key
   std::string args = argv[1];
   // 添加range的范围
   args += ':' + argv[2] + '@' + argv[3];
-  res = database_[db_idx_]->GetKey(dbobject::kDbZSet, args);
+  return ReadReply(argv[0], db->GetKey(dbobject::kDbZSet, args));
+}
 
-  return res.empty() ? DbStatus::NotFound("Empty Content").ToString() : res;
+std::string DbServer::ZCountCommand(ClientSession &session, VecS &&argv)
+{
+  StorageEngine *db = database_[session.db_].get();
+  if (argv.size() != 4 || argv[2].empty() || argv[3].empty())
+  {
+    return dbreply::kParameterError;
+  }
+  double min, max;
+  if (!ParseScore(argv[2], &min) || !ParseScore(argv[3], &max))
+  {
+    return DbStatus::IOError("min or max is not a float").ToString();
+  }
+  RangeSpec range(min, max);
+  RangeAggregate agg;
+  if (!db->ZRangeAggregate(argv[1], range, &agg))
+  {
+    return dbreply::kKeyNotFound;
+  }
+  return "(count)" + std::to_string(agg.count_);
 }
 
-std::string DbServer::ZCountCommand(VecS &&argv)
+std::string DbServer::ZSumRangeCommand(ClientSession &session, VecS &&argv)
 {
+  StorageEngine *db = database_[session.db_].get();
   if (argv.size() != 4 || argv[2].empty() || argv[3].empty())
   {
-    return DbStatus::IOError("Parameter error").ToString();
+    return dbreply::kParameterError;
   }
-  std::string res;
-  auto it = database_[db_idx_]->GetKeyZSetObj();
-  RangeSpec range(std::stod(argv[2]), std::stod(argv[3]));
-  auto obj = it.find(argv[1]);
-  if (obj == it.end())
+  double min, max;
+  if (!ParseScore(argv[2], &min) || !ParseScore(argv[3], &max))
   {
-    res = DbStatus::NotFound("key").ToString();
+    return DbStatus::IOError("min or max is not a float").ToString();
   }
-  else
+  RangeSpec range(min, max);
+  RangeAggregate agg;
+  if (!db->ZRangeAggregate(argv[1], range, &agg))
   {
-    res = "(count)" + std::to_string(obj->second->GetCountInRange(range));
+    return dbreply::kKeyNotFound;
   }
-  return res;
+  return "(sum)" + std::to_string(agg.sum_);
+}
+
+std::string DbServer::ZAvgRangeCommand(ClientSession &session, VecS &&argv)
+{
+  StorageEngine *db = database_[session.db_].get();
+  if (argv.size() != 4 || argv[2].empty() || argv[3].empty())
+  {
+    return dbreply::kParameterError;
+  }
+  double min, max;
+  if (!ParseScore(argv[2], &min) || !ParseScore(argv[3], &max))
+  {
+    return DbStatus::IOError("min or max is not a float").ToString();
+  }
+  RangeSpec range(min, max);
+  RangeAggregate agg;
+  if (!db->ZRangeAggregate(argv[1], range, &agg))
+  {
+    return dbreply::kKeyNotFound;
+  }
+  if (agg.count_ == 0)
+  {
+    return DbStatus::NotFound("Empty Content").ToString();
+  }
+  return "(avg)" + std::to_string(agg.sum_ / agg.count_);
 }
 
-std::string DbServer::ZGetAllCommand(VecS &&argv)
+std::string DbServer::ZGetAllCommand(ClientSession &session, VecS &&argv)
 {
+  StorageEngine *db = database_[session.db_].get();
   if (argv.size() != 2)
   {
-    return DbStatus::IOError("Parameter error").ToString();
+    return dbreply::kParameterError;
   }
-  std::string res = database_[db_idx_]->GetKey(dbobject::kDbZSet, argv[1]);
+  return ReadReply(argv[0], db->GetKey(dbobject::kDbZSet, argv[1]));
+}
+std::string DbServer::ZUnionStoreCommand(ClientSession &session, VecS &&argv)
+{
+  return ZSetStoreCommand(session, dbobject::kZSetUnion, std::move(argv));
+}
+
+std::string DbServer::ZInterStoreCommand(ClientSession &session, VecS &&argv)
+{
+  return ZSetStoreCommand(session, dbobject::kZSetInter, std::move(argv));
+}
 
-  return res.empty() ? DbStatus::NotFound("Empty Content").ToString() : res;
+std::string DbServer::ZDiffStoreCommand(ClientSession &session, VecS &&argv)
+{
+  return ZSetStoreCommand(session, dbobject::kZSetDiff, std::move(argv));
 }
-std::string DbServer::SaveHead()
+
+std::string DbServer::ZSetStoreCommand(ClientSession &session, const int op,
+                                       VecS &&argv)
 {
-  std::string tmp = "KV0001";
-  return tmp;
+  StorageEngine *db = database_[session.db_].get();
+  if (argv.size() < 4)
+  {
+    return dbreply::kParameterError;
+  }
+  int numkeys = atoi(argv[2].c_str());
+  if (numkeys <= 0 || argv.size() < 3 + static_cast<size_t>(numkeys))
+  {
+    return dbreply::kParameterError;
+  }
+  VecS keys(argv.begin() + 3, argv.begin() + 3 + numkeys);
+
+  std::vector<double> weights;
+  int aggregate = dbobject::kAggregateSum;
+  size_t i = 3 + numkeys;
+  while (i < argv.size())
+  {
+    if (op != dbobject::kZSetDiff &&
+        strcasecmp(argv[i].c_str(), "weights") == 0 &&
+        i + numkeys < argv.size())
+    {
+      weights.clear();
+      for (int j = 1; j <= numkeys; ++j)
+      {
+        double weight;
+        if (!ParseScore(argv[i + j], &weight))
+        {
+          return DbStatus::IOError("weight value is not a float").ToString();
+        }
+        weights.emplace_back(weight);
+      }
+      i += numkeys + 1;
+    }
+    else if (op != dbobject::kZSetDiff &&
+             strcasecmp(argv[i].c_str(), "aggregate") == 0 &&
+             i + 1 < argv.size())
+    {
+      const char *mode = argv[i + 1].c_str();
+      if (strcasecmp(mode, "sum") == 0)
+      {
+        aggregate = dbobject::kAggregateSum;
+      }
+      else if (strcasecmp(mode, "min") == 0)
+      {
+        aggregate = dbobject::kAggregateMin;
+      }
+      else if (strcasecmp(mode, "max") == 0)
+      {
+        aggregate = dbobject::kAggregateMax;
+      }
+      else
+      {
+        return DbStatus::IOError("syntax error").ToString();
+      }
+      i += 2;
+    }
+    else
+    {
+      return DbStatus::IOError("syntax error").ToString();
+    }
+  }
+
+  long len = db->ZSetStore(op, argv[1], keys, weights, aggregate);
+  return std::to_string(len);
 }
 
-std::string DbServer::SaveSelectDB(const int index)
+bool DbServer::CheckSaveCondition()
 {
-  return "SD" + std::to_string(index);
+  Timestamp now = Timestamp::now();
+  if (!last_save_ok_ &&
+      timeDifference(now, last_save_try_) < kSaveRetryDelay)
+  {
+    return false;
+  }
+  uint64_t changes = TotalDirty() - dirty_at_last_save_;
+  double elapsed = timeDifference(now, last_save_);
+  for (auto &rule : config_.save_rules_)
+  {
+    if (changes >= rule.second && elapsed >= rule.first)
+    {
+      LOG_INFO << changes << " changes in " << rule.first
+               << " seconds. bgsaving...";
+      return true;
+    }
+  }
+  return false;
 }
 
-std::string DbServer::SaveExpiredTime(const Timestamp &expiredTime)
+// scan系列命令的选项：[match pattern] [count count] [type type]，
+// allow_type为false时不接受type
+static bool ParseScanOptions(const DbServer::VecS &argv, size_t first,
+                             bool allow_type, std::string *match,
+                             size_t *count, int *type)
 {
-  return "ST" + std::to_string(expiredTime.microSecondsSinceEpoch());
+  static const std::unordered_map<std::string, int> kTypeNames = {
+      {"string", dbobject::kDbString},
+      {"list", dbobject::kDbList},
+      {"hash", dbobject::kDbHash},
+      {"set", dbobject::kDbSet},
+      {"zset", dbobject::kDbZSet}};
+  for (size_t i = first; i < argv.size(); i += 2)
+  {
+    if (i + 1 >= argv.size())
+    {
+      return false;
+    }
+    if (strcasecmp(argv[i].c_str(), "match") == 0)
+    {
+      *match = argv[i + 1];
+    }
+    else if (strcasecmp(argv[i].c_str(), "count") == 0)
+    {
+      long n = atol(argv[i + 1].c_str());
+      if (n <= 0)
+      {
+        return false;
+      }
+      *count = static_cast<size_t>(n);
+    }
+    else if (allow_type && strcasecmp(argv[i].c_str(), "type") == 0)
+    {
+      auto it = kTypeNames.find(argv[i + 1]);
+      if (it == kTypeNames.end())
+      {
+        return false;
+      }
+      *type = it->second;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  return true;
 }
 
-std::string DbServer::SaveType(const int type)
+// 游标为十进制的无符号整数
+static bool ParseCursor(const std::string &arg, uint64_t *cursor)
 {
-  return "^" + std::to_string(type);
+  if (arg.empty() || arg.find_first_not_of("0123456789") != std::string::npos)
+  {
+    return false;
+  }
+  errno = 0;
+  *cursor = strtoull(arg.c_str(), nullptr, 10);
+  return errno == 0;
 }
 
-std::string DbServer::SaveKV(const std::string &key, const std::string &value)
+// 哈希的游标为 h<上次返回的field的十六进制>，有序集合的游标为
+// z<上次返回的成员的十六进制>:<其分值>，集合的游标为十进制的反向二进制游标。
+// 成员可能含有空白，编码后游标总是一个不含空白的参数
+static std::string FormatValueCursor(const int type, const ValueCursor &cursor)
 {
-  char buf[1024];
-  sprintf(buf, "!%d#%s!%d$%s", static_cast<int>(key.size()), key.c_str(),
-          static_cast<int>(value.size()), value.c_str());
-  return std::string(buf);
+  if (type == dbobject::kDbSet)
+  {
+    return std::to_string(cursor.bucket_);
+  }
+  static const char kHex[] = "0123456789abcdef";
+  std::string res(1, type == dbobject::kDbHash ? 'h' : 'z');
+  for (unsigned char c : cursor.member_)
+  {
+    res += kHex[c >> 4];
+    res += kHex[c & 0xf];
+  }
+  if (type == dbobject::kDbZSet)
+  {
+    // 17位有效数字保证分值精确还原
+    char score[32];
+    snprintf(score, sizeof(score), ":%.17g", cursor.score_);
+    res += score;
+  }
+  return res;
 }
 
-bool DbServer::CheckSaveCondition()
+static bool ParseValueCursor(const int type, const std::string &arg,
+                             ValueCursor *cursor)
 {
-  Timestamp save_interval(Timestamp::now().microSecondsSinceEpoch() -
-                          last_save_.microSecondsSinceEpoch());
-  if (save_interval > dbobject::kRdbDefaultTime)
+  if (arg == "0")
   {
-    LOG_INFO << "bgsaving...";
-    RdbSave();
-    last_save_ = Timestamp::now();
     return true;
   }
-  return false;
-}
\ No newline at end of file
+  cursor->started_ = true;
+  if (type == dbobject::kDbSet)
+  {
+    return ParseCursor(arg, &cursor->bucket_);
+  }
+  if (arg.empty() || arg[0] != (type == dbobject::kDbHash ? 'h' : 'z'))
+  {
+    return false;
+  }
+  size_t end = type == dbobject::kDbHash ? arg.size() : arg.find(':');
+  if (end == std::string::npos || end % 2 == 0)
+  {
+    return false;
+  }
+  for (size_t i = 1; i < end; i += 2)
+  {
+    char *stop;
+    char byte[3] = {arg[i], arg[i + 1], '\0'};
+    cursor->member_ += static_cast<char>(strtol(byte, &stop, 16));
+    if (*stop != '\0' || !isxdigit(byte[0]))
+    {
+      return false;
+    }
+  }
+  if (type == dbobject::kDbZSet)
+  {
+    char *stop;
+    cursor->score_ = strtod(arg.c_str() + end + 1, &stop);
+    if (*stop != '\0' || stop == arg.c_str() + end + 1 ||
+        std::isnan(cursor->score_))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string DbServer::ScanCommand(ClientSession &session, VecS &&argv)
+{
+  // 游标的高位为类型，低位为该类型字典的反向二进制游标，
+  // 桶数不超过2^kTypeShift时两部分互不重叠
+  const int kTypeShift = 56;
+  const uint64_t kPosMask = (1ULL << kTypeShift) - 1;
+  uint64_t cursor;
+  std::string match = "*";
+  size_t count = 10;
+  int only = -1;
+  if (argv.size() < 2 || !ParseCursor(argv[1], &cursor) ||
+      !ParseScanOptions(argv, 2, true, &match, &count, &only))
+  {
+    return dbreply::kParameterError;
+  }
+  StorageEngine *db = database_[session.db_].get();
+  int type = static_cast<int>(cursor >> kTypeShift);
+  uint64_t pos = cursor & kPosMask;
+  if (only > type)
+  {
+    type = only;
+    pos = 0;
+  }
+
+  // 一种类型遍历完且返回的key不足count时继续下一种类型
+  std::vector<std::string> keys;
+  while (type <= dbobject::kDbZSet && (only < 0 || type == only) &&
+         keys.size() < count)
+  {
+    pos = db->Scan(type, pos, count - keys.size(), &keys);
+    if (pos != 0)
+    {
+      break;
+    }
+    ++type;
+  }
+
+  uint64_t next = 0;
+  if (type <= dbobject::kDbZSet && (only < 0 || type == only))
+  {
+    next = static_cast<uint64_t>(type) << kTypeShift | pos;
+  }
+  GlobMatcher matcher(match);
+  std::string res = std::to_string(next);
+  for (auto &key : keys)
+  {
+    if (matcher.Match(key))
+    {
+      res += '\n' + key;
+    }
+  }
+  return res;
+}
+
+std::string DbServer::HScanCommand(ClientSession &session, VecS &&argv)
+{
+  return ScanValueCommand(session, dbobject::kDbHash, std::move(argv));
+}
+
+std::string DbServer::SScanCommand(ClientSession &session, VecS &&argv)
+{
+  return ScanValueCommand(session, dbobject::kDbSet, std::move(argv));
+}
+
+std::string DbServer::ZScanCommand(ClientSession &session, VecS &&argv)
+{
+  return ScanValueCommand(session, dbobject::kDbZSet, std::move(argv));
+}
+
+std::string DbServer::ScanValueCommand(ClientSession &session,
+                                       const int type, VecS &&argv)
+{
+  StorageEngine *db = database_[session.db_].get();
+  ValueCursor cursor;
+  std::string match = "*";
+  size_t count = 10;
+  int only = -1;
+  if (argv.size() < 3 || !ParseValueCursor(type, argv[2], &cursor) ||
+      !ParseScanOptions(argv, 3, false, &match, &count, &only))
+  {
+    return dbreply::kParameterError;
+  }
+  std::vector<ValueItem> items;
+  bool finished = db->ScanValue(type, argv[1], &cursor, count, &items);
+  // 与hgetall、zrange相同，哈希和有序集合的元素为 成员:值
+  GlobMatcher matcher(match);
+  std::string res = finished ? "0" : FormatValueCursor(type, cursor);
+  char score[32];
+  for (auto &item : items)
+  {
+    if (!matcher.Match(item.member_))
+    {
+      continue;
+    }
+    res += '\n' + item.member_;
+    if (type == dbobject::kDbHash)
+    {
+      res += ':' + item.value_;
+    }
+    else if (type == dbobject::kDbZSet)
+    {
+      snprintf(score, sizeof(score), ":%.17g", item.score_);
+      res += score;
+    }
+  }
+  return res;
+}
+
+std::string DbServer::ClientCommand(ClientSession &session, VecS &&argv)
+{
+  if (argv.size() == 3 && strcasecmp(argv[1].c_str(), "setname") == 0)
+  {
+    session.name_ = argv[2];
+    return dbreply::kOk;
+  }
+  if (argv.size() == 2 && strcasecmp(argv[1].c_str(), "getname") == 0)
+  {
+    return session.name_;
+  }
+  if (argv.size() != 2 || strcasecmp(argv[1].c_str(), "list") != 0)
+  {
+    return dbreply::kParameterError;
+  }
+  int64_t now = Timestamp::now().microSecondsSinceEpoch();
+  std::string res;
+  for (auto &client : sessions_)
+  {
+    const ClientSession &session = *client.second;
+    const ClientStats &stats = session.stats_;
+    res += "id=" + client.first + " name=" + session.name_ +
+           " db=" + std::to_string(session.db_ + 1) + " age=" +
+           std::to_string((now - stats.since_.microSecondsSinceEpoch()) /
+                          Timestamp::kMicroSecondsPerSecond) +
+           " cmds=" + std::to_string(stats.cmds_) +
+           " usec=" + std::to_string(stats.usec_) +
+           " sliced=" + std::to_string(stats.sliced_) +
+           " slices=" + std::to_string(stats.slices_) +
+           " queued=" + std::to_string(stats.queued_) +
+           " max_wait_us=" + std::to_string(stats.max_wait_us_) + '\n';
+  }
+  if (!res.empty())
+  {
+    res.pop_back();
+  }
+  return res;
+}
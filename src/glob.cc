@@ -0,0 +1,168 @@
+#include "glob.h"
+
+#include <utility>
+
+// 匹配pattern开头的字符集[...]，*len为字符集的长度(含括号)
+static bool MatchClass(const char *pattern, size_t plen, char c, size_t *len)
+{
+  size_t i = 1;
+  bool negate = i < plen && pattern[i] == '^';
+  if (negate)
+  {
+    ++i;
+  }
+  bool matched = false;
+  while (i < plen && pattern[i] != ']')
+  {
+    if (pattern[i] == '\\' && i + 1 < plen)
+    {
+      ++i;
+      matched = matched || pattern[i] == c;
+      ++i;
+    }
+    else if (i + 2 < plen && pattern[i + 1] == '-' && pattern[i + 2] != ']')
+    {
+      char lo = pattern[i], hi = pattern[i + 2];
+      if (lo > hi)
+      {
+        std::swap(lo, hi);
+      }
+      matched = matched || (c >= lo && c <= hi);
+      i += 3;
+    }
+    else
+    {
+      matched = matched || pattern[i] == c;
+      ++i;
+    }
+  }
+  // 未闭合的[一直延伸到模式末尾
+  *len = i < plen ? i + 1 : plen;
+  return negate ? !matched : matched;
+}
+
+bool GlobMatch(const char *pattern, size_t plen, const char *str, size_t slen)
+{
+  size_t p = 0, s = 0;
+  // 最后一个*之后的位置及其当时匹配到的字符串位置，失配时从这里回溯
+  size_t star_p = std::string::npos, star_s = 0;
+  while (s < slen)
+  {
+    if (p < plen)
+    {
+      char c = pattern[p];
+      if (c == '*')
+      {
+        // 连续的*等价于一个
+        while (p < plen && pattern[p] == '*')
+        {
+          ++p;
+        }
+        if (p == plen)
+        {
+          return true;
+        }
+        star_p = p;
+        star_s = s;
+        continue;
+      }
+      size_t len = 1;
+      bool matched;
+      if (c == '?')
+      {
+        matched = true;
+      }
+      else if (c == '[')
+      {
+        matched = MatchClass(pattern + p, plen - p, str[s], &len);
+      }
+      else if (c == '\\' && p + 1 < plen)
+      {
+        matched = pattern[p + 1] == str[s];
+        len = 2;
+      }
+      else
+      {
+        matched = c == str[s];
+      }
+      if (matched)
+      {
+        p += len;
+        ++s;
+        continue;
+      }
+    }
+    // 失配：让最后一个*多吞一个字符
+    if (star_p == std::string::npos)
+    {
+      return false;
+    }
+    p = star_p;
+    s = ++star_s;
+  }
+  while (p < plen && pattern[p] == '*')
+  {
+    ++p;
+  }
+  return p == plen;
+}
+
+GlobMatcher::GlobMatcher(const std::string &pattern)
+    : kind_(kGeneral), pattern_(pattern)
+{
+  size_t stars = 0;
+  bool special = false;
+  for (char c : pattern)
+  {
+    if (c == '*')
+    {
+      ++stars;
+    }
+    else if (c == '?' || c == '[' || c == '\\')
+    {
+      special = true;
+    }
+  }
+  if (special)
+  {
+    return;
+  }
+  if (stars == pattern.size() && stars > 0)
+  {
+    kind_ = kAll;
+  }
+  else if (stars == 0)
+  {
+    kind_ = kExact;
+    literal_ = pattern;
+  }
+  else if (stars == 1 && pattern.back() == '*')
+  {
+    kind_ = kPrefix;
+    literal_ = pattern.substr(0, pattern.size() - 1);
+  }
+  else if (stars == 1 && pattern.front() == '*')
+  {
+    kind_ = kSuffix;
+    literal_ = pattern.substr(1);
+  }
+}
+
+bool GlobMatcher::Match(const std::string &str) const
+{
+  switch (kind_)
+  {
+  case kAll:
+    return true;
+  case kExact:
+    return str == literal_;
+  case kPrefix:
+    return str.compare(0, literal_.size(), literal_) == 0;
+  case kSuffix:
+    return str.size() >= literal_.size() &&
+           str.compare(str.size() - literal_.size(), literal_.size(),
+                       literal_) == 0;
+  default:
+    return GlobMatch(pattern_.data(), pattern_.size(), str.data(), str.size());
+  }
+}
@@ -0,0 +1,278 @@
+#include "handover.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <muduo/base/Logging.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+namespace handover
+{
+  static const char kRequest[] = "handover";
+
+  static bool FillAddr(const std::string &path, struct sockaddr_un *addr)
+  {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr->sun_path))
+    {
+      return false;
+    }
+    memcpy(addr->sun_path, path.data(), path.size());
+    return true;
+  }
+
+  static std::string TrimLine(const std::string &msg)
+  {
+    size_t end = msg.find('\n');
+    return end == std::string::npos ? msg : msg.substr(0, end);
+  }
+
+  int Listen(const std::string &path)
+  {
+    struct sockaddr_un addr;
+    if (!FillAddr(path, &addr))
+    {
+      LOG_ERROR << "handover socket path too long: " << path;
+      return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+      LOG_ERROR << "create handover socket error: " << strerror(errno);
+      return -1;
+    }
+    // 旧进程退出时不删除，新进程启动时接手同一路径
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) !=
+            0 ||
+        listen(fd, 4) != 0)
+    {
+      LOG_ERROR << "listen on handover socket " << path
+                << " error: " << strerror(errno);
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  bool Request(const std::string &path, int *listen_fd, std::string *image,
+               std::string *err)
+  {
+    struct sockaddr_un addr;
+    if (!FillAddr(path, &addr))
+    {
+      *err = "handover socket path too long";
+      return false;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 ||
+        connect(sock, reinterpret_cast<struct sockaddr *>(&addr),
+                sizeof(addr)) != 0)
+    {
+      *err = std::string("connect ") + path + ": " + strerror(errno);
+      if (sock >= 0)
+      {
+        close(sock);
+      }
+      return false;
+    }
+    std::string request = std::string(kRequest) + '\n';
+    if (write(sock, request.data(), request.size()) !=
+        static_cast<ssize_t>(request.size()))
+    {
+      *err = std::string("send request: ") + strerror(errno);
+      close(sock);
+      return false;
+    }
+
+    // 旧进程写完镜像才回复，阻塞等待直到对方关闭连接
+    std::string msg;
+    int fd = -1;
+    char buf[4096];
+    char control[CMSG_SPACE(sizeof(int))];
+    while (true)
+    {
+      struct iovec iov = {buf, sizeof(buf)};
+      struct msghdr mh;
+      memset(&mh, 0, sizeof(mh));
+      mh.msg_iov = &iov;
+      mh.msg_iovlen = 1;
+      mh.msg_control = control;
+      mh.msg_controllen = sizeof(control);
+      ssize_t n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+      if (n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (n <= 0)
+      {
+        break;
+      }
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg != nullptr;
+           cmsg = CMSG_NXTHDR(&mh, cmsg))
+      {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            fd < 0)
+        {
+          memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+      }
+      msg.append(buf, n);
+    }
+    close(sock);
+
+    msg = TrimLine(msg);
+    if (msg.compare(0, 3, "ok ") == 0 && fd >= 0)
+    {
+      *listen_fd = fd;
+      *image = msg.substr(3);
+      return true;
+    }
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    *err = msg.compare(0, 4, "err ") == 0 ? msg.substr(4) : "bad reply";
+    return false;
+  }
+
+  bool ReadRequest(int conn)
+  {
+    // 新进程连接后立即发送请求，不让一个不发数据的连接卡住事件循环
+    struct timeval timeout = {1, 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string line;
+    char c;
+    while (line.size() < sizeof(kRequest) && read(conn, &c, 1) == 1)
+    {
+      if (c == '\n')
+      {
+        return line == kRequest;
+      }
+      line += c;
+    }
+    return false;
+  }
+
+  bool Reply(int conn, const std::string &msg, int fd)
+  {
+    std::string line = msg + '\n';
+    struct iovec iov = {const_cast<char *>(line.data()), line.size()};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0)
+    {
+      memset(control, 0, sizeof(control));
+      mh.msg_control = control;
+      mh.msg_controllen = sizeof(control);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    // 回复只有一行，套接字缓冲区足以一次发完
+    ssize_t n;
+    while ((n = sendmsg(conn, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+    {
+    }
+    if (n != static_cast<ssize_t>(line.size()))
+    {
+      LOG_ERROR << "send handover reply error: " << strerror(errno);
+      return false;
+    }
+    return true;
+  }
+
+  int FindTcpSocket(int port, bool listening)
+  {
+    DIR *d = opendir("/proc/self/fd");
+    if (d == nullptr)
+    {
+      return -1;
+    }
+    int found = -1;
+    int dir_fd = dirfd(d);
+    while (struct dirent *entry = readdir(d))
+    {
+      if (entry->d_name[0] == '.')
+      {
+        continue;
+      }
+      int fd = atoi(entry->d_name);
+      int value;
+      socklen_t len = sizeof(value);
+      if (fd == dir_fd ||
+          getsockopt(fd, SOL_SOCKET, SO_TYPE, &value, &len) != 0 ||
+          value != SOCK_STREAM)
+      {
+        continue;
+      }
+      struct sockaddr_storage addr;
+      socklen_t addr_len = sizeof(addr);
+      if (getsockname(fd, reinterpret_cast<struct sockaddr *>(&addr),
+                      &addr_len) != 0)
+      {
+        continue;
+      }
+      int local_port;
+      if (addr.ss_family == AF_INET)
+      {
+        local_port =
+            ntohs(reinterpret_cast<struct sockaddr_in *>(&addr)->sin_port);
+      }
+      else if (addr.ss_family == AF_INET6)
+      {
+        local_port =
+            ntohs(reinterpret_cast<struct sockaddr_in6 *>(&addr)->sin6_port);
+      }
+      else
+      {
+        continue;
+      }
+      len = sizeof(value);
+      if (local_port == 0 || (port >= 0 && local_port != port) ||
+          getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &value, &len) != 0 ||
+          (value != 0) != listening)
+      {
+        continue;
+      }
+      // 已连接的套接字也未listen，排除
+      addr_len = sizeof(addr);
+      if (!listening &&
+          getpeername(fd, reinterpret_cast<struct sockaddr *>(&addr),
+                      &addr_len) == 0)
+      {
+        continue;
+      }
+      found = fd;
+      break;
+    }
+    closedir(d);
+    return found;
+  }
+
+  bool Adopt(int listen_fd)
+  {
+    int fd = FindTcpSocket(-1, false);
+    if (fd < 0 || dup2(listen_fd, fd) < 0)
+    {
+      return false;
+    }
+    close(listen_fd);
+    // dup2不保留FD_CLOEXEC；O_NONBLOCK属于打开的文件，旧进程已设置，再设一次
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return true;
+  }
+} // namespace handover
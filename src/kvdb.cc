@@ -0,0 +1,280 @@
+#include "kvdb.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "db_config.h"
+#include "db_log.h"
+#include "db_obj.h"
+#include "rdb.h"
+#include "rdb_loader.h"
+#include "storage_engine.h"
+
+void WriteBatch::Add(OpType type, const std::string &key,
+                     const std::string &field, const std::string &value,
+                     double number)
+{
+  ops_.push_back(Op{type, key, field, value, number});
+}
+
+void WriteBatch::Set(const std::string &key, const std::string &value)
+{
+  Add(kSet, key, "", value, 0);
+}
+
+void WriteBatch::Del(const std::string &key) { Add(kDel, key, "", "", 0); }
+
+void WriteBatch::PExpire(const std::string &key, int64_t ms)
+{
+  Add(kPExpire, key, "", "", static_cast<double>(ms));
+}
+
+void WriteBatch::RPush(const std::string &key, const std::string &value)
+{
+  Add(kRPush, key, "", value, 0);
+}
+
+void WriteBatch::HSet(const std::string &key, const std::string &field,
+                      const std::string &value)
+{
+  Add(kHSet, key, field, value, 0);
+}
+
+void WriteBatch::SAdd(const std::string &key, const std::string &member)
+{
+  Add(kSAdd, key, member, "", 0);
+}
+
+void WriteBatch::ZAdd(const std::string &key, double score,
+                      const std::string &member)
+{
+  Add(kZAdd, key, member, "", score);
+}
+
+Kvdb::Kvdb() : index_(0) {}
+
+Kvdb::~Kvdb() = default;
+
+std::unique_ptr<Kvdb> Kvdb::Open(const KvdbOptions &options)
+{
+  if (options.db_num_ <= 0)
+  {
+    return nullptr;
+  }
+  DbConfig config;
+  config.engine_ = options.engine_;
+  config.vlog_min_size_ = options.vlog_min_size_;
+  config.vlog_dir_ = options.vlog_dir_;
+  config.vlog_cache_size_ = options.vlog_cache_size_;
+
+  std::unique_ptr<Kvdb> db(new Kvdb());
+  db->options_ = options;
+  // 不提供定时器，不做定时删除
+  for (int i = 0; i < options.db_num_; ++i)
+  {
+    db->dbs_.emplace_back(StorageEngine::Create(config, i, options.db_num_));
+    if (!db->dbs_.back())
+    {
+      return nullptr;
+    }
+  }
+  return db;
+}
+
+bool Kvdb::Select(int index)
+{
+  if (index < 0 || index >= static_cast<int>(dbs_.size()))
+  {
+    return false;
+  }
+  index_ = index;
+  return true;
+}
+
+bool Kvdb::Set(const std::string &key, const std::string &value)
+{
+  return Current()->AddKey(dbobject::kDbString, key, value, "");
+}
+
+bool Kvdb::Get(const std::string &key, std::string *value)
+{
+  return Current()->GetString(key, value);
+}
+
+bool Kvdb::Del(const std::string &key)
+{
+  bool deleted = false;
+  for (int type = dbobject::kDbString; type <= dbobject::kDbZSet; ++type)
+  {
+    deleted = Current()->DelKey(type, key) || deleted;
+  }
+  return deleted;
+}
+
+bool Kvdb::PExpire(const std::string &key, int64_t ms)
+{
+  for (int type = dbobject::kDbString; type <= dbobject::kDbZSet; ++type)
+  {
+    if (Current()->SetPExpireTime(type, key, static_cast<double>(ms)))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Kvdb::RPush(const std::string &key, const std::string &value)
+{
+  return Current()->AddKey(dbobject::kDbList, key, value, "");
+}
+
+bool Kvdb::RPop(const std::string &key, std::string *value)
+{
+  return Current()->RPop(key, value);
+}
+
+bool Kvdb::HSet(const std::string &key, const std::string &field,
+                const std::string &value)
+{
+  return Current()->AddKey(dbobject::kDbHash, key, field, value);
+}
+
+bool Kvdb::HGet(const std::string &key, const std::string &field,
+                std::string *value)
+{
+  return Current()->HGet(key, field, value);
+}
+
+bool Kvdb::SAdd(const std::string &key, const std::string &member)
+{
+  return Current()->AddKey(dbobject::kDbSet, key, member, "");
+}
+
+bool Kvdb::ZAdd(const std::string &key, double score,
+                const std::string &member)
+{
+  // 分值以文本传给引擎，%.17g可以无损还原
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.17g", score);
+  return Current()->AddKey(dbobject::kDbZSet, key, member, buf);
+}
+
+long Kvdb::ZCard(const std::string &key)
+{
+  return Current()->ZCard(key);
+}
+
+long Kvdb::ZCount(const std::string &key, double min, double max)
+{
+  RangeSpec range(min, max);
+  range.minex_ = false;
+  range.maxex_ = false;
+  RangeAggregate agg;
+  if (!Current()->ZRangeAggregate(key, range, &agg))
+  {
+    return -1;
+  }
+  return static_cast<long>(agg.count_);
+}
+
+bool Kvdb::Write(const WriteBatch &batch)
+{
+  bool ok = true;
+  for (auto &op : batch.ops_)
+  {
+    bool done = false;
+    switch (op.type_)
+    {
+    case WriteBatch::kSet:
+      done = Set(op.key_, op.value_);
+      break;
+    case WriteBatch::kDel:
+      done = Del(op.key_);
+      break;
+    case WriteBatch::kPExpire:
+      done = PExpire(op.key_, static_cast<int64_t>(op.number_));
+      break;
+    case WriteBatch::kRPush:
+      done = RPush(op.key_, op.value_);
+      break;
+    case WriteBatch::kHSet:
+      done = HSet(op.key_, op.field_, op.value_);
+      break;
+    case WriteBatch::kSAdd:
+      done = SAdd(op.key_, op.field_);
+      break;
+    case WriteBatch::kZAdd:
+      done = ZAdd(op.key_, op.number_, op.field_);
+      break;
+    }
+    ok = ok && done;
+  }
+  return ok;
+}
+
+bool Kvdb::Save(const std::string &path)
+{
+  std::string tmp_path = path + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+  if (fd < 0)
+  {
+    DB_LOG_ERROR << "open " << tmp_path << " error: " << strerror(errno);
+    return false;
+  }
+  RdbWriter writer(fd);
+  writer.SetCompression(options_.rdb_compression_);
+  writer.WriteHeader();
+  for (size_t i = 0; i < dbs_.size(); ++i)
+  {
+    if (dbs_[i]->GetKeySize() == 0)
+    {
+      continue;
+    }
+    dbs_[i]->RdbSave(&writer, static_cast<int>(i));
+  }
+  writer.WriteEof();
+  bool ok = writer.Ok() && fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0)
+  {
+    DB_LOG_ERROR << "save " << path << " error: " << strerror(errno);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool Kvdb::Load(const std::string &path)
+{
+  std::vector<StorageEngine *> dbs;
+  for (auto &db : dbs_)
+  {
+    dbs.push_back(db.get());
+  }
+  RdbLoader loader(dbs);
+  return loader.Load(path);
+}
+
+void Kvdb::Tick()
+{
+  Timestamp now = Timestamp::now();
+  for (auto &db : dbs_)
+  {
+    db->Cron(now);
+  }
+}
+
+uint64_t Kvdb::KeyCount() const
+{
+  uint64_t count = 0;
+  for (auto &db : dbs_)
+  {
+    count += db->GetKeySize();
+  }
+  return count;
+}
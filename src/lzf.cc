@@ -0,0 +1,209 @@
+#include "lzf.h"
+
+#include <cstring>
+
+namespace
+{
+  // 一段原样字节的最大长度
+  const size_t kMaxLiteral = 1 << 5;
+  // 最大回溯距离
+  const size_t kMaxOffset = 1 << 13;
+  // 最大匹配长度
+  const size_t kMaxMatch = (1 << 8) + (1 << 3);
+  // 哈希表最大为2^14项，短输入用更小的表以减少清零的开销
+  const int kMaxHashLog = 14;
+  const int kMinHashLog = 8;
+
+  inline uint32_t Hash(const uint8_t *p, int hash_log)
+  {
+    uint32_t v = (static_cast<uint32_t>(p[0]) << 16) |
+                 (static_cast<uint32_t>(p[1]) << 8) | p[2];
+    return (v * 2654435761u) >> (32 - hash_log);
+  }
+} // namespace
+
+size_t LzfCompress(const void *in, size_t in_len, void *out, size_t out_len)
+{
+  const uint8_t *base = static_cast<const uint8_t *>(in);
+  const uint8_t *ip = base;
+  const uint8_t *in_end = base + in_len;
+  uint8_t *op = static_cast<uint8_t *>(out);
+  uint8_t *out_begin = op;
+  uint8_t *out_end = op + out_len;
+  if (in_len == 0 || out_len == 0)
+  {
+    return 0;
+  }
+
+  int hash_log = kMinHashLog;
+  while (hash_log < kMaxHashLog && (static_cast<size_t>(1) << hash_log) < in_len)
+  {
+    ++hash_log;
+  }
+  // 表项为距输入开头的偏移，未使用的项为0，由逐字节比较排除误匹配
+  uint32_t table[1 << kMaxHashLog];
+  memset(table, 0, sizeof(uint32_t) << hash_log);
+
+  // lit为当前这段原样字节的个数，其控制字节位于op[-lit - 1]
+  size_t lit = 0;
+  ++op;
+  while (in_end - ip > 2)
+  {
+    uint32_t h = Hash(ip, hash_log);
+    const uint8_t *ref = base + table[h];
+    table[h] = static_cast<uint32_t>(ip - base);
+
+    size_t off = ip - ref - 1;
+    if (ref < ip && off < kMaxOffset && ref[0] == ip[0] && ref[1] == ip[1] &&
+        ref[2] == ip[2])
+    {
+      size_t max_len = in_end - ip - 2;
+      if (max_len > kMaxMatch)
+      {
+        max_len = kMaxMatch;
+      }
+      size_t len = 3;
+      while (len < max_len && ref[len] == ip[len])
+      {
+        ++len;
+      }
+
+      // 结束当前这段原样字节，没有原样字节时收回预留的控制字节
+      if (lit == 0)
+      {
+        --op;
+      }
+      else
+      {
+        op[-static_cast<ptrdiff_t>(lit) - 1] = static_cast<uint8_t>(lit - 1);
+      }
+      // 回溯块最多3字节，再为下一段原样字节预留1字节
+      if (out_end - op < 4)
+      {
+        return 0;
+      }
+      len -= 2;
+      if (len < 7)
+      {
+        *op++ = static_cast<uint8_t>((off >> 8) + (len << 5));
+      }
+      else
+      {
+        *op++ = static_cast<uint8_t>((off >> 8) + (7 << 5));
+        *op++ = static_cast<uint8_t>(len - 7);
+      }
+      *op++ = static_cast<uint8_t>(off);
+      lit = 0;
+      ++op;
+
+      ip += len + 2;
+      // 匹配末尾的两个位置也加入哈希表
+      if (in_end - ip > 2)
+      {
+        table[Hash(ip - 2, hash_log)] = static_cast<uint32_t>(ip - 2 - base);
+        table[Hash(ip - 1, hash_log)] = static_cast<uint32_t>(ip - 1 - base);
+      }
+      continue;
+    }
+
+    if (op >= out_end)
+    {
+      return 0;
+    }
+    *op++ = *ip++;
+    if (++lit == kMaxLiteral)
+    {
+      op[-static_cast<ptrdiff_t>(lit) - 1] = static_cast<uint8_t>(lit - 1);
+      lit = 0;
+      ++op;
+    }
+  }
+
+  while (ip < in_end)
+  {
+    if (op >= out_end)
+    {
+      return 0;
+    }
+    *op++ = *ip++;
+    if (++lit == kMaxLiteral)
+    {
+      op[-static_cast<ptrdiff_t>(lit) - 1] = static_cast<uint8_t>(lit - 1);
+      lit = 0;
+      ++op;
+    }
+  }
+  if (lit == 0)
+  {
+    --op;
+  }
+  else
+  {
+    op[-static_cast<ptrdiff_t>(lit) - 1] = static_cast<uint8_t>(lit - 1);
+  }
+  return op - out_begin;
+}
+
+size_t LzfDecompress(const void *in, size_t in_len, void *out, size_t out_len)
+{
+  const uint8_t *ip = static_cast<const uint8_t *>(in);
+  const uint8_t *in_end = ip + in_len;
+  uint8_t *op = static_cast<uint8_t *>(out);
+  uint8_t *out_begin = op;
+  uint8_t *out_end = op + out_len;
+
+  while (ip < in_end)
+  {
+    size_t ctrl = *ip++;
+    if (ctrl < kMaxLiteral)
+    {
+      size_t len = ctrl + 1;
+      if (static_cast<size_t>(out_end - op) < len ||
+          static_cast<size_t>(in_end - ip) < len)
+      {
+        return 0;
+      }
+      memcpy(op, ip, len);
+      op += len;
+      ip += len;
+    }
+    else
+    {
+      size_t len = ctrl >> 5;
+      if (len == 7)
+      {
+        if (ip == in_end)
+        {
+          return 0;
+        }
+        len += *ip++;
+      }
+      if (ip == in_end)
+      {
+        return 0;
+      }
+      size_t off = ((ctrl & 0x1f) << 8) + *ip++ + 1;
+      len += 2;
+      if (off > static_cast<size_t>(op - out_begin) ||
+          static_cast<size_t>(out_end - op) < len)
+      {
+        return 0;
+      }
+      const uint8_t *ref = op - off;
+      if (off >= len)
+      {
+        memcpy(op, ref, len);
+        op += len;
+      }
+      else
+      {
+        // 源和目标重叠，逐字节复制
+        while (len--)
+        {
+          *op++ = *ref++;
+        }
+      }
+    }
+  }
+  return op - out_begin;
+}
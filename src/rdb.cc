@@ -0,0 +1,510 @@
+#include "rdb.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "crc64.h"
+#include "lzf.h"
+
+// 压缩后的长度上界，用于输出缓冲区
+static size_t CompressBound(size_t len) { return len + len / 32 + 16; }
+
+static int64_t MonotonicMicros()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool RdbSection::Verify() const
+{
+  return Crc64(0, payload_, len_) == crc_;
+}
+
+bool RdbSection::Decompress(std::string *raw) const
+{
+  raw->resize(raw_len_);
+  return raw_len_ != 0 &&
+         LzfDecompress(payload_, len_, &(*raw)[0], raw_len_) == raw_len_;
+}
+
+RdbWriter::RdbWriter(int fd, size_t buffer_size)
+    : fd_(fd), out_(nullptr), buffer_size_(buffer_size), compress_(false),
+      rate_limit_(0), tokens_(0), last_refill_us_(0), sync_bytes_(0),
+      synced_(0), dropped_(0), progress_(nullptr), ok_(true), offset_(0),
+      db_(0), type_(0), count_(0)
+{
+  section_.reserve(buffer_size_);
+}
+
+RdbWriter::RdbWriter(std::string *out, size_t buffer_size)
+    : fd_(-1), out_(out), buffer_size_(buffer_size), compress_(false),
+      rate_limit_(0), tokens_(0), last_refill_us_(0), sync_bytes_(0),
+      synced_(0), dropped_(0), progress_(nullptr), ok_(true), offset_(0),
+      db_(0), type_(0), count_(0)
+{
+  section_.reserve(buffer_size_);
+}
+
+void RdbWriter::SetRateLimit(uint64_t bytes_per_sec)
+{
+  rate_limit_ = bytes_per_sec;
+  tokens_ = 0;
+  last_refill_us_ = MonotonicMicros();
+}
+
+void RdbWriter::Write(const char *data, size_t len)
+{
+  if (!ok_)
+  {
+    return;
+  }
+  if (out_ != nullptr)
+  {
+    offset_ += len;
+    out_->append(data, len);
+    return;
+  }
+  while (len > 0 && ok_)
+  {
+    size_t chunk = len;
+    if (rate_limit_ > 0 && chunk > rdb::kThrottleChunk)
+    {
+      chunk = rdb::kThrottleChunk;
+    }
+    Throttle(chunk);
+    WriteFd(data, chunk);
+    data += chunk;
+    len -= chunk;
+    offset_ += chunk;
+    if (progress_ != nullptr)
+    {
+      progress_->bytes_written_.fetch_add(chunk, std::memory_order_relaxed);
+    }
+    if (sync_bytes_ > 0 && offset_ - synced_ >= sync_bytes_)
+    {
+      SyncRange();
+    }
+  }
+}
+
+void RdbWriter::WriteFd(const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = ::write(fd_, data, len);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      ok_ = false;
+      return;
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+void RdbWriter::Throttle(size_t len)
+{
+  if (rate_limit_ == 0)
+  {
+    return;
+  }
+  int64_t now = MonotonicMicros();
+  tokens_ += static_cast<double>(now - last_refill_us_) * rate_limit_ / 1e6;
+  last_refill_us_ = now;
+  double burst = rate_limit_ / 10.0;
+  if (tokens_ > burst)
+  {
+    tokens_ = burst;
+  }
+  tokens_ -= len;
+  if (tokens_ < 0)
+  {
+    // 欠下的配额补足后再写，睡眠期间产生的令牌在下次计算时补上
+    int64_t wait_us = static_cast<int64_t>(-tokens_ * 1e6 / rate_limit_);
+    struct timespec ts = {static_cast<time_t>(wait_us / 1000000),
+                          static_cast<long>(wait_us % 1000000 * 1000)};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+    {
+    }
+  }
+}
+
+void RdbWriter::SyncRange()
+{
+#ifdef __linux__
+  // 异步启动新写出部分的回写
+  sync_file_range(fd_, synced_, offset_ - synced_, SYNC_FILE_RANGE_WRITE);
+  // 等待上一部分落盘，之后其页缓存可以直接丢弃
+  if (dropped_ < synced_)
+  {
+    sync_file_range(fd_, dropped_, synced_ - dropped_,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd_, dropped_, synced_ - dropped_, POSIX_FADV_DONTNEED);
+    dropped_ = synced_;
+  }
+#else
+  fdatasync(fd_);
+  posix_fadvise(fd_, dropped_, offset_ - dropped_, POSIX_FADV_DONTNEED);
+  dropped_ = offset_;
+#endif
+  synced_ = offset_;
+}
+
+void RdbWriter::AppendVarint(std::string *dst, uint64_t value)
+{
+  char buf[10];
+  int n = 0;
+  while (value >= 0x80)
+  {
+    buf[n++] = static_cast<char>(value | 0x80);
+    value >>= 7;
+  }
+  buf[n++] = static_cast<char>(value);
+  dst->append(buf, n);
+}
+
+void RdbWriter::AppendFixed64(std::string *dst, uint64_t value)
+{
+  char buf[8];
+  for (int i = 0; i < 8; i++)
+  {
+    buf[i] = static_cast<char>(value >> (8 * i));
+  }
+  dst->append(buf, 8);
+}
+
+void RdbWriter::WriteHeader()
+{
+  char version = static_cast<char>(rdb::kVersion);
+  Write(rdb::kMagic, rdb::kMagicLen);
+  Write(&version, 1);
+}
+
+void RdbWriter::WriteEof()
+{
+  // 索引偏移指向kOpEof
+  uint64_t index_offset = offset_;
+  char op = static_cast<char>(rdb::kOpEof);
+  Write(&op, 1);
+
+  std::string entries;
+  AppendVarint(&entries, index_.size());
+  for (auto &entry : index_)
+  {
+    AppendVarint(&entries, entry.db_);
+    entries.push_back(static_cast<char>(entry.type_));
+    AppendVarint(&entries, entry.count_);
+    AppendVarint(&entries, entry.offset_);
+  }
+  std::string index;
+  index.push_back(static_cast<char>(rdb::kOpIndex));
+  index.append(entries);
+  AppendFixed64(&index, Crc64(0, entries.data(), entries.size()));
+  AppendFixed64(&index, index_offset);
+  index.append(rdb::kIndexMagic, rdb::kMagicLen);
+  Write(index.data(), index.size());
+}
+
+void RdbWriter::BeginSection(int index, int type)
+{
+  db_ = index;
+  type_ = type;
+  count_ = 0;
+  section_.clear();
+}
+
+void RdbWriter::EndSection()
+{
+  if (count_ == 0)
+  {
+    return;
+  }
+  const char *payload = section_.data();
+  size_t len = section_.size();
+  uint8_t encoding = rdb::kEncRaw;
+  if (compress_)
+  {
+    // 至少节省1/16才值得载入时解压
+    compressed_.resize(CompressBound(len));
+    size_t n = LzfCompress(section_.data(), len, &compressed_[0], len - len / 16);
+    if (n > 0)
+    {
+      payload = compressed_.data();
+      len = n;
+      encoding = rdb::kEncLzf;
+    }
+  }
+
+  std::string head;
+  head.push_back(static_cast<char>(rdb::kOpSection));
+  AppendVarint(&head, db_);
+  head.push_back(static_cast<char>(type_));
+  head.push_back(static_cast<char>(encoding));
+  AppendVarint(&head, count_);
+  AppendVarint(&head, len);
+  if (encoding == rdb::kEncLzf)
+  {
+    AppendVarint(&head, section_.size());
+  }
+  std::string crc;
+  AppendFixed64(&crc, Crc64(0, payload, len));
+
+  index_.push_back(RdbIndexEntry{db_, type_, count_, offset_});
+  Write(head.data(), head.size());
+  Write(payload, len);
+  Write(crc.data(), crc.size());
+
+  if (progress_ != nullptr)
+  {
+    progress_->keys_saved_.fetch_add(count_, std::memory_order_relaxed);
+  }
+  section_.clear();
+  // 单个大条目撑大的缓冲区不长期占用
+  if (section_.capacity() > 2 * buffer_size_)
+  {
+    section_.shrink_to_fit();
+    section_.reserve(buffer_size_);
+  }
+  count_ = 0;
+}
+
+void RdbWriter::PutEntry(int64_t expire, const std::string &key)
+{
+  if (section_.size() >= buffer_size_)
+  {
+    int db = db_, type = type_;
+    EndSection();
+    BeginSection(db, type);
+  }
+  ++count_;
+  AppendVarint(&section_, expire > 0 ? expire : 0);
+  PutString(key);
+}
+
+void RdbWriter::PutVarint(uint64_t value) { AppendVarint(&section_, value); }
+
+void RdbWriter::PutDouble(double value)
+{
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  AppendFixed64(&section_, bits);
+}
+
+void RdbWriter::PutString(const std::string &value)
+{
+  if (compress_ && value.size() >= rdb::kCompressMinLen)
+  {
+    // 压缩后至少节省原始长度字段占用的空间
+    compressed_.resize(CompressBound(value.size()));
+    size_t n = LzfCompress(value.data(), value.size(), &compressed_[0],
+                           value.size() - 4);
+    if (n > 0)
+    {
+      AppendVarint(&section_, static_cast<uint64_t>(n) << 1 | 1);
+      AppendVarint(&section_, value.size());
+      section_.append(compressed_.data(), n);
+      return;
+    }
+  }
+  AppendVarint(&section_, static_cast<uint64_t>(value.size()) << 1);
+  section_.append(value);
+}
+
+bool RdbReader::ReadHeader()
+{
+  if (static_cast<size_t>(end_ - cur_) < rdb::kMagicLen + 1 ||
+      memcmp(cur_, rdb::kMagic, rdb::kMagicLen) != 0 ||
+      static_cast<uint8_t>(cur_[rdb::kMagicLen]) != rdb::kVersion)
+  {
+    return Fail();
+  }
+  cur_ += rdb::kMagicLen + 1;
+  return true;
+}
+
+int RdbReader::ReadSection(RdbSection *section)
+{
+  uint8_t op, type, encoding;
+  uint64_t db, len;
+  if (!GetByte(&op))
+  {
+    return -1;
+  }
+  if (op == rdb::kOpEof)
+  {
+    return 0;
+  }
+  if (op != rdb::kOpSection || !GetVarint(&db) || !GetByte(&type) ||
+      !GetByte(&encoding) || !GetVarint(&section->count_) ||
+      !GetVarint(&len) ||
+      (encoding == rdb::kEncLzf && !GetVarint(&section->raw_len_)) ||
+      static_cast<uint64_t>(end_ - cur_) < len)
+  {
+    Fail();
+    return -1;
+  }
+  section->db_ = static_cast<int>(db);
+  section->type_ = type;
+  section->encoding_ = encoding;
+  section->payload_ = cur_;
+  section->len_ = len;
+  cur_ += len;
+  if (!GetFixed64(&section->crc_))
+  {
+    return -1;
+  }
+  return 1;
+}
+
+bool RdbReader::ReadIndex(const char *data, size_t len,
+                          std::vector<RdbIndexEntry> *index)
+{
+  const size_t trailer = 8 + rdb::kMagicLen;
+  if (len < trailer ||
+      memcmp(data + len - rdb::kMagicLen, rdb::kIndexMagic,
+             rdb::kMagicLen) != 0)
+  {
+    return false;
+  }
+  RdbReader offset_reader(data + len - trailer, 8);
+  uint64_t offset;
+  offset_reader.GetFixed64(&offset);
+  if (offset >= len - trailer)
+  {
+    return false;
+  }
+
+  // kOpEof之后是kOpIndex
+  RdbReader reader(data + offset, len - trailer - offset);
+  uint8_t op;
+  uint64_t n;
+  if (!reader.GetByte(&op) || op != rdb::kOpEof || !reader.GetByte(&op) ||
+      op != rdb::kOpIndex)
+  {
+    return false;
+  }
+  const char *entries = reader.Pos();
+  if (!reader.GetVarint(&n))
+  {
+    return false;
+  }
+  index->clear();
+  for (uint64_t i = 0; i < n; i++)
+  {
+    uint64_t db, count, section_offset;
+    uint8_t type;
+    if (!reader.GetVarint(&db) || !reader.GetByte(&type) ||
+        !reader.GetVarint(&count) || !reader.GetVarint(&section_offset) ||
+        section_offset >= offset)
+    {
+      return false;
+    }
+    index->push_back(RdbIndexEntry{static_cast<int>(db), type, count,
+                                   section_offset});
+  }
+  uint64_t crc;
+  const char *entries_end = reader.Pos();
+  if (!reader.GetFixed64(&crc) ||
+      Crc64(0, entries, entries_end - entries) != crc)
+  {
+    index->clear();
+    return false;
+  }
+  return true;
+}
+
+bool RdbReader::GetByte(uint8_t *value)
+{
+  if (!ok_ || cur_ == end_)
+  {
+    return Fail();
+  }
+  *value = static_cast<uint8_t>(*cur_++);
+  return true;
+}
+
+bool RdbReader::GetVarint(uint64_t *value)
+{
+  uint64_t result = 0;
+  for (int shift = 0; ok_ && shift <= 63 && cur_ != end_; shift += 7)
+  {
+    uint64_t byte = static_cast<uint8_t>(*cur_++);
+    result |= (byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+    {
+      *value = result;
+      return true;
+    }
+  }
+  return Fail();
+}
+
+bool RdbReader::GetFixed64(uint64_t *value)
+{
+  if (!ok_ || end_ - cur_ < 8)
+  {
+    return Fail();
+  }
+  uint64_t result = 0;
+  for (int i = 0; i < 8; i++)
+  {
+    result |= static_cast<uint64_t>(static_cast<uint8_t>(cur_[i])) << (8 * i);
+  }
+  cur_ += 8;
+  *value = result;
+  return true;
+}
+
+bool RdbReader::GetDouble(double *value)
+{
+  uint64_t bits;
+  if (!GetFixed64(&bits))
+  {
+    return false;
+  }
+  memcpy(value, &bits, sizeof(bits));
+  return true;
+}
+
+bool RdbReader::GetString(std::string *value)
+{
+  uint64_t header;
+  if (!GetVarint(&header))
+  {
+    return false;
+  }
+  uint64_t len = header >> 1;
+  if (header & 1)
+  {
+    uint64_t raw_len;
+    if (!GetVarint(&raw_len) || raw_len == 0 ||
+        static_cast<uint64_t>(end_ - cur_) < len)
+    {
+      return Fail();
+    }
+    value->resize(raw_len);
+    if (LzfDecompress(cur_, len, &(*value)[0], raw_len) != raw_len)
+    {
+      return Fail();
+    }
+    cur_ += len;
+    return true;
+  }
+  if (static_cast<uint64_t>(end_ - cur_) < len)
+  {
+    return Fail();
+  }
+  value->assign(cur_, len);
+  cur_ += len;
+  return true;
+}
@@ -0,0 +1,456 @@
+#include "rdb_loader.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <thread>
+
+#include "database.h"
+#include "db_log.h"
+#include "rdb.h"
+
+namespace
+{
+  // 用threads个线程执行func(0) ... func(n - 1)，任务通过共享计数器领取
+  template <typename Func>
+  void ParallelFor(size_t n, int threads, Func func)
+  {
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+      size_t i;
+      while ((i = next.fetch_add(1)) < n)
+      {
+        func(i);
+      }
+    };
+    threads = static_cast<int>(std::min<size_t>(threads, n));
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; ++t)
+    {
+      pool.emplace_back(worker);
+    }
+    // 当前线程也参与
+    worker();
+    for (auto &thread : pool)
+    {
+      thread.join();
+    }
+  }
+
+  /**
+   * 只读映射rdb文件，fd保持打开以便丢弃页缓存。
+   * 文件不存在或为空时返回nullptr，*ok为true
+   */
+  char *MapFile(const std::string &path, bool populate, int *fd, size_t *len,
+                bool *ok)
+  {
+    *ok = true;
+    *fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (*fd < 0)
+    {
+      if (errno != ENOENT)
+      {
+        DB_LOG_ERROR << "open " << path << " error: " << strerror(errno);
+        *ok = false;
+      }
+      return nullptr;
+    }
+
+    // 获取文件信息
+    struct stat buf;
+    fstat(*fd, &buf);
+    *len = buf.st_size;
+    if (*len == 0)
+    {
+      close(*fd);
+      return nullptr;
+    }
+
+    char *addr = static_cast<char *>(
+        mmap(NULL, *len, PROT_READ, MAP_PRIVATE | (populate ? MAP_POPULATE : 0),
+             *fd, 0));
+    if (addr == MAP_FAILED)
+    {
+      DB_LOG_ERROR << "mmap " << path << " error: " << strerror(errno);
+      close(*fd);
+      *ok = false;
+      return nullptr;
+    }
+    madvise(addr, *len, MADV_SEQUENTIAL);
+    return addr;
+  }
+
+  // 收集需要载入的段，优先使用段索引
+  bool CollectSections(const char *addr, size_t len,
+                       const std::function<bool(int)> &wanted,
+                       std::vector<RdbSection> *sections)
+  {
+    RdbReader reader(addr, len);
+    std::vector<RdbIndexEntry> index;
+    if (!reader.ReadHeader())
+    {
+      DB_LOG_ERROR << "unsupported rdb file";
+      return false;
+    }
+    if (RdbReader::ReadIndex(addr, len, &index))
+    {
+      for (auto &entry : index)
+      {
+        if (!wanted(entry.db_))
+        {
+          continue;
+        }
+        RdbSection section;
+        RdbReader section_reader(addr + entry.offset_, len - entry.offset_);
+        if (section_reader.ReadSection(&section) != 1 ||
+            section.db_ != entry.db_ || section.type_ != entry.type_)
+        {
+          return false;
+        }
+        sections->push_back(section);
+      }
+      return true;
+    }
+
+    RdbSection section;
+    int ret;
+    while ((ret = reader.ReadSection(&section)) > 0)
+    {
+      if (wanted(section.db_))
+      {
+        sections->push_back(section);
+      }
+    }
+    return ret == 0;
+  }
+
+  /**
+   * 段解析完后其数据已复制到暂存结果中，丢弃映射的页和页缓存。
+   * 只丢弃完全属于该段的页，首尾与相邻段共用的页留给相邻段
+   * @return 丢弃的字节数
+   */
+  uint64_t ReleaseSection(const char *addr, int fd, const RdbSection &section)
+  {
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = reinterpret_cast<uintptr_t>(section.payload_);
+    uintptr_t end = begin + section.len_;
+    begin = (begin + page - 1) / page * page;
+    end = end / page * page;
+    if (begin >= end)
+    {
+      return 0;
+    }
+    madvise(reinterpret_cast<void *>(begin), end - begin, MADV_DONTNEED);
+    posix_fadvise(fd, begin - reinterpret_cast<uintptr_t>(addr), end - begin,
+                  POSIX_FADV_DONTNEED);
+    return end - begin;
+  }
+} // namespace
+
+RdbLoader::RdbLoader(const std::vector<StorageEngine *> &dbs, int threads)
+    : dbs_(dbs), threads_(threads), keys_loaded_(0), sections_loaded_(0)
+{
+  if (threads_ <= 0)
+  {
+    threads_ = std::max(1u, std::thread::hardware_concurrency());
+  }
+}
+
+bool RdbLoader::Load(const std::string &path)
+{
+  keys_loaded_ = 0;
+  sections_loaded_ = 0;
+
+  // 载入所有库时整个文件都要读，映射时一次预读完；只载入个别库时按需读取
+  bool whole = std::all_of(dbs_.begin(), dbs_.end(),
+                           [](StorageEngine *db) { return db != nullptr; });
+  int fd;
+  size_t len;
+  bool ok;
+  char *addr = MapFile(path, whole, &fd, &len, &ok);
+  if (addr == nullptr)
+  {
+    return ok;
+  }
+
+  Timestamp start = Timestamp::now();
+  auto wanted = [this](int db) {
+    return db >= 0 && static_cast<size_t>(db) < dbs_.size() &&
+           dbs_[db] != nullptr;
+  };
+  std::vector<RdbSection> sections;
+  ok = CollectSections(addr, len, wanted, &sections);
+
+  // 阶段一: 并行校验、解析，解析完的段立即丢弃其映射的页，
+  // 载入过程中的内存占用约为数据集大小，而不是再加上整个文件
+  std::atomic<uint64_t> released(0);
+  std::vector<RdbStage> stages(sections.size());
+  std::vector<char> parsed(sections.size(), 0);
+  ParallelFor(sections.size(), threads_, [&](size_t i) {
+    parsed[i] = sections[i].Verify() &&
+                Database::RdbParseSection(sections[i], &stages[i]);
+    released += ReleaseSection(addr, fd, sections[i]);
+  });
+
+  // 只并入第一个损坏的段之前的段
+  size_t valid = std::find(parsed.begin(), parsed.end(), 0) - parsed.begin();
+  if (valid != sections.size())
+  {
+    ok = false;
+  }
+
+  // 阶段二: 按(库, 类型)分组，组内保持文件顺序，组间并行
+  std::map<std::pair<int, int>, std::vector<size_t>> group_map;
+  for (size_t i = 0; i < valid; ++i)
+  {
+    group_map[std::make_pair(stages[i].db_, stages[i].type_)].push_back(i);
+    keys_loaded_ += stages[i].keys_.size();
+  }
+  std::vector<std::vector<size_t>> groups;
+  for (auto &group : group_map)
+  {
+    groups.emplace_back(std::move(group.second));
+  }
+  ParallelFor(groups.size(), threads_, [&](size_t g) {
+    for (size_t i : groups[g])
+    {
+      dbs_[stages[i].db_]->RdbMergeStage(std::move(stages[i]));
+    }
+  });
+  sections_loaded_ = valid;
+
+  munmap(addr, len);
+  close(fd);
+  if (!ok)
+  {
+    DB_LOG_ERROR << "rdb file " << path << " is corrupted, loaded "
+              << sections_loaded_ << " sections before the damage";
+  }
+  DB_LOG_INFO << "rdb loaded " << keys_loaded_ << " keys from "
+           << sections_loaded_ << " sections in "
+           << timeDifference(Timestamp::now(), start) << "s with "
+           << threads_ << " threads, released " << released
+           << " bytes of mapping during parse";
+  return ok;
+}
+
+AsyncRdbLoader::AsyncRdbLoader(const std::vector<StorageEngine *> &dbs)
+    : dbs_(dbs),
+      addr_(nullptr),
+      len_(0),
+      fd_(-1),
+      stop_(false),
+      ok_(true),
+      merge_queued_(false),
+      parsed_(0),
+      merged_(0),
+      keys_loaded_(0),
+      bytes_loaded_(0),
+      bytes_total_(0),
+      start_(Timestamp::invalid()) {}
+
+AsyncRdbLoader::~AsyncRdbLoader()
+{
+  stop_ = true;
+  if (thread_.joinable())
+  {
+    thread_.join();
+  }
+  if (addr_ != nullptr)
+  {
+    munmap(addr_, len_);
+    close(fd_);
+  }
+}
+
+bool AsyncRdbLoader::Start(const std::string &path,
+                           const std::function<void()> &ready,
+                           const std::function<void(bool)> &done)
+{
+  bool ok;
+  addr_ = MapFile(path, false, &fd_, &len_, &ok);
+  if (addr_ == nullptr)
+  {
+    return false;
+  }
+  auto wanted = [this](int db) {
+    return db >= 0 && static_cast<size_t>(db) < dbs_.size() &&
+           dbs_[db] != nullptr;
+  };
+  ok_ = CollectSections(addr_, len_, wanted, &sections_);
+  if (!ok_)
+  {
+    DB_LOG_ERROR << "rdb file " << path << " is corrupted";
+  }
+  if (sections_.empty())
+  {
+    munmap(addr_, len_);
+    close(fd_);
+    addr_ = nullptr;
+    return false;
+  }
+
+  path_ = path;
+  ready_ = ready;
+  done_ = done;
+  start_ = Timestamp::now();
+  state_.assign(sections_.size(), kPending);
+  for (size_t i = 0; i < sections_.size(); ++i)
+  {
+    stages_.emplace_back(new RdbStage);
+    groups_[std::make_pair(sections_[i].db_, sections_[i].type_)].push_back(i);
+    bytes_total_ += sections_[i].len_;
+  }
+  thread_ = std::thread(&AsyncRdbLoader::Run, this);
+  return true;
+}
+
+bool AsyncRdbLoader::Parse(size_t i)
+{
+  bool ok = sections_[i].Verify() &&
+            Database::RdbParseSection(sections_[i], stages_[i].get());
+  if (!ok)
+  {
+    DB_LOG_ERROR << "rdb section " << i << " of " << path_
+              << " is corrupted, skipped";
+    *stages_[i] = RdbStage();
+  }
+  ReleaseSection(addr_, fd_, sections_[i]);
+  bytes_loaded_ += sections_[i].len_;
+  return ok;
+}
+
+void AsyncRdbLoader::Run()
+{
+  for (size_t i = 0; i < sections_.size() && !stop_; ++i)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (state_[i] != kPending)
+      {
+        // 已被主线程优先载入
+        continue;
+      }
+      state_[i] = kParsing;
+    }
+    bool ok = Parse(i);
+    bool notify;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      state_[i] = kParsed;
+      ok_ = ok_ && ok;
+      ++parsed_;
+      // 主线程还没处理上一次通知时不重复通知
+      notify = !merge_queued_;
+      merge_queued_ = true;
+    }
+    cond_.notify_all();
+    if (notify)
+    {
+      ready_();
+    }
+  }
+}
+
+void AsyncRdbLoader::Merge(size_t i)
+{
+  keys_loaded_ += stages_[i]->keys_.size();
+  dbs_[sections_[i].db_]->RdbMergeStage(std::move(*stages_[i]));
+  stages_[i].reset();
+  ++merged_;
+}
+
+void AsyncRdbLoader::MergeReady()
+{
+  std::vector<size_t> ready;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    merge_queued_ = false;
+    for (size_t i = 0; i < state_.size(); ++i)
+    {
+      if (state_[i] == kParsed)
+      {
+        state_[i] = kMerged;
+        ready.push_back(i);
+      }
+    }
+  }
+  for (size_t i : ready)
+  {
+    Merge(i);
+  }
+  CheckDone();
+}
+
+void AsyncRdbLoader::EnsureLoaded(int db, int type)
+{
+  auto group = groups_.find(std::make_pair(db, type));
+  if (group == groups_.end())
+  {
+    return;
+  }
+  for (size_t i : group->second)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (state_[i] == kMerged)
+    {
+      continue;
+    }
+    if (state_[i] == kPending)
+    {
+      // 后台线程还没解析到，在当前线程立即解析
+      state_[i] = kParsing;
+      lock.unlock();
+      bool ok = Parse(i);
+      lock.lock();
+      ok_ = ok_ && ok;
+      ++parsed_;
+    }
+    else
+    {
+      // 后台线程正在解析，只等待这一个段
+      cond_.wait(lock, [&] { return state_[i] != kParsing; });
+    }
+    state_[i] = kMerged;
+    lock.unlock();
+    Merge(i);
+  }
+  groups_.erase(group);
+  CheckDone();
+}
+
+void AsyncRdbLoader::EnsureAllLoaded()
+{
+  while (!groups_.empty())
+  {
+    auto group = groups_.begin()->first;
+    EnsureLoaded(group.first, group.second);
+  }
+}
+
+void AsyncRdbLoader::CheckDone()
+{
+  if (merged_ != sections_.size() || !done_)
+  {
+    return;
+  }
+  groups_.clear();
+  thread_.join();
+  munmap(addr_, len_);
+  close(fd_);
+  addr_ = nullptr;
+  DB_LOG_INFO << "rdb loaded " << keys_loaded_ << " keys from " << merged_
+           << " sections in background in "
+           << timeDifference(Timestamp::now(), start_) << "s";
+  // done可能销毁当前对象，放在最后
+  auto done = std::move(done_);
+  done_ = nullptr;
+  done(ok_);
+}
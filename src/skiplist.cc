@@ -1,7 +1,11 @@
 #include "skiplist.h"
 
 #include <cassert>
+#include <cmath>
+#include <cstdlib>
 #include <memory>
+#include <random>
+#include <thread>
 
 SkiplistNode::SkiplistNode(const std::string &obj, double score, int level)
     : obj_(obj), score_(score)
@@ -14,10 +18,86 @@ SkiplistNode::SkiplistNode(const std::string &obj, double score, int level)
   }
 }
 
+bool ParseScore(const std::string &str, double *score)
+{
+  char *end = nullptr;
+  *score = strtod(str.c_str(), &end);
+  return !str.empty() && *end == '\0' && !std::isnan(*score);
+}
+
+// 无误差的加法：a + b = *s + *e
+static void TwoSum(double a, double b, double *s, double *e)
+{
+  *s = a + b;
+  double bb = *s - a;
+  *e = (a - (*s - bb)) + (b - bb);
+}
+
+void ScoreSum::Add(double score)
+{
+  if (std::isinf(score))
+  {
+    ++(score > 0 ? pos_inf_ : neg_inf_);
+    return;
+  }
+  double e;
+  TwoSum(hi_, score, &hi_, &e);
+  TwoSum(hi_, lo_ + e, &hi_, &lo_);
+}
+
+void ScoreSum::Sub(double score)
+{
+  if (std::isinf(score))
+  {
+    --(score > 0 ? pos_inf_ : neg_inf_);
+    return;
+  }
+  Add(-score);
+}
+
+ScoreSum &ScoreSum::operator+=(const ScoreSum &rhs)
+{
+  double e;
+  TwoSum(hi_, rhs.hi_, &hi_, &e);
+  TwoSum(hi_, lo_ + rhs.lo_ + e, &hi_, &lo_);
+  pos_inf_ += rhs.pos_inf_;
+  neg_inf_ += rhs.neg_inf_;
+  return *this;
+}
+
+ScoreSum &ScoreSum::operator-=(const ScoreSum &rhs)
+{
+  double e;
+  TwoSum(hi_, -rhs.hi_, &hi_, &e);
+  TwoSum(hi_, lo_ - rhs.lo_ + e, &hi_, &lo_);
+  pos_inf_ -= rhs.pos_inf_;
+  neg_inf_ -= rhs.neg_inf_;
+  return *this;
+}
+
+double ScoreSum::Value() const
+{
+  if (pos_inf_ != 0 && neg_inf_ != 0)
+  {
+    return NAN;
+  }
+  if (pos_inf_ != 0)
+  {
+    return INFINITY;
+  }
+  if (neg_inf_ != 0)
+  {
+    return -INFINITY;
+  }
+  return hi_ + lo_;
+}
+
 // implement for skiplist
 
 Skiplist::Skiplist()
-    : header_(new SkiplistNode("", 0, MAX_LEVEL)), length_(0), level_(1) {}
+    : header_(new SkiplistNode("", 0, MAX_LEVEL)),
+      level_(1),
+      length_(0) {}
 
 Skiplist::~Skiplist()
 {
@@ -44,8 +124,11 @@ int Skiplist::GetRandomLevel()
 {
   // 0.25的概率
   static const unsigned int kBranching = 4;
+  // 每个线程独立的随机数引擎，并行载入时构建跳表不在rand()的全局锁上竞争
+  static thread_local std::mt19937 engine(
+      std::hash<std::thread::id>()(std::this_thread::get_id()));
   int level = 1;
-  while (level < MAX_LEVEL && ((rand() % kBranching) == 0))
+  while (level < MAX_LEVEL && ((engine() % kBranching) == 0))
   {
     level++;
   }
@@ -66,16 +149,23 @@ void Skiplist::InsertNode(const std::string &obj, double score)
 
   // 待插入节点的前驱节点
   SkiplistNode *update[MAX_LEVEL];
+  // 前驱节点的排名及其之前(含)所有节点的分值和
+  unsigned long rank[MAX_LEVEL];
+  ScoreSum rank_sum[MAX_LEVEL];
   SkiplistNode *tmp = header_;
 
   // 从最上层开始遍历
   for (int i = level_ - 1; i >= 0; --i)
   {
+    rank[i] = i == level_ - 1 ? 0 : rank[i + 1];
+    rank_sum[i] = i == level_ - 1 ? ScoreSum() : rank_sum[i + 1];
     while (tmp->levels_[i]->forward_ &&
            (tmp->levels_[i]->forward_->score_ < score ||
             (tmp->levels_[i]->forward_->score_ == score &&
-             tmp->levels_[i]->forward_->obj_ != obj)))
+             tmp->levels_[i]->forward_->obj_ < obj)))
     {
+      rank[i] += tmp->levels_[i]->span_;
+      rank_sum[i] += tmp->levels_[i]->sum_;
       tmp = tmp->levels_[i]->forward_;
     }
     // 记录第i层遍历到的最后一个节点,即在该节点后插入新节点
@@ -88,21 +178,41 @@ void Skiplist::InsertNode(const std::string &obj, double score)
   {
     for (int i = level_; i < level; i++)
     {
+      rank[i] = 0;
+      rank_sum[i] = ScoreSum();
       update[i] = header_;
+      update[i]->levels_[i]->span_ = length_;
+      update[i]->levels_[i]->sum_ = sum_;
     }
     level_ = level;
   }
 
-  // 插入新节点
-  tmp = CreateNode(obj, score, level_);
+  // 插入新节点,新节点把前驱节点的跨度一分为二
+  tmp = CreateNode(obj, score, level);
   for (int i = 0; i < level; i++)
   {
     tmp->levels_[i]->forward_ = update[i]->levels_[i]->forward_;
     update[i]->levels_[i]->forward_ = tmp;
+
+    tmp->levels_[i]->span_ =
+        update[i]->levels_[i]->span_ - (rank[0] - rank[i]);
+    tmp->levels_[i]->sum_ =
+        update[i]->levels_[i]->sum_ - (rank_sum[0] - rank_sum[i]);
+    update[i]->levels_[i]->span_ = (rank[0] - rank[i]) + 1;
+    update[i]->levels_[i]->sum_ = rank_sum[0] - rank_sum[i];
+    update[i]->levels_[i]->sum_.Add(score);
+  }
+
+  // 更高的层跨过了新节点
+  for (int i = level; i < level_; i++)
+  {
+    update[i]->levels_[i]->span_++;
+    update[i]->levels_[i]->sum_.Add(score);
   }
 
   // 长度加一
   length_++;
+  sum_.Add(score);
 }
 
 void Skiplist::DeleteNode(const std::string &obj, double score)
@@ -115,7 +225,7 @@ void Skiplist::DeleteNode(const std::string &obj, double score)
     while (tmp->levels_[i]->forward_ &&
            (tmp->levels_[i]->forward_->score_ < score ||
             (tmp->levels_[i]->forward_->score_ == score &&
-             tmp->levels_[i]->forward_->obj_ != obj)))
+             tmp->levels_[i]->forward_->obj_ < obj)))
     {
       tmp = tmp->levels_[i]->forward_;
     }
@@ -125,13 +235,21 @@ void Skiplist::DeleteNode(const std::string &obj, double score)
   tmp = tmp->levels_[0]->forward_;
   if (tmp && tmp->score_ == score && tmp->obj_ == obj)
   {
-    // 设置前进指针
+    // 设置前进指针,被删除节点的跨度并入前驱节点
     for (int i = 0; i < level_; i++)
     {
       if (update[i]->levels_[i]->forward_ == tmp)
       {
+        update[i]->levels_[i]->span_ += tmp->levels_[i]->span_ - 1;
+        update[i]->levels_[i]->sum_ += tmp->levels_[i]->sum_;
+        update[i]->levels_[i]->sum_.Sub(score);
         update[i]->levels_[i]->forward_ = tmp->levels_[i]->forward_;
       }
+      else
+      {
+        update[i]->levels_[i]->span_--;
+        update[i]->levels_[i]->sum_.Sub(score);
+      }
     }
 
     while (level_ > 1 && header_->levels_[level_ - 1]->forward_ == nullptr)
@@ -139,31 +257,125 @@ void Skiplist::DeleteNode(const std::string &obj, double score)
       level_--;
     }
     length_--;
+    sum_.Sub(score);
+    key_set_.erase(obj);
+    delete tmp;
   }
-  delete tmp;
 }
 
-unsigned long Skiplist::GetCountInRange(RangeSpec &range)
+bool Skiplist::GetScore(const std::string &obj, double *score) const
+{
+  auto it = key_set_.find(obj);
+  if (it == key_set_.end())
+  {
+    return false;
+  }
+  *score = it->second;
+  return true;
+}
+
+Skiplist::ptr Skiplist::BuildFromSorted(
+    std::vector<std::pair<std::string, double>> &&elems)
+{
+  ptr list = std::make_shared<Skiplist>();
+  // 每一层当前的最后一个节点,及其排名和之前(含)所有节点的分值和
+  SkiplistNode *tail[MAX_LEVEL];
+  unsigned long tail_rank[MAX_LEVEL];
+  ScoreSum tail_sum[MAX_LEVEL];
+  for (int i = 0; i < MAX_LEVEL; i++)
+  {
+    tail[i] = list->header_;
+    tail_rank[i] = 0;
+  }
+
+  list->key_set_.reserve(elems.size());
+  for (auto &elem : elems)
+  {
+    int level = list->GetRandomLevel();
+    if (level > list->level_)
+    {
+      list->level_ = level;
+    }
+    SkiplistNode *node = list->CreateNode(elem.first, elem.second, level);
+    list->length_++;
+    list->sum_.Add(elem.second);
+    for (int i = 0; i < level; i++)
+    {
+      tail[i]->levels_[i]->forward_ = node;
+      tail[i]->levels_[i]->span_ = list->length_ - tail_rank[i];
+      tail[i]->levels_[i]->sum_ = list->sum_ - tail_sum[i];
+      tail[i] = node;
+      tail_rank[i] = list->length_;
+      tail_sum[i] = list->sum_;
+    }
+    list->key_set_.emplace(std::move(elem.first), elem.second);
+  }
+  // 每层最后一个节点的跨度延伸到表尾
+  for (int i = 0; i < list->level_; i++)
+  {
+    tail[i]->levels_[i]->span_ = list->length_ - tail_rank[i];
+    tail[i]->levels_[i]->sum_ = list->sum_ - tail_sum[i];
+  }
+  return list;
+}
+
+SkiplistNode *Skiplist::GetNodeAfter(double score, const std::string &obj) const
 {
   SkiplistNode *tmp = header_;
-  unsigned long count = 0;
+  for (int i = level_ - 1; i >= 0; i--)
+  {
+    while (tmp->levels_[i]->forward_ &&
+           (tmp->levels_[i]->forward_->score_ < score ||
+            (tmp->levels_[i]->forward_->score_ == score &&
+             tmp->levels_[i]->forward_->obj_ <= obj)))
+    {
+      tmp = tmp->levels_[i]->forward_;
+    }
+  }
+  return tmp->levels_[0]->forward_;
+}
+
+unsigned long Skiplist::GetCountInRange(RangeSpec &range)
+{
+  return GetAggregateInRange(range).count_;
+}
 
+SkiplistNode *Skiplist::GetPrefix(double value, bool inclusive,
+                                  unsigned long *count, ScoreSum *sum)
+{
+  SkiplistNode *tmp = header_;
+  *count = 0;
+  *sum = ScoreSum();
   for (int i = level_ - 1; i >= 0; i--)
   {
     while (tmp->levels_[i]->forward_ &&
-           (range.minex_ ? tmp->levels_[i]->forward_->score_ <= range.min_
-                         : tmp->levels_[i]->forward_->score_ < range.min_))
+           (inclusive ? tmp->levels_[i]->forward_->score_ <= value
+                      : tmp->levels_[i]->forward_->score_ < value))
+    {
+      *count += tmp->levels_[i]->span_;
+      *sum += tmp->levels_[i]->sum_;
       tmp = tmp->levels_[i]->forward_;
+    }
   }
-  tmp = tmp->levels_[0]->forward_;
+  return tmp;
+}
 
-  while (tmp && (range.maxex_ ? tmp->score_ < range.max_
-                              : tmp->score_ <= range.max_))
+RangeAggregate Skiplist::GetAggregateInRange(RangeSpec &range)
+{
+  RangeAggregate res;
+  unsigned long lo_count, hi_count;
+  ScoreSum lo_sum, hi_sum;
+  // 范围之前的最后一个节点和范围内的最后一个节点
+  SkiplistNode *lo = GetPrefix(range.min_, range.minex_, &lo_count, &lo_sum);
+  SkiplistNode *hi = GetPrefix(range.max_, !range.maxex_, &hi_count, &hi_sum);
+  if (hi_count > lo_count)
   {
-    count++;
-    tmp = tmp->levels_[0]->forward_;
+    res.count_ = hi_count - lo_count;
+    res.sum_ = (hi_sum - lo_sum).Value();
+    res.min_ = lo->levels_[0]->forward_->score_;
+    res.max_ = hi->score_;
   }
-  return count;
+  return res;
 }
 
 std::vector<SkiplistNode *> Skiplist::GetNodeInRange(RangeSpec &range)
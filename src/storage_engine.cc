@@ -0,0 +1,49 @@
+#include "storage_engine.h"
+
+#include <sys/stat.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "database.h"
+#include "db_config.h"
+#include "db_log.h"
+#include "value_log.h"
+
+static std::unique_ptr<StorageEngine> CreateDict(const DbConfig &config,
+                                                 int index, int db_num,
+                                                 const RunAtFunc &run_at)
+{
+  std::unique_ptr<Database> db(new Database(run_at));
+  if (config.vlog_min_size_ > 0)
+  {
+    if (mkdir(config.vlog_dir_.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+      DB_LOG_ERROR << "create value log dir " << config.vlog_dir_
+                << " failed: " << strerror(errno);
+      return nullptr;
+    }
+    // 每个库一组值日志文件，块缓存容量均分
+    std::unique_ptr<ValueLog> vlog(
+        new ValueLog(config.vlog_dir_ + "/db" + std::to_string(index) + '-',
+                     config.vlog_cache_size_ / db_num));
+    if (!vlog->Open())
+    {
+      return nullptr;
+    }
+    db->SetValueLog(std::move(vlog), config.vlog_min_size_);
+  }
+  return db;
+}
+
+std::unique_ptr<StorageEngine> StorageEngine::Create(const DbConfig &config,
+                                                     int index, int db_num,
+                                                     const RunAtFunc &run_at)
+{
+  if (config.engine_ == "dict")
+  {
+    return CreateDict(config, index, db_num, run_at);
+  }
+  DB_LOG_ERROR << "unknown storage engine " << config.engine_;
+  return nullptr;
+}
@@ -0,0 +1,408 @@
+#include "value_log.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "db_log.h"
+
+const uint64_t ValueLog::kDefaultFileSize;
+const size_t ValueLog::kBlockSize;
+constexpr double ValueLog::kGcRatio;
+
+// 记录头：键长度、值长度各4字节小端
+static const size_t kRecordHeaderLen = 8;
+
+static void EncodeFixed32(char *dst, uint32_t value)
+{
+  for (int i = 0; i < 4; ++i)
+  {
+    dst[i] = static_cast<char>(value >> (8 * i));
+  }
+}
+
+static uint32_t DecodeFixed32(const char *src)
+{
+  uint32_t value = 0;
+  for (int i = 0; i < 4; ++i)
+  {
+    value |= static_cast<uint32_t>(static_cast<uint8_t>(src[i])) << (8 * i);
+  }
+  return value;
+}
+
+ValueLog::ValueLog(const std::string &prefix, size_t cache_size,
+                   uint64_t file_size)
+    : prefix_(prefix),
+      pid_(getpid()),
+      file_size_(file_size),
+      active_(0),
+      gc_file_(0),
+      gc_offset_(0),
+      cache_size_(cache_size),
+      cache_used_(0),
+      cache_hits_(0),
+      cache_misses_(0) {}
+
+ValueLog::~ValueLog()
+{
+  // 值日志不负责持久化，退出时删除所有文件
+  while (!files_.empty())
+  {
+    RemoveFile(files_.begin()->first);
+  }
+}
+
+std::string ValueLog::FileName(uint32_t id) const
+{
+  return prefix_ + std::to_string(pid_) + '-' + std::to_string(id) + ".vlog";
+}
+
+bool ValueLog::Open()
+{
+  // 删除上次运行(可能是崩溃)留下的文件。热升级时旧进程的文件也在此删除，
+  // 旧进程已把数据写入镜像，仍打开的文件描述符不受影响
+  std::string dir = ".";
+  std::string base = prefix_;
+  size_t slash = prefix_.rfind('/');
+  if (slash != std::string::npos)
+  {
+    dir = prefix_.substr(0, slash);
+    base = prefix_.substr(slash + 1);
+  }
+  DIR *d = opendir(dir.c_str());
+  if (d == nullptr)
+  {
+    DB_LOG_ERROR << "open value log dir " << dir << " error: " << strerror(errno);
+    return false;
+  }
+  const std::string suffix = ".vlog";
+  while (struct dirent *entry = readdir(d))
+  {
+    std::string name = entry->d_name;
+    if (name.size() > base.size() + suffix.size() &&
+        name.compare(0, base.size(), base) == 0 &&
+        name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+    {
+      unlink((dir + '/' + name).c_str());
+    }
+  }
+  closedir(d);
+  return NewFile();
+}
+
+bool ValueLog::NewFile()
+{
+  uint32_t id = active_ + 1;
+  std::string path = FileName(id);
+  int fd = open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    DB_LOG_ERROR << "open value log " << path << " error: " << strerror(errno);
+    return false;
+  }
+  files_[id] = File{fd, 0, 0};
+  active_ = id;
+  return true;
+}
+
+void ValueLog::RemoveFile(uint32_t id)
+{
+  auto it = files_.find(id);
+  if (it == files_.end())
+  {
+    return;
+  }
+  close(it->second.fd_);
+  unlink(FileName(id).c_str());
+  files_.erase(it);
+
+  for (auto block = lru_.begin(); block != lru_.end();)
+  {
+    if ((block->first >> 40) == id)
+    {
+      cache_.erase(block->first);
+      cache_used_ -= block->second.size();
+      block = lru_.erase(block);
+    }
+    else
+    {
+      ++block;
+    }
+  }
+}
+
+bool ValueLog::Append(const std::string &key, const std::string &value,
+                      ValuePointer *ptr)
+{
+  if (files_[active_].size_ >= file_size_ && !NewFile())
+  {
+    return false;
+  }
+  File &file = files_[active_];
+
+  char header[kRecordHeaderLen];
+  EncodeFixed32(header, static_cast<uint32_t>(key.size()));
+  EncodeFixed32(header + 4, static_cast<uint32_t>(value.size()));
+  struct iovec iov[3] = {
+      {header, kRecordHeaderLen},
+      {const_cast<char *>(key.data()), key.size()},
+      {const_cast<char *>(value.data()), value.size()}};
+  size_t total = kRecordHeaderLen + key.size() + value.size();
+  size_t written = 0;
+  int cur = 0;
+  while (written < total)
+  {
+    ssize_t n = writev(file.fd_, iov + cur, 3 - cur);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      DB_LOG_ERROR << "write value log error: " << strerror(errno);
+      // 截掉写了一半的记录
+      if (ftruncate(file.fd_, file.size_) != 0)
+      {
+        DB_LOG_ERROR << "truncate value log error: " << strerror(errno);
+      }
+      return false;
+    }
+    written += n;
+    // 跳过已写完的部分
+    while (cur < 3 && static_cast<size_t>(n) >= iov[cur].iov_len)
+    {
+      n -= iov[cur].iov_len;
+      ++cur;
+    }
+    if (cur < 3)
+    {
+      iov[cur].iov_base = static_cast<char *>(iov[cur].iov_base) + n;
+      iov[cur].iov_len -= n;
+    }
+  }
+
+  ptr->file_ = active_;
+  ptr->offset_ = file.size_ + kRecordHeaderLen + key.size();
+  ptr->len_ = static_cast<uint32_t>(value.size());
+  file.size_ += total;
+  return true;
+}
+
+bool ValueLog::ReadAt(int fd, uint64_t offset, size_t len, char *buf)
+{
+  while (len > 0)
+  {
+    ssize_t n = pread(fd, buf, len, offset);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      DB_LOG_ERROR << "read value log error: "
+                << (n == 0 ? "unexpected eof" : strerror(errno));
+      return false;
+    }
+    buf += n;
+    offset += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool ValueLog::ReadBlock(uint32_t id, const File &file, uint64_t block,
+                         std::string *scratch, const std::string **data)
+{
+  uint64_t key = static_cast<uint64_t>(id) << 40 | block;
+  auto it = cache_.find(key);
+  if (it != cache_.end())
+  {
+    ++cache_hits_;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    *data = &it->second->second;
+    return true;
+  }
+
+  ++cache_misses_;
+  uint64_t start = block * kBlockSize;
+  size_t len = kBlockSize;
+  if (file.size_ - start < len)
+  {
+    len = file.size_ - start;
+  }
+  scratch->resize(len);
+  if (!ReadAt(file.fd_, start, len, &(*scratch)[0]))
+  {
+    return false;
+  }
+  if (len < kBlockSize)
+  {
+    // 活跃文件的末尾块之后还会追加，不缓存
+    *data = scratch;
+    return true;
+  }
+
+  while (!lru_.empty() && cache_used_ + kBlockSize > cache_size_)
+  {
+    cache_used_ -= lru_.back().second.size();
+    cache_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+  lru_.emplace_front(key, std::move(*scratch));
+  cache_[key] = lru_.begin();
+  cache_used_ += kBlockSize;
+  *data = &lru_.front().second;
+  return true;
+}
+
+bool ValueLog::Read(const ValuePointer &ptr, std::string *value)
+{
+  auto it = files_.find(ptr.file_);
+  if (it == files_.end() || ptr.offset_ + ptr.len_ > it->second.size_)
+  {
+    DB_LOG_ERROR << "bad value log pointer " << ptr.file_ << ':' << ptr.offset_;
+    return false;
+  }
+  const File &file = it->second;
+  value->resize(ptr.len_);
+  if (cache_size_ == 0 || ptr.len_ > cache_size_ / 8)
+  {
+    return ReadAt(file.fd_, ptr.offset_, ptr.len_, &(*value)[0]);
+  }
+
+  std::string scratch;
+  uint64_t pos = ptr.offset_;
+  uint64_t end = ptr.offset_ + ptr.len_;
+  char *out = &(*value)[0];
+  while (pos < end)
+  {
+    const std::string *data;
+    if (!ReadBlock(ptr.file_, file, pos / kBlockSize, &scratch, &data))
+    {
+      return false;
+    }
+    size_t in = pos % kBlockSize;
+    size_t n = data->size() - in;
+    if (n > end - pos)
+    {
+      n = end - pos;
+    }
+    memcpy(out, data->data() + in, n);
+    out += n;
+    pos += n;
+  }
+  return true;
+}
+
+void ValueLog::Discard(const ValuePointer &ptr, size_t key_len)
+{
+  auto it = files_.find(ptr.file_);
+  if (it != files_.end())
+  {
+    it->second.dead_ += kRecordHeaderLen + key_len + ptr.len_;
+  }
+}
+
+bool ValueLog::CollectGarbage(
+    size_t budget,
+    const std::function<bool(const std::string &, const ValuePointer &)> &live,
+    const std::function<void(const std::string &, const ValuePointer &)>
+        &moved)
+{
+  if (gc_file_ == 0)
+  {
+    double max_ratio = kGcRatio;
+    for (auto &it : files_)
+    {
+      if (it.first == active_ || it.second.size_ == 0)
+      {
+        continue;
+      }
+      double ratio = static_cast<double>(it.second.dead_) / it.second.size_;
+      if (ratio >= max_ratio)
+      {
+        max_ratio = ratio;
+        gc_file_ = it.first;
+      }
+    }
+    if (gc_file_ == 0)
+    {
+      return false;
+    }
+    gc_offset_ = 0;
+  }
+
+  // Append换新文件只插入files_，不影响file的引用
+  const File &file = files_[gc_file_];
+  size_t scanned = 0;
+  char header[kRecordHeaderLen];
+  std::string key;
+  std::string value;
+  while (gc_offset_ < file.size_ && scanned < budget)
+  {
+    if (!ReadAt(file.fd_, gc_offset_, kRecordHeaderLen, header))
+    {
+      gc_file_ = 0;
+      return false;
+    }
+    key.resize(DecodeFixed32(header));
+    ValuePointer ptr;
+    ptr.file_ = gc_file_;
+    ptr.offset_ = gc_offset_ + kRecordHeaderLen + key.size();
+    ptr.len_ = DecodeFixed32(header + 4);
+    if (!ReadAt(file.fd_, gc_offset_ + kRecordHeaderLen, key.size(), &key[0]))
+    {
+      gc_file_ = 0;
+      return false;
+    }
+
+    if (live(key, ptr))
+    {
+      ValuePointer to;
+      value.resize(ptr.len_);
+      if (!ReadAt(file.fd_, ptr.offset_, ptr.len_, &value[0]) ||
+          !Append(key, value, &to))
+      {
+        gc_file_ = 0;
+        return false;
+      }
+      moved(key, to);
+    }
+    gc_offset_ = ptr.offset_ + ptr.len_;
+    scanned += kRecordHeaderLen + key.size() + ptr.len_;
+  }
+
+  if (gc_offset_ >= file.size_)
+  {
+    DB_LOG_DEBUG << "value log file " << gc_file_ << " collected, "
+              << file.dead_ << " dead bytes freed";
+    RemoveFile(gc_file_);
+    gc_file_ = 0;
+  }
+  return true;
+}
+
+uint64_t ValueLog::TotalBytes() const
+{
+  uint64_t total = 0;
+  for (auto &it : files_)
+  {
+    total += it.second.size_;
+  }
+  return total;
+}
+
+uint64_t ValueLog::DeadBytes() const
+{
+  uint64_t dead = 0;
+  for (auto &it : files_)
+  {
+    dead += it.second.dead_;
+  }
+  return dead;
+}
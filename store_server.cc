@@ -1,10 +1,52 @@
+#include <muduo/base/Logging.h>
 
+#include "db_log.h"
 #include "db_server.h"
+#include "handover.h"
+
+// 用法: ./store_server [--port 10000] [--appendonly yes|no]
+//       [--appendfilename appendonly.aof] [--appendfsync always|everysec|no]
+//       [--handover-socket path] [--upgrade-from path]
+int main(int argc, char *argv[]) {
+  DbConfig config;
+  std::string err;
+  if (!config.ParseArgs(argc, argv, &err)) {
+    LOG_ERROR << err;
+    return 1;
+  }
+  // 存储引擎的日志交给muduo的Logger，与服务器自身的日志格式一致
+  dblog::SetLogOutput(
+      [](dblog::LogLevel level, const char *file, int line,
+         const std::string &msg) {
+        static const muduo::Logger::LogLevel kLevels[] = {
+            muduo::Logger::DEBUG, muduo::Logger::INFO, muduo::Logger::WARN,
+            muduo::Logger::ERROR};
+        muduo::Logger(muduo::Logger::SourceFile(file), line, kLevels[level])
+                .stream()
+            << msg;
+      },
+      muduo::Logger::logLevel() <= muduo::Logger::DEBUG ? dblog::kDebug
+                                                          : dblog::kInfo);
+
+  // 热升级：先从旧进程取得监听套接字和数据镜像
+  int listen_fd = -1;
+  if (!config.upgrade_from_.empty()) {
+    if (!handover::Request(config.upgrade_from_, &listen_fd,
+                           &config.restart_image_, &err)) {
+      LOG_ERROR << "upgrade failed: " << err;
+      return 1;
+    }
+  }
 
-int main() {
   muduo::net::EventLoop loop;
-  muduo::net::InetAddress local_addr("0.0.0.0", 10000);
-  DbServer db_server(&loop, local_addr);
+  // 接管时监听套接字来自旧进程，TcpServer先绑定任意端口，随后替换
+  muduo::net::InetAddress local_addr("0.0.0.0",
+                                     listen_fd >= 0 ? 0 : config.port_);
+  DbServer db_server(&loop, local_addr, config);
+  if (listen_fd >= 0 && !handover::Adopt(listen_fd)) {
+    LOG_ERROR << "adopt listening socket failed";
+    return 1;
+  }
 
   db_server.Start();
   loop.loop();
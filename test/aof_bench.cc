@@ -0,0 +1,50 @@
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+
+#include "../include/aof.h"
+#include "../include/db_obj.h"
+
+// 比较三种fsync策略下的AOF写入吞吐
+// 每轮事件循环追加batch条命令后Flush一次，模拟组提交
+// 用法: ./aof_bench [命令数] [每轮命令数] [值大小]
+int main(int argc, char *argv[])
+{
+  long total = argc > 1 ? atol(argv[1]) : 200000;
+  long batch = argc > 2 ? atol(argv[2]) : 32;
+  long value_size = argc > 3 ? atol(argv[3]) : 64;
+  const char *names[] = {"always", "everysec", "no"};
+  const int policies[] = {dbobject::kAofFsyncAlways,
+                          dbobject::kAofFsyncEverysec, dbobject::kAofFsyncNo};
+  std::string value(value_size, 'v');
+
+  for (int p = 0; p < 3; ++p)
+  {
+    std::string path = "bench.aof";
+    unlink(path.c_str());
+    double seconds;
+    {
+      Aof aof(path, policies[p]);
+      aof.Open();
+      auto start = std::chrono::steady_clock::now();
+      for (long i = 0; i < total; ++i)
+      {
+        aof.Feed(0, {"set", "key:" + std::to_string(i), value});
+        if ((i + 1) % batch == 0)
+        {
+          aof.Flush();
+        }
+      }
+      aof.Flush();
+      seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    }
+    std::cout << names[p] << ": " << total / seconds << " cmds/s, "
+              << total / batch / seconds << " flushes/s" << std::endl;
+  }
+  unlink("bench.aof");
+  return 0;
+}
+// compile: g++ -O2 aof_bench.cc ../src/aof.cc -I../include -lmuduo_base -lpthread -std=c++14
@@ -0,0 +1,123 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <iostream>
+#include <string>
+
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/InetAddress.h>
+
+#include "../include/db_config.h"
+#include "../include/db_server.h"
+#include "../include/db_status.h"
+
+static const int kPort = 10017;
+
+// 在子进程中运行开启AOF的服务器，直到被杀死
+static pid_t StartServer(const std::string &aof)
+{
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0)
+  {
+    DbConfig config;
+    config.port_ = kPort;
+    config.appendonly_ = true;
+    config.aof_path_ = aof;
+    config.aof_fsync_ = dbobject::kAofFsyncAlways;
+    config.save_rules_.clear();
+    config.worker_threads_ = 0;
+    muduo::net::EventLoop loop;
+    DbServer server(&loop, muduo::net::InetAddress(kPort), config);
+    server.Start();
+    loop.loop();
+    _exit(0);
+  }
+  return pid;
+}
+
+static int Connect()
+{
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(kPort);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  // 等待服务器开始监听
+  for (int i = 0; i < 100; ++i)
+  {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0)
+    {
+      return fd;
+    }
+    close(fd);
+    usleep(50 * 1000);
+  }
+  assert(false);
+  return -1;
+}
+
+// 发送一条命令，读到响应后再等一小段时间没有新数据为止
+static std::string Request(int fd, const std::string &cmd)
+{
+  ssize_t written = write(fd, cmd.data(), cmd.size());
+  assert(written == static_cast<ssize_t>(cmd.size()));
+  std::string res;
+  pollfd pfd = {fd, POLLIN, 0};
+  while (poll(&pfd, 1, res.empty() ? 2000 : 100) > 0)
+  {
+    char buf[4096];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0)
+    {
+      break;
+    }
+    res.append(buf, n);
+  }
+  return res;
+}
+
+static void StopServer(pid_t pid, int fd)
+{
+  close(fd);
+  kill(pid, SIGKILL);
+  int status;
+  waitpid(pid, &status, 0);
+}
+
+// 命令带有多余的参数时只执行固定个数的参数，AOF记录的也是执行的参数，
+// 重启重放后的结果与重启前相同
+int main()
+{
+  const std::string aof = "aof_replay_test.aof";
+  unlink(aof.c_str());
+
+  pid_t pid = StartServer(aof);
+  int fd = Connect();
+  assert(Request(fd, "set k v extra") == dbreply::kOk);
+  assert(Request(fd, "hset h f v extra tokens") == dbreply::kOk);
+  assert(Request(fd, "select 2 extra") == dbreply::kOk);
+  assert(Request(fd, "set k2 v2 x y z") == dbreply::kOk);
+  assert(Request(fd, "get k2") == "v2");
+  StopServer(pid, fd);
+
+  pid = StartServer(aof);
+  fd = Connect();
+  assert(Request(fd, "get k") == "v");
+  assert(Request(fd, "hget h f") == "v");
+  assert(Request(fd, "select 2") == dbreply::kOk);
+  assert(Request(fd, "get k2") == "v2");
+  StopServer(pid, fd);
+
+  unlink(aof.c_str());
+  std::cout << "aof replay test passed" << std::endl;
+  return 0;
+}
+// compile: g++ aof_replay_test.cc ../src/*.cc -I../include -std=c++14 -lmuduo_net -lmuduo_base -lpthread
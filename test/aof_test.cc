@@ -0,0 +1,131 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../include/aof.h"
+#include "../include/db_obj.h"
+
+typedef std::vector<std::string> VecS;
+
+static std::vector<VecS> Replay(const std::string &path)
+{
+  std::vector<VecS> cmds;
+  Aof aof(path, dbobject::kAofFsyncNo);
+  assert(aof.Replay([&](const VecS &argv) { cmds.push_back(argv); }));
+  return cmds;
+}
+
+static void Append(const std::string &path, const std::string &data)
+{
+  std::ofstream out(path, std::ios::app | std::ios::binary);
+  out << data;
+}
+
+int main()
+{
+  const std::string path = "aof_test.aof";
+  unlink(path.c_str());
+
+  // 值中含有空白、换行符和\0
+  const std::string value = std::string("a b\r\nc\n\0d", 10);
+  {
+    Aof aof(path, dbobject::kAofFsyncNo);
+    assert(aof.Open());
+    aof.Feed(0, {"set", "k1", value});
+    aof.Feed(2, {"rpush", "l", "x y", "", "z"});
+    assert(aof.Flush());
+  }
+  std::vector<VecS> cmds = Replay(path);
+  assert(cmds.size() == 4);
+  assert((cmds[0] == VecS{"select", "1"}));
+  assert((cmds[1] == VecS{"set", "k1", value}));
+  assert((cmds[2] == VecS{"select", "3"}));
+  assert((cmds[3] == VecS{"rpush", "l", "x y", "", "z"}));
+
+  // 末尾不完整的记录被截断，截断后可继续追加
+  std::string record;
+  Aof::AppendRecord(&record, {"set", "k2", "v2"});
+  Append(path, record.substr(0, record.size() - 3));
+  assert(Replay(path).size() == 4);
+  Append(path, record);
+  assert(Replay(path).size() == 5);
+
+  // 兼容旧版本每行一条的文本命令
+  Append(path, "set k3 v3\n\nsadd s m\n");
+  cmds = Replay(path);
+  assert(cmds.size() == 7);
+  assert((cmds[5] == VecS{"set", "k3", "v3"}));
+  assert((cmds[6] == VecS{"sadd", "s", "m"}));
+
+  // 事务整体重放，没有exec的事务整体截断，没有写命令的事务不写入记录
+  {
+    Aof aof(path, dbobject::kAofFsyncNo);
+    assert(aof.Open());
+    aof.BeginMulti();
+    aof.EndMulti();
+    aof.BeginMulti();
+    aof.Feed(0, {"set", "t1", "v"});
+    aof.Feed(1, {"set", "t2", "v"});
+    aof.EndMulti();
+    aof.BeginMulti();
+    aof.Feed(1, {"set", "t3", "v"});
+    assert(aof.Flush());
+  }
+  cmds = Replay(path);
+  assert(cmds.size() == 11);
+  assert((cmds[7] == VecS{"select", "1"}));
+  assert((cmds[8] == VecS{"set", "t1", "v"}));
+  assert((cmds[10] == VecS{"set", "t2", "v"}));
+  assert(Replay(path).size() == 11);
+  Append(path, "*1\r\n$4\r\nexec\r\n");
+  {
+    Aof aof(path, dbobject::kAofFsyncNo);
+    assert(!aof.Replay([](const VecS &) {}));
+  }
+  truncate(path.c_str(), 0);
+  Append(path, "set k v\n");
+
+  // 中间格式错误的记录不截断，重放失败
+  Append(path, "*2\r\n$3\r\nset\r\n$9\r\nab\r\n");
+  Append(path, record);
+  {
+    Aof aof(path, dbobject::kAofFsyncNo);
+    assert(!aof.Replay([](const VecS &) {}));
+  }
+
+  // 部分写入失败时截掉已写入的字节，重试后每条命令只出现一次
+  unlink(path.c_str());
+  {
+    Aof aof(path, dbobject::kAofFsyncNo);
+    assert(aof.Open());
+    aof.Feed(0, {"set", "k1", "v1"});
+    assert(aof.Flush());
+    aof.Feed(0, {"set", "k2", std::string(4096, 'x')});
+    // 文件大小限制使write只写入一部分
+    signal(SIGXFSZ, SIG_IGN);
+    rlimit old_limit, limit;
+    getrlimit(RLIMIT_FSIZE, &old_limit);
+    limit = old_limit;
+    limit.rlim_cur = aof.Size() - 1024;
+    setrlimit(RLIMIT_FSIZE, &limit);
+    assert(!aof.Flush());
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    assert(aof.Flush());
+  }
+  cmds = Replay(path);
+  assert(cmds.size() == 3);
+  assert((cmds[1] == VecS{"set", "k1", "v1"}));
+  assert((cmds[2] == VecS{"set", "k2", std::string(4096, 'x')}));
+
+  unlink(path.c_str());
+  std::cout << "aof test passed" << std::endl;
+  return 0;
+}
+// compile: g++ -O2 aof_test.cc ../src/aof.cc -I../include -lmuduo_base -lpthread -std=c++14
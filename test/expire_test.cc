@@ -0,0 +1,29 @@
+#include <unistd.h>
+
+#include <cassert>
+#include <iostream>
+#include <string>
+
+#include "../include/database.h"
+
+// 定期删除：每种类型的key全部过期后，Cron删除到剩余不足一次抽查的数目
+int main()
+{
+  const int kKeys = 200;
+  for (int type = dbobject::kDbString; type <= dbobject::kDbZSet; ++type)
+  {
+    Database db;
+    for (int i = 0; i < kKeys; ++i)
+    {
+      std::string key = "k" + std::to_string(i);
+      db.AddKey(type, key, "v", "1");
+      assert(db.SetPExpireTime(type, key, 1));
+    }
+    usleep(20 * 1000);
+    db.Cron(addTime(Timestamp::now(), Database::kExpireCycleSeconds + 1));
+    assert(db.GetKeySize() < dbobject::kCheckNum);
+  }
+  std::cout << "expire test passed" << std::endl;
+  return 0;
+}
+// compile: g++ -O2 expire_test.cc ../src/database.cc ../src/rdb.cc ../src/rdb_loader.cc ../src/skiplist.cc ../src/crc64.cc ../src/lzf.cc ../src/value_log.cc ../src/db_log.cc -I../include -lpthread -std=c++14
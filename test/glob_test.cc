@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "../include/glob.h"
+
+// 逐字符递归的参考实现，只用于对照
+static bool Reference(const char *p, const char *pe, const char *s,
+                      const char *se)
+{
+  if (p == pe)
+  {
+    return s == se;
+  }
+  if (*p == '*')
+  {
+    for (const char *t = s; t <= se; ++t)
+    {
+      if (Reference(p + 1, pe, t, se))
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+  if (s == se)
+  {
+    return false;
+  }
+  if (*p == '?')
+  {
+    return Reference(p + 1, pe, s + 1, se);
+  }
+  if (*p == '[')
+  {
+    const char *q = p + 1;
+    bool negate = q < pe && *q == '^';
+    q += negate;
+    bool matched = false;
+    while (q < pe && *q != ']')
+    {
+      if (*q == '\\' && q + 1 < pe)
+      {
+        matched = matched || q[1] == *s;
+        q += 2;
+      }
+      else if (q + 2 < pe && q[1] == '-' && q[2] != ']')
+      {
+        char lo = std::min(q[0], q[2]), hi = std::max(q[0], q[2]);
+        matched = matched || (*s >= lo && *s <= hi);
+        q += 3;
+      }
+      else
+      {
+        matched = matched || *q == *s;
+        ++q;
+      }
+    }
+    q = q < pe ? q + 1 : pe;
+    return matched != negate && Reference(q, pe, s + 1, se);
+  }
+  if (*p == '\\' && p + 1 < pe)
+  {
+    return p[1] == *s && Reference(p + 2, pe, s + 1, se);
+  }
+  return *p == *s && Reference(p + 1, pe, s + 1, se);
+}
+
+static bool Match(const std::string &pattern, const std::string &str)
+{
+  return GlobMatcher(pattern).Match(str);
+}
+
+int main()
+{
+  assert(Match("*", ""));
+  assert(Match("user:*", "user:42"));
+  assert(!Match("user:*", "use"));
+  assert(Match("*:log", "a:log"));
+  assert(Match("k?y", "key"));
+  assert(Match("k[a-f]y", "key"));
+  assert(!Match("k[^e]y", "key"));
+  assert(Match("k\\*y", "k*y"));
+  assert(!Match("k\\*y", "kay"));
+  assert(Match("a*b*c", "axxbyyc"));
+  assert(!Match("a*b*c", "axxbyy"));
+  // 多个*不会指数回溯
+  std::string long_str(10000, 'a');
+  assert(!Match("*a*a*a*a*a*a*a*a*b", long_str));
+
+  // 小字母表上的随机模式与参考实现对照
+  std::mt19937 rng(1);
+  const char kPatternChars[] = "ab*?[]^-\\";
+  for (int i = 0; i < 200000; ++i)
+  {
+    std::string pattern, str;
+    for (int n = rng() % 7; n > 0; --n)
+    {
+      pattern += kPatternChars[rng() % (sizeof(kPatternChars) - 1)];
+    }
+    for (int n = rng() % 7; n > 0; --n)
+    {
+      str += "ab-^"[rng() % 4];
+    }
+    bool expected = Reference(pattern.data(), pattern.data() + pattern.size(),
+                              str.data(), str.data() + str.size());
+    assert(Match(pattern, str) == expected);
+    (void)expected;
+  }
+  std::cout << "glob test passed" << std::endl;
+  return 0;
+}
+// compile: g++ glob_test.cc ../src/glob.cc -I../include -std=c++14
@@ -0,0 +1,91 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <iostream>
+
+#include "../include/handover.h"
+
+// 绑定127.0.0.1:port的TCP套接字，listening为true时再listen
+static int TcpSocket(int port, bool listening)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert(bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) ==
+         0);
+  if (listening)
+  {
+    assert(listen(fd, 16) == 0);
+  }
+  return fd;
+}
+
+static int LocalPort(int fd)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  getsockname(fd, reinterpret_cast<struct sockaddr *>(&addr), &len);
+  return ntohs(addr.sin_port);
+}
+
+int main()
+{
+  const std::string path = "handover_test.sock";
+  int port = LocalPort(TcpSocket(0, true));
+  int handover_fd = handover::Listen(path);
+  assert(handover_fd >= 0);
+
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    // 新进程：请求接管，再用接管的套接字替换自己的套接字
+    int listen_fd;
+    std::string image, err;
+    assert(handover::Request(path, &listen_fd, &image, &err));
+    assert(image == "/dev/shm/image.rdb");
+    int own = TcpSocket(0, false);
+    assert(handover::Adopt(listen_fd));
+    assert(LocalPort(own) == port);
+    // 旧进程退出前到达的连接在监听队列中，由新进程accept
+    int conn = accept(own, nullptr, nullptr);
+    assert(conn >= 0);
+    _exit(0);
+  }
+
+  // 旧进程：应答请求，附带监听套接字
+  int conn;
+  while ((conn = accept(handover_fd, nullptr, nullptr)) < 0)
+  {
+    usleep(1000);
+  }
+  assert(handover::ReadRequest(conn));
+  int listen_fd = handover::FindTcpSocket(port, true);
+  assert(listen_fd >= 0);
+  assert(handover::Reply(conn, "ok /dev/shm/image.rdb", listen_fd));
+  close(conn);
+  close(listen_fd);
+
+  int client = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert(connect(client, reinterpret_cast<struct sockaddr *>(&addr),
+                 sizeof(addr)) == 0);
+
+  int status;
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  unlink(path.c_str());
+  std::cout << "handover test passed" << std::endl;
+  return 0;
+}
+// compile: g++ handover_test.cc ../src/handover.cc -I../include -std=c++14 -lmuduo_base -lpthread
@@ -0,0 +1,102 @@
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../include/kvdb.h"
+
+// 进程内嵌入使用的吞吐量，不需要事件循环
+// 用法: ./kvdb_bench [操作次数] [值大小]
+static void Run(const char *name, long ops,
+                const std::function<void(long)> &func)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < ops; ++i)
+  {
+    func(i);
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  std::cout << name << ": " << static_cast<long>(ops / seconds) << " ops/s"
+            << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  long ops = argc > 1 ? atol(argv[1]) : 1000000;
+  long value_size = argc > 2 ? atol(argv[2]) : 64;
+
+  std::unique_ptr<Kvdb> db = Kvdb::Open();
+  assert(db);
+  std::vector<std::string> keys;
+  for (long i = 0; i < ops; ++i)
+  {
+    keys.push_back("key:" + std::to_string(i));
+  }
+  std::string value(value_size, 'v');
+  std::string out;
+
+  Run("set", ops, [&](long i) { db->Set(keys[i], value); });
+  Run("get", ops, [&](long i) {
+    bool found = db->Get(keys[i], &out);
+    assert(found && out == value);
+    (void)found;
+  });
+  Run("hset", ops, [&](long i) {
+    db->HSet("hash:" + std::to_string(i % 1000), keys[i], value);
+  });
+  Run("hget", ops, [&](long i) {
+    db->HGet("hash:" + std::to_string(i % 1000), keys[i], &out);
+  });
+  Run("zadd", ops, [&](long i) {
+    db->ZAdd("zset:" + std::to_string(i % 1000), static_cast<double>(i),
+             keys[i]);
+  });
+  Run("zcount", ops / 10, [&](long i) {
+    db->ZCount("zset:" + std::to_string(i % 1000), 0, static_cast<double>(i));
+  });
+  Run("rpush+rpop", ops, [&](long i) {
+    db->RPush("list", keys[i]);
+    db->RPop("list", &out);
+  });
+
+  // 哈希、列表、过期时间三个写操作逐个执行与合并为一批执行
+  Run("hset+rpush+pexpire", ops / 3, [&](long i) {
+    db->HSet("user:" + std::to_string(i), "name", value);
+    db->RPush("log:" + std::to_string(i), value);
+    db->PExpire("user:" + std::to_string(i), 60000);
+  });
+  WriteBatch batch;
+  Run("batch of hset+rpush+pexpire", ops / 3, [&](long i) {
+    batch.Clear();
+    batch.HSet("user:" + std::to_string(i), "name", value);
+    batch.RPush("log:" + std::to_string(i), value);
+    batch.PExpire("user:" + std::to_string(i), 60000);
+    bool ok = db->Write(batch);
+    assert(ok);
+    (void)ok;
+  });
+
+  // 过期与周期维护
+  assert(db->PExpire(keys[0], 1));
+  std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  Run("tick", 1000, [&](long) { db->Tick(); });
+  assert(!db->Get(keys[0], &out));
+
+  assert(db->Save("kvdb_bench.rdb"));
+  std::unique_ptr<Kvdb> loaded = Kvdb::Open();
+  assert(loaded->Load("kvdb_bench.rdb"));
+  assert(loaded->KeyCount() == db->KeyCount());
+  std::cout << "saved and reloaded " << loaded->KeyCount() << " keys"
+            << std::endl;
+  remove("kvdb_bench.rdb");
+  return 0;
+}
+// compile: g++ -O2 kvdb_bench.cc -I../include -L../lib -lkvdb -lpthread -std=c++14
@@ -0,0 +1,121 @@
+#include <sys/time.h>
+
+#include <cassert>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../include/lzf.h"
+#include "../include/rdb.h"
+
+static double Now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// 生成约size字节的JSON对象，字段名重复、取值随机，与线上的值相近
+static std::string MakeJson(std::mt19937 &rng, size_t size)
+{
+  static const char *kNames[] = {"alice", "bob", "carol", "dave", "erin"};
+  static const char *kTags[] = {"new", "vip", "blocked", "trial", "paid"};
+  std::string json = "[";
+  while (json.size() < size)
+  {
+    json += "{\"id\":" + std::to_string(rng() % 1000000) + ",\"name\":\"" +
+            kNames[rng() % 5] + "\",\"score\":" +
+            std::to_string(rng() % 10000 / 100.0) + ",\"tags\":[\"" +
+            kTags[rng() % 5] + "\"],\"active\":" +
+            (rng() % 2 ? "true" : "false") + "},";
+  }
+  json.back() = ']';
+  return json;
+}
+
+// 值大小分布: 50% 256B~1KB, 35% 1KB~8KB, 15% 8KB~64KB
+static size_t ValueSize(std::mt19937 &rng)
+{
+  unsigned p = rng() % 100;
+  if (p < 50)
+  {
+    return 256 + rng() % 768;
+  }
+  if (p < 85)
+  {
+    return 1024 + rng() % (7 * 1024);
+  }
+  return 8192 + rng() % (56 * 1024);
+}
+
+// 用法: ./lzf_bench [值的个数]
+int main(int argc, char *argv[])
+{
+  long count = argc > 1 ? atol(argv[1]) : 20000;
+  std::mt19937 rng(42);
+  std::vector<std::string> values;
+  size_t raw_bytes = 0;
+  for (long i = 0; i < count; ++i)
+  {
+    values.push_back(MakeJson(rng, ValueSize(rng)));
+    raw_bytes += values.back().size();
+  }
+
+  // 单个值的压缩和解压
+  std::vector<std::string> packed(values.size());
+  size_t packed_bytes = 0;
+  double start = Now();
+  for (size_t i = 0; i < values.size(); ++i)
+  {
+    std::string &out = packed[i];
+    out.resize(values[i].size() + values[i].size() / 32 + 16);
+    size_t n = LzfCompress(values[i].data(), values[i].size(), &out[0],
+                           out.size());
+    assert(n > 0);
+    out.resize(n);
+    packed_bytes += n;
+  }
+  double compress_time = Now() - start;
+
+  start = Now();
+  std::string raw;
+  for (size_t i = 0; i < values.size(); ++i)
+  {
+    raw.resize(values[i].size());
+    size_t n = LzfDecompress(packed[i].data(), packed[i].size(), &raw[0],
+                             raw.size());
+    assert(n == values[i].size());
+  }
+  double decompress_time = Now() - start;
+
+  double mb = raw_bytes / 1024.0 / 1024.0;
+  std::cout << count << " values, " << mb << " MB" << std::endl;
+  std::cout << "ratio " << static_cast<double>(raw_bytes) / packed_bytes
+            << "x, compress " << mb / compress_time << " MB/s, decompress "
+            << mb / decompress_time << " MB/s" << std::endl;
+
+  // 写rdb时的开销：不压缩与压缩段数据和字符串
+  for (int compress = 0; compress <= 1; ++compress)
+  {
+    std::string file;
+    RdbWriter writer(&file);
+    writer.SetCompression(compress == 1);
+    start = Now();
+    writer.WriteHeader();
+    writer.BeginSection(0, 0);
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+      writer.PutEntry(0, "key:" + std::to_string(i));
+      writer.PutString(values[i]);
+    }
+    writer.EndSection();
+    writer.WriteEof();
+    double write_time = Now() - start;
+    std::cout << (compress ? "compressed" : "raw") << " rdb "
+              << file.size() / 1024.0 / 1024.0 << " MB, write "
+              << mb / write_time << " MB/s" << std::endl;
+  }
+  return 0;
+}
+// compile: g++ -O2 lzf_bench.cc ../src/lzf.cc ../src/rdb.cc ../src/crc64.cc -I../include -std=c++14
@@ -0,0 +1,106 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+#include "../include/database.h"
+#include "../include/rdb.h"
+#include "../include/rdb_loader.h"
+
+// 生成合成的rdb文件，比较不同线程数的载入时间
+// 用法: ./rdb_load_bench [键数目] [值大小] [文件路径]
+int main(int argc, char *argv[])
+{
+  long keys = argc > 1 ? atol(argv[1]) : 2000000;
+  long value_size = argc > 2 ? atol(argv[2]) : 1024;
+  std::string path = argc > 3 ? argv[3] : "bench.rdb";
+  const int kDbNum = 4;
+
+  {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    RdbWriter writer(fd);
+    writer.WriteHeader();
+    std::string value(value_size, 'v');
+    for (int db = 0; db < kDbNum; ++db)
+    {
+      writer.BeginSection(db, dbobject::kDbString);
+      for (long i = db; i < keys; i += kDbNum)
+      {
+        writer.PutEntry(0, "key:" + std::to_string(i));
+        writer.PutString(value);
+      }
+      writer.EndSection();
+
+      writer.BeginSection(db, dbobject::kDbZSet);
+      for (long i = db; i < keys / 1000; i += kDbNum)
+      {
+        writer.PutEntry(0, "zset:" + std::to_string(i));
+        writer.PutVarint(100);
+        for (int j = 0; j < 100; ++j)
+        {
+          writer.PutString("m" + std::to_string(j));
+          writer.PutDouble(j);
+        }
+      }
+      writer.EndSection();
+    }
+    writer.WriteEof();
+    assert(writer.Ok());
+    fsync(fd);
+    close(fd);
+    std::cout << "dump size: " << writer.Offset() / (1024 * 1024) << " MB"
+              << std::endl;
+  }
+
+  int max_threads = std::max(1u, std::thread::hardware_concurrency());
+  for (int threads = 1; threads <= max_threads; threads *= 2)
+  {
+    std::vector<std::unique_ptr<Database>> dbs;
+    std::vector<StorageEngine *> ptrs;
+    for (int db = 0; db < kDbNum; ++db)
+    {
+      dbs.emplace_back(new Database());
+      ptrs.push_back(dbs.back().get());
+    }
+    RdbLoader loader(ptrs, threads);
+    Timestamp start = Timestamp::now();
+    bool ok = loader.Load(path);
+    double seconds = timeDifference(Timestamp::now(), start);
+    assert(ok && loader.KeysLoaded() == static_cast<uint64_t>(
+                                            keys + keys / 1000));
+    std::cout << threads << " threads: " << seconds << " s, "
+              << loader.KeysLoaded() / seconds << " keys/s" << std::endl;
+  }
+
+  // 后台载入：优先载入一个库的有序集合所需的时间，与全部载入完成的时间对比
+  {
+    std::vector<std::unique_ptr<Database>> dbs;
+    std::vector<StorageEngine *> ptrs;
+    for (int db = 0; db < kDbNum; ++db)
+    {
+      dbs.emplace_back(new Database());
+      ptrs.push_back(dbs.back().get());
+    }
+    AsyncRdbLoader loader(ptrs);
+    bool done = false;
+    Timestamp start = Timestamp::now();
+    assert(loader.Start(path, []() {}, [&](bool ok) { done = ok; }));
+    loader.EnsureLoaded(kDbNum - 1, dbobject::kDbZSet);
+    double first = timeDifference(Timestamp::now(), start);
+    assert(dbs[kDbNum - 1]->ZCard("zset:" + std::to_string(kDbNum - 1)) ==
+           100);
+    loader.EnsureAllLoaded();
+    double seconds = timeDifference(Timestamp::now(), start);
+    assert(done && loader.KeysLoaded() == static_cast<uint64_t>(
+                                              keys + keys / 1000));
+    std::cout << "async: db " << kDbNum - 1 << " zsets ready in " << first
+              << " s, all loaded in " << seconds << " s" << std::endl;
+  }
+  unlink(path.c_str());
+  return 0;
+}
+// compile: g++ -O2 rdb_load_bench.cc -I../include -L../lib -lkvdb -lpthread -std=c++14
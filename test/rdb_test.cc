@@ -0,0 +1,165 @@
+#include <cassert>
+#include <cfloat>
+#include <iostream>
+
+#include "../include/rdb.h"
+
+int main()
+{
+  std::string file;
+  RdbWriter writer(&file);
+  writer.WriteHeader();
+
+  // 值中包含旧格式的分隔符
+  writer.BeginSection(3, 0);
+  writer.PutEntry(0, "k1");
+  writer.PutString("SD^ST!#$");
+  writer.PutEntry(123456789, "k2");
+  writer.PutString(std::string(5000, 'v'));
+  writer.EndSection();
+
+  writer.BeginSection(5, 4);
+  writer.PutEntry(0, "zset");
+  writer.PutVarint(2);
+  writer.PutString("a");
+  writer.PutDouble(-DBL_MAX);
+  writer.PutString("b");
+  writer.PutDouble(0.1);
+  writer.EndSection();
+
+  // 空段不写入
+  writer.BeginSection(6, 1);
+  writer.EndSection();
+  writer.WriteEof();
+
+  RdbReader reader(file.data(), file.size());
+  assert(reader.ReadHeader());
+  RdbSection section;
+  assert(reader.ReadSection(&section) == 1);
+  assert(section.db_ == 3 && section.type_ == 0 && section.count_ == 2);
+  assert(section.Verify());
+  {
+    RdbReader payload(section.payload_, section.len_);
+    uint64_t expire;
+    std::string key, value;
+    assert(payload.GetVarint(&expire) && expire == 0);
+    assert(payload.GetString(&key) && key == "k1");
+    assert(payload.GetString(&value) && value == "SD^ST!#$");
+    assert(payload.GetVarint(&expire) && expire == 123456789);
+    assert(payload.GetString(&key) && key == "k2");
+    assert(payload.GetString(&value) && value.size() == 5000);
+    assert(payload.Eof());
+  }
+
+  assert(reader.ReadSection(&section) == 1);
+  assert(section.db_ == 5 && section.type_ == 4 && section.count_ == 1);
+  {
+    RdbReader payload(section.payload_, section.len_);
+    uint64_t expire, size;
+    std::string key, member;
+    double score;
+    assert(payload.GetVarint(&expire) && payload.GetString(&key));
+    assert(payload.GetVarint(&size) && size == 2);
+    assert(payload.GetString(&member) && payload.GetDouble(&score));
+    assert(member == "a" && score == -DBL_MAX);
+    assert(payload.GetString(&member) && payload.GetDouble(&score));
+    assert(member == "b" && score == 0.1);
+  }
+  assert(reader.ReadSection(&section) == 0);
+
+  // 段索引指向各个段的起始位置
+  std::vector<RdbIndexEntry> index;
+  assert(RdbReader::ReadIndex(file.data(), file.size(), &index));
+  assert(index.size() == 2);
+  assert(index[1].db_ == 5 && index[1].type_ == 4 && index[1].count_ == 1);
+  RdbReader seek(file.data() + index[1].offset_,
+                 file.size() - index[1].offset_);
+  assert(seek.ReadSection(&section) == 1 && section.db_ == 5);
+  assert(section.Verify());
+  assert(!RdbReader::ReadIndex(file.data(), file.size() - 1, &index));
+
+  // 段数据被破坏时校验失败
+  std::string broken = file;
+  broken[20] ^= 0x1;
+  RdbReader broken_reader(broken.data(), broken.size());
+  assert(broken_reader.ReadHeader());
+  assert(broken_reader.ReadSection(&section) == 1);
+  assert(!section.Verify());
+
+  // 截断的文件
+  RdbReader truncated(file.data(), 30);
+  assert(truncated.ReadHeader());
+  assert(truncated.ReadSection(&section) == -1);
+
+  // 缓冲区写满后切分为多个同类型的段
+  std::string split;
+  RdbWriter small(&split, 64);
+  small.WriteHeader();
+  small.BeginSection(1, 2);
+  for (int i = 0; i < 100; ++i)
+  {
+    small.PutEntry(0, "key" + std::to_string(i));
+    small.PutVarint(0);
+  }
+  small.EndSection();
+  small.WriteEof();
+  assert(small.Offset() == split.size());
+  RdbReader split_reader(split.data(), split.size());
+  assert(split_reader.ReadHeader());
+  uint64_t total = 0;
+  int sections = 0;
+  while (split_reader.ReadSection(&section) == 1)
+  {
+    assert(section.db_ == 1 && section.type_ == 2 && section.Verify());
+    total += section.count_;
+    ++sections;
+  }
+  assert(total == 100 && sections > 1);
+
+  // 压缩的段和字符串
+  std::string json;
+  for (int i = 0; i < 100; ++i)
+  {
+    json += "{\"id\":" + std::to_string(i) + ",\"name\":\"user\",\"tags\":[]},";
+  }
+  std::string packed;
+  RdbWriter compressed(&packed);
+  compressed.SetCompression(true);
+  compressed.WriteHeader();
+  compressed.BeginSection(2, 0);
+  for (int i = 0; i < 50; ++i)
+  {
+    compressed.PutEntry(0, "json" + std::to_string(i));
+    compressed.PutString(json);
+  }
+  compressed.PutEntry(0, "short");
+  compressed.PutString("v");
+  compressed.EndSection();
+  compressed.WriteEof();
+  assert(packed.size() < json.size());
+  RdbReader packed_reader(packed.data(), packed.size());
+  assert(packed_reader.ReadHeader());
+  assert(packed_reader.ReadSection(&section) == 1);
+  assert(section.encoding_ == rdb::kEncLzf && section.Verify());
+  std::string raw;
+  assert(section.Decompress(&raw));
+  {
+    RdbReader payload(raw.data(), raw.size());
+    uint64_t expire;
+    std::string key, value;
+    for (int i = 0; i < 50; ++i)
+    {
+      assert(payload.GetVarint(&expire) && payload.GetString(&key));
+      assert(payload.GetString(&value) && value == json);
+    }
+    assert(payload.GetVarint(&expire) && payload.GetString(&key));
+    assert(payload.GetString(&value) && value == "v");
+    assert(payload.Eof());
+  }
+  section.raw_len_ -= 1;
+  assert(!section.Decompress(&raw));
+
+  std::cout << "rdb test passed" << std::endl;
+  return 0;
+}
+// compile: g++ rdb_test.cc ../src/rdb.cc ../src/crc64.cc ../src/lzf.cc -I../include -std=c++14
@@ -0,0 +1,131 @@
+#include <cassert>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../include/database.h"
+
+// 遍历期间插入大量key使字典多次扩容，并删除一部分key：
+// 遍历开始前存在且未被删除的key至少返回一次，返回的key都曾经存在过
+static void CheckScanAcrossRehash(Database &db, int type)
+{
+  const int kKeys = 2000;
+  for (int i = 0; i < kKeys; ++i)
+  {
+    db.AddKey(type, "k" + std::to_string(i), "v", "1");
+  }
+  std::map<std::string, int> seen;
+  uint64_t cursor = 0;
+  int calls = 0;
+  int added = 0;
+  do
+  {
+    std::vector<std::string> keys;
+    cursor = db.Scan(type, cursor, 7, &keys);
+    for (auto &key : keys)
+    {
+      ++seen[key];
+    }
+    // 前一半调用中持续插入，字典扩容数次
+    if (++calls % 4 == 0 && added < 20 * kKeys)
+    {
+      for (int i = 0; i < 500; ++i, ++added)
+      {
+        db.AddKey(type, "n" + std::to_string(added), "v", "1");
+      }
+    }
+    if (calls == 50)
+    {
+      for (int i = 0; i < kKeys; i += 10)
+      {
+        db.DelKey(type, "k" + std::to_string(i));
+      }
+    }
+  } while (cursor != 0);
+
+  for (int i = 0; i < kKeys; ++i)
+  {
+    std::string key = "k" + std::to_string(i);
+    assert(i % 10 == 0 || seen.count(key) == 1);
+  }
+  for (auto &it : seen)
+  {
+    assert(it.first[0] == 'k' || it.first[0] == 'n');
+  }
+}
+
+int main()
+{
+  for (int type = dbobject::kDbString; type <= dbobject::kDbZSet; ++type)
+  {
+    Database db;
+    CheckScanAcrossRehash(db, type);
+  }
+
+  // 空库和不存在的key
+  {
+    Database db;
+    std::vector<std::string> keys;
+    assert(db.Scan(dbobject::kDbString, 0, 10, &keys) == 0 && keys.empty());
+    ValueCursor cursor;
+    std::vector<ValueItem> items;
+    assert(db.ScanValue(dbobject::kDbHash, "none", &cursor, 10, &items));
+    assert(items.empty());
+  }
+
+  // 哈希和有序集合从上次返回的元素之后继续：遍历期间插入排在前后的新元素，
+  // 一直存在的元素恰好返回一次并保持顺序；集合扩容后仍至少返回一次
+  for (int type : {dbobject::kDbHash, dbobject::kDbZSet, dbobject::kDbSet})
+  {
+    Database db;
+    const int kItems = 1000;
+    for (int i = 0; i < kItems; ++i)
+    {
+      db.AddKey(type, "c", "m" + std::to_string(i),
+                std::to_string(i % 37 + 0.5));
+    }
+    ValueCursor cursor;
+    std::vector<ValueItem> all;
+    int calls = 0;
+    bool done = false;
+    while (!done)
+    {
+      std::vector<ValueItem> items;
+      done = db.ScanValue(type, "c", &cursor, 13, &items);
+      all.insert(all.end(), items.begin(), items.end());
+      if (++calls % 5 == 0)
+      {
+        for (int i = 0; i < 50; ++i)
+        {
+          db.AddKey(type, "c", "x" + std::to_string(calls * 50 + i), "0.25");
+        }
+      }
+    }
+    std::map<std::string, int> seen;
+    for (size_t i = 0; i < all.size(); ++i)
+    {
+      ++seen[all[i].member_];
+      if (type == dbobject::kDbHash && i > 0)
+      {
+        assert(all[i - 1].member_ < all[i].member_);
+      }
+      if (type == dbobject::kDbZSet && i > 0)
+      {
+        assert(all[i - 1].score_ < all[i].score_ ||
+               (all[i - 1].score_ == all[i].score_ &&
+                all[i - 1].member_ < all[i].member_));
+      }
+    }
+    for (int i = 0; i < kItems; ++i)
+    {
+      std::string member = "m" + std::to_string(i);
+      assert(seen.count(member) == 1);
+      assert(type == dbobject::kDbSet || seen[member] == 1);
+    }
+  }
+
+  std::cout << "scan test passed" << std::endl;
+  return 0;
+}
+// compile: g++ -O2 scan_test.cc ../src/database.cc ../src/rdb.cc ../src/rdb_loader.cc ../src/skiplist.cc ../src/crc64.cc ../src/lzf.cc ../src/value_log.cc ../src/db_log.cc -I../include -lpthread -std=c++14
@@ -0,0 +1,165 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+
+#include "../include/skiplist.h"
+
+// 检查第0层按(分值, 成员)升序且长度正确
+static void CheckOrder(Skiplist &list, unsigned long len)
+{
+  unsigned long cnt = 0;
+  SkiplistNode *prev = nullptr;
+  for (auto node = list.First(); node; node = node->levels_[0]->forward_)
+  {
+    assert(!prev || prev->score_ <= node->score_);
+    prev = node;
+    ++cnt;
+  }
+  assert(cnt == len);
+  assert(list.GetLength() == len);
+}
+
+// 与逐个遍历的结果比较范围聚合
+static void CheckAggregate(Skiplist &list, double min, double max, bool minex,
+                           bool maxex)
+{
+  RangeSpec range(min, max);
+  range.minex_ = minex;
+  range.maxex_ = maxex;
+  unsigned long cnt = 0;
+  double sum = 0, lo = 0, hi = 0;
+  for (auto node = list.First(); node; node = node->levels_[0]->forward_)
+  {
+    bool gte = minex ? node->score_ > min : node->score_ >= min;
+    bool lte = maxex ? node->score_ < max : node->score_ <= max;
+    if (gte && lte)
+    {
+      lo = cnt == 0 ? node->score_ : lo;
+      hi = node->score_;
+      ++cnt;
+      sum += node->score_;
+    }
+  }
+  RangeAggregate agg = list.GetAggregateInRange(range);
+  assert(agg.count_ == cnt);
+  if (std::isnan(sum) || std::isinf(sum))
+  {
+    assert((std::isnan(sum) && std::isnan(agg.sum_)) || agg.sum_ == sum);
+  }
+  else
+  {
+    assert(std::fabs(agg.sum_ - sum) <= 1e-9 * std::max(1.0, std::fabs(sum)));
+  }
+  assert(cnt == 0 || (agg.min_ == lo && agg.max_ == hi));
+}
+
+int main()
+{
+  std::vector<std::pair<std::string, double>> elems;
+  for (int i = 0; i < 1000; ++i)
+  {
+    elems.emplace_back("m" + std::to_string(i), i * 0.5);
+  }
+  Skiplist::ptr list = Skiplist::BuildFromSorted(std::move(elems));
+  CheckOrder(*list, 1000);
+
+  double score;
+  assert(list->GetScore("m10", &score) && score == 5);
+  assert(!list->GetScore("none", &score));
+
+  // 批量构建后仍可正常插入、更新
+  list->InsertNode("m10", -1);
+  list->InsertNode("new", 1000);
+  CheckOrder(*list, 1001);
+  assert(list->GetScore("m10", &score) && score == -1);
+  assert(list->First()->obj_ == "m10");
+
+  RangeSpec range(0, 10);
+  range.minex_ = range.maxex_ = false;
+  assert(list->GetCountInRange(range) == 20);
+
+  CheckAggregate(*list, 0, 10, false, false);
+  CheckAggregate(*list, 0, 10, true, true);
+  CheckAggregate(*list, -5, 2000, true, false);
+  CheckAggregate(*list, 10, 0, false, false);
+
+  // 随机插入、更新、删除后跨度与分值和仍然正确
+  Skiplist random_list;
+  std::map<std::string, double> members;
+  srand(7);
+  for (int i = 0; i < 5000; ++i)
+  {
+    std::string obj = "k" + std::to_string(rand() % 800);
+    double score = rand() % 300;
+    if (rand() % 4 == 0 && members.count(obj))
+    {
+      random_list.DeleteNode(obj, members[obj]);
+      members.erase(obj);
+    }
+    else
+    {
+      random_list.InsertNode(obj, score);
+      members[obj] = score;
+    }
+    if (i % 250 == 0)
+    {
+      double lo = rand() % 300, hi = lo + rand() % 100;
+      CheckAggregate(random_list, lo, hi, rand() % 2, rand() % 2);
+    }
+  }
+  CheckOrder(random_list, members.size());
+  CheckAggregate(random_list, 0, 300, false, false);
+
+  // 非整数和无穷大的分值：不含无穷大的范围和为有限值，
+  // 只含+inf时为+inf，同时含有+inf和-inf时为NaN
+  Skiplist inf_list;
+  inf_list.InsertNode("neg", -INFINITY);
+  inf_list.InsertNode("pos", INFINITY);
+  for (int i = 0; i < 1000; ++i)
+  {
+    inf_list.InsertNode("f" + std::to_string(i), i * 0.1 - 30);
+  }
+  CheckAggregate(inf_list, -10.05, 20.05, false, false);
+  CheckAggregate(inf_list, -INFINITY, 0, true, false);
+  CheckAggregate(inf_list, 0, INFINITY, false, false);
+  CheckAggregate(inf_list, -INFINITY, INFINITY, false, false);
+  CheckAggregate(inf_list, -INFINITY, INFINITY, false, true);
+  RangeSpec finite(-INFINITY, INFINITY);
+  assert(std::isfinite(inf_list.GetAggregateInRange(finite).sum_));
+
+  // 删除无穷大和数量级很大的分值后，剩下的范围和仍然精确
+  for (int i = 0; i < 100; ++i)
+  {
+    inf_list.InsertNode("big" + std::to_string(i), 1e17 * (i % 2 ? 1 : -1) + i);
+  }
+  CheckAggregate(inf_list, -10.05, 20.05, false, false);
+  inf_list.DeleteNode("neg", -INFINITY);
+  inf_list.DeleteNode("pos", INFINITY);
+  for (int i = 0; i < 100; ++i)
+  {
+    inf_list.DeleteNode("big" + std::to_string(i),
+                        1e17 * (i % 2 ? 1 : -1) + i);
+  }
+  CheckOrder(inf_list, 1000);
+  CheckAggregate(inf_list, -INFINITY, INFINITY, false, false);
+  CheckAggregate(inf_list, -10.05, 20.05, false, false);
+  RangeSpec all(-INFINITY, INFINITY);
+  RangeAggregate agg = inf_list.GetAggregateInRange(all);
+  assert(std::fabs(agg.sum_ - (0.1 * 999 * 1000 / 2 - 30000)) < 1e-6);
+
+  // 命令参数中的分值和范围：非数字、空串、多余字符和NaN都不接受
+  assert(ParseScore("1.5", &score) && score == 1.5);
+  assert(ParseScore("-inf", &score) && score == -INFINITY);
+  assert(ParseScore("1e3", &score) && score == 1000);
+  for (const char *bad : {"a", "", "1x", "1.5 ", "nan", "-NaN"})
+  {
+    assert(!ParseScore(bad, &score));
+  }
+
+  std::cout << "skiplist test passed" << std::endl;
+  return 0;
+}
+// compile: g++ skiplist_test.cc ../src/skiplist.cc -I../include -std=c++14
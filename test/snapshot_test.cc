@@ -0,0 +1,218 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cassert>
+#include <iostream>
+#include <map>
+#include <random>
+#include <thread>
+
+#include "../include/database.h"
+#include "../include/rdb.h"
+#include "../include/rdb_loader.h"
+
+// 随机的写操作，覆盖修改、删除、新增、过期和整体替换
+static void RandomWrite(Database &db, std::mt19937 &rng, int keys, long op)
+{
+  std::string key = "k" + std::to_string(rng() % (2 * keys));
+  int type = rng() % (dbobject::kDbZSet + 1);
+  switch (rng() % 5)
+  {
+  case 0:
+    db.DelKey(type, key);
+    break;
+  case 1:
+    db.AddKey(type, key, "n" + std::to_string(op), "9");
+    break;
+  case 2:
+    db.RPopList(key);
+    break;
+  case 3:
+    db.SetPExpireTime(type, key, 5e6);
+    break;
+  default:
+    db.ZSetStore(dbobject::kZSetUnion, key, {key, "k1"}, {},
+                 dbobject::kAggregateSum);
+    break;
+  }
+}
+
+// 读快照中所有key的值，分多次小批遍历
+// 每批之后穿插writes个写操作
+static std::map<std::string, std::string> ReadAll(Database &db,
+                                                  const ReadSnapshot &snap,
+                                                  std::mt19937 &rng, int keys,
+                                                  int writes, long *ops)
+{
+  std::map<std::string, std::string> values;
+  for (int type = dbobject::kDbString; type <= dbobject::kDbZSet; ++type)
+  {
+    size_t cursor = 0;
+    bool finished = false;
+    while (!finished)
+    {
+      std::vector<std::pair<std::string, int64_t>> batch;
+      finished = db.ScanAt(snap, type, &cursor, 16, &batch);
+      for (auto &key : batch)
+      {
+        std::string name = std::to_string(type) + key.first;
+        // 同一个key只输出一次
+        assert(values.count(name) == 0);
+        values[name] = std::to_string(key.second) + ' ' +
+                       db.GetKeyAt(snap, type, key.first);
+      }
+      for (int i = 0; i < writes; ++i)
+      {
+        RandomWrite(db, rng, keys, (*ops)++);
+      }
+    }
+  }
+  return values;
+}
+
+// 能重建数据库的命令，排序后与遍历顺序无关
+static std::vector<std::string> Dump(Database &db)
+{
+  std::vector<std::string> cmds;
+  db.AofRewrite([&](const std::vector<std::string> &argv) {
+    std::string cmd;
+    for (auto &arg : argv)
+    {
+      cmd += arg + ' ';
+    }
+    cmds.push_back(cmd);
+  });
+  std::sort(cmds.begin(), cmds.end());
+  return cmds;
+}
+
+int main()
+{
+  Database db;
+  const int kKeys = 20000;
+  for (int i = 0; i < kKeys; ++i)
+  {
+    std::string key = "k" + std::to_string(i);
+    db.AddKey(dbobject::kDbString, key, "v" + std::to_string(i), "");
+    db.AddKey(dbobject::kDbList, key, "x", "");
+    db.AddKey(dbobject::kDbList, key, "y", "");
+    db.AddKey(dbobject::kDbHash, key, "f", "v");
+    db.AddKey(dbobject::kDbSet, key, "m", "");
+    db.AddKey(dbobject::kDbZSet, key, "a", std::to_string(i % 7));
+    if (i % 10 == 0)
+    {
+      db.SetPExpireTime(dbobject::kDbString, key, 1e7);
+    }
+  }
+  auto expected = Dump(db);
+
+  // 快照线程写文件的同时，主线程修改、删除和新增key
+  const char *path = "snapshot_test.rdb";
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  db.SnapshotBegin(Timestamp::now());
+  std::atomic<bool> done(false);
+  std::thread saver([&]() {
+    // 小缓冲区使快照分多个段写出
+    RdbWriter writer(fd, 4096);
+    writer.WriteHeader();
+    db.SnapshotSave(&writer, 0);
+    writer.WriteEof();
+    assert(writer.Ok());
+    done = true;
+  });
+
+  std::mt19937 rng(1);
+  long ops = 0;
+  while (!done)
+  {
+    RandomWrite(db, rng, kKeys, ops++);
+  }
+  saver.join();
+  close(fd);
+  db.SnapshotEnd();
+
+  // 载入的数据应与快照开始时刻完全一致
+  Database loaded;
+  std::vector<StorageEngine *> dbs{&loaded};
+  RdbLoader loader(dbs);
+  assert(loader.Load(path));
+  assert(Dump(loaded) == expected);
+  unlink(path);
+
+  // 读快照：不写入时读到的就是打开时刻的数据，以此为准，
+  // 再在遍历期间不断写入，两个快照各自仍读到打开时刻的数据
+  long read_ops = 0;
+  auto first = db.OpenReadSnapshot();
+  auto first_expected = ReadAll(db, *first, rng, kKeys, 0, &read_ops);
+  assert(ReadAll(db, *first, rng, kKeys, 50, &read_ops) == first_expected);
+  auto second = db.OpenReadSnapshot();
+  assert(second->epoch_ == first->epoch_ + 1);
+  auto second_expected = ReadAll(db, *second, rng, kKeys, 0, &read_ops);
+  assert(second_expected != first_expected);
+  assert(ReadAll(db, *first, rng, kKeys, 50, &read_ops) == first_expected);
+  assert(ReadAll(db, *second, rng, kKeys, 50, &read_ops) == second_expected);
+  std::map<std::string, uint64_t> stats;
+  db.AddStats(&stats);
+  assert(stats["read_snapshots"] == 2 && stats["read_snapshot_versions"] > 0);
+  db.CloseReadSnapshot(first);
+  db.CloseReadSnapshot(second);
+  stats.clear();
+  db.AddStats(&stats);
+  assert(stats["read_snapshots"] == 0);
+
+  // 其他线程读取较大的key：读取开始前修改、删除该key都不等待，
+  // 读到的仍是PrepareRead时的值
+  for (int type : {dbobject::kDbHash, dbobject::kDbSet, dbobject::kDbZSet})
+  {
+    for (int i = 0; i < kKeys; ++i)
+    {
+      db.AddKey(type, "big", "f" + std::to_string(i), std::to_string(i));
+    }
+    std::string big = db.GetKey(type, "big");
+    assert(!db.PrepareRead(type, "big", kKeys + 1));
+    auto read = db.PrepareRead(type, "big", kKeys);
+    assert(read);
+    std::atomic<bool> written(false);
+    std::string read_result;
+    std::thread reader([&]() {
+      while (!written)
+      {
+      }
+      read_result = read.read_();
+    });
+    for (int i = 0; i < 1000; ++i)
+    {
+      RandomWrite(db, rng, kKeys, ops);
+    }
+    db.AddKey(type, "big", "late", "0.5");
+    assert(db.GetKey(type, "big") != big);
+    written = true;
+    db.DelKey(type, "big");
+    reader.join();
+    assert(read_result == big);
+    // 值在done_之前一直登记为借出
+    stats.clear();
+    db.AddStats(&stats);
+    assert(stats["lent_values"] == 1);
+    read.done_();
+    stats.clear();
+    db.AddStats(&stats);
+    assert(stats["lent_values"] == 0);
+  }
+  // 取出的共享字符串值在key被覆盖和删除后不变
+  std::shared_ptr<const std::string> shared;
+  db.AddKey(dbobject::kDbString, "shared", "old", "");
+  assert(db.GetSharedString("shared", &shared) && *shared == "old");
+  db.AddKey(dbobject::kDbString, "shared", "new", "");
+  db.DelKey(dbobject::kDbString, "shared");
+  assert(*shared == "old" && !db.GetSharedString("shared", &shared));
+
+  std::cout << "snapshot test passed, " << ops
+            << " writes during snapshot, " << read_ops
+            << " writes during read snapshots" << std::endl;
+  return 0;
+}
+// compile: g++ snapshot_test.cc ../src/database.cc ../src/rdb.cc ../src/rdb_loader.cc ../src/skiplist.cc ../src/crc64.cc ../src/lzf.cc ../src/value_log.cc ../src/db_log.cc -I../include -std=c++14 -lpthread
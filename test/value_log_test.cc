@@ -0,0 +1,116 @@
+#include <sys/stat.h>
+
+#include <cassert>
+#include <iostream>
+#include <map>
+
+#include "../include/database.h"
+#include "../include/rdb.h"
+#include "../include/rdb_loader.h"
+#include "../include/value_log.h"
+
+static std::string Value(int i, size_t len)
+{
+  std::string value(len, 'a' + i % 26);
+  value += std::to_string(i);
+  return value;
+}
+
+int main()
+{
+  mkdir("vlog_test", 0755);
+
+  // 值日志：跨块的读取、缓存、换文件和垃圾回收
+  {
+    ValueLog vlog("vlog_test/t-", 256 * 1024, 1 << 20);
+    assert(vlog.Open());
+    std::map<std::string, std::pair<ValuePointer, std::string>> live;
+    for (int i = 0; i < 2000; ++i)
+    {
+      std::string key = "k" + std::to_string(i % 500);
+      std::string value = Value(i, 100 + i * 37 % 40000);
+      ValuePointer ptr;
+      assert(vlog.Append(key, value, &ptr));
+      auto it = live.find(key);
+      if (it != live.end())
+      {
+        vlog.Discard(it->second.first, key.size());
+      }
+      live[key] = std::make_pair(ptr, value);
+    }
+    assert(vlog.FileCount() > 1);
+    for (int round = 0; round < 2; ++round)
+    {
+      for (auto &it : live)
+      {
+        std::string value;
+        assert(vlog.Read(it.second.first, &value));
+        assert(value == it.second.second);
+      }
+    }
+    assert(vlog.CacheHits() > 0);
+
+    uint64_t before = vlog.TotalBytes();
+    auto is_live = [&](const std::string &key, const ValuePointer &ptr) {
+      return live[key].first == ptr;
+    };
+    auto moved = [&](const std::string &key, const ValuePointer &ptr) {
+      live[key].first = ptr;
+    };
+    while (vlog.CollectGarbage(64 * 1024, is_live, moved))
+    {
+    }
+    assert(vlog.TotalBytes() < before);
+    for (auto &it : live)
+    {
+      std::string value;
+      assert(vlog.Read(it.second.first, &value));
+      assert(value == it.second.second);
+    }
+  }
+
+  // 数据库：较大的值存放在值日志中，读取、覆盖、删除和rdb往返
+  Database db;
+  std::unique_ptr<ValueLog> vlog(new ValueLog("vlog_test/db-", 1 << 20));
+  assert(vlog->Open());
+  db.SetValueLog(std::move(vlog), 1024);
+  for (int i = 0; i < 1000; ++i)
+  {
+    std::string key = "k" + std::to_string(i);
+    db.AddKey(dbobject::kDbString, key, Value(i, i % 2 ? 10 : 5000), "");
+  }
+  // 大值改为小值、小值改为大值
+  db.AddKey(dbobject::kDbString, "k1", Value(1, 3000), "");
+  db.AddKey(dbobject::kDbString, "k2", Value(2, 10), "");
+  db.DelKey(dbobject::kDbString, "k4");
+  assert(db.GetKey(dbobject::kDbString, "k1") == Value(1, 3000));
+  assert(db.GetKey(dbobject::kDbString, "k2") == Value(2, 10));
+  assert(db.GetKey(dbobject::kDbString, "k6") == Value(6, 5000));
+  assert(db.GetKey(dbobject::kDbString, "k7") == Value(7, 10));
+  std::map<std::string, uint64_t> stats;
+  db.AddStats(&stats);
+  assert(stats["vlog_keys"] == 499);
+  assert(stats["vlog_dead_bytes"] > 0);
+
+  std::string file;
+  RdbWriter writer(&file);
+  writer.WriteHeader();
+  db.RdbSave(&writer, 0);
+  writer.WriteEof();
+  RdbReader reader(file.data(), file.size());
+  assert(reader.ReadHeader());
+  Database copy;
+  RdbSection section;
+  while (reader.ReadSection(&section) == 1)
+  {
+    RdbStage stage;
+    assert(Database::RdbParseSection(section, &stage));
+    copy.RdbMergeStage(std::move(stage));
+  }
+  assert(copy.GetKeyStringSize() == 999);
+  assert(copy.GetKey(dbobject::kDbString, "k1") == Value(1, 3000));
+  assert(copy.GetKey(dbobject::kDbString, "k8") == Value(8, 5000));
+  std::cout << "value log test passed" << std::endl;
+  return 0;
+}
+// compile: g++ value_log_test.cc ../src/database.cc ../src/rdb.cc ../src/rdb_loader.cc ../src/skiplist.cc ../src/crc64.cc ../src/lzf.cc ../src/value_log.cc ../src/db_log.cc -I../include -std=c++14 -lpthread